@@ -0,0 +1,286 @@
+/**
+ *  @file   bench_pack.cc
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  pack_size/pack_save/pack_loadのベンチマーク(Google Benchmark)。
+ *
+ *  すべての書式文字(と'~'付きの整数配列)について、単独変数と
+ *  要素数1〜PACK_BENCH_MAX(既定は10^8)の配列を、'!'の有無の両方で測る。
+ *  比較のため、各書式と要素数について保存形式と同じバイト数のmemcpyも
+ *  測る('!'の有無でバイト数は変わらないので、'!'の無い方だけ)。
+ *
+ *  名前は 処理/書式/要素数 で、例えば save/!d#/1000000、memcpy/d#/1000000。
+ *  bytes_per_secondは保存形式のバイト数、s/fieldは1要素あたりの時間。
+ *
+ *  結果は既定でbench_pack.jsonにJSONでも書き出すので、リリース間で
+ *  比べられる(--benchmark_outで変えられる)。最適化して測るには
+ *  cmake -DCMAKE_BUILD_TYPE=Release でビルドする。
+ *
+ *  例）
+ *  ./bench_pack --benchmark_filter='save/d#'
+ *  PACK_BENCH_MAX=10000 ./bench_pack
+ */
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "pack.h"
+
+/* 固定小数点の倍率 */
+static const double bench_scale = 16.0;
+
+/**
+ *  @brief  書式文字の変数側の1要素のバイト数
+ */
+static int
+bench_data_size (char c)
+{
+    switch (c) {
+    case 'c': return sizeof(char);
+    case 'h': return sizeof(short);
+    case 'i': return sizeof(int);
+    case 'l': return sizeof(long);
+    case 'f': return sizeof(float);
+    case 'd': return sizeof(double);
+    case 'b': case 'B': return 1;
+    case 'w': case 'W': return 2;
+    case 'j': case 'J': return 4;
+    case 'q': case 'Q': case 'v': case 'z': return 8;
+    case 'e': case 'g': case 'r': case 't': return sizeof(float);
+    case 'E': case 'G': case 'R': case 'T': return sizeof(double);
+    }
+    return 0;
+}
+
+/**
+ *  @brief  固定小数点の書式文字か
+ */
+static bool
+bench_fixed_point (char c)
+{
+    return strchr ("rRtT", c) != NULL;
+}
+
+/**
+ *  @brief  型に合った値で配列を埋める
+ *
+ *  浮動小数点数は小さな範囲の値、整数は隣り合う値が近い(差分圧縮の
+ *  効く)列にする。
+ */
+static void
+bench_fill (char c, void *data, size_t n)
+{
+    size_t i;
+
+    switch (bench_data_size (c)) {
+    case 1:
+        for (i = 0; i < n; i++) ((uint8_t *) data)[i] = (uint8_t) i;
+        break;
+    case 2:
+        for (i = 0; i < n; i++) ((uint16_t *) data)[i] = (uint16_t) (i * 3);
+        break;
+    case 4:
+        if (strchr ("fegrt", c) != NULL) {
+            for (i = 0; i < n; i++) ((float *) data)[i] = (float) (i % 1000) * 0.25f;
+        }
+        else {
+            for (i = 0; i < n; i++) ((uint32_t *) data)[i] = (uint32_t) (i * 7 + (i & 3));
+        }
+        break;
+    case 8:
+        if (strchr ("dEGRT", c) != NULL) {
+            for (i = 0; i < n; i++) ((double *) data)[i] = (double) (i % 1000) * 0.25;
+        }
+        else {
+            for (i = 0; i < n; i++) ((uint64_t *) data)[i] = (uint64_t) (i * 7 + (i & 3));
+        }
+        break;
+    }
+}
+
+/**
+ *  @brief  単独変数を型に合った可変引数でsaveする
+ */
+static char *
+bench_save_scalar (char *buf, char *fmt, char c)
+{
+    switch (c) {
+    case 'c': case 'h': case 'i': case 'b': case 'B': case 'w': case 'W':
+        return pack_save (buf, fmt, 100);
+    case 'l': return pack_save (buf, fmt, 100L);
+    case 'j': return pack_save (buf, fmt, (int32_t) 100);
+    case 'J': return pack_save (buf, fmt, (uint32_t) 100);
+    case 'q': case 'z': return pack_save (buf, fmt, (int64_t) 100);
+    case 'Q': case 'v': return pack_save (buf, fmt, (uint64_t) 100);
+    }
+    if (bench_fixed_point (c)) {
+        return pack_save (buf, fmt, bench_scale, 1.5);
+    }
+    return pack_save (buf, fmt, 1.5);
+}
+
+/**
+ *  @brief  配列を型に合った可変引数でsave/loadする
+ */
+static char *
+bench_array (bool load, char *buf, char *fmt, char c, void *data, int n)
+{
+    if (bench_fixed_point (c)) {
+        return load ? pack_load (buf, fmt, bench_scale, data, n)
+                    : pack_save (buf, fmt, bench_scale, data, n);
+    }
+    return load ? pack_load (buf, fmt, data, n) : pack_save (buf, fmt, data, n);
+}
+
+/* 測る処理 */
+enum bench_op { BENCH_SIZE, BENCH_SAVE, BENCH_LOAD };
+
+/**
+ *  @brief  1つの書式文字、要素数(0は単独変数)、処理を測る
+ */
+static void
+bench_run (benchmark::State &state, bench_op op, std::string code, int n)
+{
+    char c = code.back ();
+    std::string fmt = code + ((n > 0) ? "#" : "");
+    char *f = (char *) fmt.c_str ();
+    int fields = (n > 0) ? n : 1;
+    int bound = (n > 0) ? pack_size (f, n) : pack_size (f);
+    std::vector<char> buf (bound + 16);
+    std::vector<char> data ((size_t) fields * bench_data_size (c) + 16);
+    char *bp = buf.data ();
+    char *end;
+    union {
+        int64_t q;
+        double d;
+    } v;
+
+    bench_fill (c, data.data (), fields);
+    /* loadするデータと実際のバイト数 */
+    end = (n > 0) ? bench_array (false, bp, f, c, data.data (), n) : bench_save_scalar (bp, f, c);
+    for (auto _ : state) {
+        switch (op) {
+        case BENCH_SIZE:
+            benchmark::DoNotOptimize ((n > 0) ? pack_size (f, n) : pack_size (f));
+            break;
+        case BENCH_SAVE:
+            benchmark::DoNotOptimize ((n > 0) ? bench_array (false, bp, f, c, data.data (), n)
+                                              : bench_save_scalar (bp, f, c));
+            break;
+        case BENCH_LOAD:
+            if (n > 0) {
+                benchmark::DoNotOptimize (bench_array (true, bp, f, c, data.data (), n));
+            }
+            else if (bench_fixed_point (c)) {
+                benchmark::DoNotOptimize (pack_load (bp, f, bench_scale, &v));
+            }
+            else {
+                benchmark::DoNotOptimize (pack_load (bp, f, &v));
+            }
+            break;
+        }
+        benchmark::ClobberMemory ();
+    }
+    state.SetBytesProcessed ((int64_t) state.iterations () * (end - bp));
+    state.counters["s/field"] = benchmark::Counter ((double) state.iterations () * fields,
+                                                    benchmark::Counter::kIsRate
+                                                    | benchmark::Counter::kInvert);
+}
+
+/**
+ *  @brief  比較のためのmemcpy(1つの書式文字、要素数をsaveしたのと同じバイト数)
+ */
+static void
+bench_memcpy (benchmark::State &state, std::string code, int n)
+{
+    char c = code.back ();
+    std::string fmt = code + ((n > 0) ? "#" : "");
+    char *f = (char *) fmt.c_str ();
+    int fields = (n > 0) ? n : 1;
+    size_t bytes;
+
+    {
+        /* 圧縮する書式もあるので、pack_sizeの上限ではなく実際にsaveして数える */
+        std::vector<char> buf ((size_t) ((n > 0) ? pack_size (f, n) : pack_size (f)) + 16);
+        std::vector<char> data ((size_t) fields * bench_data_size (c) + 16);
+        bench_fill (c, data.data (), fields);
+        bytes = ((n > 0) ? bench_array (false, buf.data (), f, c, data.data (), n)
+                         : bench_save_scalar (buf.data (), f, c)) - buf.data ();
+    }
+    std::vector<char> src (bytes + 1, 1), dst (bytes + 1);
+
+    for (auto _ : state) {
+        memcpy (dst.data (), src.data (), bytes);
+        benchmark::ClobberMemory ();
+    }
+    state.SetBytesProcessed ((int64_t) state.iterations () * bytes);
+}
+
+int main (int argc, char **argv)
+{
+    static const char *codes[] = {
+        "c", "h", "i", "l", "f", "d",
+        "b", "B", "w", "W", "j", "J", "q", "Q",
+        "v", "z", "e", "E", "g", "G", "r", "R", "t", "T",
+        "~i", "~l", "~j", "~J", "~q", "~Q",
+    };
+    static const char *names[] = { "size", "save", "load" };
+    const char *env = getenv ("PACK_BENCH_MAX");
+    long max = (env != NULL) ? atol (env) : 100000000L;
+    std::vector<char *> args (argv, argv + argc);
+    std::string out = "--benchmark_out=bench_pack.json";
+    std::string fmt = "--benchmark_out_format=json";
+    bool has_out = false;
+    int nargs;
+
+    for (const char *code : codes) {
+        if (code[0] != '~') {
+            benchmark::RegisterBenchmark ((std::string ("memcpy/") + code).c_str (),
+                                          bench_memcpy, std::string (code), 0);
+        }
+        for (long n = 1; n <= max; n *= 100) {
+            benchmark::RegisterBenchmark ((std::string ("memcpy/") + code + "#/"
+                                           + std::to_string (n)).c_str (),
+                                          bench_memcpy, std::string (code), (int) n);
+        }
+    }
+    for (int op = BENCH_SIZE; op <= BENCH_LOAD; op++) {
+        for (const char *code : codes) {
+            for (int swap = 0; swap < 2; swap++) {
+                std::string cs = std::string (swap ? "!" : "") + code;
+                /* 単独変数('~'は配列のみ) */
+                if (code[0] != '~') {
+                    benchmark::RegisterBenchmark ((std::string (names[op]) + "/" + cs).c_str (),
+                                                  bench_run, (bench_op) op, cs, 0);
+                }
+                for (long n = 1; n <= max; n *= 100) {
+                    benchmark::RegisterBenchmark ((std::string (names[op]) + "/" + cs + "#/"
+                                                   + std::to_string (n)).c_str (),
+                                                  bench_run, (bench_op) op, cs, (int) n);
+                }
+            }
+        }
+    }
+
+    /* 出力先が指定されていなければJSONをbench_pack.jsonに書く */
+    for (int i = 1; i < argc; i++) {
+        if (strncmp (argv[i], "--benchmark_out=", 16) == 0) {
+            has_out = true;
+        }
+    }
+    if (!has_out) {
+        args.push_back ((char *) out.c_str ());
+        args.push_back ((char *) fmt.c_str ());
+    }
+    nargs = (int) args.size ();
+    benchmark::Initialize (&nargs, args.data ());
+    if (benchmark::ReportUnrecognizedArguments (nargs, args.data ())) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks ();
+    benchmark::Shutdown ();
+    return 0;
+}
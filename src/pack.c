@@ -13,6 +13,62 @@
  * 	f - float
  *	d - double
  *
+ *  幅が固定された整数(環境によらず同じバイト数になる)
+ *	b - int8_t      B - uint8_t
+ *	w - int16_t     W - uint16_t
+ *	j - int32_t     J - uint32_t
+ *	q - int64_t     Q - uint64_t
+ *
+ *  可変長整数(LEB128, 小さい値ほど少ないバイト数になる)
+ *	v - uint64_t
+ *	z - int64_t (zigzag符号化)
+ *	pack_sizeは上限(1要素10バイト)を返す。実際のサイズは
+ *	saveと同じ引数をpack_size_exactに渡して求める。
+ *
+ *  整数配列の圧縮
+ *	i, l, j, J, q, Qの配列の前に'~'を付けると、差分を取って128要素毎に
+ *	最小値を引き、最小のビット幅で詰めて保存する(例: "~l#")。
+ *	pack_sizeは上限を返す。
+ *
+ *  精度を落とした浮動小数点数(小文字はfloat、大文字はdoubleの変数)
+ *	e, E - IEEE半精度(2バイト)
+ *	g, G - bfloat16(2バイト)
+ *	r, R - int16の固定小数点(2バイト)
+ *	t, T - int32の固定小数点(4バイト)
+ *	固定小数点は変数の前に倍率(double)を与え、値 * 倍率 を保存する。
+ *	例) pack_save (bp, "r#", 100.0, fa, 10);
+ *	    pack_load (bp, "r#", 100.0, fa, 10);
+ *	丸めの詳細はpack_conv.cを参照。
+ *
+ *  要素数を保存する配列とグループ
+ *	'#'の代わりに'*'を付けた配列は、要素数(uint32_t)を要素の前に保存する
+ *	(例: "f*")。saveには'#'と同じく配列と要素数を、loadには配列と
+ *	int *を与える。loadはintに入っている上限を超える要素数を読むと
+ *	何も書き込まずにNULLを返し(errnoはEMSGSIZE)、読めれば要素数を格納する。
+ *	'('と')'で囲んだ項目の並びはグループとなり、後ろの'*', '#', 数字で
+ *	指定した回数だけ繰り返す(例: "(i f d)*")。グループの各項目には
+ *	繰り返し数の要素を持つ配列を与え、繰り返し数はその後に配列と同じ
+ *	方法で与える。保存する時は1回分の項目を順に並べる。
+ *	グループの中の項目は1回毎に単独変数か数字で与えた要素数の配列になる
+ *	('#', '*'は無視する)。入れ子のグループ、PACK_GROUP_MAXを超える項目、
+ *	's', 'y', '@'を含むグループは扱えず、書式文字列を受け取る関数は
+ *	何もせずに失敗する(errnoはEINVAL、pack_compileはNULLを返す)。
+ *
+ *  長さを前に置く文字列とバイト列
+ *	s - 文字列(saveには'\0'で終わるconst char *を与える)
+ *	y - バイト列(saveにはconst void *とバイト数(int)を与える)
+ *	どちらもバイト数(uint32_t)に続けてバイト列をそのまま保存し、'\0'は
+ *	保存しない。loadでは複製せず、const char **とint *を与えるとbuffer内の
+ *	先頭とバイト数が返る(int *はNULL可)。返されたポインタはbufferが有効な
+ *	間だけ使え、sでも'\0'で終わらない。pack_sizeにはバイト数を与える。
+ *	要素数は付けられず、グループの中には置けない。
+ *
+ *  詰め物と境界合わせ(変数は与えない)
+ *	x  - 値0の1バイト(x8のように数字で与えたバイト数を置く)
+ *	@N - 次の項目がデータ領域の先頭からNバイトの倍数の位置になるように、
+ *	     値0のバイトを置く(例: "c @32 d#")。loadでは読み飛ばす。
+ *	pack_size等も同じ位置で数える。グループの中には'@'を置けない。
+ *
  *	例）
  *  char    ca[4];
  *  float   fa[10];
@@ -30,8 +86,51 @@
  *
  *  bp = pack_load (bp, "f#", fa, hv);
  *
+ *  要素数を保存する場合は1回で済む:
+ *  bp = pack_save (bp, "c4 f*", ca, fa, n);
+ *  n = 10;
+ *  if ((bp = pack_load (bp, "c4 f*", ca, fa, &n)) == NULL) error ();
+ *
+ *  キーと本体を複製せずに読む場合:
+ *  bp = pack_save (bp, "s y", key, body, len);
+ *  bp = pack_load (bp, "s y", &kp, &klen, &bodyp, &len);
+ *
+ *  SIMDで読めるように配列を64バイト境界に置く場合:
+ *  bp = pack_save (buf, "i @64 f#", n, fa, n);
+ *  (bufが64バイト境界にあれば、buf内のfaの位置も64バイト境界になる)
+ *
+ *  構造体の配列を1項目ずつ並べる場合:
+ *  bp = pack_save (bp, "(i f d)*", ia, fa, da, n);
+ *  n = 10;
+ *  bp = pack_load (bp, "(i f d)*", ia, fa, da, &n);
+ *
+ *  同じ書式を繰り返し使う場合:
+ *  pack_plan_t *plan = pack_compile ("c4 h f#");
+ *  size = pack_size_plan (plan, 10);
+ *  bp = pack_save_plan (bp, plan, ca, hv, fa, 10);
+ *  bp = pack_load_plan (bp, plan, ca, &hv, fa, 10);
+ *  pack_plan_free (plan);
+ *  (PACK_CACHEを定義してビルドした場合は、pack_save等も書式文字列毎の
+ *   planを内部で覚えて使う。pack_cache.cを参照)
+ *
+ *  サイズを先に求めずに伸長するバッファへsaveする場合:
+ *  pack_buf_t b;
+ *  pack_buf_init (&b, NULL, 0);
+ *  pack_buf_save (&b, "c4 h f#", ca, hv, fa, 10);
+ *  (b.data, b.lenが結果)
+ *  pack_buf_free (&b);
+ *
  */
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
 #include "pack.h"
+#include "pack_internal.h"
+#include "pack_swap.h"
+#include "pack_varint.h"
+#include "pack_for.h"
+#include "pack_conv.h"
 
 /**
  *  @brief  charをsaveする内部関数
@@ -327,410 +426,1211 @@ pack_load_double (char *p, double *v, int e)
     return p;
 }
 
+/**
+ *  @brief      幅が固定された整数をsaveする内部関数
+ *  @param  p   save先へのポインタ
+ *  @param  v   saveするデータ
+ *  @param  e   1:エンディアン変換する
+ *  @retval     saveされたデータの直後へのポインタ
+ */
+static INLINE char *
+pack_save_u16 (char *p, uint16_t v, int e)
+{
+    if (e) {
+        v = pack_bswap16 (v);
+    }
+    memcpy (p, &v, 2);
+    return p + 2;
+}
+
+static INLINE char *
+pack_save_u32 (char *p, uint32_t v, int e)
+{
+    if (e) {
+        v = pack_bswap32 (v);
+    }
+    memcpy (p, &v, 4);
+    return p + 4;
+}
+
+static INLINE char *
+pack_save_u64 (char *p, uint64_t v, int e)
+{
+    if (e) {
+        v = pack_bswap64 (v);
+    }
+    memcpy (p, &v, 8);
+    return p + 8;
+}
+
+/**
+ *  @brief      幅が固定された整数をloadする内部関数
+ *  @param  p   load元へのポインタ
+ *  @param  v   loadするデータへのポインタ
+ *  @param  e   1:エンディアン変換する
+ *  @retval     loadされたデータの直後へのポインタ
+ */
+static INLINE char *
+pack_load_u16 (char *p, void *v, int e)
+{
+    uint16_t w;
+    memcpy (&w, p, 2);
+    if (e) {
+        w = pack_bswap16 (w);
+    }
+    memcpy (v, &w, 2);
+    return p + 2;
+}
+
+static INLINE char *
+pack_load_u32 (char *p, void *v, int e)
+{
+    uint32_t w;
+    memcpy (&w, p, 4);
+    if (e) {
+        w = pack_bswap32 (w);
+    }
+    memcpy (v, &w, 4);
+    return p + 4;
+}
+
+static INLINE char *
+pack_load_u64 (char *p, void *v, int e)
+{
+    uint64_t w;
+    memcpy (&w, p, 8);
+    if (e) {
+        w = pack_bswap64 (w);
+    }
+    memcpy (v, &w, 8);
+    return p + 8;
+}
+
+/**
+ *  @brief  配列をsave/loadする内部関数
+ *
+ *  エンディアン変換する場合はpack_swapの変換コピーを、
+ *  変換しない場合はmemcpyを使ってまとめてコピーする。
+ *
+ *  @param  d       コピー先へのポインタ
+ *  @param  s       コピー元へのポインタ
+ *  @param  n       要素数
+ *  @param  size    1要素のバイト数
+ *  @param  e       1:エンディアン変換する
+ */
+static INLINE void
+pack_copy_array (void *d, const void *s, int n, int size, int e)
+{
+    if (n <= 0) {
+        return;
+    }
+    if (e && size > 1) {
+        pack_swap (d, s, n, size);
+    }
+    else {
+        memcpy (d, s, (size_t) n * size);
+    }
+}
+
 static INLINE char*
 pack_save_char_array (char *p, char *v, int n)
 {
-    int i;
-    for (i = 0; i < n; i++) {
-        p = pack_save_char (p, v[i]);
-    }
-    return p;
+    pack_copy_array (p, v, n, sizeof(char), 0);
+    return (n > 0) ? p + n : p;
 }
 
 static INLINE char *
 pack_save_short_array (char *p, short *v, int n, int e)
 {
-    int i;
-    for (i = 0; i < n; i++) {
-        p = pack_save_short (p, v[i], e);
-    }
-    return p;
+    pack_copy_array (p, v, n, sizeof(short), e);
+    return (n > 0) ? p + n * sizeof(short) : p;
 }
 
 static INLINE char *
 pack_array_int (char *p, int *v, int n, int e)
 {
-    int i;
-    for (i = 0; i < n; i++) {
-        p = pack_save_int (p, v[i], e);
-    }
-    return p;
+    pack_copy_array (p, v, n, sizeof(int), e);
+    return (n > 0) ? p + n * sizeof(int) : p;
 }
 
 static INLINE char *
 pack_array_long (char *p, long *v, int n, int e)
 {
-    int i;
-    for (i = 0; i < n; i++) {
-        p = pack_save_long (p, v[i], e);
-    }
-    return p;
+    pack_copy_array (p, v, n, sizeof(long), e);
+    return (n > 0) ? p + n * sizeof(long) : p;
 }
 
 static INLINE char*
 pack_array_float (char *p, float *v, int n, int e)
 {
-    int i;
-    for (i = 0; i < n; i++) {
-        p = pack_save_float (p, v[i], e);
-    }
-    return p;
+    pack_copy_array (p, v, n, sizeof(float), e);
+    return (n > 0) ? p + n * sizeof(float) : p;
 }
 
 static INLINE char*
 pack_array_double (char *p, double *v, int n, int e)
 {
-    int i;
-    for (i = 0; i < n; i++) {
-        p = pack_save_double (p, v[i], e);
-    }
-    return p;
+    pack_copy_array (p, v, n, sizeof(double), e);
+    return (n > 0) ? p + n * sizeof(double) : p;
 }
 
 static INLINE char *
 unpack_array_char (char *p, char *v, int n)
 {
-    int i;
-    for (i = 0; i < n; i++) {
-        p = unpack_char (p, v++);
-    }
-    return p;
+    pack_copy_array (v, p, n, sizeof(char), 0);
+    return (n > 0) ? p + n : p;
 }
 
 static INLINE char *
 unpack_array_short (char *p, short *v, int n, int e)
 {
-    int i;
-    for (i = 0; i < n; i++) {
-        p = pack_load_short (p, v++, e);
-    }
-    return p;
+    pack_copy_array (v, p, n, sizeof(short), e);
+    return (n > 0) ? p + n * sizeof(short) : p;
 }
 
 static INLINE char *
 unpack_array_int (char *p, int *v, int n, int e)
 {
-    int i;
-    for (i = 0; i < n; i++)
-        p = pack_load_int (p, v++, e);
-    return p;
+    pack_copy_array (v, p, n, sizeof(int), e);
+    return (n > 0) ? p + n * sizeof(int) : p;
 }
 
 static INLINE char *
 unpack_array_long (char *p, long *v, int n, int e)
 {
-    int i;
-    for (i = 0; i < n; i++)
-        p = pack_load_long (p, v++, e);
-    return p;
+    pack_copy_array (v, p, n, sizeof(long), e);
+    return (n > 0) ? p + n * sizeof(long) : p;
 }
 
 static INLINE char *
 unpack_array_float (char *p, float *v, int n, int e)
 {
-    int i;
-    for (i = 0; i < n; i++)
-        p = pack_load_float (p, v++, e);
-    return p;
+    pack_copy_array (v, p, n, sizeof(float), e);
+    return (n > 0) ? p + n * sizeof(float) : p;
 }
 
 static INLINE char *
 unpack_array_double (char *p, double *v, int n, int e)
 {
-    int i;
-    for (i = 0; i < n; i++) {
-        p = pack_load_double (p, v++, e);
+    pack_copy_array (v, p, n, sizeof(double), e);
+    return (n > 0) ? p + n * sizeof(double) : p;
+}
+
+/**
+ *  @brief  書式文字が表す型の1要素のバイト数を返す内部関数
+ *  @param  c   書式文字
+ *  @retval 型のバイト数、型を表さない文字の場合は0
+ */
+static INLINE int
+pack_type_size (char c)
+{
+    switch (c) {
+    case 'c': return sizeof(char);
+    case 'h': return sizeof(short);
+    case 'i': return sizeof(int);
+    case 'l': return sizeof(long);
+    case 'f': return sizeof(float);
+    case 'd': return sizeof(double);
+    case 'b': case 'B': return 1;
+    case 'w': case 'W': return 2;
+    case 'j': case 'J': return 4;
+    case 'q': case 'Q': return 8;
+    case 'v': case 'z': return PACK_VARINT_MAX;
+    case 's': case 'y': return 1;
+    case 'x': return 1;
     }
-    return p;
+    return pack_conv_size (c);
 }
 
 /**
- * @ingroup pack
- * @brief   書式文字列が表すデータ領域のサイズを返す。
- * @param   format  書式文字列
- * @param   ...     saveするデータの配列長の可変引数('#'で与えられる部分)
- * @retval  データ領域のサイズ
+ *  @brief  n要素の項目のバイト数(圧縮する場合は上限)を返す内部関数
+ *  @param  op  項目
+ *  @param  n   要素数
+ *  @retval バイト数
  */
-int pack_size (char *format, ...)
+size_t
+pack_op_bytes (const pack_op_t *op, int n)
 {
-    char *fp, *np;
-    int total = 0;
-    int size;
-    va_list args;
+    if (op->codec == '~') {
+        return pack_for_bound (n, op->size);
+    }
+    return (size_t) n * op->size;
+}
 
-    va_start (args, format);
+/**
+ *  @brief  配列の項目の、変数側の1要素のバイト数を返す内部関数
+ *  @param  op  項目
+ *  @retval バイト数
+ */
+int
+pack_data_size (const pack_op_t *op)
+{
+    if (pack_conv_size (op->type) > 0) {
+        return isupper (op->type) ? sizeof(double) : sizeof(float);
+    }
+    if (op->type == 'v' || op->type == 'z') {
+        return sizeof(uint64_t);
+    }
+    return op->size;
+}
 
-    fp = format;
-    while (*fp != '\0') {
-        if (*fp == 'c') {
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                size = va_arg (args, int);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (np == fp) {
-                    size = 1;
-                }
-                else {
-                    fp = np;
-                }
-            }
-            total += size * sizeof(char);
-            continue;
-        }
-        if (*fp == 'h') {
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                size = va_arg (args, int);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (np == fp) {
-                    size = 1;
-                }
-                else {
-                    fp = np;
-                }
-            }
-            total += size * sizeof(short);
-            continue;
-        }
-        if (*fp == 'i') {
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                size = va_arg (args, int);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (np == fp) {
-                    size = 1;
-                }
-                else {
-                    fp = np;
-                }
-            }
-            total += size * sizeof(int);
-            continue;
-        }
-        if (*fp == 'l') {
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                size = va_arg (args, int);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (np == fp) {
-                    size = 1;
-                }
-                else {
-                    fp = np;
-                }
-            }
-            total += size * sizeof(long);
-            continue;
-        }
-        if (*fp == 'f') {
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                size = va_arg (args, int);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (np == fp) {
-                    size = 1;
-                }
-                else {
-                    fp = np;
-                }
-            }
-            total += size * sizeof(float);
-            continue;
-        }
-        if (*fp == 'd') {
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                size = va_arg (args, int);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (np == fp) {
-                    size = 1;
-                }
-                else {
-                    fp = np;
-                }
-            }
-            total += size * sizeof(double);
-            continue;
+/**
+ *  @brief  配列の項目が変数のバイト列のまま保存されるかを返す内部関数
+ *
+ *  エンディアン変換も圧縮も型の変換もしない配列は、変数の領域と
+ *  保存形式が同じバイト列になるので、複製せずに参照できる。
+ *
+ *  @param  op  項目
+ *  @retval 1:変数のバイト列のまま, 0:変換が必要または単独変数
+ */
+int
+pack_op_native (const pack_op_t *op)
+{
+    if (op->mode == PACK_SCALAR || op->codec != 0) {
+        return 0;
+    }
+    if (op->endian && op->size > 1) {
+        return 0;
+    }
+    return strchr ("chilfdbBwWjJqQsy", op->type) != NULL;
+}
+
+/**
+ *  @brief  長さを前に置く文字列かバイト列('s', 'y')の項目かを返す内部関数
+ *
+ *  これらの項目はloadで複製せず、buffer内の先頭とバイト数を返す。
+ *
+ *  @param  op  項目
+ *  @retval 1:文字列かバイト列, 0:それ以外
+ */
+int
+pack_op_string (const pack_op_t *op)
+{
+    return op->type == 's' || op->type == 'y';
+}
+
+/**
+ *  @brief  '@'の項目で置く詰め物のバイト数を返す内部関数
+ *  @param  op  PACK_ALIGNの項目
+ *  @param  off データ領域の先頭からの位置
+ *  @retval バイト数
+ */
+int
+pack_align_pad (const pack_op_t *op, size_t off)
+{
+    return (int) ((op->count - off % op->count) % op->count);
+}
+
+/**
+ *  @brief  値0の詰め物を置く内部関数
+ *  @param  bp  save先へのポインタ
+ *  @param  n   バイト数
+ *  @retval 詰め物の直後へのポインタ
+ */
+char *
+pack_put_pad (char *bp, int n)
+{
+    if (n <= 0) {
+        return bp;
+    }
+    memset (bp, 0, n);
+    return bp + n;
+}
+
+/**
+ *  @brief  型の後の'#', '*', 数字を解析する内部関数
+ *  @param  fp  型の直後
+ *  @param  op  mode, countを格納する項目
+ *  @retval 解析した部分の直後へのポインタ
+ */
+static INLINE char *
+pack_parse_count (char *fp, pack_op_t *op)
+{
+    char *np;
+
+    if (*fp == '#' || *fp == '*') {
+        op->mode = (*fp == '#') ? PACK_VAR : PACK_PREFIX;
+        op->count = 0;
+        return fp + 1;
+    }
+    op->count = strtol (fp, &np, 10);
+    if (np == fp) {
+        op->mode = PACK_SCALAR;
+        op->count = 1;
+        return fp;
+    }
+    op->mode = PACK_FIXED;
+    return np;
+}
+
+/**
+ *  @brief  グループの中の項目を1回分の配列にする内部関数
+ */
+static INLINE void
+pack_group_member (pack_op_t *m)
+{
+    if (m->mode != PACK_FIXED) {
+        m->mode = PACK_FIXED;
+        m->count = 1;
+        m->bytes = (int) pack_op_bytes (m, 1);
+    }
+}
+
+/**
+ *  @brief  グループを解析する内部関数
+ *
+ *  グループの項目は数えるだけで、opには'('の直後の位置を残す。
+ *  項目はpack_group_membersで取り出す。扱えない項目を含むグループは
+ *  その項目を除いて解析すると可変引数と合わなくなるので、解析を打ち切る。
+ *
+ *  @param  fp      '('の直後
+ *  @param  op      解析結果を格納する領域へのポインタ
+ *  @param  endian  エンディアン変換フラグ
+ *  @retval グループの直後へのポインタ、')'が無いか扱えない項目を含めばNULL
+ *          (後者の場合errnoはEINVAL)
+ */
+static char *
+pack_parse_group (char *fp, pack_op_t *op, int *endian)
+{
+    char *end = strchr (fp, ')'), *np;
+    int e = *endian;
+    pack_op_t m;
+
+    if (end == NULL) {
+        return NULL;
+    }
+    if (memchr (fp, '(', end - fp) != NULL || memchr (fp, '@', end - fp) != NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    op->type = PACK_GROUP;
+    op->endian = *endian;
+    op->codec = 0;
+    op->size = 0;
+    op->group = 0;
+    op->body = fp;
+    while ((np = pack_parse_op (fp, &m, &e)) != NULL && np <= end) {
+        if (op->group == PACK_GROUP_MAX || pack_op_string (&m)) {
+            errno = EINVAL;
+            return NULL;
         }
-        fp++;
+        pack_group_member (&m);
+        op->size += m.bytes;
+        op->group++;
+        *endian = e;
+        fp = np;
     }
-    va_end (args);
-    return total;
+    fp = pack_parse_count (end + 1, op);
+    if (op->mode == PACK_SCALAR) {
+        op->mode = PACK_FIXED;
+    }
+    op->bytes = (int) pack_op_bytes (op, op->count);
+    return fp;
 }
 
 /**
- *  @ingroup pack
- *  @brief  書式文字列 formatに従ってbufferにデータをパックする
- *  @param  buffer  データ領域の先頭へのポインタ
- *  @param  format  書式文字列
- *  @param  ...     saveする変数列（可変引数）
- *  @retval buffer内にsaveされたデータの直後へのポインタ
+ *  @brief  グループの項目を返す内部関数
+ *  @param  g   グループの項目
+ *  @param  buf 書式文字列から解析する場合に項目を格納する領域(PACK_GROUP_MAX個)
+ *  @retval g->group個の項目の配列
  */
-char* pack_save (char *buffer, char *format, ...)
+const pack_op_t *
+pack_group_members (const pack_op_t *g, pack_op_t *buf)
 {
-    char *fp, *bp, *np;
-    int size;
-    int endian = 0;
-    va_list args;
+    char *fp = g->body;
+    int i, endian = g->endian;
 
-    va_start (args, format);
-    fp = format;
-    bp = buffer;
+    if (fp == NULL) {
+        /* planでは直後に並んでいる */
+        return g + 1;
+    }
+    for (i = 0; i < g->group; i++) {
+        fp = pack_parse_op (fp, &buf[i], &endian);
+        pack_group_member (&buf[i]);
+    }
+    return buf;
+}
+
+/**
+ *  @brief  書式文字列から次の1項目を取り出す内部関数
+ *  @param  fp      書式文字列の解析位置
+ *  @param  op      解析結果を格納する領域へのポインタ
+ *  @param  endian  エンディアン変換フラグ('!'を読むと1になる)
+ *  @retval 解析した項目の直後へのポインタ、項目が無ければNULL
+ */
+char *
+pack_parse_op (char *fp, pack_op_t *op, int *endian)
+{
+    char codec = 0;
 
     while (*fp != '\0') {
         if (*fp == '!') {
             /* エンディアン変換を行う */
             fp++;
-            endian = 1;
+            *endian = 1;
             continue;
         }
-        if (*fp == 'c') {
-            char* data;
+        if (*fp == '~') {
+            /* 次の整数配列を圧縮する */
             fp++;
-            if (*fp == '#') {
-                fp++;
-                data = va_arg (args, char *);
-                size = va_arg (args, int);
-                bp = pack_save_char_array (bp, data, size);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (np != fp) {
-                    bp = pack_save_char_array (bp, va_arg (args, char *), size);
-                    fp = np;
-                }
-                else {
-                    bp = pack_save_char (bp, va_arg (args, int));
-                }
-            }
+            codec = '~';
             continue;
         }
-        if (*fp == 'h') {
-            short* data;
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                data = va_arg (args, short *);
-                size = va_arg (args, int);
-                bp = pack_save_short_array (bp, data, size, endian);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (fp == np) {
-                    bp = pack_save_short (bp, va_arg (args, int), endian);
-                }
-                else {
-                    bp = pack_save_short_array (bp, va_arg (args, short *), size, endian);
-                    fp = np;
-                }
-            }
-            continue;
+        if (*fp == '(') {
+            /* 項目の並びを繰り返す */
+            return pack_parse_group (fp + 1, op, endian);
         }
-        if (*fp == 'i') {
-            int* data;
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                data = va_arg (args, int *);
-                size = va_arg (args, int);
-                bp = pack_array_int (bp, data, size, endian);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (fp == np) {
-                    bp = pack_save_int (bp, va_arg (args, int), endian);
-                }
-                else {
-                    bp = pack_array_int (bp, va_arg (args, int*), size, endian);
-                    fp = np;
-                }
+        if (*fp == '@') {
+            /* 次の項目の位置を揃える */
+            op->type = PACK_ALIGN;
+            op->endian = *endian;
+            op->mode = PACK_FIXED;
+            op->codec = 0;
+            op->count = strtol (fp + 1, &fp, 10);
+            if (op->count < 1) {
+                op->count = 1;
             }
-            continue;
+            op->size = 1;
+            op->bytes = 0;
+            op->group = 0;
+            op->body = NULL;
+            return fp;
         }
-        if (*fp == 'l') {
-            long* data;
+        op->size = pack_type_size (*fp);
+        if (op->size == 0) {
             fp++;
-            if (*fp == '#') {
-                fp++;
-                data = va_arg (args, long *);
-                size = va_arg (args, int);
-                bp = pack_array_long (bp, data, size, endian);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (fp == np) {
-                    bp = pack_save_long (bp, va_arg (args, int), endian);
-                }
-                else {
-                    bp = pack_array_long (bp, va_arg (args, long *), size, endian);
-                    fp = np;
-                }
-            }
             continue;
         }
-        if (*fp == 'f') {
-            float* data;
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                data = va_arg (args, float *);
-                size = va_arg (args, int);
-                bp = pack_array_float (bp, data, size, endian);
+        op->type = *fp++;
+        op->endian = *endian;
+        op->codec = 0;
+        op->group = 0;
+        op->body = NULL;
+        if (pack_op_string (op)) {
+            /* 常にバイト数を前に置く */
+            op->mode = PACK_PREFIX;
+            op->count = 0;
+            op->bytes = 0;
+            return fp;
+        }
+        fp = pack_parse_count (fp, op);
+        if (op->type == 'x' && op->mode != PACK_FIXED) {
+            /* 詰め物は数字で与えたバイト数だけ */
+            op->mode = PACK_FIXED;
+            op->count = 1;
+        }
+        if (codec && op->mode != PACK_SCALAR && strchr ("iljJqQ", op->type) != NULL) {
+            op->codec = codec;
+        }
+        op->bytes = (int) pack_op_bytes (op, op->count);
+        return fp;
+    }
+    return NULL;
+}
+
+/**
+ *  @brief  1項目のバイト数を返す内部関数
+ *  @param  op  項目
+ *  @param  off データ領域の先頭からの位置('@'の場合のみ使う)
+ *  @param  ap  要素数の可変引数('#', '*', 's', 'y'の場合のみ読む)
+ *  @retval 項目のバイト数
+ */
+static INLINE int
+pack_size_op (const pack_op_t *op, int off, va_list *ap)
+{
+    if (op->type == PACK_ALIGN) {
+        return pack_align_pad (op, off);
+    }
+    if (op->mode == PACK_VAR) {
+        return (int) pack_op_bytes (op, va_arg (*ap, int));
+    }
+    if (op->mode == PACK_PREFIX) {
+        return PACK_PREFIX_SIZE + (int) pack_op_bytes (op, va_arg (*ap, int));
+    }
+    return op->bytes;
+}
+
+/**
+ *  @brief  saveする1項目分の変数を可変引数から取り出す内部関数
+ *  @param  f   取り出したデータを格納する領域へのポインタ
+ *  @param  op  項目
+ *  @param  ap  saveする変数の可変引数
+ *  @retval 項目のバイト数
+ */
+size_t
+pack_fetch_save (pack_field_t *f, const pack_op_t *op, va_list *ap)
+{
+    size_t bytes;
+
+    f->op = op;
+    if (op->type == 'x' || op->type == PACK_ALIGN) {
+        /* 詰め物は変数を取らない */
+        f->data = &f->v;
+        f->n = op->bytes;
+        return op->bytes;
+    }
+    if (strchr ("rRtT", op->type) != NULL) {
+        /* 固定小数点の倍率 */
+        f->scale = va_arg (*ap, double);
+    }
+    if (op->mode == PACK_SCALAR) {
+        f->n = 1;
+        f->data = &f->v;
+        switch (op->type) {
+        case 'c': f->v.c = va_arg (*ap, int); break;
+        case 'h': f->v.h = va_arg (*ap, int); break;
+        case 'i': f->v.i = va_arg (*ap, int); break;
+        case 'l': f->v.l = va_arg (*ap, long); break;
+        case 'f': f->v.f = va_arg (*ap, double); break;
+        case 'd': f->v.d = va_arg (*ap, double); break;
+        case 'b': case 'B': f->v.u8 = va_arg (*ap, int); break;
+        case 'w': case 'W': f->v.u16 = va_arg (*ap, int); break;
+        case 'j': f->v.u32 = va_arg (*ap, int32_t); break;
+        case 'J': f->v.u32 = va_arg (*ap, uint32_t); break;
+        case 'q': f->v.u64 = va_arg (*ap, int64_t); break;
+        case 'Q': f->v.u64 = va_arg (*ap, uint64_t); break;
+        case 'v': f->v.u64 = va_arg (*ap, uint64_t); break;
+        case 'z': f->v.u64 = va_arg (*ap, int64_t); break;
+        case 'e': case 'g': case 'r': case 't': f->v.f = va_arg (*ap, double); break;
+        case 'E': case 'G': case 'R': case 'T': f->v.d = va_arg (*ap, double); break;
+        }
+        return op->size;
+    }
+    f->data = va_arg (*ap, void *);
+    if (op->type == 's') {
+        f->n = (f->data != NULL) ? (int) strlen (f->data) : 0;
+    }
+    else {
+        f->n = (op->mode == PACK_VAR || op->mode == PACK_PREFIX) ? va_arg (*ap, int) : op->count;
+    }
+    bytes = (f->n > 0) ? pack_op_bytes (op, f->n) : 0;
+    return (op->mode == PACK_PREFIX) ? PACK_PREFIX_SIZE + bytes : bytes;
+}
+
+/**
+ *  @brief  loadする1項目分の格納先を可変引数から取り出す内部関数
+ *  @param  f   取り出した格納先を格納する領域へのポインタ
+ *  @param  op  項目
+ *  @param  ap  loadする変数へのポインタの可変引数
+ *  @retval 項目のバイト数('*'の場合は上限の要素数での値、
+ *          's', 'y'の場合はバイト数を除いた値)
+ */
+size_t
+pack_fetch_load (pack_field_t *f, const pack_op_t *op, va_list *ap)
+{
+    size_t bytes;
+
+    f->op = op;
+    if (op->type == 'x' || op->type == PACK_ALIGN) {
+        f->data = &f->v;
+        f->n = op->bytes;
+        return op->bytes;
+    }
+    if (strchr ("rRtT", op->type) != NULL) {
+        /* 固定小数点の倍率 */
+        f->scale = va_arg (*ap, double);
+    }
+    f->data = va_arg (*ap, void *);
+    if (pack_op_string (op)) {
+        /* dataは先頭を受け取るポインタ、countはNULL可 */
+        f->count = va_arg (*ap, int *);
+        f->n = 0;
+    }
+    else if (op->mode == PACK_PREFIX) {
+        f->count = va_arg (*ap, int *);
+        f->n = *f->count;
+    }
+    else {
+        f->n = (op->mode == PACK_VAR) ? va_arg (*ap, int) : op->count;
+    }
+    bytes = (f->n > 0) ? pack_op_bytes (op, f->n) : 0;
+    return (op->mode == PACK_PREFIX) ? PACK_PREFIX_SIZE + bytes : bytes;
+}
+
+/**
+ *  @brief  取り出した1項目を実際にsaveした場合のバイト数を返す内部関数
+ *  @param  f   pack_fetch_saveで取り出したデータ
+ *  @retval バイト数
+ */
+int
+pack_field_size (const pack_field_t *f)
+{
+    const pack_op_t *op = f->op;
+    int prefix = (op->mode == PACK_PREFIX) ? PACK_PREFIX_SIZE : 0;
+
+    if (f->n <= 0) {
+        return prefix;
+    }
+    if (op->codec == '~') {
+        return prefix + (int) pack_for_size (f->data, f->n, op->size, islower (op->type));
+    }
+    switch (op->type) {
+    case 'v':
+        return prefix + ((op->mode == PACK_SCALAR) ? pack_varint_len (f->v.u64)
+                         : (int) pack_varint_size_array (f->data, f->n, 0));
+    case 'z':
+        return prefix + ((op->mode == PACK_SCALAR) ? pack_varint_len (pack_zigzag (f->v.u64))
+                         : (int) pack_varint_size_array (f->data, f->n, 1));
+    }
+    return prefix + f->n * op->size;
+}
+
+/**
+ *  @brief  取り出した1項目をsaveする内部関数
+ *  @param  bp  save先へのポインタ
+ *  @param  f   pack_fetch_saveで取り出したデータ
+ *  @retval saveされたデータの直後へのポインタ
+ */
+char *
+pack_put_field (char *bp, const pack_field_t *f)
+{
+    const pack_op_t *op = f->op;
+
+    if (op->type == 'x' || op->type == PACK_ALIGN) {
+        return pack_put_pad (bp, f->n);
+    }
+    if (op->mode == PACK_PREFIX) {
+        bp = pack_save_u32 (bp, (f->n > 0) ? (uint32_t) f->n : 0, op->endian);
+    }
+    if (pack_conv_size (op->type) > 0) {
+        return pack_conv_put (bp, f->data, f->n, op->type, f->scale, op->endian);
+    }
+    if (op->mode == PACK_SCALAR) {
+        switch (op->type) {
+        case 'c': return pack_save_char (bp, f->v.c);
+        case 'h': return pack_save_short (bp, f->v.h, op->endian);
+        case 'i': return pack_save_int (bp, f->v.i, op->endian);
+        case 'l': return pack_save_long (bp, f->v.l, op->endian);
+        case 'f': return pack_save_float (bp, f->v.f, op->endian);
+        case 'd': return pack_save_double (bp, f->v.d, op->endian);
+        case 'b': case 'B': return pack_save_char (bp, f->v.u8);
+        case 'w': case 'W': return pack_save_u16 (bp, f->v.u16, op->endian);
+        case 'j': case 'J': return pack_save_u32 (bp, f->v.u32, op->endian);
+        case 'q': case 'Q': return pack_save_u64 (bp, f->v.u64, op->endian);
+        case 'v': return pack_varint_put (bp, f->v.u64);
+        case 'z': return pack_varint_put (bp, pack_zigzag (f->v.u64));
+        }
+        return bp;
+    }
+    if (op->codec == '~') {
+        return pack_for_put (bp, f->data, f->n, op->size, islower (op->type));
+    }
+    switch (op->type) {
+    case 'c': return pack_save_char_array (bp, f->data, f->n);
+    case 'h': return pack_save_short_array (bp, f->data, f->n, op->endian);
+    case 'i': return pack_array_int (bp, f->data, f->n, op->endian);
+    case 'l': return pack_array_long (bp, f->data, f->n, op->endian);
+    case 'f': return pack_array_float (bp, f->data, f->n, op->endian);
+    case 'd': return pack_array_double (bp, f->data, f->n, op->endian);
+    case 'v': return pack_varint_put_array (bp, f->data, f->n, 0);
+    case 'z': return pack_varint_put_array (bp, f->data, f->n, 1);
+    }
+    /* 幅が固定された整数 */
+    if (f->n > 0) {
+        pack_copy_array (bp, f->data, f->n, op->size, op->endian);
+        bp += f->n * op->size;
+    }
+    return bp;
+}
+
+/**
+ *  @brief  取り出した格納先へ1項目をloadする内部関数
+ *  @param  bp  load元へのポインタ
+ *  @param  f   pack_fetch_loadで取り出した格納先
+ *  @retval loadされた領域の直後へのポインタ、
+ *          '*'の要素数が上限を超えていればNULL(errnoはEMSGSIZE)
+ */
+char *
+pack_get_field (char *bp, const pack_field_t *f)
+{
+    const pack_op_t *op = f->op;
+    pack_field_t g;
+    uint32_t n;
+
+    if (op->type == 'x' || op->type == PACK_ALIGN) {
+        return (f->n > 0) ? bp + f->n : bp;
+    }
+    if (pack_op_string (op)) {
+        /* 複製せずにbuffer内を指す */
+        bp = pack_load_u32 (bp, &n, op->endian);
+        *(char **) f->data = bp;
+        if (f->count != NULL) {
+            *f->count = (int) n;
+        }
+        return bp + n;
+    }
+    if (op->mode == PACK_PREFIX) {
+        bp = pack_load_u32 (bp, &n, op->endian);
+        if (n > (uint32_t) ((f->n > 0) ? f->n : 0)) {
+            errno = EMSGSIZE;
+            return NULL;
+        }
+        *f->count = (int) n;
+        g = *f;
+        g.n = (int) n;
+        f = &g;
+    }
+    if (pack_conv_size (op->type) > 0) {
+        return pack_conv_get (bp, f->data, f->n, op->type, f->scale, op->endian);
+    }
+    if (op->mode == PACK_SCALAR) {
+        switch (op->type) {
+        case 'c': return unpack_char (bp, f->data);
+        case 'h': return pack_load_short (bp, f->data, op->endian);
+        case 'i': return pack_load_int (bp, f->data, op->endian);
+        case 'l': return pack_load_long (bp, f->data, op->endian);
+        case 'f': return pack_load_float (bp, f->data, op->endian);
+        case 'd': return pack_load_double (bp, f->data, op->endian);
+        case 'b': case 'B': return unpack_char (bp, f->data);
+        case 'w': case 'W': return pack_load_u16 (bp, f->data, op->endian);
+        case 'j': case 'J': return pack_load_u32 (bp, f->data, op->endian);
+        case 'q': case 'Q': return pack_load_u64 (bp, f->data, op->endian);
+        case 'v': return pack_varint_get (bp, f->data);
+        case 'z':
+            bp = pack_varint_get (bp, f->data);
+            *(uint64_t *) f->data = pack_unzigzag (*(uint64_t *) f->data);
+            return bp;
+        }
+        return bp;
+    }
+    if (op->codec == '~') {
+        return pack_for_get (bp, f->data, f->n, op->size);
+    }
+    switch (op->type) {
+    case 'c': return unpack_array_char (bp, f->data, f->n);
+    case 'h': return unpack_array_short (bp, f->data, f->n, op->endian);
+    case 'i': return unpack_array_int (bp, f->data, f->n, op->endian);
+    case 'l': return unpack_array_long (bp, f->data, f->n, op->endian);
+    case 'f': return unpack_array_float (bp, f->data, f->n, op->endian);
+    case 'd': return unpack_array_double (bp, f->data, f->n, op->endian);
+    case 'v': return pack_varint_get_array (bp, f->data, f->n, 0);
+    case 'z': return pack_varint_get_array (bp, f->data, f->n, 1);
+    }
+    /* 幅が固定された整数 */
+    if (f->n > 0) {
+        pack_copy_array (f->data, bp, f->n, op->size, op->endian);
+        bp += f->n * op->size;
+    }
+    return bp;
+}
+
+/**
+ *  @brief  グループをsaveする内部関数
+ *
+ *  bpがNULLならsaveせずにバイト数だけ数える。
+ *
+ *  @param  bp  save先へのポインタ(NULL可)
+ *  @param  g   グループの項目
+ *  @param  ap  saveする変数の可変引数(項目毎の配列、繰り返し数)
+ *  @retval saveしたバイト数
+ */
+size_t
+pack_group_put (char *bp, const pack_op_t *g, va_list *ap)
+{
+    pack_op_t buf[PACK_GROUP_MAX];
+    const pack_op_t *m = pack_group_members (g, buf);
+    pack_field_t f[PACK_GROUP_MAX], e;
+    size_t stride[PACK_GROUP_MAX], total = 0;
+    char *start = bp;
+    int i, k, n;
+
+    for (k = 0; k < g->group; k++) {
+        pack_fetch_save (&f[k], &m[k], ap);
+        stride[k] = (size_t) m[k].count * pack_data_size (&m[k]);
+    }
+    n = (g->mode == PACK_FIXED) ? g->count : va_arg (*ap, int);
+    if (n < 0) {
+        n = 0;
+    }
+    if (g->mode == PACK_PREFIX) {
+        if (bp != NULL) {
+            bp = pack_save_u32 (bp, (uint32_t) n, g->endian);
+        }
+        total += PACK_PREFIX_SIZE;
+    }
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < g->group; k++) {
+            e = f[k];
+            e.data = (char *) f[k].data + i * stride[k];
+            if (bp != NULL) {
+                bp = pack_put_field (bp, &e);
             }
             else {
-                size = strtol (fp, &np, 10);
-                if (fp == np) {
-                    bp = pack_save_float (bp, va_arg (args, double), endian);
-                }
-                else {
-                    bp = pack_array_float (bp, va_arg (args, float *), size, endian);
-                    fp = np;
-                }
+                total += pack_field_size (&e);
             }
-            continue;
         }
-        if (*fp == 'd') {
-            double* data;
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                data = va_arg (args, double *);
-                size = va_arg (args, int);
-                bp = pack_array_double (bp, data, size, endian);
+    }
+    return (start != NULL) ? (size_t) (bp - start) : total;
+}
+
+/**
+ *  @brief  グループをloadする内部関数
+ *  @param  bp  load元へのポインタ
+ *  @param  g   グループの項目
+ *  @param  ap  loadする変数の可変引数(項目毎の配列、繰り返し数)
+ *  @retval loadされた領域の直後へのポインタ、
+ *          '*'の繰り返し数が上限を超えていればNULL(errnoはEMSGSIZE)
+ */
+char *
+pack_group_get (char *bp, const pack_op_t *g, va_list *ap)
+{
+    pack_op_t buf[PACK_GROUP_MAX];
+    const pack_op_t *m = pack_group_members (g, buf);
+    pack_field_t f[PACK_GROUP_MAX], e;
+    size_t stride[PACK_GROUP_MAX];
+    uint32_t c;
+    int i, k, n, *count;
+
+    for (k = 0; k < g->group; k++) {
+        pack_fetch_load (&f[k], &m[k], ap);
+        stride[k] = (size_t) m[k].count * pack_data_size (&m[k]);
+    }
+    if (g->mode == PACK_PREFIX) {
+        count = va_arg (*ap, int *);
+        bp = pack_load_u32 (bp, &c, g->endian);
+        if (c > (uint32_t) ((*count > 0) ? *count : 0)) {
+            errno = EMSGSIZE;
+            return NULL;
+        }
+        *count = n = (int) c;
+    }
+    else {
+        n = (g->mode == PACK_FIXED) ? g->count : va_arg (*ap, int);
+    }
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < g->group; k++) {
+            e = f[k];
+            e.data = (char *) f[k].data + i * stride[k];
+            bp = pack_get_field (bp, &e);
+        }
+    }
+    return bp;
+}
+
+/**
+ *  @brief  1項目をsaveする内部関数
+ *  @param  bp      save先へのポインタ
+ *  @param  base    データ領域の先頭('@'の位置の基準)
+ *  @param  op      項目
+ *  @param  ap      saveする変数の可変引数
+ *  @retval saveされたデータの直後へのポインタ
+ */
+static INLINE char *
+pack_save_op (char *bp, char *base, const pack_op_t *op, va_list *ap)
+{
+    pack_field_t f;
+
+    if (op->type == PACK_ALIGN) {
+        return pack_put_pad (bp, pack_align_pad (op, bp - base));
+    }
+    if (op->type == PACK_GROUP) {
+        return bp + pack_group_put (bp, op, ap);
+    }
+    pack_fetch_save (&f, op, ap);
+    return pack_put_field (bp, &f);
+}
+
+/**
+ *  @brief  1項目をloadする内部関数
+ *  @param  bp      load元へのポインタ
+ *  @param  base    データ領域の先頭('@'の位置の基準)
+ *  @param  op      項目
+ *  @param  ap      loadする変数へのポインタの可変引数
+ *  @retval loadされた領域の直後へのポインタ、'*'の上限を超えればNULL
+ */
+static INLINE char *
+pack_load_op (char *bp, char *base, const pack_op_t *op, va_list *ap)
+{
+    pack_field_t f;
+
+    if (op->type == PACK_ALIGN) {
+        return bp + pack_align_pad (op, bp - base);
+    }
+    if (op->type == PACK_GROUP) {
+        return pack_group_get (bp, op, ap);
+    }
+    pack_fetch_load (&f, op, ap);
+    return pack_get_field (bp, &f);
+}
+
+/**
+ *  @brief  planが表すデータ領域のサイズを返す内部関数
+ */
+static INLINE int
+pack_plan_size (const pack_plan_t *plan, va_list *ap)
+{
+    int i, total = plan->fixed;
+
+    if (plan->nvar > 0 && plan->align > 0) {
+        /* '@'の詰め物は前の項目の大きさで変わるので、順に数える */
+        for (i = total = 0; i < plan->nops; i += 1 + plan->op[i].group) {
+            total += pack_size_op (&plan->op[i], total, ap);
+        }
+        return total;
+    }
+    for (i = 0; i < plan->nops && plan->nvar > 0; i += 1 + plan->op[i].group) {
+        if (plan->op[i].mode == PACK_VAR || plan->op[i].mode == PACK_PREFIX) {
+            total += pack_size_op (&plan->op[i], 0, ap);
+        }
+    }
+    return total;
+}
+
+/**
+ *  @brief  planに従ってsaveする内部関数
+ */
+static INLINE char *
+pack_plan_save (char *bp, const pack_plan_t *plan, va_list *ap)
+{
+    char *base = bp;
+    int i;
+
+    for (i = 0; i < plan->nops; i += 1 + plan->op[i].group) {
+        bp = pack_save_op (bp, base, &plan->op[i], ap);
+    }
+    return bp;
+}
+
+/**
+ *  @brief  planに従ってloadする内部関数
+ */
+static INLINE char *
+pack_plan_load (char *bp, const pack_plan_t *plan, va_list *ap)
+{
+    char *base = bp;
+    int i;
+
+    for (i = 0; bp != NULL && i < plan->nops; i += 1 + plan->op[i].group) {
+        bp = pack_load_op (bp, base, &plan->op[i], ap);
+    }
+    return bp;
+}
+
+/**
+ *  @brief  書式文字列を最後まで解析できるかを確かめる内部関数
+ *  @param  format  書式文字列
+ *  @retval 0:解析できる, -1:扱えないグループを含む(errnoはEINVAL)
+ */
+static int
+pack_format_valid (char *format)
+{
+    char *fp = format, *np;
+    int endian = 0;
+    pack_op_t op;
+
+    while ((np = pack_parse_op (fp, &op, &endian)) != NULL) {
+        fp = np;
+    }
+    /* 解析を打ち切ったグループは'('が残る */
+    if (strchr (fp, '(') != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ *  @brief  書式文字列を受け取る関数が、処理を始める前に書式を確かめる内部関数
+ *
+ *  グループを含まない書式と表に登録済みの書式は解析し直さない。
+ *
+ *  @param  format  書式文字列
+ *  @retval 0:扱える, -1:扱えないグループを含む(errnoはEINVAL)
+ */
+int
+pack_format_check (char *format)
+{
+    if (strchr (format, '(') == NULL || pack_cache_get (format) != NULL) {
+        return 0;
+    }
+    return pack_format_valid (format);
+}
+
+/**
+ *  @brief  書式文字列に従ってsaveする内部関数
+ *
+ *  bpがNULLならsaveせずにバイト数だけ数える。可変長の項目も上限ではなく
+ *  実際のバイト数を数えるので、同じ可変引数で先に大きさを求めてから
+ *  領域を確保できる。
+ *
+ *  @param  bp      save先へのポインタ(NULL可)
+ *  @param  format  書式文字列
+ *  @param  ap      saveする変数の可変引数
+ *  @retval saveしたバイト数、扱えない書式の場合は(size_t) -1(errnoはEINVAL)
+ */
+size_t
+pack_format_put (char *bp, char *format, va_list *ap)
+{
+    const pack_plan_t *plan = pack_cache_get (format);
+    const pack_op_t *o;
+    char *fp = format;
+    int i = 0, endian = 0;
+    size_t total = 0, n;
+    pack_op_t op;
+    pack_field_t f;
+
+    if (plan == NULL && pack_format_check (format) < 0) {
+        return (size_t) -1;
+    }
+
+    for (;;) {
+        if (plan != NULL) {
+            if (i >= plan->nops) {
+                break;
             }
-            else {
-                size = strtol (fp, &np, 10);
-                if (fp == np) {
-                    bp = pack_save_double (bp, va_arg (args, double), endian);
-                }
-                else {
-                    bp = pack_array_double (bp, va_arg (args, double *), size, endian);
-                    fp = np;
-                }
+            o = &plan->op[i];
+            i += 1 + o->group;
+        }
+        else {
+            if ((fp = pack_parse_op (fp, &op, &endian)) == NULL) {
+                break;
             }
+            o = &op;
+        }
+        if (o->type == PACK_ALIGN) {
+            n = pack_align_pad (o, total);
+            if (bp != NULL) {
+                bp = pack_put_pad (bp, n);
+            }
+            total += n;
             continue;
         }
-        fp++;
+        if (o->type == PACK_GROUP) {
+            n = pack_group_put (bp, o, ap);
+            if (bp != NULL) {
+                bp += n;
+            }
+            total += n;
+            continue;
+        }
+        pack_fetch_save (&f, o, ap);
+        if (bp != NULL) {
+            bp = pack_put_field (bp, &f);
+        }
+        total += pack_field_size (&f);
+    }
+    return total;
+}
+
+/**
+ *  @brief  書式文字列に従ってloadする内部関数
+ *  @param  bp      load元へのポインタ
+ *  @param  format  書式文字列
+ *  @param  ap      loadする変数へのポインタの可変引数
+ *  @retval loadされた領域の直後へのポインタ、'*'の上限を超えるか
+ *          扱えない書式の場合はNULL
+ */
+char *
+pack_format_get (char *bp, char *format, va_list *ap)
+{
+    const pack_plan_t *plan = pack_cache_get (format);
+    char *fp = format, *base = bp;
+    int endian = 0;
+    pack_op_t op;
+
+    if (plan != NULL) {
+        return pack_plan_load (bp, plan, ap);
+    }
+    if (pack_format_check (format) < 0) {
+        return NULL;
+    }
+    while (bp != NULL && (fp = pack_parse_op (fp, &op, &endian)) != NULL) {
+        bp = pack_load_op (bp, base, &op, ap);
+    }
+    return bp;
+}
+
+/**
+ * @ingroup pack
+ * @brief   書式文字列が表すデータ領域のサイズを返す。
+ * @param   format  書式文字列
+ * @param   ...     saveするデータの配列長の可変引数('#'と'*'で与えられる部分)
+ * @retval  データ領域のサイズ、扱えない書式の場合は-1(errnoはEINVAL)
+ */
+int pack_size (char *format, ...)
+{
+    char *fp;
+    int total = 0;
+    int endian = 0;
+    pack_op_t op;
+    const pack_plan_t *plan;
+    va_list args;
+    PACK_STATS_START (t0);
+
+    va_start (args, format);
+    if ((plan = pack_cache_get (format)) != NULL) {
+        total = pack_plan_size (plan, &args);
+    }
+    else if (pack_format_check (format) < 0) {
+        total = -1;
+    }
+    else {
+        fp = format;
+        while ((fp = pack_parse_op (fp, &op, &endian)) != NULL) {
+            total += pack_size_op (&op, total, &args);
+        }
+    }
+    va_end (args);
+    PACK_STATS_ADD (PACK_STATS_SIZE, format, (total > 0) ? total : 0, t0);
+    return total;
+}
+
+/**
+ * @ingroup pack
+ * @brief   書式文字列に従ってsaveした場合の実際のサイズを返す。
+ *
+ * 可変長整数('v', 'z')を含む書式では、pack_sizeは上限を返すのに対し、
+ * こちらは値から実際のバイト数を求める。
+ *
+ * @param   format  書式文字列
+ * @param   ...     saveする変数列(pack_saveと同じ可変引数)
+ * @retval  データ領域のサイズ、扱えない書式の場合は-1(errnoはEINVAL)
+ */
+int pack_size_exact (char *format, ...)
+{
+    int total;
+    va_list args;
+
+    va_start (args, format);
+    total = (int) pack_format_put (NULL, format, &args);
+    va_end (args);
+    return total;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書式文字列 formatに従ってbufferにデータをパックする
+ *  @param  buffer  データ領域の先頭へのポインタ
+ *  @param  format  書式文字列
+ *  @param  ...     saveする変数列（可変引数）
+ *  @retval buffer内にsaveされたデータの直後へのポインタ、
+ *          扱えない書式の場合は何もせずにNULL(errnoはEINVAL)
+ */
+char* pack_save (char *buffer, char *format, ...)
+{
+    char *fp, *bp;
+    int endian = 0;
+    pack_op_t op;
+    const pack_plan_t *plan;
+    va_list args;
+    PACK_STATS_START (t0);
+
+    va_start (args, format);
+    if ((plan = pack_cache_get (format)) != NULL) {
+        bp = pack_plan_save (buffer, plan, &args);
+    }
+    else if (pack_format_check (format) < 0) {
+        bp = NULL;
+    }
+    else {
+        fp = format;
+        bp = buffer;
+        while ((fp = pack_parse_op (fp, &op, &endian)) != NULL) {
+            bp = pack_save_op (bp, buffer, &op, &args);
+        }
     }
     va_end (args);
+    PACK_STATS_ADD (PACK_STATS_SAVE, format, (bp != NULL) ? bp - buffer : 0, t0);
     return bp;
 }
 
@@ -740,153 +1640,168 @@ char* pack_save (char *buffer, char *format, ...)
  *  @param  buffer  データ領域の先頭へのポインタ
  *  @param  format  書式文字列
  *  @param  ...     loadする変数列（可変引数）
- *  @retval buffer内からloadされた領域の直後へのポインタ
+ *  @retval buffer内からloadされた領域の直後へのポインタ、
+ *          '*'の要素数が上限を超えた場合はNULL(errnoはEMSGSIZE)、
+ *          扱えない書式の場合は何もせずにNULL(errnoはEINVAL)
  */
 char* pack_load (char *buffer, char *format, ...)
 {
-    char *fp, *np, *bp;
-    int size;
+    char *fp, *bp;
     int endian = 0;
+    pack_op_t op;
+    const pack_plan_t *plan;
     va_list args;
+    PACK_STATS_START (t0);
 
     va_start (args, format);
-    fp = format;
-    bp = buffer;
-    while (*fp != '\0') {
-        if (*fp == '!') {
-            /* エンディアン変換を行う */
-            fp++;
-            endian = 1;
-            continue;
-        }
-        if (*fp == 'c') {
-            char* data;
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                data = va_arg (args, char *);
-                size = va_arg (args, int);
-                bp = unpack_array_char (bp, data, size);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (fp == np) {
-                    bp = unpack_char (bp, va_arg (args, char *));
-                }
-                else {
-                    bp = unpack_array_char (bp, va_arg (args, char *), size);
-                    fp = np;
-                }
-            }
-            continue;
-        }
-        if (*fp == 'h') {
-            short* data;
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                data = va_arg (args, short *);
-                size = va_arg (args, int);
-                bp = unpack_array_short (bp, data, size, endian);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (fp == np) {
-                    bp = pack_load_short (bp, va_arg (args, short *), endian);
-                }
-                else {
-                    bp = unpack_array_short (bp, va_arg (args, short *), size, endian);
-                    fp = np;
-                }
-            }
-            continue;
+    if ((plan = pack_cache_get (format)) != NULL) {
+        bp = pack_plan_load (buffer, plan, &args);
+    }
+    else if (pack_format_check (format) < 0) {
+        bp = NULL;
+    }
+    else {
+        fp = format;
+        bp = buffer;
+        while (bp != NULL && (fp = pack_parse_op (fp, &op, &endian)) != NULL) {
+            bp = pack_load_op (bp, buffer, &op, &args);
         }
-        if (*fp == 'i') {
-            int* data;
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                data = va_arg (args, int*);
-                size = va_arg (args, int);
-                bp = unpack_array_int (bp, data, size, endian);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (fp == np) {
-                    bp = pack_load_int (bp, va_arg (args, int*), endian);
-                }
-                else {
-                    bp = unpack_array_int (bp, va_arg (args, int*), size, endian);
-                    fp = np;
-                }
-            }
-            continue;
+    }
+    va_end (args);
+    PACK_STATS_ADD (PACK_STATS_LOAD, format, (bp != NULL) ? bp - buffer : 0, t0);
+    return bp;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書式文字列を解析し、繰り返し使える解析済みの書式(plan)を作る。
+ *
+ *  同じ書式を何度もsave/loadする場合は、pack_compileで作ったplanを
+ *  pack_save_plan, pack_load_plan, pack_size_planに渡すことで
+ *  呼び出し毎の書式文字列の解析を省略できる。
+ *  不要になったplanはpack_plan_freeで解放する。
+ *
+ *  @param  format  書式文字列
+ *  @retval 解析済みの書式、扱えないグループを含む場合(errnoはEINVAL)と
+ *          メモリが確保できなければNULL
+ */
+pack_plan_t* pack_compile (char *format)
+{
+    pack_plan_t *plan;
+    pack_op_t op, *o;
+    char *fp;
+    int n = 0, endian = 0;
+
+    if (pack_format_valid (format) < 0) {
+        return NULL;
+    }
+    fp = format;
+    while ((fp = pack_parse_op (fp, &op, &endian)) != NULL) {
+        n += 1 + op.group;
+    }
+    plan = malloc (sizeof(pack_plan_t) + n * sizeof(pack_op_t));
+    if (plan == NULL) {
+        return NULL;
+    }
+    plan->nops = n;
+    plan->nvar = 0;
+    plan->fixed = 0;
+    plan->align = 0;
+
+    n = 0;
+    endian = 0;
+    fp = format;
+    while ((fp = pack_parse_op (fp, &plan->op[n], &endian)) != NULL) {
+        o = &plan->op[n];
+        if (o->mode == PACK_VAR || o->mode == PACK_PREFIX) {
+            plan->nvar++;
         }
-        if (*fp == 'l') {
-            long* data;
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                data = va_arg (args, long *);
-                size = va_arg (args, int);
-                bp = unpack_array_long (bp, data, size, endian);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (fp == np) {
-                    bp = pack_load_long (bp, va_arg (args, long *), endian);
-                }
-                else {
-                    bp = unpack_array_long (bp, va_arg (args, long *), size, endian);
-                    fp = np;
-                }
-            }
-            continue;
+        if (o->type == PACK_ALIGN) {
+            plan->align++;
         }
-        if (*fp == 'f') {
-            float* data;
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                data = va_arg (args, float *);
-                size = va_arg (args, int);
-                bp = unpack_array_float (bp, data, size, endian);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (fp == np) {
-                    bp = pack_load_float (bp, va_arg (args, float *), endian);
-                }
-                else {
-                    bp = unpack_array_float (bp, va_arg (args, float *), size, endian);
-                    fp = np;
-                }
-            }
-            continue;
+        plan->fixed += o->bytes;
+        if (o->type == PACK_GROUP) {
+            /* グループの項目を直後に並べ、書式文字列を参照しないようにする */
+            pack_group_members (o, o + 1);
+            o->body = NULL;
         }
-        if (*fp == 'd') {
-            double* data;
-            fp++;
-            if (*fp == '#') {
-                fp++;
-                data = va_arg (args, double *);
-                size = va_arg (args, int);
-                bp = unpack_array_double (bp, data, size, endian);
-            }
-            else {
-                size = strtol (fp, &np, 10);
-                if (fp == np) {
-                    bp = pack_load_double (bp, va_arg (args, double *), endian);
-                }
-                else {
-                    bp = unpack_array_double (bp, va_arg (args, double *), size, endian);
-                    fp = np;
-                }
-            }
-            continue;
+        n += 1 + o->group;
+    }
+    if (plan->nvar == 0 && plan->align > 0) {
+        /* 詰め物も含めて大きさが決まる */
+        for (n = plan->fixed = 0; n < plan->nops; n += 1 + plan->op[n].group) {
+            plan->fixed += pack_size_op (&plan->op[n], plan->fixed, NULL);
         }
-        fp++;
     }
+    return plan;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  pack_compileで作ったplanを解放する。
+ *  @param  plan    解析済みの書式(NULLの場合は何もしない)
+ */
+void pack_plan_free (pack_plan_t *plan)
+{
+    free (plan);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  planが表すデータ領域のサイズを返す。
+ *  @param  plan    解析済みの書式
+ *  @param  ...     saveするデータの配列長の可変引数('#'と'*'で与えられる部分)
+ *  @retval データ領域のサイズ
+ */
+int pack_size_plan (const pack_plan_t *plan, ...)
+{
+    int total;
+    va_list args;
+
+    if (plan->nvar == 0) {
+        return plan->fixed;
+    }
+    va_start (args, plan);
+    total = pack_plan_size (plan, &args);
+    va_end (args);
+    return total;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  planに従ってbufferにデータをパックする。
+ *  @param  buffer  データ領域の先頭へのポインタ
+ *  @param  plan    解析済みの書式
+ *  @param  ...     saveする変数列（可変引数）
+ *  @retval buffer内にsaveされたデータの直後へのポインタ
+ */
+char* pack_save_plan (char *buffer, const pack_plan_t *plan, ...)
+{
+    char *bp;
+    va_list args;
+
+    va_start (args, plan);
+    bp = pack_plan_save (buffer, plan, &args);
+    va_end (args);
+    return bp;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  planに従ってbufferから変数へデータをloadする。
+ *  @param  buffer  データ領域の先頭へのポインタ
+ *  @param  plan    解析済みの書式
+ *  @param  ...     loadする変数列（可変引数）
+ *  @retval buffer内からloadされた領域の直後へのポインタ、
+ *          '*'の要素数が上限を超えた場合はNULL(errnoはEMSGSIZE)
+ */
+char* pack_load_plan (char *buffer, const pack_plan_t *plan, ...)
+{
+    char *bp;
+    va_list args;
+
+    va_start (args, plan);
+    bp = pack_plan_load (buffer, plan, &args);
     va_end (args);
     return bp;
 }
@@ -18,9 +18,37 @@
 extern "C" {
 #endif
 
+/* 解析済みの書式(内容は非公開) */
+typedef struct pack_plan pack_plan_t;
+
+/* 自動で伸長する出力バッファ */
+typedef struct {
+    char *data;         /* バッファの先頭 */
+    size_t len;         /* 書き込み済みのバイト数 */
+    size_t cap;         /* バッファの容量 */
+    char *storage;      /* 呼び出し側が与えた領域(解放しない) */
+    struct pack_arena *arena;   /* 領域を割り当てるアリーナ(NULLならmalloc) */
+} pack_buf_t;
+
 int pack_size (char *format, ...);
+int pack_size_exact (char *format, ...);
 char* pack_save (char *buffer, char *format, ...);
 char* pack_load (char* self, char* format, ...);
+char* pack_view (char *buffer, char *format, ...);
+
+pack_plan_t* pack_compile (char *format);
+void pack_plan_free (pack_plan_t *plan);
+int pack_size_plan (const pack_plan_t *plan, ...);
+char* pack_save_plan (char *buffer, const pack_plan_t *plan, ...);
+char* pack_load_plan (char *buffer, const pack_plan_t *plan, ...);
+char* pack_view_plan (char *buffer, const pack_plan_t *plan, ...);
+
+void pack_buf_init (pack_buf_t *b, char *storage, size_t size);
+void pack_buf_reset (pack_buf_t *b);
+void pack_buf_free (pack_buf_t *b);
+int pack_buf_reserve (pack_buf_t *b, size_t n);
+int pack_buf_save (pack_buf_t *b, char *format, ...);
+int pack_buf_save_plan (pack_buf_t *b, const pack_plan_t *plan, ...);
 
 #ifdef __cplusplus
 }
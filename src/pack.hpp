@@ -0,0 +1,436 @@
+/**
+ *  @file   pack.hpp
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  packライブラリのC++用フロントエンド(ヘッダのみ, C++20以降)。
+ *
+ *  書式文字列をテンプレート引数として与えると、コンパイル時に解析して
+ *  可変引数や書式文字列の解析を介さない直列の代入に展開する。
+ *  出力されるバイト列はpack_save/pack_loadと同一である。
+ *  引数の型は書式に合わせてコンパイル時に検査される。
+ *
+ *  例）
+ *  char *bp = pack::save<"!i f# d4">(buf, iv, fa, 10, da);
+ *  bp = pack::load<"!i f# d4">(buf, &iv, fa, 10, da);
+ *  constexpr int n = pack::size<"i d4">();
+ */
+#ifndef __PACK_HPP__
+#define __PACK_HPP__
+
+#if __cplusplus < 202002L
+#error "pack.hpp requires C++20"
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace pack {
+
+/**
+ *  テンプレート引数に渡すための書式文字列
+ */
+template <std::size_t N>
+struct format {
+    char s[N];
+
+    constexpr format (const char (&str)[N])
+    {
+        for (std::size_t i = 0; i < N; i++) {
+            s[i] = str[i];
+        }
+    }
+};
+
+namespace detail {
+
+/* 配列の指定方法(pack.cと同じ) */
+enum { SCALAR = 0, FIXED = 1, VAR = 2 };
+
+/**
+ *  書式文字列の1項目
+ */
+struct op {
+    char type;
+    bool endian;
+    int mode;
+    int count;
+};
+
+/**
+ *  解析済みの書式
+ */
+template <std::size_t N>
+struct plan {
+    op ops[N > 0 ? N : 1];
+    std::size_t nops;
+};
+
+constexpr bool is_type (char c)
+{
+    return c == 'c' || c == 'h' || c == 'i' || c == 'l' || c == 'f' || c == 'd'
+        || c == 'b' || c == 'B' || c == 'w' || c == 'W'
+        || c == 'j' || c == 'J' || c == 'q' || c == 'Q';
+}
+
+constexpr bool is_space (char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+/**
+ *  書式文字列を解析する。strtolと同じく数字の前の空白と符号を受け付ける。
+ *  @retval 書式文字列の項目数(opsがnullptrでない場合は内容も格納する)
+ */
+template <std::size_t N>
+constexpr std::size_t parse (const format<N> &f, op *ops)
+{
+    std::size_t n = 0;
+    bool endian = false;
+    std::size_t i = 0;
+
+    while (i < N && f.s[i] != '\0') {
+        char c = f.s[i];
+        if (c == '!') {
+            endian = true;
+            i++;
+            continue;
+        }
+        if (!is_type (c)) {
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '~') {
+                throw "pack: unsupported format character";
+            }
+            if (c == '*' || c == '(' || c == ')') {
+                throw "pack: '*' arrays and groups are not supported";
+            }
+            if (c == '@') {
+                throw "pack: '@' alignment is not supported";
+            }
+            i++;
+            continue;
+        }
+        op o{c, endian, SCALAR, 1};
+        i++;
+        if (f.s[i] == '#') {
+            i++;
+            o.mode = VAR;
+            o.count = 0;
+        }
+        else {
+            std::size_t j = i;
+            int sign = 1, value = 0;
+            bool digits = false;
+            while (is_space (f.s[j])) {
+                j++;
+            }
+            if (f.s[j] == '+' || f.s[j] == '-') {
+                sign = (f.s[j] == '-') ? -1 : 1;
+                j++;
+            }
+            while (f.s[j] >= '0' && f.s[j] <= '9') {
+                value = value * 10 + (f.s[j] - '0');
+                digits = true;
+                j++;
+            }
+            if (digits) {
+                o.mode = FIXED;
+                o.count = sign * value;
+                i = j;
+            }
+        }
+        if (ops != nullptr) {
+            ops[n] = o;
+        }
+        n++;
+    }
+    return n;
+}
+
+template <format F>
+constexpr std::size_t nops = parse (F, nullptr);
+
+template <format F>
+constexpr plan<nops<F>> make_plan ()
+{
+    plan<nops<F>> p{};
+    p.nops = parse (F, p.ops);
+    return p;
+}
+
+template <format F>
+constexpr plan<nops<F>> plan_of = make_plan<F> ();
+
+/* 書式文字に対応するCの型 */
+template <char C> struct ctype;
+template <> struct ctype<'c'> { using type = char; };
+template <> struct ctype<'h'> { using type = short; };
+template <> struct ctype<'i'> { using type = int; };
+template <> struct ctype<'l'> { using type = long; };
+template <> struct ctype<'f'> { using type = float; };
+template <> struct ctype<'d'> { using type = double; };
+template <> struct ctype<'b'> { using type = std::int8_t; };
+template <> struct ctype<'B'> { using type = std::uint8_t; };
+template <> struct ctype<'w'> { using type = std::int16_t; };
+template <> struct ctype<'W'> { using type = std::uint16_t; };
+template <> struct ctype<'j'> { using type = std::int32_t; };
+template <> struct ctype<'J'> { using type = std::uint32_t; };
+template <> struct ctype<'q'> { using type = std::int64_t; };
+template <> struct ctype<'Q'> { using type = std::uint64_t; };
+
+/* 項目が消費する引数の数 */
+constexpr std::size_t nargs (const op &o)
+{
+    return o.mode == VAR ? 2 : 1;
+}
+
+/**
+ *  値のバイト列を反転する
+ */
+template <class T>
+inline T bswap (T v)
+{
+    if constexpr (sizeof(T) == 1) {
+        return v;
+    }
+    else {
+#if defined(__GNUC__)
+        if constexpr (sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8) {
+            using U = std::conditional_t<sizeof(T) == 2, std::uint16_t,
+                      std::conditional_t<sizeof(T) == 4, std::uint32_t, std::uint64_t>>;
+            U u;
+            std::memcpy (&u, &v, sizeof(T));
+            if constexpr (sizeof(T) == 2) {
+                u = __builtin_bswap16 (u);
+            }
+            else if constexpr (sizeof(T) == 4) {
+                u = __builtin_bswap32 (u);
+            }
+            else {
+                u = __builtin_bswap64 (u);
+            }
+            std::memcpy (&v, &u, sizeof(T));
+            return v;
+        }
+#endif
+        unsigned char w[sizeof(T)], r[sizeof(T)];
+        std::memcpy (w, &v, sizeof(T));
+        for (std::size_t i = 0; i < sizeof(T); i++) {
+            r[i] = w[sizeof(T) - 1 - i];
+        }
+        std::memcpy (&v, r, sizeof(T));
+        return v;
+    }
+}
+
+template <class T, bool E>
+inline char *put (char *p, T v)
+{
+    if constexpr (E) {
+        v = bswap (v);
+    }
+    std::memcpy (p, &v, sizeof(T));
+    return p + sizeof(T);
+}
+
+template <class T, bool E>
+inline char *get (char *p, T *v)
+{
+    T w;
+    std::memcpy (&w, p, sizeof(T));
+    if constexpr (E) {
+        w = bswap (w);
+    }
+    *v = w;
+    return p + sizeof(T);
+}
+
+template <class T, bool E>
+inline char *put_array (char *p, const T *v, int n)
+{
+    if (n <= 0) {
+        return p;
+    }
+    if constexpr (E && sizeof(T) > 1) {
+        for (int i = 0; i < n; i++) {
+            p = put<T, E> (p, v[i]);
+        }
+        return p;
+    }
+    else {
+        std::memcpy (p, v, std::size_t (n) * sizeof(T));
+        return p + std::size_t (n) * sizeof(T);
+    }
+}
+
+template <class T, bool E>
+inline char *get_array (char *p, T *v, int n)
+{
+    if (n <= 0) {
+        return p;
+    }
+    if constexpr (E && sizeof(T) > 1) {
+        for (int i = 0; i < n; i++) {
+            p = get<T, E> (p, &v[i]);
+        }
+        return p;
+    }
+    else {
+        std::memcpy (v, p, std::size_t (n) * sizeof(T));
+        return p + std::size_t (n) * sizeof(T);
+    }
+}
+
+/* 書式が消費する引数の総数 */
+template <format F, std::size_t I = 0>
+constexpr std::size_t total_args ()
+{
+    if constexpr (I == plan_of<F>.nops) {
+        return 0;
+    }
+    else {
+        return nargs (plan_of<F>.ops[I]) + total_args<F, I + 1> ();
+    }
+}
+
+template <format F, std::size_t I, std::size_t J, class Tuple>
+inline char *save_impl (char *bp, const Tuple &t)
+{
+    if constexpr (I == plan_of<F>.nops) {
+        return bp;
+    }
+    else {
+        constexpr op o = plan_of<F>.ops[I];
+        using T = typename ctype<o.type>::type;
+        using A = std::remove_cvref_t<std::tuple_element_t<J, Tuple>>;
+        if constexpr (o.mode == SCALAR) {
+            static_assert (std::is_arithmetic_v<A>,
+                           "pack::save: scalar field needs an arithmetic argument");
+            bp = put<T, o.endian> (bp, static_cast<T> (std::get<J> (t)));
+        }
+        else {
+            static_assert (std::is_convertible_v<A, const T *>,
+                           "pack::save: array field needs a pointer to the field type");
+            const T *data = std::get<J> (t);
+            if constexpr (o.mode == FIXED) {
+                bp = put_array<T, o.endian> (bp, data, o.count);
+            }
+            else {
+                using B = std::remove_cvref_t<std::tuple_element_t<J + 1, Tuple>>;
+                static_assert (std::is_integral_v<B>,
+                               "pack::save: '#' field needs an integer count");
+                bp = put_array<T, o.endian> (bp, data, static_cast<int> (std::get<J + 1> (t)));
+            }
+        }
+        return save_impl<F, I + 1, J + nargs (o)> (bp, t);
+    }
+}
+
+template <format F, std::size_t I, std::size_t J, class Tuple>
+inline char *load_impl (char *bp, const Tuple &t)
+{
+    if constexpr (I == plan_of<F>.nops) {
+        return bp;
+    }
+    else {
+        constexpr op o = plan_of<F>.ops[I];
+        using T = typename ctype<o.type>::type;
+        using A = std::remove_cvref_t<std::tuple_element_t<J, Tuple>>;
+        static_assert (std::is_convertible_v<A, T *>,
+                       "pack::load: field needs a pointer to the field type");
+        T *data = std::get<J> (t);
+        if constexpr (o.mode == SCALAR) {
+            bp = get<T, o.endian> (bp, data);
+        }
+        else if constexpr (o.mode == FIXED) {
+            bp = get_array<T, o.endian> (bp, data, o.count);
+        }
+        else {
+            using B = std::remove_cvref_t<std::tuple_element_t<J + 1, Tuple>>;
+            static_assert (std::is_integral_v<B>,
+                           "pack::load: '#' field needs an integer count");
+            bp = get_array<T, o.endian> (bp, data, static_cast<int> (std::get<J + 1> (t)));
+        }
+        return load_impl<F, I + 1, J + nargs (o)> (bp, t);
+    }
+}
+
+template <format F, std::size_t I = 0, std::size_t J = 0, class Tuple>
+constexpr int size_var (const Tuple &t)
+{
+    if constexpr (I == plan_of<F>.nops) {
+        return 0;
+    }
+    else {
+        constexpr op o = plan_of<F>.ops[I];
+        using T = typename ctype<o.type>::type;
+        if constexpr (o.mode == VAR) {
+            return static_cast<int> (std::get<J> (t)) * int (sizeof(T))
+                + size_var<F, I + 1, J + 1> (t);
+        }
+        else {
+            return o.count * int (sizeof(T)) + size_var<F, I + 1, J> (t);
+        }
+    }
+}
+
+template <format F, std::size_t I = 0>
+constexpr std::size_t count_var ()
+{
+    if constexpr (I == plan_of<F>.nops) {
+        return 0;
+    }
+    else {
+        return (plan_of<F>.ops[I].mode == VAR ? 1 : 0) + count_var<F, I + 1> ();
+    }
+}
+
+} /* namespace detail */
+
+/**
+ *  @brief  書式Fに従ってbufferにデータをパックする(pack_saveと同じ出力)
+ *  @param  buffer  データ領域の先頭へのポインタ
+ *  @param  args    saveする変数列(pack_saveの可変引数と同じ並び)
+ *  @retval buffer内にsaveされたデータの直後へのポインタ
+ */
+template <format F, class... Args>
+inline char *save (char *buffer, Args &&... args)
+{
+    static_assert (sizeof...(Args) == detail::total_args<F> (),
+                   "pack::save: argument count does not match the format");
+    return detail::save_impl<F, 0, 0> (buffer, std::forward_as_tuple (args...));
+}
+
+/**
+ *  @brief  書式Fに従ってbufferから変数へデータをloadする(pack_loadと同じ解釈)
+ *  @param  buffer  データ領域の先頭へのポインタ
+ *  @param  args    loadする変数へのポインタ列(pack_loadの可変引数と同じ並び)
+ *  @retval buffer内からloadされた領域の直後へのポインタ
+ */
+template <format F, class... Args>
+inline char *load (char *buffer, Args &&... args)
+{
+    static_assert (sizeof...(Args) == detail::total_args<F> (),
+                   "pack::load: argument count does not match the format");
+    return detail::load_impl<F, 0, 0> (buffer, std::forward_as_tuple (args...));
+}
+
+/**
+ *  @brief  書式Fが表すデータ領域のサイズを返す(pack_sizeと同じ値)
+ *  @param  counts  '#'の要素数
+ *  @retval データ領域のサイズ
+ */
+template <format F, class... Counts>
+constexpr int size (Counts... counts)
+{
+    static_assert (sizeof...(Counts) == detail::count_var<F> (),
+                   "pack::size: one count is needed for each '#' field");
+    return detail::size_var<F> (std::make_tuple (counts...));
+}
+
+} /* namespace pack */
+
+#endif /* __PACK_HPP__ */
@@ -0,0 +1,544 @@
+/**
+ *  @file   pack_arena.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  パック用のバッファを割り当てるアリーナ。
+ *
+ *  メッセージ毎にmallocしてsaveし、送ったらfreeする経路では、mallocと
+ *  freeの呼び出しそのものが目立つ。アリーナはPACK_ARENA_CHUNKバイトの
+ *  チャンクをmmapし、64バイトからPACK_ARENA_MAXバイトまでの2のべき乗の
+ *  サイズクラスに切り分けて割り当てる。解放したブロックはクラス毎の
+ *  一覧に戻して再利用するので、定常状態ではmmapもmallocも呼ばない。
+ *
+ *  各スレッドはクラス毎の空きブロックの一覧を自分で持ち、ロックを取らずに
+ *  割り当てと解放をする。一覧が空になるとアリーナ共有の一覧(無ければ
+ *  チャンクの未使用部分)からARENA_BATCH個をまとめて取り、ARENA_CACHE個を
+ *  超えるとまとめて共有の一覧へ戻す。ロックを取るのはこの時だけで済む。
+ *  あるスレッドで割り当てたブロックを別のスレッドで解放してもよい。
+ *
+ *  pack_arena_resetは割り当て済みのブロックをまとめて捨てる。チャンクは
+ *  解放せずに先頭から切り分け直すので、リクエスト毎にresetするループでも
+ *  mmapは最初の数回だけになる。PACK_ARENA_MAXより大きなブロックは個別に
+ *  mallocし、resetとpack_arena_freeで解放する。
+ *
+ *  PACK_ARENA_HUGEを指定するとチャンクをhuge pageに置く(MAP_HUGETLB、
+ *  huge pageが予約されていなければ境界を揃えてMADV_HUGEPAGEを頼む)。
+ *  パックした大きな配列を読み書きする時のTLBミスが減る。
+ *
+ *  例）
+ *  pack_arena_t *a = pack_arena_create (0);
+ *  pack_buf_t b;
+ *  for (;;) {
+ *      pack_buf_init_arena (&b, a);
+ *      pack_buf_save (&b, "i d#", n, da, n);
+ *      write (fd, b.data, b.len);
+ *      pack_buf_free (&b);
+ *  }
+ *  pack_arena_free (a);
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "pack_arena.h"
+
+#define ARENA_LINE      64                  /* チャンクの先頭に置く管理領域 */
+#define ARENA_SHIFT     6                   /* 最小のクラスは64バイト */
+#define ARENA_CLASSES   15                  /* 64〜PACK_ARENA_MAXバイト */
+#define ARENA_LARGE     ARENA_CLASSES       /* 個別にmallocしたブロック */
+#define ARENA_BATCH     32                  /* 共有の一覧と一度に移す数 */
+#define ARENA_CACHE     64                  /* スレッド毎に持つ最大の数 */
+#define ARENA_CARVE     (64 << 10)          /* チャンクから一度に切り出す最大のバイト数 */
+
+/* ブロックの先頭(この直後を呼び出し側に渡す) */
+typedef union arena_block {
+    struct {
+        union arena_block *next;    /* 空きブロックの一覧 */
+        size_t cls;                 /* サイズクラス、またはARENA_LARGE */
+    } h;
+    char pad[16];
+} arena_block_t;
+
+/* PACK_ARENA_MAXより大きなブロック */
+typedef struct arena_large {
+    struct arena_large *prev;
+    struct arena_large *next;
+    size_t size;                /* 使えるバイト数 */
+    size_t pad;
+    arena_block_t blk;
+} arena_large_t;
+
+/* チャンクの先頭 */
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+} arena_chunk_t;
+
+/* スレッド毎の空きブロック */
+typedef struct arena_tcache {
+    struct arena_tcache *next;  /* アリーナのスレッドの一覧 */
+    pack_arena_t *arena;
+    unsigned long gen;          /* 一覧を作った時のアリーナの世代 */
+    arena_block_t *head[ARENA_CLASSES];
+    int n[ARENA_CLASSES];
+} arena_tcache_t;
+
+struct pack_arena {
+    pthread_mutex_t lock;       /* 以下を保護する */
+    pthread_key_t key;          /* スレッド毎のarena_tcache_t */
+    int flags;                  /* PACK_ARENA_HUGE */
+    unsigned long gen;          /* resetの度に増やす */
+    arena_block_t *free[ARENA_CLASSES];
+    arena_chunk_t *chunks;      /* 確保したチャンク */
+    arena_chunk_t *cur;         /* 切り分けているチャンク */
+    size_t off;                 /* curの未使用部分の先頭 */
+    arena_large_t *large;       /* 個別にmallocしたブロック */
+    arena_tcache_t *tcaches;    /* スレッド毎の空きブロック */
+};
+
+/**
+ *  @brief  クラスのブロックのバイト数
+ */
+static INLINE size_t
+arena_class_size (size_t cls)
+{
+    return (size_t) 1 << (cls + ARENA_SHIFT);
+}
+
+/**
+ *  @brief  sizeバイトを割り当てるクラス
+ */
+static INLINE size_t
+arena_class (size_t size)
+{
+    size_t need = size + sizeof(arena_block_t);
+
+    if (need <= ((size_t) 1 << ARENA_SHIFT)) {
+        return 0;
+    }
+    return (size_t) (64 - __builtin_clzll (need - 1)) - ARENA_SHIFT;
+}
+
+/**
+ *  @brief  チャンクを1つmmapする内部関数
+ */
+static arena_chunk_t *
+arena_map (int flags)
+{
+    const size_t len = PACK_ARENA_CHUNK;
+    char *p = MAP_FAILED, *q;
+
+#ifdef MAP_HUGETLB
+    if (flags & PACK_ARENA_HUGE) {
+        p = mmap (NULL, len, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (p == MAP_FAILED && !(flags & PACK_ARENA_HUGE)) {
+        p = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    else if (p == MAP_FAILED) {
+        /* 透過的huge pageに載るよう、チャンクの境界に揃える */
+        p = mmap (NULL, 2 * len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            q = (char *) (((uintptr_t) p + len - 1) & ~(uintptr_t) (len - 1));
+            if (q > p) {
+                munmap (p, q - p);
+            }
+            munmap (q + len, p + len - q);
+            p = q;
+#ifdef MADV_HUGEPAGE
+            madvise (p, len, MADV_HUGEPAGE);
+#endif
+        }
+    }
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    ((arena_chunk_t *) p)->next = NULL;
+    return (arena_chunk_t *) p;
+}
+
+/**
+ *  @brief  チャンクからクラスclsのブロックを切り出す内部関数(ロックを取って呼ぶ)
+ *  @retval 切り出したブロックの一覧、メモリが確保できなければNULL
+ */
+static arena_block_t *
+arena_carve (pack_arena_t *a, size_t cls, int *count)
+{
+    size_t bsize = arena_class_size (cls);
+    int n = (bsize >= ARENA_CARVE) ? 1 : (int) (ARENA_CARVE / bsize);
+    arena_block_t *head = NULL, *b;
+    arena_chunk_t *c;
+    int i;
+
+    if (n > ARENA_BATCH) {
+        n = ARENA_BATCH;
+    }
+    for (i = 0; i < n; i++) {
+        if (a->cur == NULL || a->off + bsize > PACK_ARENA_CHUNK) {
+            c = (a->cur != NULL) ? a->cur->next : a->chunks;
+            if (c == NULL) {
+                c = arena_map (a->flags);
+                if (c == NULL) {
+                    break;
+                }
+                if (a->cur != NULL) {
+                    a->cur->next = c;
+                }
+                else {
+                    a->chunks = c;
+                }
+            }
+            a->cur = c;
+            a->off = ARENA_LINE;
+        }
+        b = (arena_block_t *) ((char *) a->cur + a->off);
+        a->off += bsize;
+        b->h.cls = cls;
+        b->h.next = head;
+        head = b;
+    }
+    *count = i;
+    return head;
+}
+
+/**
+ *  @brief  スレッドの一覧をアリーナ共有の一覧へ戻す内部関数(ロックを取って呼ぶ)
+ */
+static void
+arena_drain (pack_arena_t *a, arena_tcache_t *t)
+{
+    arena_block_t *b;
+    size_t cls;
+
+    for (cls = 0; cls < ARENA_CLASSES; cls++) {
+        while ((b = t->head[cls]) != NULL) {
+            t->head[cls] = b->h.next;
+            b->h.next = a->free[cls];
+            a->free[cls] = b;
+        }
+        t->n[cls] = 0;
+    }
+}
+
+/**
+ *  @brief  スレッドが終了した時に空きブロックを戻す内部関数
+ */
+static void
+arena_tcache_exit (void *v)
+{
+    arena_tcache_t *t = v, **pp;
+    pack_arena_t *a = t->arena;
+
+    pthread_mutex_lock (&a->lock);
+    if (t->gen == a->gen) {
+        arena_drain (a, t);
+    }
+    for (pp = &a->tcaches; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == t) {
+            *pp = t->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock (&a->lock);
+    free (t);
+}
+
+/**
+ *  @brief  呼び出したスレッドの空きブロックの一覧を返す内部関数
+ *  @retval 一覧、作れなければNULL
+ */
+static arena_tcache_t *
+arena_tcache (pack_arena_t *a)
+{
+    arena_tcache_t *t = pthread_getspecific (a->key);
+
+    if (t == NULL) {
+        t = calloc (1, sizeof(arena_tcache_t));
+        if (t == NULL) {
+            return NULL;
+        }
+        t->arena = a;
+        if (pthread_setspecific (a->key, t) != 0) {
+            free (t);
+            return NULL;
+        }
+        pthread_mutex_lock (&a->lock);
+        t->gen = a->gen;
+        t->next = a->tcaches;
+        a->tcaches = t;
+        pthread_mutex_unlock (&a->lock);
+    }
+    else if (t->gen != a->gen) {
+        /* resetの前のブロックは捨てる */
+        memset (t->head, 0, sizeof(t->head));
+        memset (t->n, 0, sizeof(t->n));
+        t->gen = a->gen;
+    }
+    return t;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  アリーナを作る。
+ *  @param  flags   0またはPACK_ARENA_HUGE
+ *  @retval アリーナ、失敗した場合はNULL
+ */
+pack_arena_t* pack_arena_create (int flags)
+{
+    pack_arena_t *a = calloc (1, sizeof(pack_arena_t));
+
+    if (a == NULL) {
+        return NULL;
+    }
+    if (pthread_key_create (&a->key, arena_tcache_exit) != 0) {
+        free (a);
+        errno = EAGAIN;
+        return NULL;
+    }
+    pthread_mutex_init (&a->lock, NULL);
+    a->flags = flags;
+    return a;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  アリーナとそこから割り当てたすべてのブロックを解放する。
+ *
+ *  他のスレッドがアリーナを使っている間に呼んではならない。
+ *
+ *  @param  a   アリーナ(NULLの場合は何もしない)
+ */
+void pack_arena_free (pack_arena_t *a)
+{
+    arena_tcache_t *t;
+    arena_chunk_t *c;
+    arena_large_t *l;
+
+    if (a == NULL) {
+        return;
+    }
+    pthread_key_delete (a->key);
+    while ((t = a->tcaches) != NULL) {
+        a->tcaches = t->next;
+        free (t);
+    }
+    while ((l = a->large) != NULL) {
+        a->large = l->next;
+        free (l);
+    }
+    while ((c = a->chunks) != NULL) {
+        a->chunks = c->next;
+        munmap (c, PACK_ARENA_CHUNK);
+    }
+    pthread_mutex_destroy (&a->lock);
+    free (a);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  割り当てたすべてのブロックをまとめて捨てる。
+ *
+ *  チャンクは解放せずに再利用する。他のスレッドがアリーナを使っている
+ *  間に呼んではならない。reset前に割り当てたブロックは、解放もせずに
+ *  使うのをやめること。
+ *
+ *  @param  a   アリーナ
+ */
+void pack_arena_reset (pack_arena_t *a)
+{
+    arena_large_t *l;
+
+    pthread_mutex_lock (&a->lock);
+    memset (a->free, 0, sizeof(a->free));
+    a->cur = NULL;
+    a->off = 0;
+    while ((l = a->large) != NULL) {
+        a->large = l->next;
+        free (l);
+    }
+    a->gen++;
+    pthread_mutex_unlock (&a->lock);
+}
+
+/**
+ *  @brief  PACK_ARENA_MAXより大きなブロックを割り当てる内部関数
+ */
+static void *
+arena_alloc_large (pack_arena_t *a, size_t size)
+{
+    arena_large_t *l = malloc (sizeof(arena_large_t) + size);
+
+    if (l == NULL) {
+        return NULL;
+    }
+    l->size = size;
+    l->blk.h.cls = ARENA_LARGE;
+    l->prev = NULL;
+    pthread_mutex_lock (&a->lock);
+    l->next = a->large;
+    if (a->large != NULL) {
+        a->large->prev = l;
+    }
+    a->large = l;
+    pthread_mutex_unlock (&a->lock);
+    return &l->blk + 1;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  sizeバイトのブロックを割り当てる。
+ *
+ *  ブロックは16バイト境界に置かれ、pack_arena_size(p)バイトまで使える。
+ *
+ *  @param  a       アリーナ
+ *  @param  size    バイト数
+ *  @retval ブロックの先頭、メモリが確保できなければNULL(errnoはENOMEM)
+ */
+void* pack_arena_alloc (pack_arena_t *a, size_t size)
+{
+    arena_tcache_t *t;
+    arena_block_t *b;
+    size_t cls;
+    int n;
+
+    if (size > PACK_ARENA_MAX - sizeof(arena_block_t)) {
+        return arena_alloc_large (a, size);
+    }
+    cls = arena_class (size);
+    t = arena_tcache (a);
+    if (t == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (t->head[cls] == NULL) {
+        pthread_mutex_lock (&a->lock);
+        for (n = 0; n < ARENA_BATCH && (b = a->free[cls]) != NULL; n++) {
+            a->free[cls] = b->h.next;
+            b->h.next = t->head[cls];
+            t->head[cls] = b;
+        }
+        if (n == 0) {
+            t->head[cls] = arena_carve (a, cls, &n);
+        }
+        pthread_mutex_unlock (&a->lock);
+        t->n[cls] = n;
+        if (n == 0) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    b = t->head[cls];
+    t->head[cls] = b->h.next;
+    t->n[cls]--;
+    return b + 1;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  ブロックをアリーナに返す。
+ *  @param  a   アリーナ
+ *  @param  p   pack_arena_allocで割り当てたブロック(NULLの場合は何もしない)
+ */
+void pack_arena_release (pack_arena_t *a, void *p)
+{
+    arena_block_t *b = (arena_block_t *) p - 1;
+    arena_large_t *l;
+    arena_tcache_t *t;
+    size_t cls;
+    int i;
+
+    if (p == NULL) {
+        return;
+    }
+    cls = b->h.cls;
+    if (cls == ARENA_LARGE) {
+        l = (arena_large_t *) ((char *) b - offsetof (arena_large_t, blk));
+        pthread_mutex_lock (&a->lock);
+        if (l->prev != NULL) {
+            l->prev->next = l->next;
+        }
+        else {
+            a->large = l->next;
+        }
+        if (l->next != NULL) {
+            l->next->prev = l->prev;
+        }
+        pthread_mutex_unlock (&a->lock);
+        free (l);
+        return;
+    }
+    t = arena_tcache (a);
+    if (t == NULL) {
+        pthread_mutex_lock (&a->lock);
+        b->h.next = a->free[cls];
+        a->free[cls] = b;
+        pthread_mutex_unlock (&a->lock);
+        return;
+    }
+    b->h.next = t->head[cls];
+    t->head[cls] = b;
+    if (++t->n[cls] > ARENA_CACHE) {
+        pthread_mutex_lock (&a->lock);
+        for (i = 0; i < ARENA_BATCH; i++) {
+            b = t->head[cls];
+            t->head[cls] = b->h.next;
+            b->h.next = a->free[cls];
+            a->free[cls] = b;
+        }
+        pthread_mutex_unlock (&a->lock);
+        t->n[cls] -= ARENA_BATCH;
+    }
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  ブロックの大きさを変える。
+ *
+ *  今のブロックに収まる場合は同じブロックを返す。
+ *
+ *  @param  a       アリーナ
+ *  @param  p       ブロック(NULLならpack_arena_allocと同じ)
+ *  @param  size    新しいバイト数
+ *  @retval ブロックの先頭、メモリが確保できなければNULL(pはそのまま)
+ */
+void* pack_arena_realloc (pack_arena_t *a, void *p, size_t size)
+{
+    size_t old;
+    void *q;
+
+    if (p == NULL) {
+        return pack_arena_alloc (a, size);
+    }
+    old = pack_arena_size (p);
+    if (size <= old) {
+        return p;
+    }
+    q = pack_arena_alloc (a, size);
+    if (q != NULL) {
+        memcpy (q, p, old);
+        pack_arena_release (a, p);
+    }
+    return q;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  ブロックで使えるバイト数を返す。
+ *  @param  p   pack_arena_allocで割り当てたブロック
+ *  @retval バイト数(割り当てた時のsize以上)
+ */
+size_t pack_arena_size (const void *p)
+{
+    const arena_block_t *b = (const arena_block_t *) p - 1;
+
+    if (b->h.cls == ARENA_LARGE) {
+        return ((const arena_large_t *) ((const char *) b - offsetof (arena_large_t, blk)))->size;
+    }
+    return arena_class_size (b->h.cls) - sizeof(arena_block_t);
+}
@@ -0,0 +1,43 @@
+/**
+ *  @file   pack_arena.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  パック用のバッファを割り当てるアリーナの宣言
+ */
+#ifndef __PACK_ARENA_H__
+#define __PACK_ARENA_H__
+
+#include <stddef.h>
+#include "pack.h"
+#include "pack_stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* pack_arena_createのflags */
+#define PACK_ARENA_HUGE     1           /* チャンクをhuge pageに置く */
+
+#define PACK_ARENA_CHUNK    (2 << 20)   /* 一度に確保するバイト数 */
+#define PACK_ARENA_MAX      (1 << 20)   /* サイズクラスで割り当てる最大のバイト数 */
+
+/* アリーナ(内容は非公開) */
+typedef struct pack_arena pack_arena_t;
+
+pack_arena_t* pack_arena_create (int flags);
+void pack_arena_free (pack_arena_t *a);
+void pack_arena_reset (pack_arena_t *a);
+void* pack_arena_alloc (pack_arena_t *a, size_t size);
+void* pack_arena_realloc (pack_arena_t *a, void *p, size_t size);
+void pack_arena_release (pack_arena_t *a, void *p);
+size_t pack_arena_size (const void *p);
+
+void pack_buf_init_arena (pack_buf_t *b, pack_arena_t *a);
+int pack_stream_init_arena (pack_stream_t *s, int fd, size_t size, pack_arena_t *a);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __PACK_ARENA_H__ */
@@ -0,0 +1,261 @@
+/**
+ *  @file   pack_buf.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  自動で伸長する出力バッファ。
+ *
+ *  pack_size -> malloc -> pack_save の代わりに、書式文字列と可変引数を
+ *  1回だけ走査しながらバッファの末尾へ追記する。
+ *  容量が足りない場合は倍々に伸長し、pack_buf_resetでは領域を解放しないため、
+ *  同じバッファを使い回すループでは定常状態でmallocが発生しない。
+ *  '@'はバッファの先頭(data)からの位置で揃える。
+ *
+ *  例）
+ *  pack_buf_t b;
+ *  pack_buf_init (&b, NULL, 0);
+ *  for (;;) {
+ *      pack_buf_reset (&b);
+ *      pack_buf_save (&b, "c4 h f#", ca, hv, fa, 10);
+ *      write (fd, b.data, b.len);
+ *  }
+ *  pack_buf_free (&b);
+ */
+#include <string.h>
+#include "pack.h"
+#include "pack_arena.h"
+#include "pack_internal.h"
+
+/* 最初に確保する容量 */
+#define PACK_BUF_MIN 64
+
+/**
+ *  @ingroup pack
+ *  @brief  バッファを初期化する。
+ *  @param  b       バッファ
+ *  @param  storage 最初に使う領域(NULLの場合は最初の書き込みで確保する)
+ *  @param  size    storageのバイト数
+ *
+ *  storageは呼び出し側が管理し、容量が足りなくなった時点で
+ *  mallocした領域へ内容を移す。
+ */
+void pack_buf_init (pack_buf_t *b, char *storage, size_t size)
+{
+    b->data = storage;
+    b->len = 0;
+    b->cap = (storage != NULL) ? size : 0;
+    b->storage = storage;
+    b->arena = NULL;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  アリーナから領域を割り当てるバッファとして初期化する。
+ *
+ *  pack_buf_freeはアリーナに領域を返し、アリーナを使う設定は残す。
+ *
+ *  @param  b   バッファ
+ *  @param  a   アリーナ
+ */
+void pack_buf_init_arena (pack_buf_t *b, pack_arena_t *a)
+{
+    pack_buf_init (b, NULL, 0);
+    b->arena = a;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書き込み済みの内容を捨てる。確保した領域はそのまま再利用する。
+ *  @param  b   バッファ
+ */
+void pack_buf_reset (pack_buf_t *b)
+{
+    b->len = 0;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  バッファが確保した領域を解放する。
+ *
+ *  解放後に再び使う場合はpack_buf_initで初期化し直す。
+ *
+ *  @param  b   バッファ
+ */
+void pack_buf_free (pack_buf_t *b)
+{
+    pack_arena_t *a = b->arena;
+
+    if (b->data != b->storage) {
+        if (a != NULL) {
+            pack_arena_release (a, b->data);
+        }
+        else {
+            free (b->data);
+        }
+    }
+    pack_buf_init (b, NULL, 0);
+    b->arena = a;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  末尾にnバイト書き込めるように容量を確保する。
+ *  @param  b   バッファ
+ *  @param  n   追記するバイト数
+ *  @retval 0:成功, -1:メモリが確保できない
+ */
+int pack_buf_reserve (pack_buf_t *b, size_t n)
+{
+    size_t cap;
+    char *p;
+
+    if (b->cap - b->len >= n) {
+        return 0;
+    }
+    cap = (b->cap < PACK_BUF_MIN) ? PACK_BUF_MIN : b->cap;
+    while (cap - b->len < n) {
+        cap *= 2;
+    }
+    if (b->data != NULL && b->data != b->storage) {
+        p = (b->arena != NULL) ? pack_arena_realloc (b->arena, b->data, cap)
+                               : realloc (b->data, cap);
+        if (p == NULL) {
+            return -1;
+        }
+    }
+    else {
+        p = (b->arena != NULL) ? pack_arena_alloc (b->arena, cap) : malloc (cap);
+        if (p == NULL) {
+            return -1;
+        }
+        if (b->len > 0) {
+            memcpy (p, b->data, b->len);
+        }
+    }
+    b->data = p;
+    /* アリーナのブロックはサイズクラスの大きさまで使える */
+    b->cap = (b->arena != NULL) ? pack_arena_size (p) : cap;
+    return 0;
+}
+
+/**
+ *  @brief  1項目を取り出してバッファの末尾へ追記する内部関数
+ *  @param  b   バッファ
+ *  @param  op  項目
+ *  @param  ap  saveする変数の可変引数
+ *  @retval 0:成功, -1:メモリが確保できない
+ */
+static int
+pack_buf_put_op (pack_buf_t *b, const pack_op_t *op, va_list *ap)
+{
+    pack_field_t f;
+    va_list aq;
+    size_t bytes;
+
+    if (op->type == PACK_ALIGN) {
+        /* バッファの先頭からの位置で揃える */
+        bytes = pack_align_pad (op, b->len);
+        if (pack_buf_reserve (b, bytes) < 0) {
+            return -1;
+        }
+        b->len = pack_put_pad (b->data + b->len, bytes) - b->data;
+        return 0;
+    }
+    if (op->type == PACK_GROUP) {
+        /* グループは大きさを数えてからsaveする */
+        va_copy (aq, *ap);
+        bytes = pack_group_put (NULL, op, &aq);
+        va_end (aq);
+        if (pack_buf_reserve (b, bytes) < 0) {
+            return -1;
+        }
+        b->len += pack_group_put (b->data + b->len, op, ap);
+        return 0;
+    }
+    bytes = pack_fetch_save (&f, op, ap);
+    if (pack_buf_reserve (b, bytes) < 0) {
+        return -1;
+    }
+    b->len = pack_put_field (b->data + b->len, &f) - b->data;
+    return 0;
+}
+
+/**
+ *  @brief  planに従ってバッファの末尾へデータをパックする内部関数
+ *  @retval 0:成功, -1:メモリが確保できない(バッファの内容は呼び出し前に戻る)
+ */
+static int
+pack_buf_put_plan (pack_buf_t *b, const pack_plan_t *plan, va_list *ap)
+{
+    size_t start = b->len;
+    int i;
+
+    if (plan->nvar == 0 && pack_buf_reserve (b, plan->fixed) < 0) {
+        return -1;
+    }
+    for (i = 0; i < plan->nops; i += 1 + plan->op[i].group) {
+        if (pack_buf_put_op (b, &plan->op[i], ap) < 0) {
+            b->len = start;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書式文字列に従ってバッファの末尾へデータをパックする。
+ *  @param  b       バッファ
+ *  @param  format  書式文字列
+ *  @param  ...     saveする変数列（可変引数）
+ *  @retval 0:成功, -1:メモリが確保できない(バッファの内容は呼び出し前に戻る)、
+ *          扱えない書式(errnoはEINVAL)
+ */
+int pack_buf_save (pack_buf_t *b, char *format, ...)
+{
+    char *fp = format;
+    size_t start = b->len;
+    int endian = 0;
+    int r = 0;
+    pack_op_t op;
+    const pack_plan_t *plan;
+    va_list args;
+
+    va_start (args, format);
+    if ((plan = pack_cache_get (format)) != NULL) {
+        r = pack_buf_put_plan (b, plan, &args);
+    }
+    else if (pack_format_check (format) < 0) {
+        r = -1;
+    }
+    else {
+        while ((fp = pack_parse_op (fp, &op, &endian)) != NULL) {
+            if (pack_buf_put_op (b, &op, &args) < 0) {
+                b->len = start;
+                r = -1;
+                break;
+            }
+        }
+    }
+    va_end (args);
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  planに従ってバッファの末尾へデータをパックする。
+ *  @param  b       バッファ
+ *  @param  plan    解析済みの書式
+ *  @param  ...     saveする変数列（可変引数）
+ *  @retval 0:成功, -1:メモリが確保できない(バッファの内容は呼び出し前に戻る)
+ */
+int pack_buf_save_plan (pack_buf_t *b, const pack_plan_t *plan, ...)
+{
+    int r;
+    va_list args;
+
+    va_start (args, plan);
+    r = pack_buf_put_plan (b, plan, &args);
+    va_end (args);
+    return r;
+}
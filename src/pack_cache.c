@@ -0,0 +1,158 @@
+/**
+ *  @file   pack_cache.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  書式文字列の解析結果(plan)の表。
+ *
+ *  pack_size, pack_save, pack_loadなどに渡された書式文字列をpack_compileで
+ *  解析して覚えておき、同じ書式文字列の2回目以降の解析を省く。
+ *  呼び出し側を変える必要はない。
+ *
+ *  表はまず書式文字列のポインタで引き、見つからなければ内容のハッシュで
+ *  引く。ポインタが一致しても内容は比べるので、同じ領域の書式文字列を
+ *  書き換えて使っても正しく動く。
+ *
+ *  登録はCASで空いたスロットに入れるだけで、登録したplanは置き換えも
+ *  解放もしないため、引く側はロックを取らない。登録数はPACK_CACHE_SIZE、
+ *  書式文字列の長さはPACK_CACHE_MAXLENまでで、それを超えた書式文字列は
+ *  従来通り毎回解析する。
+ *
+ *  PACK_CACHEを定義してビルドした場合のみ使う(CMakeの既定では定義する)。
+ */
+#ifdef PACK_CACHE
+
+#include <string.h>
+#include "pack_internal.h"
+
+/* 表のスロット数(登録数の2倍にして、空きスロットが必ずあるようにする) */
+#define CACHE_SLOTS (2 * PACK_CACHE_SIZE)
+
+/* 1つの書式文字列の解析結果 */
+typedef struct {
+    const char *key;    /* 登録した時の書式文字列のポインタ */
+    uint64_t hash;      /* 書式文字列の内容のハッシュ */
+    pack_plan_t *plan;  /* 解析済みの書式 */
+    char format[1];     /* 書式文字列の複製 */
+} cache_entry_t;
+
+/* ポインタで引く表と内容のハッシュで引く表 */
+static cache_entry_t *cache_ptr[CACHE_SLOTS];
+static cache_entry_t *cache_hash[CACHE_SLOTS];
+/* 登録数(登録を諦めた分も含む) */
+static int cache_count;
+
+/**
+ *  @brief  ポインタの表の最初のスロット
+ */
+static INLINE unsigned
+cache_ptr_slot (const char *p)
+{
+    return (unsigned) (((uint64_t) (uintptr_t) p * 0x9E3779B97F4A7C15ull) >> 32) % CACHE_SLOTS;
+}
+
+/**
+ *  @brief  書式文字列を解析して表に登録する内部関数
+ *
+ *  他のスレッドが同じ内容を先に登録していれば、そちらを返す。
+ *
+ *  @retval 解析済みの書式、登録できなければNULL
+ */
+static const pack_plan_t *
+cache_insert (const char *format, uint64_t hash, size_t len)
+{
+    cache_entry_t *e, *old;
+    unsigned i;
+
+    if (__atomic_load_n (&cache_count, __ATOMIC_RELAXED) >= PACK_CACHE_SIZE
+        || __atomic_fetch_add (&cache_count, 1, __ATOMIC_RELAXED) >= PACK_CACHE_SIZE) {
+        return NULL;
+    }
+    e = malloc (sizeof(cache_entry_t) + len);
+    if (e == NULL) {
+        return NULL;
+    }
+    memcpy (e->format, format, len + 1);
+    e->key = format;
+    e->hash = hash;
+    /* 呼び出し側が書き換えても良いように複製の方を解析する */
+    e->plan = pack_compile (e->format);
+    if (e->plan == NULL) {
+        /* 扱えない書式で登録数を使い切らないようにする */
+        __atomic_fetch_sub (&cache_count, 1, __ATOMIC_RELAXED);
+        free (e);
+        return NULL;
+    }
+
+    /* 内容の表に入れる */
+    for (i = hash % CACHE_SLOTS; ; i = (i + 1) % CACHE_SLOTS) {
+        old = NULL;
+        if (__atomic_compare_exchange_n (&cache_hash[i], &old, e, 0,
+                                         __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if (old->hash == hash && strcmp (old->format, e->format) == 0) {
+            /* 先を越された分は登録数に数えない */
+            __atomic_fetch_sub (&cache_count, 1, __ATOMIC_RELAXED);
+            pack_plan_free (e->plan);
+            free (e);
+            return old->plan;
+        }
+    }
+    /* ポインタの表に入れる */
+    for (i = cache_ptr_slot (format); ; i = (i + 1) % CACHE_SLOTS) {
+        old = NULL;
+        if (__atomic_compare_exchange_n (&cache_ptr[i], &old, e, 0,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    return e->plan;
+}
+
+/**
+ *  @brief  書式文字列の解析済みの書式を返す。
+ *
+ *  初めての書式文字列は解析して登録する。
+ *
+ *  @param  format  書式文字列
+ *  @retval 解析済みの書式(解放してはならない)、表に無く登録もできなければNULL
+ */
+const pack_plan_t *
+pack_cache_get (const char *format)
+{
+    cache_entry_t *e;
+    uint64_t hash;
+    size_t len;
+    unsigned i, k;
+
+    /* ポインタで引く */
+    i = cache_ptr_slot (format);
+    for (k = 0; k < CACHE_SLOTS; k++, i = (i + 1) % CACHE_SLOTS) {
+        e = __atomic_load_n (&cache_ptr[i], __ATOMIC_ACQUIRE);
+        if (e == NULL) {
+            break;
+        }
+        if (e->key == format && strcmp (e->format, format) == 0) {
+            return e->plan;
+        }
+    }
+    /* 内容のハッシュで引く */
+    hash = pack_hash_string (format, &len);
+    if (len > PACK_CACHE_MAXLEN) {
+        return NULL;
+    }
+    i = hash % CACHE_SLOTS;
+    for (k = 0; k < CACHE_SLOTS; k++, i = (i + 1) % CACHE_SLOTS) {
+        e = __atomic_load_n (&cache_hash[i], __ATOMIC_ACQUIRE);
+        if (e == NULL) {
+            break;
+        }
+        if (e->hash == hash && strcmp (e->format, format) == 0) {
+            return e->plan;
+        }
+    }
+    return cache_insert (format, hash, len);
+}
+
+#endif /* PACK_CACHE */
@@ -0,0 +1,605 @@
+/**
+ *  @file   pack_chan.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  プロセス間でパックしたレコードを受け渡す共有メモリのチャネル。
+ *
+ *  書き手はpack_chan_reserveで共有メモリ上のリングに領域を予約して直接
+ *  saveし、pack_chan_commitで読み手に見せる。読み手はpack_chan_nextで
+ *  次のレコードを受け取ってその場でloadし、pack_chan_releaseで読み終える。
+ *  パイプと違い、レコードの複製もread/writeの呼び出しも要らない。
+ *
+ *  書き手は1つ、読み手はPACK_CHAN_READERSまで接続でき、各読み手が
+ *  すべてのレコードを受け取る。書き手は最も遅れている読み手が読み終える
+ *  まで、そのレコードの領域を上書きしない。読み手がいない間のレコードは
+ *  誰にも読まれずに捨てられる。読み手は接続した後のレコードから読む。
+ *
+ *  待つ場合はヘッダのカウンタ(wseq, rseq)をfutexで待つ。相手は待っている
+ *  プロセスがある場合だけFUTEX_WAKEを呼ぶ。書き手がpack_chan_closeすると、
+ *  残りのレコードを読み終えた読み手にはEPIPEが返る。
+ *
+ *  共有メモリはpack_chan_createでmemfd(名前がNULLまたは'/'で始まらない
+ *  場合)か、shm_open(名前が'/'で始まる場合)で作る。読み手はfdを
+ *  (forkで引き継ぐ、SCM_RIGHTSで受け取る等して)pack_chan_attachに渡すか、
+ *  shm_openの名前をpack_chan_openに渡して接続する。shm_openの名前は
+ *  使い終えたら呼び出し側がshm_unlinkする。
+ *
+ *  読み手は終了する前にpack_chan_closeを呼ぶ。接続したまま終了した
+ *  (異常終了した)読み手は、書き手がpack_chan_reserveで空きを待つ時に
+ *  kill(pid, 0)で調べてスロットを空ける。書き手は待っている間も
+ *  CHAN_REAP_MS毎に起きて調べ直す。ただし、waitpidされていないゾンビ、
+ *  PID名前空間の異なるプロセス、PIDが再利用された場合は見分けられない。
+ *
+ *  例）
+ *  書き手:
+ *  pack_chan_create (&c, NULL, 1 << 20);
+ *  (fork等でc.fdを読み手に渡す)
+ *  pack_chan_save (&c, -1, "i d#", n, da, n);
+ *  読み手:
+ *  pack_chan_attach (&r, fd);
+ *  p = pack_chan_next (&r, &len, -1);
+ *  pack_load (p, "i", &n);
+ *  ...
+ *  pack_chan_release (&r);
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "pack_chan.h"
+#include "pack_internal.h"
+
+/* 書き手が空きを待つ間に、終了した読み手を調べ直す間隔 */
+#define CHAN_REAP_MS    100
+
+/* レコードの先頭 */
+typedef struct {
+    uint32_t len;
+    uint32_t flags;
+} chan_record_t;
+
+/* レコード全体のバイト数(8バイト境界に切り上げる) */
+#define CHAN_RECORD(len) \
+    ((sizeof(chan_record_t) + (len) + PACK_CHAN_ALIGN - 1) & ~(uint64_t) (PACK_CHAN_ALIGN - 1))
+
+/**
+ *  @brief  リング内の位置のレコード
+ */
+static INLINE chan_record_t *
+chan_record (const pack_chan_t *c, uint64_t pos)
+{
+    return (chan_record_t *) (c->ring + (pos & (c->size - 1)));
+}
+
+/**
+ *  @brief  待つ期限を求める内部関数
+ *  @param  timeout_ms  待つミリ秒数(負なら無期限)
+ *  @retval 期限、無期限ならNULL
+ */
+static struct timespec *
+chan_deadline (struct timespec *ts, int timeout_ms)
+{
+    if (timeout_ms < 0) {
+        return NULL;
+    }
+    clock_gettime (CLOCK_MONOTONIC, ts);
+    ts->tv_sec += timeout_ms / 1000;
+    ts->tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+/**
+ *  @brief  カウンタseqが変わるまで待つ内部関数
+ *
+ *  seqがoldのままでなければすぐに戻る。起こされたか期限が来る前に
+ *  戻ることもあるので、呼び出し側は条件を調べ直す。
+ *
+ *  @param  seq         待つカウンタ
+ *  @param  waiters     待っている数
+ *  @param  old         条件を調べる前に読んだseq
+ *  @param  deadline    期限(NULLなら無期限)
+ *  @retval 0:条件を調べ直す, -1:期限が過ぎた(errnoはEAGAIN)
+ */
+static int
+chan_sleep (uint32_t *seq, uint32_t *waiters, uint32_t old, const struct timespec *deadline)
+{
+    struct timespec now, rel, *tp = NULL;
+
+    if (deadline != NULL) {
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        rel.tv_sec = deadline->tv_sec - now.tv_sec;
+        rel.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+        if (rel.tv_nsec < 0) {
+            rel.tv_sec--;
+            rel.tv_nsec += 1000000000;
+        }
+        if (rel.tv_sec < 0 || (rel.tv_sec == 0 && rel.tv_nsec == 0)) {
+            errno = EAGAIN;
+            return -1;
+        }
+        tp = &rel;
+    }
+    __atomic_fetch_add (waiters, 1, __ATOMIC_SEQ_CST);
+    syscall (SYS_futex, seq, FUTEX_WAIT, old, tp, NULL, 0);
+    __atomic_fetch_sub (waiters, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/**
+ *  @brief  カウンタを進め、待っているプロセスがあれば起こす内部関数
+ */
+static void
+chan_wake (uint32_t *seq, uint32_t *waiters)
+{
+    __atomic_fetch_add (seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (waiters, __ATOMIC_SEQ_CST) > 0) {
+        syscall (SYS_futex, seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/**
+ *  @brief  共有メモリをマップする内部関数
+ */
+static int
+chan_map (pack_chan_t *c, size_t len)
+{
+    void *p = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+    c->hdr = p;
+    c->map_len = len;
+    c->ring = (char *) p + PACK_CHAN_HEADER;
+    return 0;
+}
+
+/**
+ *  @brief  エラーの後始末をする内部関数(errnoは保つ)
+ */
+static int
+chan_fail (pack_chan_t *c)
+{
+    int e = errno;
+
+    if (c->hdr != NULL) {
+        munmap (c->hdr, c->map_len);
+        c->hdr = NULL;
+    }
+    if (c->fd >= 0) {
+        close (c->fd);
+        c->fd = -1;
+    }
+    errno = e;
+    return -1;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  チャネルを作り、書き手として開く。
+ *  @param  c       チャネル
+ *  @param  name    '/'で始まればshm_openの名前、それ以外(NULL可)はmemfdの名前
+ *  @param  size    リングのバイト数(2のべき乗に切り上げる)
+ *  @retval 0:成功, -1:失敗(errnoを参照)
+ */
+int pack_chan_create (pack_chan_t *c, const char *name, size_t size)
+{
+    pack_chan_header_t *h;
+    size_t n = 4096;
+
+    while (n < size) {
+        n *= 2;
+    }
+    memset (c, 0, sizeof(*c));
+    c->reader = -1;
+    if (name != NULL && name[0] == '/') {
+        c->fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    else {
+        c->fd = memfd_create ((name != NULL) ? name : "pack_chan", MFD_CLOEXEC);
+    }
+    if (c->fd < 0) {
+        return -1;
+    }
+    if (ftruncate (c->fd, PACK_CHAN_HEADER + n) < 0
+        || chan_map (c, PACK_CHAN_HEADER + n) < 0) {
+        return chan_fail (c);
+    }
+    c->size = n;
+    h = c->hdr;
+    h->version = PACK_CHAN_VERSION;
+    h->readers = PACK_CHAN_READERS;
+    h->size = n;
+    /* 読み手がmagicを見た時には他の値が揃っている */
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    memcpy (h->magic, PACK_CHAN_MAGIC, 8);
+    return 0;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  共有メモリのfdでチャネルに読み手として接続する。
+ *
+ *  fdは複製して使うので、呼び出し側で閉じてよい。
+ *  接続した後にコミットされたレコードから読む。
+ *
+ *  @param  c   チャネル
+ *  @param  fd  pack_chan_createで作った共有メモリのファイル記述子
+ *  @retval 0:成功, -1:失敗(errnoを参照、読み手が多すぎる場合はEBUSY)
+ */
+int pack_chan_attach (pack_chan_t *c, int fd)
+{
+    pack_chan_header_t *h;
+    struct stat st;
+    uint32_t free_slot;
+    int i;
+
+    memset (c, 0, sizeof(*c));
+    c->reader = -1;
+    c->fd = fcntl (fd, F_DUPFD_CLOEXEC, 0);
+    if (c->fd < 0) {
+        return -1;
+    }
+    if (fstat (c->fd, &st) < 0) {
+        return chan_fail (c);
+    }
+    if ((size_t) st.st_size <= PACK_CHAN_HEADER) {
+        errno = EINVAL;
+        return chan_fail (c);
+    }
+    if (chan_map (c, st.st_size) < 0) {
+        return chan_fail (c);
+    }
+    h = c->hdr;
+    if (memcmp (h->magic, PACK_CHAN_MAGIC, 8) != 0 || h->version != PACK_CHAN_VERSION
+        || h->size != (uint64_t) st.st_size - PACK_CHAN_HEADER) {
+        errno = EINVAL;
+        return chan_fail (c);
+    }
+    c->size = h->size;
+
+    for (i = 0; i < PACK_CHAN_READERS; i++) {
+        free_slot = 0;
+        if (__atomic_compare_exchange_n (&h->reader[i].active, &free_slot, 2, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (i == PACK_CHAN_READERS) {
+        errno = EBUSY;
+        return chan_fail (c);
+    }
+    c->reader = i;
+    h->reader[i].pid = getpid ();
+    c->pos = __atomic_load_n (&h->write_pos, __ATOMIC_ACQUIRE);
+    __atomic_store_n (&h->reader[i].pos, c->pos, __ATOMIC_RELEASE);
+    __atomic_store_n (&h->reader[i].active, 1, __ATOMIC_SEQ_CST);
+    /* 接続が書き手に見える前のレコードは上書きされうるので、今の位置から読む */
+    c->pos = __atomic_load_n (&h->write_pos, __ATOMIC_SEQ_CST);
+    __atomic_store_n (&h->reader[i].pos, c->pos, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  shm_openの名前でチャネルに読み手として接続する。
+ *  @param  c       チャネル
+ *  @param  name    pack_chan_createに渡した'/'で始まる名前
+ *  @retval 0:成功, -1:失敗(errnoを参照)
+ */
+int pack_chan_open (pack_chan_t *c, const char *name)
+{
+    int fd = shm_open (name, O_RDWR, 0);
+    int r, e;
+
+    if (fd < 0) {
+        return -1;
+    }
+    r = pack_chan_attach (c, fd);
+    e = errno;
+    close (fd);
+    errno = e;
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  チャネルを閉じる。
+ *
+ *  書き手が閉じると、読み手は残りのレコードを読み終えた後EPIPEを受け取る。
+ *  読み手が閉じると、書き手はその読み手を待たなくなる。
+ *
+ *  @param  c   チャネル
+ *  @retval 0:成功, -1:失敗
+ */
+int pack_chan_close (pack_chan_t *c)
+{
+    pack_chan_header_t *h = c->hdr;
+    int r = 0;
+
+    if (h != NULL) {
+        if (c->reader < 0) {
+            __atomic_store_n (&h->closed, 1, __ATOMIC_SEQ_CST);
+            chan_wake (&h->wseq, &h->rwait);
+        }
+        else {
+            __atomic_store_n (&h->reader[c->reader].active, 0, __ATOMIC_SEQ_CST);
+            chan_wake (&h->rseq, &h->wwait);
+        }
+        r = munmap (h, c->map_len);
+        c->hdr = NULL;
+    }
+    if (c->fd >= 0 && close (c->fd) < 0) {
+        r = -1;
+    }
+    c->fd = -1;
+    return r;
+}
+
+/**
+ *  @brief  最も遅れている読み手の位置を返す内部関数(読み手がいなければpos)
+ */
+static uint64_t
+chan_min_reader (const pack_chan_t *c, uint64_t pos)
+{
+    pack_chan_header_t *h = c->hdr;
+    uint64_t min = pos, p;
+    int i;
+
+    for (i = 0; i < PACK_CHAN_READERS; i++) {
+        if (__atomic_load_n (&h->reader[i].active, __ATOMIC_ACQUIRE) == 1) {
+            p = __atomic_load_n (&h->reader[i].pos, __ATOMIC_ACQUIRE);
+            if ((int64_t) (p - min) < 0) {
+                min = p;
+            }
+        }
+    }
+    return min;
+}
+
+/**
+ *  @brief  接続したまま終了した読み手のスロットを空ける内部関数
+ *  @retval 空けたスロットの数
+ */
+static int
+chan_reap (const pack_chan_t *c)
+{
+    pack_chan_header_t *h = c->hdr;
+    uint32_t active, pid;
+    int i, n = 0;
+
+    for (i = 0; i < PACK_CHAN_READERS; i++) {
+        if (__atomic_load_n (&h->reader[i].active, __ATOMIC_ACQUIRE) != 1) {
+            continue;
+        }
+        pid = __atomic_load_n (&h->reader[i].pid, __ATOMIC_RELAXED);
+        if (pid == 0 || kill ((pid_t) pid, 0) == 0 || errno != ESRCH) {
+            continue;
+        }
+        /* 調べている間に別の読み手が入れ替わっていれば空けない */
+        active = 1;
+        if (__atomic_load_n (&h->reader[i].pid, __ATOMIC_ACQUIRE) == pid
+            && __atomic_compare_exchange_n (&h->reader[i].active, &active, 0, 0,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            n++;
+        }
+    }
+    return n;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  レコードを書き込む領域を予約する(書き手)。
+ *
+ *  予約した領域に書き込んだ後、pack_chan_commitで読み手に見せる。
+ *  空きが足りなければ、接続したまま終了した読み手のスロットを空けてから待つ。
+ *
+ *  @param  c           チャネル
+ *  @param  size        書き込むバイト数の上限(リングの半分まで)
+ *  @param  timeout_ms  空くまで待つミリ秒数(負なら無期限、0なら待たない)
+ *  @retval 書き込む領域の先頭、空かなければNULL(errnoはEAGAIN)、
+ *          sizeが大きすぎればNULL(errnoはEMSGSIZE)
+ */
+char* pack_chan_reserve (pack_chan_t *c, size_t size, int timeout_ms)
+{
+    pack_chan_header_t *h = c->hdr;
+    struct timespec ts, *deadline = chan_deadline (&ts, timeout_ms);
+    struct timespec rts, *wake;
+    uint64_t need = CHAN_RECORD (size), pad = 0, off;
+    uint32_t seq;
+    int e;
+
+    if (need > c->size / 2) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+    off = c->pos & (c->size - 1);
+    if (off + need > c->size) {
+        pad = c->size - off;
+    }
+    for (;;) {
+        seq = __atomic_load_n (&h->rseq, __ATOMIC_SEQ_CST);
+        if (c->pos + pad + need - chan_min_reader (c, c->pos) <= c->size) {
+            break;
+        }
+        e = errno;
+        if (chan_reap (c) > 0) {
+            continue;
+        }
+        errno = e;
+        /* 終了した読み手は起こしてくれないので、CHAN_REAP_MS毎に調べ直す */
+        wake = chan_deadline (&rts, CHAN_REAP_MS);
+        if (deadline != NULL && (deadline->tv_sec < wake->tv_sec
+                                 || (deadline->tv_sec == wake->tv_sec
+                                     && deadline->tv_nsec < wake->tv_nsec))) {
+            wake = deadline;
+        }
+        if (chan_sleep (&h->rseq, &h->wwait, seq, wake) < 0 && wake == deadline) {
+            return NULL;
+        }
+    }
+    if (pad > 0) {
+        chan_record (c, c->pos)->len = (uint32_t) (pad - sizeof(chan_record_t));
+        chan_record (c, c->pos)->flags = PACK_CHAN_PAD;
+    }
+    c->next = c->pos + pad;
+    return (char *) (chan_record (c, c->next) + 1);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  予約した領域に書き込んだレコードを読み手に見せる(書き手)。
+ *  @param  c       チャネル
+ *  @param  len     書き込んだバイト数(予約したsize以下)
+ */
+void pack_chan_commit (pack_chan_t *c, size_t len)
+{
+    pack_chan_header_t *h = c->hdr;
+    chan_record_t *rec = chan_record (c, c->next);
+
+    rec->len = (uint32_t) len;
+    rec->flags = 0;
+    c->pos = c->next + CHAN_RECORD (len);
+    __atomic_store_n (&h->write_pos, c->pos, __ATOMIC_RELEASE);
+    chan_wake (&h->wseq, &h->rwait);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  次のレコードを受け取る(読み手)。
+ *
+ *  受け取ったレコードは、読み終えた後にpack_chan_releaseで返す。
+ *
+ *  @param  c           チャネル
+ *  @param  len         レコードのバイト数を格納する領域へのポインタ(NULL可)
+ *  @param  timeout_ms  届くまで待つミリ秒数(負なら無期限、0なら待たない)
+ *  @retval レコードの先頭、届かなければNULL(errnoはEAGAIN)、
+ *          書き手が閉じていればNULL(errnoはEPIPE)
+ */
+char* pack_chan_next (pack_chan_t *c, size_t *len, int timeout_ms)
+{
+    pack_chan_header_t *h = c->hdr;
+    struct timespec ts, *deadline = chan_deadline (&ts, timeout_ms);
+    chan_record_t *rec;
+    uint64_t wp;
+    uint32_t seq;
+
+    for (;;) {
+        seq = __atomic_load_n (&h->wseq, __ATOMIC_SEQ_CST);
+        wp = __atomic_load_n (&h->write_pos, __ATOMIC_ACQUIRE);
+        while (c->pos != wp) {
+            rec = chan_record (c, c->pos);
+            if (rec->flags & PACK_CHAN_PAD) {
+                c->pos += sizeof(chan_record_t) + rec->len;
+                continue;
+            }
+            c->next = c->pos + CHAN_RECORD (rec->len);
+            if (len != NULL) {
+                *len = rec->len;
+            }
+            return (char *) (rec + 1);
+        }
+        if (__atomic_load_n (&h->closed, __ATOMIC_ACQUIRE)) {
+            errno = EPIPE;
+            return NULL;
+        }
+        if (chan_sleep (&h->wseq, &h->rwait, seq, deadline) < 0) {
+            return NULL;
+        }
+    }
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  pack_chan_nextで受け取ったレコードを読み終える(読み手)。
+ *  @param  c   チャネル
+ */
+void pack_chan_release (pack_chan_t *c)
+{
+    pack_chan_header_t *h = c->hdr;
+
+    c->pos = c->next;
+    __atomic_store_n (&h->reader[c->reader].pos, c->pos, __ATOMIC_RELEASE);
+    chan_wake (&h->rseq, &h->wwait);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書式文字列に従ってレコードをsaveし、読み手に見せる(書き手)。
+ *  @param  c           チャネル
+ *  @param  timeout_ms  空くまで待つミリ秒数(負なら無期限、0なら待たない)
+ *  @param  format      書式文字列
+ *  @param  ...         saveする変数列(pack_saveと同じ可変引数)
+ *  @retval 0:成功, -1:失敗(errnoはpack_chan_reserveと同じ、扱えない書式はEINVAL)
+ */
+int pack_chan_save (pack_chan_t *c, int timeout_ms, char *format, ...)
+{
+    char *p;
+    size_t size;
+    va_list args, copy;
+
+    va_start (args, format);
+    va_copy (copy, args);
+    size = pack_format_put (NULL, format, &copy);
+    va_end (copy);
+    if (size == (size_t) -1) {
+        /* 扱えない書式(errnoはEINVAL) */
+        va_end (args);
+        return -1;
+    }
+    p = pack_chan_reserve (c, size, timeout_ms);
+    if (p != NULL) {
+        pack_format_put (p, format, &args);
+        pack_chan_commit (c, size);
+    }
+    va_end (args);
+    return (p != NULL) ? 0 : -1;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  次のレコードを書式文字列に従ってloadし、読み終える(読み手)。
+ *  @param  c           チャネル
+ *  @param  timeout_ms  届くまで待つミリ秒数(負なら無期限、0なら待たない)
+ *  @param  format      書式文字列
+ *  @param  ...         loadする変数列(pack_loadと同じ可変引数)
+ *  @retval 0:成功, -1:失敗(errnoはpack_chan_nextと同じ、'*'の上限を超えれば
+ *          EMSGSIZE、参照を返す's', 'y'や扱えないグループを含めばEINVAL)
+ */
+int pack_chan_load (pack_chan_t *c, int timeout_ms, char *format, ...)
+{
+    char *p;
+    va_list args;
+
+    if (strpbrk (format, "sy") != NULL) {
+        /* pack_chan_nextとpack_loadで読み、使い終えてからpack_chan_releaseする */
+        errno = EINVAL;
+        return -1;
+    }
+    if (pack_format_check (format) < 0) {
+        return -1;
+    }
+    p = pack_chan_next (c, NULL, timeout_ms);
+    if (p == NULL) {
+        return -1;
+    }
+    va_start (args, format);
+    p = pack_format_get (p, format, &args);
+    va_end (args);
+    pack_chan_release (c);
+    return (p != NULL) ? 0 : -1;
+}
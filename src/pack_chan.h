@@ -0,0 +1,97 @@
+/**
+ *  @file   pack_chan.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  プロセス間でパックしたレコードを受け渡す共有メモリのチャネルの宣言
+ *
+ *  共有メモリの配置(すべてのプロセスで同じ):
+ *
+ *  0                       pack_chan_header_t(PACK_CHAN_HEADERバイトに切り上げる)
+ *  PACK_CHAN_HEADER        リング(sizeバイト、2のべき乗)
+ *
+ *  リングには8バイト境界から順にレコードを置く。位置はリングの先頭から
+ *  書き始めてからの通算のバイト数で表し、sizeで割った余りがリング内の
+ *  位置になる。1レコードは
+ *
+ *  uint32_t len        ペイロードのバイト数
+ *  uint32_t flags      0、またはPACK_CHAN_PAD(リングの末尾の詰め物)
+ *  char payload[len]   パックしたデータ(8バイト境界まで詰める)
+ *
+ *  レコードはリングの末尾で折り返さない。末尾に入りきらない場合は、
+ *  残りをPACK_CHAN_PADのレコード(lenは残り-8)で埋めて先頭から書く。
+ *  数値はすべてその計算機のバイト順で、同じ計算機のプロセス間で使う。
+ */
+#ifndef __PACK_CHAN_H__
+#define __PACK_CHAN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "pack.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PACK_CHAN_MAGIC     "PACKCHN1"
+#define PACK_CHAN_VERSION   1
+#define PACK_CHAN_HEADER    4096    /* リングの開始位置 */
+#define PACK_CHAN_READERS   16      /* 同時に接続できる読み手の数 */
+#define PACK_CHAN_ALIGN     8       /* レコードの境界 */
+#define PACK_CHAN_PAD       1       /* レコードのflags: 末尾の詰め物 */
+
+/* 共有メモリの先頭(各行は64バイトのキャッシュラインを占める) */
+typedef struct {
+    /* 不変の情報 */
+    char magic[8];              /* PACK_CHAN_MAGIC */
+    uint32_t version;           /* PACK_CHAN_VERSION */
+    uint32_t readers;           /* PACK_CHAN_READERS */
+    uint64_t size;              /* リングのバイト数 */
+    char pad0[40];
+    /* 書き手が更新する */
+    uint64_t write_pos;         /* コミットしたレコードの終わりの位置 */
+    uint32_t wseq;              /* コミットの度に増やす(読み手がfutexで待つ) */
+    uint32_t rwait;             /* wseqで待っている読み手の数 */
+    uint32_t closed;            /* 1:書き手が閉じた */
+    char pad1[44];
+    /* 読み手が更新する */
+    uint32_t rseq;              /* 読み終える度に増やす(書き手がfutexで待つ) */
+    uint32_t wwait;             /* rseqで待っている書き手の数 */
+    char pad2[56];
+    /* 読み手毎の状態 */
+    struct {
+        uint32_t active;        /* 0:空き, 1:接続中, 2:接続処理中 */
+        uint32_t pid;           /* 読み手のプロセスID */
+        uint64_t pos;           /* 読み終えた位置 */
+        char pad[48];
+    } reader[PACK_CHAN_READERS];
+} pack_chan_header_t;
+
+/* チャネルの一方の端 */
+typedef struct {
+    int fd;                     /* 共有メモリのファイル記述子 */
+    int reader;                 /* 読み手のスロット番号(書き手は-1) */
+    pack_chan_header_t *hdr;    /* 共有メモリの先頭 */
+    char *ring;                 /* リングの先頭 */
+    size_t size;                /* リングのバイト数 */
+    size_t map_len;             /* 共有メモリのバイト数 */
+    uint64_t pos;               /* 書き手:書く位置, 読み手:読む位置 */
+    uint64_t next;              /* 書き手:予約したレコードの位置, 読み手:次のレコードの位置 */
+} pack_chan_t;
+
+int pack_chan_create (pack_chan_t *c, const char *name, size_t size);
+int pack_chan_attach (pack_chan_t *c, int fd);
+int pack_chan_open (pack_chan_t *c, const char *name);
+int pack_chan_close (pack_chan_t *c);
+char* pack_chan_reserve (pack_chan_t *c, size_t size, int timeout_ms);
+void pack_chan_commit (pack_chan_t *c, size_t len);
+char* pack_chan_next (pack_chan_t *c, size_t *len, int timeout_ms);
+void pack_chan_release (pack_chan_t *c);
+int pack_chan_save (pack_chan_t *c, int timeout_ms, char *format, ...);
+int pack_chan_load (pack_chan_t *c, int timeout_ms, char *format, ...);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __PACK_CHAN_H__ */
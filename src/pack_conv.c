@@ -0,0 +1,597 @@
+/**
+ *  @file   pack_conv.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  浮動小数点数の精度を落とした保存形式への変換。
+ *
+ *	e, E - IEEE 754 binary16 (半精度)
+ *	g, G - bfloat16 (floatの上位16bit)
+ *	r, R - int16の固定小数点 (値 * scale を保存)
+ *	t, T - int32の固定小数点 (値 * scale を保存)
+ *
+ *  小文字はfloat、大文字はdoubleの変数を対象とする。
+ *
+ *  丸めは次のとおり。
+ *  - binary16, bfloat16: 最近接偶数丸め。binary16で表せない大きさの値は
+ *    無限大になる。NaNはquiet NaNになる(ペイロードは保たれるとは限らない)。
+ *    doubleはいったんfloatに最近接偶数丸めしてから変換する(二重丸め)。
+ *  - 固定小数点: 値 * scale を最近接偶数丸めし、保存する型の範囲に
+ *    飽和させる。NaNは0になる。floatの変数はfloatで、doubleの変数は
+ *    doubleで計算する。loadでは保存した値を scale で割る。
+ *
+ *  x86ではF16C(binary16)とAVX2(bfloat16, 固定小数点)の実装を初回呼び出し時に
+ *  選び、それ以外の環境ではスカラーの実装を使う。結果はどちらも同じになる。
+ */
+#include <string.h>
+#include <math.h>
+#include "pack_conv.h"
+#include "pack_swap.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PACK_CONV_X86 1
+#include <immintrin.h>
+#endif
+
+/* 一度に変換する要素数 */
+#define CONV_CHUNK 256
+
+/* floatで表せるint32の範囲 */
+#define CONV_I32_MAXF 2147483520.0f
+#define CONV_I32_MINF -2147483648.0f
+
+static inline uint32_t
+conv_bits (float f)
+{
+    uint32_t x;
+    memcpy (&x, &f, 4);
+    return x;
+}
+
+static inline float
+conv_float (uint32_t x)
+{
+    float f;
+    memcpy (&f, &x, 4);
+    return f;
+}
+
+/**
+ *  @brief  floatをbinary16に変換する内部関数(最近接偶数丸め)
+ */
+static inline uint16_t
+conv_f32_to_f16 (float f)
+{
+    const uint32_t f32infty = 255u << 23;
+    const uint32_t f16max = (127u + 16) << 23;
+    const uint32_t denorm_magic = ((127u - 15) + (23 - 10) + 1) << 23;
+    uint32_t x = conv_bits (f);
+    uint32_t sign = x & 0x80000000u;
+    uint16_t o;
+
+    x ^= sign;
+    if (x >= f16max) {
+        /* 無限大またはNaN */
+        o = (x > f32infty) ? 0x7e00 : 0x7c00;
+    }
+    else if (x < (113u << 23)) {
+        /* 非正規化数または0: 加算の丸めを利用する */
+        o = (uint16_t) (conv_bits (conv_float (x) + conv_float (denorm_magic)) - denorm_magic);
+    }
+    else {
+        uint32_t odd = (x >> 13) & 1;
+        x += ((uint32_t) (15 - 127) << 23) + 0xfff;
+        x += odd;
+        o = (uint16_t) (x >> 13);
+    }
+    return o | (uint16_t) (sign >> 16);
+}
+
+/**
+ *  @brief  binary16をfloatに変換する内部関数(誤差なし)
+ */
+static inline float
+conv_f16_to_f32 (uint16_t h)
+{
+    const uint32_t shifted_exp = 0x7c00u << 13;
+    uint32_t o = (uint32_t) (h & 0x7fff) << 13;
+    uint32_t exp = shifted_exp & o;
+
+    o += (uint32_t) (127 - 15) << 23;
+    if (exp == shifted_exp) {
+        /* 無限大またはNaN */
+        o += (uint32_t) (128 - 16) << 23;
+    }
+    else if (exp == 0) {
+        /* 非正規化数または0 */
+        o += 1u << 23;
+        o = conv_bits (conv_float (o) - conv_float (113u << 23));
+    }
+    o |= (uint32_t) (h & 0x8000) << 16;
+    return conv_float (o);
+}
+
+/**
+ *  @brief  floatをbfloat16に変換する内部関数(最近接偶数丸め)
+ */
+static inline uint16_t
+conv_f32_to_bf16 (float f)
+{
+    uint32_t x = conv_bits (f);
+
+    if ((x & 0x7fffffffu) > 0x7f800000u) {
+        return (uint16_t) ((x >> 16) | 0x40);
+    }
+    x += 0x7fff + ((x >> 16) & 1);
+    return (uint16_t) (x >> 16);
+}
+
+static inline float
+conv_bf16_to_f32 (uint16_t h)
+{
+    return conv_float ((uint32_t) h << 16);
+}
+
+/**
+ *  @brief  固定小数点への変換(float)の内部関数
+ */
+static inline int32_t
+conv_fix_f32 (float v, float scale, float lo, float hi)
+{
+    float y = v * scale;
+
+    if (y != y) {
+        return 0;
+    }
+    if (y < lo) {
+        y = lo;
+    }
+    if (y > hi) {
+        y = hi;
+    }
+    return (int32_t) lrintf (y);
+}
+
+/**
+ *  @brief  固定小数点への変換(double)の内部関数
+ */
+static inline int32_t
+conv_fix_f64 (double v, double scale, double lo, double hi)
+{
+    double y = v * scale;
+
+    if (y != y) {
+        return 0;
+    }
+    if (y < lo) {
+        y = lo;
+    }
+    if (y > hi) {
+        y = hi;
+    }
+    return (int32_t) lrint (y);
+}
+
+/*
+ *  float配列の変換(スカラー版)
+ */
+static void
+f32_to_f16_scalar (uint16_t *d, const float *s, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        d[i] = conv_f32_to_f16 (s[i]);
+    }
+}
+
+static void
+f16_to_f32_scalar (float *d, const uint16_t *s, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        d[i] = conv_f16_to_f32 (s[i]);
+    }
+}
+
+static void
+f32_to_bf16_scalar (uint16_t *d, const float *s, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        d[i] = conv_f32_to_bf16 (s[i]);
+    }
+}
+
+static void
+f32_to_fix16_scalar (int16_t *d, const float *s, size_t n, float scale)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        d[i] = (int16_t) conv_fix_f32 (s[i], scale, -32768.0f, 32767.0f);
+    }
+}
+
+static void
+f32_to_fix32_scalar (int32_t *d, const float *s, size_t n, float scale)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        d[i] = conv_fix_f32 (s[i], scale, CONV_I32_MINF, CONV_I32_MAXF);
+    }
+}
+
+#ifdef PACK_CONV_X86
+
+__attribute__((target("avx,f16c")))
+static void
+f32_to_f16_f16c (uint16_t *d, const float *s, size_t n)
+{
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps (s + i);
+        __m128i h = _mm256_cvtps_ph (x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm_storeu_si128 ((__m128i *) (d + i), h);
+    }
+    f32_to_f16_scalar (d + i, s + i, n - i);
+}
+
+__attribute__((target("avx,f16c")))
+static void
+f16_to_f32_f16c (float *d, const uint16_t *s, size_t n)
+{
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i h = _mm_loadu_si128 ((const __m128i *) (s + i));
+        _mm256_storeu_ps (d + i, _mm256_cvtph_ps (h));
+    }
+    f16_to_f32_scalar (d + i, s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+f32_to_bf16_avx2 (uint16_t *d, const float *s, size_t n)
+{
+    const __m256i bias = _mm256_set1_epi32 (0x7fff);
+    const __m256i one = _mm256_set1_epi32 (1);
+    const __m256i qnan = _mm256_set1_epi32 (0x40);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m256i r[2];
+        int j;
+        for (j = 0; j < 2; j++) {
+            __m256 f = _mm256_loadu_ps (s + i + 8 * j);
+            __m256i x = _mm256_castps_si256 (f);
+            __m256i nan = _mm256_castps_si256 (_mm256_cmp_ps (f, f, _CMP_UNORD_Q));
+            __m256i lsb = _mm256_and_si256 (_mm256_srli_epi32 (x, 16), one);
+            __m256i rounded = _mm256_srli_epi32 (_mm256_add_epi32 (_mm256_add_epi32 (x, bias), lsb), 16);
+            __m256i quiet = _mm256_or_si256 (_mm256_srli_epi32 (x, 16), qnan);
+            r[j] = _mm256_blendv_epi8 (rounded, quiet, nan);
+        }
+        /* 32bit -> 16bit (packusはレーン毎なので並べ直す) */
+        __m256i p = _mm256_packus_epi32 (r[0], r[1]);
+        p = _mm256_permute4x64_epi64 (p, 0xd8);
+        _mm256_storeu_si256 ((__m256i *) (d + i), p);
+    }
+    f32_to_bf16_scalar (d + i, s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+bf16_to_f32_avx2 (float *d, const uint16_t *s, size_t n)
+{
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i h = _mm_loadu_si128 ((const __m128i *) (s + i));
+        __m256i x = _mm256_slli_epi32 (_mm256_cvtepu16_epi32 (h), 16);
+        _mm256_storeu_si256 ((__m256i *) (d + i), x);
+    }
+    for (; i < n; i++) {
+        d[i] = conv_bf16_to_f32 (s[i]);
+    }
+}
+
+/**
+ *  @brief  値 * scaleを丸めてint32にする(AVX2, 8要素)
+ */
+__attribute__((target("avx2")))
+static inline __m256i
+fix_avx2 (const float *s, __m256 scale, __m256 lo, __m256 hi)
+{
+    __m256 y = _mm256_mul_ps (_mm256_loadu_ps (s), scale);
+    /* NaNは0にする */
+    y = _mm256_and_ps (y, _mm256_cmp_ps (y, y, _CMP_ORD_Q));
+    y = _mm256_min_ps (_mm256_max_ps (y, lo), hi);
+    return _mm256_cvtps_epi32 (y);
+}
+
+__attribute__((target("avx2")))
+static void
+f32_to_fix16_avx2 (int16_t *d, const float *s, size_t n, float scale)
+{
+    const __m256 sc = _mm256_set1_ps (scale);
+    const __m256 lo = _mm256_set1_ps (-32768.0f);
+    const __m256 hi = _mm256_set1_ps (32767.0f);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m256i a = fix_avx2 (s + i, sc, lo, hi);
+        __m256i b = fix_avx2 (s + i + 8, sc, lo, hi);
+        __m256i p = _mm256_permute4x64_epi64 (_mm256_packs_epi32 (a, b), 0xd8);
+        _mm256_storeu_si256 ((__m256i *) (d + i), p);
+    }
+    f32_to_fix16_scalar (d + i, s + i, n - i, scale);
+}
+
+__attribute__((target("avx2")))
+static void
+f32_to_fix32_avx2 (int32_t *d, const float *s, size_t n, float scale)
+{
+    const __m256 sc = _mm256_set1_ps (scale);
+    const __m256 lo = _mm256_set1_ps (CONV_I32_MINF);
+    const __m256 hi = _mm256_set1_ps (CONV_I32_MAXF);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256 ((__m256i *) (d + i), fix_avx2 (s + i, sc, lo, hi));
+    }
+    f32_to_fix32_scalar (d + i, s + i, n - i, scale);
+}
+
+#endif /* PACK_CONV_X86 */
+
+/**
+ *  実行中のCPUで使う実装
+ */
+typedef struct {
+    void (*f32_to_f16) (uint16_t *, const float *, size_t);
+    void (*f16_to_f32) (float *, const uint16_t *, size_t);
+    void (*f32_to_bf16) (uint16_t *, const float *, size_t);
+    void (*bf16_to_f32) (float *, const uint16_t *, size_t);
+    void (*f32_to_fix16) (int16_t *, const float *, size_t, float);
+    void (*f32_to_fix32) (int32_t *, const float *, size_t, float);
+} conv_kernels_t;
+
+static void
+bf16_to_f32_scalar (float *d, const uint16_t *s, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        d[i] = conv_bf16_to_f32 (s[i]);
+    }
+}
+
+static conv_kernels_t conv_kernels;
+static volatile int conv_ready;
+
+/**
+ *  @brief  CPUの機能を調べて実装を選ぶ内部関数
+ */
+static const conv_kernels_t *
+conv_select (void)
+{
+    conv_kernels_t k;
+
+    if (conv_ready) {
+        return &conv_kernels;
+    }
+    k.f32_to_f16 = f32_to_f16_scalar;
+    k.f16_to_f32 = f16_to_f32_scalar;
+    k.f32_to_bf16 = f32_to_bf16_scalar;
+    k.bf16_to_f32 = bf16_to_f32_scalar;
+    k.f32_to_fix16 = f32_to_fix16_scalar;
+    k.f32_to_fix32 = f32_to_fix32_scalar;
+#ifdef PACK_CONV_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx") && __builtin_cpu_supports ("f16c")) {
+        k.f32_to_f16 = f32_to_f16_f16c;
+        k.f16_to_f32 = f16_to_f32_f16c;
+    }
+    if (__builtin_cpu_supports ("avx2")) {
+        k.f32_to_bf16 = f32_to_bf16_avx2;
+        k.bf16_to_f32 = bf16_to_f32_avx2;
+        k.f32_to_fix16 = f32_to_fix16_avx2;
+        k.f32_to_fix32 = f32_to_fix32_avx2;
+    }
+#endif
+    conv_kernels = k;
+    conv_ready = 1;
+    return &conv_kernels;
+}
+
+/**
+ *  @brief  float配列をbinary16に変換する
+ */
+void pack_f32_to_f16 (uint16_t *d, const float *s, size_t n)
+{
+    conv_select ()->f32_to_f16 (d, s, n);
+}
+
+/**
+ *  @brief  binary16の配列をfloatに変換する
+ */
+void pack_f16_to_f32 (float *d, const uint16_t *s, size_t n)
+{
+    conv_select ()->f16_to_f32 (d, s, n);
+}
+
+/**
+ *  @brief  float配列をbfloat16に変換する
+ */
+void pack_f32_to_bf16 (uint16_t *d, const float *s, size_t n)
+{
+    conv_select ()->f32_to_bf16 (d, s, n);
+}
+
+/**
+ *  @brief  bfloat16の配列をfloatに変換する
+ */
+void pack_bf16_to_f32 (float *d, const uint16_t *s, size_t n)
+{
+    conv_select ()->bf16_to_f32 (d, s, n);
+}
+
+/**
+ *  @brief  書式文字の保存形式の1要素のバイト数を返す
+ *  @param  type    書式文字(e, E, g, G, r, R, t, T)
+ *  @retval バイト数、対象外の文字の場合は0
+ */
+int pack_conv_size (char type)
+{
+    switch (type) {
+    case 'e': case 'E':
+    case 'g': case 'G':
+    case 'r': case 'R':
+        return 2;
+    case 't': case 'T':
+        return 4;
+    }
+    return 0;
+}
+
+/**
+ *  @brief  変数の配列を保存形式に変換してsaveする
+ *  @param  p       save先へのポインタ
+ *  @param  v       変数の配列(小文字の書式はfloat、大文字はdouble)
+ *  @param  n       要素数
+ *  @param  type    書式文字(e, E, g, G, r, R, t, T)
+ *  @param  scale   固定小数点の倍率(r, R, t, T)
+ *  @param  e       1:エンディアン変換する
+ *  @retval saveされたデータの直後へのポインタ
+ */
+char *pack_conv_put (char *p, const void *v, int n, char type, double scale, int e)
+{
+    const conv_kernels_t *k = conv_select ();
+    int size = pack_conv_size (type);
+    union {
+        uint16_t h[CONV_CHUNK];
+        int16_t r[CONV_CHUNK];
+        int32_t t[CONV_CHUNK];
+    } out;
+    float tmp[CONV_CHUNK];
+    int i, j, m;
+
+    for (i = 0; i < n; i += m) {
+        const float *src = (const float *) v + i;
+        const double *dsrc = (const double *) v + i;
+
+        m = (n - i < CONV_CHUNK) ? n - i : CONV_CHUNK;
+        if (type == 'E' || type == 'G') {
+            /* doubleはfloatに丸めてから変換する */
+            for (j = 0; j < m; j++) {
+                tmp[j] = (float) dsrc[j];
+            }
+            src = tmp;
+        }
+        switch (type) {
+        case 'e': case 'E':
+            k->f32_to_f16 (out.h, src, m);
+            break;
+        case 'g': case 'G':
+            k->f32_to_bf16 (out.h, src, m);
+            break;
+        case 'r':
+            k->f32_to_fix16 (out.r, src, m, (float) scale);
+            break;
+        case 't':
+            k->f32_to_fix32 (out.t, src, m, (float) scale);
+            break;
+        case 'R':
+            for (j = 0; j < m; j++) {
+                out.r[j] = (int16_t) conv_fix_f64 (dsrc[j], scale, -32768.0, 32767.0);
+            }
+            break;
+        case 'T':
+            for (j = 0; j < m; j++) {
+                out.t[j] = conv_fix_f64 (dsrc[j], scale, -2147483648.0, 2147483647.0);
+            }
+            break;
+        }
+        if (e) {
+            pack_swap (p, &out, m, size);
+        }
+        else {
+            memcpy (p, &out, (size_t) m * size);
+        }
+        p += (size_t) m * size;
+    }
+    return p;
+}
+
+/**
+ *  @brief  保存形式のデータをloadして変数の型に戻す
+ *  @param  p       load元へのポインタ
+ *  @param  v       変数の配列(小文字の書式はfloat、大文字はdouble)
+ *  @param  n       要素数
+ *  @param  type    書式文字(e, E, g, G, r, R, t, T)
+ *  @param  scale   固定小数点の倍率(r, R, t, T)
+ *  @param  e       1:エンディアン変換する
+ *  @retval loadされた領域の直後へのポインタ
+ */
+char *pack_conv_get (char *p, void *v, int n, char type, double scale, int e)
+{
+    const conv_kernels_t *k = conv_select ();
+    int size = pack_conv_size (type);
+    union {
+        uint16_t h[CONV_CHUNK];
+        int16_t r[CONV_CHUNK];
+        int32_t t[CONV_CHUNK];
+    } in;
+    float tmp[CONV_CHUNK];
+    int i, j, m;
+
+    for (i = 0; i < n; i += m) {
+        float *dst = (float *) v + i;
+        double *ddst = (double *) v + i;
+
+        m = (n - i < CONV_CHUNK) ? n - i : CONV_CHUNK;
+        if (e) {
+            pack_swap (&in, p, m, size);
+        }
+        else {
+            memcpy (&in, p, (size_t) m * size);
+        }
+        p += (size_t) m * size;
+        switch (type) {
+        case 'e':
+            k->f16_to_f32 (dst, in.h, m);
+            break;
+        case 'g':
+            k->bf16_to_f32 (dst, in.h, m);
+            break;
+        case 'E':
+            k->f16_to_f32 (tmp, in.h, m);
+            for (j = 0; j < m; j++) {
+                ddst[j] = tmp[j];
+            }
+            break;
+        case 'G':
+            k->bf16_to_f32 (tmp, in.h, m);
+            for (j = 0; j < m; j++) {
+                ddst[j] = tmp[j];
+            }
+            break;
+        case 'r':
+            for (j = 0; j < m; j++) {
+                dst[j] = in.r[j] / (float) scale;
+            }
+            break;
+        case 't':
+            for (j = 0; j < m; j++) {
+                dst[j] = in.t[j] / (float) scale;
+            }
+            break;
+        case 'R':
+            for (j = 0; j < m; j++) {
+                ddst[j] = in.r[j] / scale;
+            }
+            break;
+        case 'T':
+            for (j = 0; j < m; j++) {
+                ddst[j] = in.t[j] / scale;
+            }
+            break;
+        }
+    }
+    return p;
+}
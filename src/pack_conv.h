@@ -0,0 +1,31 @@
+/**
+ *  @file   pack_conv.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  浮動小数点数の精度を落とした保存形式への変換(packライブラリ内部用)
+ */
+#ifndef __PACK_CONV_H__
+#define __PACK_CONV_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void pack_f32_to_f16 (uint16_t *d, const float *s, size_t n);
+void pack_f16_to_f32 (float *d, const uint16_t *s, size_t n);
+void pack_f32_to_bf16 (uint16_t *d, const float *s, size_t n);
+void pack_bf16_to_f32 (float *d, const uint16_t *s, size_t n);
+
+int pack_conv_size (char type);
+char *pack_conv_put (char *p, const void *v, int n, char type, double scale, int e);
+char *pack_conv_get (char *p, void *v, int n, char type, double scale, int e);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __PACK_CONV_H__ */
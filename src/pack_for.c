@@ -0,0 +1,448 @@
+/**
+ *  @file   pack_for.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  整数配列の差分+frame of reference+bit packing符号化。
+ *
+ *  配列をPACK_FOR_BLOCK要素ずつのブロックに分け、ブロック毎に
+ *
+ *	1バイト     ビット幅 b (0〜64)
+ *	varint      差分の最小値 min (zigzag符号化)
+ *	(m*b+7)/8   (差分 - min) を b bitずつ下位から詰めたビット列
+ *
+ *  の順に書く(mはブロックの要素数)。差分は直前の要素との差で、
+ *  配列の先頭は0との差とする。ビット列はホストによらずリトルエンディアン
+ *  なので、エンディアン変換('!')の影響は受けない。
+ *
+ *  タイムスタンプや整列済みの添字のように、隣り合う値の差が小さい配列ほど
+ *  小さくなる。復号はAVX2(x86で使える場合)のgatherと可変シフトで
+ *  4要素ずつビット列を展開する。
+ */
+#include <string.h>
+#include <stdint.h>
+#include "pack_for.h"
+#include "pack_varint.h"
+#include "pack_swap.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PACK_FOR_X86 1
+#include <immintrin.h>
+#endif
+
+/**
+ *  @brief  リトルエンディアンの64bit値を読む内部関数
+ */
+static inline uint64_t
+for_le64 (const unsigned char *p)
+{
+    uint64_t v;
+    memcpy (&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = pack_bswap64 (v);
+#endif
+    return v;
+}
+
+/**
+ *  @brief  リトルエンディアンの64bit値を、lenバイトを超えないように読む内部関数
+ */
+static inline uint64_t
+for_le64_tail (const unsigned char *p, size_t len)
+{
+    uint64_t v = 0;
+    size_t i;
+
+    if (len >= 8) {
+        return for_le64 (p);
+    }
+    for (i = 0; i < len; i++) {
+        v |= (uint64_t) p[i] << (8 * i);
+    }
+    return v;
+}
+
+/**
+ *  @brief  配列のi番目の要素を64bitに広げて返す内部関数
+ *  @param  v       配列
+ *  @param  i       添字
+ *  @param  size    要素のバイト数(4または8)
+ *  @param  sign    1:符号付き
+ */
+static inline uint64_t
+for_elem (const void *v, int i, int size, int sign)
+{
+    if (size == 4) {
+        uint32_t x = ((const uint32_t *) v)[i];
+        return sign ? (uint64_t) (int64_t) (int32_t) x : (uint64_t) x;
+    }
+    return ((const uint64_t *) v)[i];
+}
+
+/**
+ *  @brief  1ブロックの差分を求め、ビット幅と最小値を返す内部関数
+ *  @param  v       配列
+ *  @param  start   ブロックの先頭の添字
+ *  @param  m       ブロックの要素数
+ *  @param  prev    直前の要素(配列の先頭では0)
+ *  @param  u       (差分 - min)の格納先
+ *  @param  min     差分の最小値の格納先
+ *  @retval ビット幅
+ */
+static int
+for_block (const void *v, int start, int m, uint64_t prev, int size, int sign,
+           uint64_t *u, int64_t *min)
+{
+    uint64_t max = 0;
+    int64_t lo;
+    int k;
+
+    for (k = 0; k < m; k++) {
+        uint64_t x = for_elem (v, start + k, size, sign);
+        u[k] = x - prev;
+        prev = x;
+    }
+    lo = (int64_t) u[0];
+    for (k = 1; k < m; k++) {
+        if ((int64_t) u[k] < lo) {
+            lo = (int64_t) u[k];
+        }
+    }
+    for (k = 0; k < m; k++) {
+        u[k] -= (uint64_t) lo;
+        max |= u[k];
+    }
+    *min = lo;
+    return (max == 0) ? 0 : 64 - __builtin_clzll (max);
+}
+
+/**
+ *  @brief  符号化した配列のバイト数の上限を返す
+ *  @param  n       要素数
+ *  @param  size    要素のバイト数(4または8)
+ *  @retval バイト数
+ */
+size_t pack_for_bound (int n, int size)
+{
+    size_t blocks, bits;
+
+    if (n <= 0) {
+        return 0;
+    }
+    blocks = (n + PACK_FOR_BLOCK - 1) / PACK_FOR_BLOCK;
+    /* 32bitの値の差分は33bit、最小値を引くと34bitまで広がる */
+    bits = (size == 4) ? 34 : 64;
+    return blocks * (1 + PACK_VARINT_MAX) + ((size_t) n * bits + 7) / 8;
+}
+
+/**
+ *  @brief  符号化した配列の実際のバイト数を返す
+ *  @param  v       配列
+ *  @param  n       要素数
+ *  @param  size    要素のバイト数(4または8)
+ *  @param  sign    1:符号付き
+ *  @retval バイト数
+ */
+size_t pack_for_size (const void *v, int n, int size, int sign)
+{
+    uint64_t u[PACK_FOR_BLOCK];
+    uint64_t prev = 0;
+    size_t total = 0;
+    int64_t min;
+    int i, m, b;
+
+    for (i = 0; i < n; i += m) {
+        m = (n - i < PACK_FOR_BLOCK) ? n - i : PACK_FOR_BLOCK;
+        b = for_block (v, i, m, prev, size, sign, u, &min);
+        prev = for_elem (v, i + m - 1, size, sign);
+        total += 1 + pack_varint_len (pack_zigzag (min)) + ((size_t) m * b + 7) / 8;
+    }
+    return total;
+}
+
+/**
+ *  @brief  配列を符号化してsaveする
+ *  @param  p       save先へのポインタ
+ *  @param  v       配列
+ *  @param  n       要素数
+ *  @param  size    要素のバイト数(4または8)
+ *  @param  sign    1:符号付き
+ *  @retval saveされたデータの直後へのポインタ
+ */
+char *pack_for_put (char *p, const void *v, int n, int size, int sign)
+{
+    uint64_t prev = 0;
+    return pack_for_put_from (p, v, n, size, sign, &prev);
+}
+
+/**
+ *  @brief  配列の途中から符号化してsaveする
+ *
+ *  長い配列を何回かに分けて符号化する場合に使う。最後以外の呼び出しでは
+ *  nをPACK_FOR_BLOCKの倍数にすれば、まとめて符号化した場合と同じ結果になる。
+ *
+ *  @param  p       save先へのポインタ
+ *  @param  v       配列
+ *  @param  n       要素数
+ *  @param  size    要素のバイト数(4または8)
+ *  @param  sign    1:符号付き
+ *  @param  prev_p  直前の要素(配列の先頭では0)、最後の要素に更新される
+ *  @retval saveされたデータの直後へのポインタ
+ */
+char *pack_for_put_from (char *p, const void *v, int n, int size, int sign, uint64_t *prev_p)
+{
+    uint64_t u[PACK_FOR_BLOCK];
+    uint64_t prev = *prev_p;
+    int64_t min;
+    int i, k, m, b;
+
+    for (i = 0; i < n; i += m) {
+        uint64_t acc = 0;
+        int nbits = 0;
+
+        m = (n - i < PACK_FOR_BLOCK) ? n - i : PACK_FOR_BLOCK;
+        b = for_block (v, i, m, prev, size, sign, u, &min);
+        prev = for_elem (v, i + m - 1, size, sign);
+        *p++ = (char) b;
+        p = pack_varint_put (p, pack_zigzag (min));
+        if (b == 0) {
+            continue;
+        }
+        for (k = 0; k < m; k++) {
+            acc |= u[k] << nbits;
+            if (nbits + b >= 64) {
+                int j;
+                for (j = 0; j < 8; j++) {
+                    *p++ = (char) (acc >> (8 * j));
+                }
+                acc = (nbits == 0) ? 0 : u[k] >> (64 - nbits);
+                nbits = nbits + b - 64;
+            }
+            else {
+                nbits += b;
+            }
+        }
+        while (nbits > 0) {
+            *p++ = (char) acc;
+            acc >>= 8;
+            nbits -= 8;
+        }
+    }
+    *prev_p = prev;
+    return p;
+}
+
+/**
+ *  @brief  ビット列のk番目の値を取り出す内部関数
+ *  @param  q   ビット列の先頭
+ *  @param  len ビット列のバイト数
+ *  @param  k   添字
+ *  @param  b   ビット幅(1〜64)
+ */
+static inline uint64_t
+for_unpack1 (const unsigned char *q, size_t len, int k, int b)
+{
+    size_t bit = (size_t) k * b;
+    size_t byte = bit >> 3;
+    int sh = (int) (bit & 7);
+    uint64_t x = for_le64_tail (q + byte, len - byte) >> sh;
+
+    if (sh + b > 64) {
+        x |= (uint64_t) q[byte + 8] << (64 - sh);
+    }
+    return (b == 64) ? x : x & ((1ULL << b) - 1);
+}
+
+/**
+ *  @brief  ビット列を展開する(スカラー版)
+ *  @param  q   ビット列の先頭
+ *  @param  len ビット列のバイト数
+ *  @param  u   展開した値の格納先
+ *  @param  m   要素数
+ *  @param  b   ビット幅(1〜64)
+ */
+static void
+for_unpack_scalar (const unsigned char *q, size_t len, uint64_t *u, int m, int b)
+{
+    int k;
+
+    for (k = 0; k < m; k++) {
+        u[k] = for_unpack1 (q, len, k, b);
+    }
+}
+
+#ifdef PACK_FOR_X86
+
+/**
+ *  @brief  ビット列を展開する(AVX2版)
+ *
+ *  b <= 56なら1要素は読み出し位置から8バイト以内に収まるので、
+ *  4要素分の8バイトをgatherで読み、可変シフトとマスクで取り出す。
+ *  ビット列の末尾を超えて読むことになる要素はスカラー版で処理する。
+ */
+__attribute__((target("avx2")))
+static void
+for_unpack_avx2 (const unsigned char *q, size_t len, uint64_t *u, int m, int b)
+{
+    int k = 0;
+
+    if (b <= 56) {
+        const __m256i mask = _mm256_set1_epi64x ((long long) ((1ULL << b) - 1));
+        const __m256i step = _mm256_set1_epi64x ((long long) 4 * b);
+        const __m256i seven = _mm256_set1_epi64x (7);
+        __m256i bit = _mm256_set_epi64x (3LL * b, 2LL * b, 1LL * b, 0);
+
+        for (; k + 4 <= m; k += 4) {
+            if (((size_t) (k + 3) * b >> 3) + 8 > len) {
+                break;
+            }
+            __m256i byte = _mm256_srli_epi64 (bit, 3);
+            __m256i x = _mm256_i64gather_epi64 ((const long long *) q, byte, 1);
+            x = _mm256_srlv_epi64 (x, _mm256_and_si256 (bit, seven));
+            _mm256_storeu_si256 ((__m256i *) (u + k), _mm256_and_si256 (x, mask));
+            bit = _mm256_add_epi64 (bit, step);
+        }
+    }
+    for (; k < m; k++) {
+        u[k] = for_unpack1 (q, len, k, b);
+    }
+}
+
+#endif /* PACK_FOR_X86 */
+
+typedef void (*for_kernel_t) (const unsigned char *, size_t, uint64_t *, int, int);
+
+static void for_kernel_init (const unsigned char *q, size_t len, uint64_t *u, int m, int b);
+
+/* 実行中のCPUで使う展開の実装(初回呼び出し時に決まる) */
+static for_kernel_t for_kernel = for_kernel_init;
+
+static void
+for_kernel_init (const unsigned char *q, size_t len, uint64_t *u, int m, int b)
+{
+    for_kernel_t k = for_unpack_scalar;
+#if defined(PACK_FOR_X86) && !(defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2")) {
+        k = for_unpack_avx2;
+    }
+#endif
+    for_kernel = k;
+    k (q, len, u, m, b);
+}
+
+/**
+ *  @brief  符号化された配列をloadする
+ *  @param  p       load元へのポインタ
+ *  @param  v       配列の格納先
+ *  @param  n       要素数
+ *  @param  size    要素のバイト数(4または8)
+ *  @retval loadされた領域の直後へのポインタ
+ */
+char *pack_for_get (char *p, void *v, int n, int size)
+{
+    uint64_t prev = 0;
+    return pack_for_get_from (p, v, n, size, &prev);
+}
+
+/**
+ *  @brief  符号化された配列の途中からloadする
+ *  @param  p       load元へのポインタ
+ *  @param  v       配列の格納先
+ *  @param  n       要素数(最後以外の呼び出しではPACK_FOR_BLOCKの倍数)
+ *  @param  size    要素のバイト数(4または8)
+ *  @param  prev_p  直前の要素(配列の先頭では0)、最後の要素に更新される
+ *  @retval loadされた領域の直後へのポインタ
+ */
+char *pack_for_get_from (char *p, void *v, int n, int size, uint64_t *prev_p)
+{
+    uint64_t u[PACK_FOR_BLOCK];
+    uint64_t prev = *prev_p, min;
+    int i, k, m, b;
+
+    for (i = 0; i < n; i += m) {
+        size_t len;
+
+        m = (n - i < PACK_FOR_BLOCK) ? n - i : PACK_FOR_BLOCK;
+        b = (unsigned char) *p++;
+        p = pack_varint_get (p, &min);
+        min = pack_unzigzag (min);
+        if (b > 64) {
+            b = 64;
+        }
+        len = ((size_t) m * b + 7) / 8;
+        if (b == 0) {
+            memset (u, 0, m * sizeof(uint64_t));
+        }
+        else {
+            for_kernel ((const unsigned char *) p, len, u, m, b);
+        }
+        p += len;
+        if (size == 4) {
+            uint32_t *w = (uint32_t *) v + i;
+            for (k = 0; k < m; k++) {
+                prev += u[k] + min;
+                w[k] = (uint32_t) prev;
+            }
+        }
+        else {
+            uint64_t *w = (uint64_t *) v + i;
+            for (k = 0; k < m; k++) {
+                prev += u[k] + min;
+                w[k] = prev;
+            }
+        }
+    }
+    *prev_p = prev;
+    return p;
+}
+
+/**
+ *  @brief  符号化された配列を読み飛ばす
+ *  @param  p   load元へのポインタ
+ *  @param  n   要素数
+ *  @retval 配列の直後へのポインタ
+ */
+char *pack_for_skip (char *p, int n)
+{
+    uint64_t min;
+    int i, m, b;
+
+    for (i = 0; i < n; i += m) {
+        m = (n - i < PACK_FOR_BLOCK) ? n - i : PACK_FOR_BLOCK;
+        b = (unsigned char) *p++;
+        p = pack_varint_get (p, &min);
+        if (b > 64) {
+            b = 64;
+        }
+        p += ((size_t) m * b + 7) / 8;
+    }
+    return p;
+}
+
+/**
+ *  @brief  符号化された1ブロックのバイト数を返す
+ *  @param  p       ブロックの先頭
+ *  @param  avail   pから読めるバイト数
+ *  @param  m       ブロックの要素数
+ *  @retval バイト数、availが足りずに求められない場合は0
+ */
+size_t pack_for_block_size (const char *p, size_t avail, int m)
+{
+    size_t i;
+    int b;
+
+    if (avail < 2) {
+        return 0;
+    }
+    b = (unsigned char) p[0];
+    if (b > 64) {
+        b = 64;
+    }
+    for (i = 1; i < avail && i <= PACK_VARINT_MAX; i++) {
+        if ((p[i] & 0x80) == 0) {
+            return i + 1 + ((size_t) m * b + 7) / 8;
+        }
+    }
+    return 0;
+}
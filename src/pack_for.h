@@ -0,0 +1,34 @@
+/**
+ *  @file   pack_for.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  整数配列の差分+frame of reference+bit packing符号化(packライブラリ内部用)
+ */
+#ifndef __PACK_FOR_H__
+#define __PACK_FOR_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 1ブロックの要素数 */
+#define PACK_FOR_BLOCK 128
+
+size_t pack_for_bound (int n, int size);
+size_t pack_for_size (const void *v, int n, int size, int sign);
+char *pack_for_put (char *p, const void *v, int n, int size, int sign);
+char *pack_for_get (char *p, void *v, int n, int size);
+char *pack_for_put_from (char *p, const void *v, int n, int size, int sign, uint64_t *prev_p);
+char *pack_for_get_from (char *p, void *v, int n, int size, uint64_t *prev_p);
+char *pack_for_skip (char *p, int n);
+size_t pack_for_block_size (const char *p, size_t avail, int m);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __PACK_FOR_H__ */
@@ -0,0 +1,131 @@
+/**
+ *  @file   pack_gen.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  packgenが生成する関数から使うインライン関数。
+ *
+ *  要素数、1要素のバイト数、エンディアン変換の有無は生成したコードでは
+ *  定数になるので、インライン展開されるとmemcpyとbswapだけが残る。
+ */
+#ifndef __PACK_GEN_H__
+#define __PACK_GEN_H__
+
+#include <stdint.h>
+#include <string.h>
+#include "pack.h"
+
+/**
+ *  @brief  n要素をバイト順を逆にして複製する
+ */
+static inline void
+pack_gen_swap (void *d, const void *s, int n, size_t size)
+{
+    char *dp = (char *) d;
+    const char *sp = (const char *) s;
+    int i;
+
+    for (i = 0; i < n; i++, dp += size, sp += size) {
+        switch (size) {
+        case 2: {
+            uint16_t v;
+            memcpy (&v, sp, 2);
+            v = __builtin_bswap16 (v);
+            memcpy (dp, &v, 2);
+            break;
+        }
+        case 4: {
+            uint32_t v;
+            memcpy (&v, sp, 4);
+            v = __builtin_bswap32 (v);
+            memcpy (dp, &v, 4);
+            break;
+        }
+        case 8: {
+            uint64_t v;
+            memcpy (&v, sp, 8);
+            v = __builtin_bswap64 (v);
+            memcpy (dp, &v, 8);
+            break;
+        }
+        default:
+            memcpy (dp, sp, size);
+            break;
+        }
+    }
+}
+
+/**
+ *  @brief  n要素をsaveする(pack_saveの変換しない型と同じバイト列になる)
+ *  @param  p       save先へのポインタ
+ *  @param  v       変数または配列の先頭
+ *  @param  n       要素数(0以下なら何もしない)
+ *  @param  size    1要素のバイト数
+ *  @param  swap    1:エンディアン変換する
+ *  @retval saveされたデータの直後へのポインタ
+ */
+static inline char *
+pack_gen_put (char *p, const void *v, int n, size_t size, int swap)
+{
+    if (n <= 0) {
+        return p;
+    }
+    if (swap && size > 1) {
+        pack_gen_swap (p, v, n, size);
+    }
+    else {
+        memcpy (p, v, (size_t) n * size);
+    }
+    return p + (size_t) n * size;
+}
+
+/**
+ *  @brief  n要素をloadする(pack_loadの変換しない型と同じ)
+ *  @param  p       load元へのポインタ
+ *  @param  v       変数または配列の先頭
+ *  @param  n       要素数(0以下なら何もしない)
+ *  @param  size    1要素のバイト数
+ *  @param  swap    1:エンディアン変換する
+ *  @retval loadされた領域の直後へのポインタ
+ */
+static inline char *
+pack_gen_get (char *p, void *v, int n, size_t size, int swap)
+{
+    if (n <= 0) {
+        return p;
+    }
+    if (swap && size > 1) {
+        pack_gen_swap (v, p, n, size);
+    }
+    else {
+        memcpy (v, p, (size_t) n * size);
+    }
+    return p + (size_t) n * size;
+}
+
+/**
+ *  @brief  位置offをalignバイトの倍数に揃える詰め物のバイト数
+ *  @param  off     bufferの先頭からの位置
+ *  @param  align   境界のバイト数
+ *  @retval バイト数
+ */
+static inline size_t
+pack_gen_align (size_t off, size_t align)
+{
+    return (align - off % align) % align;
+}
+
+/**
+ *  @brief  値0の詰め物を置く(pack_saveの'x', '@'と同じバイト列になる)
+ *  @param  p       save先へのポインタ
+ *  @param  n       バイト数
+ *  @retval 詰め物の直後へのポインタ
+ */
+static inline char *
+pack_gen_pad (char *p, size_t n)
+{
+    memset (p, 0, n);
+    return p + n;
+}
+
+#endif /* __PACK_GEN_H__ */
@@ -0,0 +1,162 @@
+/**
+ *  @file   pack_internal.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  packライブラリ内部で共有する型と関数の宣言
+ */
+#ifndef __PACK_INTERNAL_H__
+#define __PACK_INTERNAL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "pack.h"
+#include "pack_stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 配列の指定方法 */
+#define PACK_SCALAR 0   /* 単独変数 */
+#define PACK_FIXED  1   /* 書式文字列中の数字で要素数を与える */
+#define PACK_VAR    2   /* '#'により要素数を可変引数で与える */
+#define PACK_PREFIX 3   /* '*', 's', 'y'により要素数をデータの前に保存する */
+
+#define PACK_PREFIX_SIZE    4   /* '*'で保存する要素数(uint32_t)のバイト数 */
+#define PACK_GROUP          '(' /* グループを表す項目のtype */
+#define PACK_GROUP_MAX      16  /* 1つのグループの最大の項目数 */
+#define PACK_ALIGN          '@' /* 境界合わせを表す項目のtype(countが境界のバイト数) */
+
+/**
+ *  書式文字列の1項目を解析した結果
+ */
+typedef struct {
+    char type;          /* 型を表す書式文字 */
+    char endian;        /* 1:エンディアン変換する */
+    char mode;          /* PACK_SCALAR, PACK_FIXED, PACK_VAR, PACK_PREFIX */
+    char codec;         /* 配列の圧縮方法('~'または0) */
+    int  count;         /* 要素数(PACK_VAR, PACK_PREFIXの場合は0) */
+    int  size;          /* 1要素のバイト数(グループは1繰り返しのバイト数) */
+    int  bytes;         /* 項目全体のバイト数(PACK_VAR, PACK_PREFIXの場合は0) */
+    int  group;         /* グループの項目数(PACK_GROUPの場合、それ以外は0) */
+    char *body;         /* グループの項目の書式('('の直後)、
+                           planでは項目を直後に並べるのでNULL */
+} pack_op_t;
+
+/**
+ *  pack_compileで作られる解析済みの書式
+ */
+struct pack_plan {
+    int nops;           /* 項目数(グループの中の項目を含む) */
+    int nvar;           /* '#'または'*'を持つ項目数 */
+    int fixed;          /* '#'と'*'を除いた項目の合計バイト数
+                           (nvarが0なら'@'の詰め物を含めた全体のバイト数) */
+    int align;          /* '@'の項目数 */
+    pack_op_t op[1];    /* 項目の配列(nops個、グループの項目はその直後に並ぶ) */
+};
+
+/**
+ *  可変引数から取り出した1項目分のデータ
+ */
+typedef struct {
+    const pack_op_t *op;    /* 項目 */
+    int n;                  /* 要素数 */
+    void *data;             /* 配列の先頭(load時は単独変数の格納先) */
+    union {
+        char c;
+        short h;
+        int i;
+        long l;
+        float f;
+        double d;
+        uint8_t u8;
+        uint16_t u16;
+        uint32_t u32;
+        uint64_t u64;
+    } v;                    /* save時の単独変数の値 */
+    double scale;           /* 固定小数点の倍率 */
+    int *count;             /* '*', 's', 'y'のload時に要素数を格納する先 */
+} pack_field_t;
+
+/**
+ *  @brief  書式文字列の内容のハッシュ(FNV-1a)を求める
+ *  @param  s   書式文字列
+ *  @param  len 書式文字列の長さを格納する領域へのポインタ
+ */
+static inline uint64_t
+pack_hash_string (const char *s, size_t *len)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    const char *p;
+
+    for (p = s; *p != '\0'; p++) {
+        h = (h ^ (unsigned char) *p) * 0x100000001b3ull;
+    }
+    *len = p - s;
+    return h;
+}
+
+/*
+ *  統計(PACK_STATSを定義した場合のみ、pack_stats.cを参照)
+ *  PACK_STATS_START(t)で時刻を変数tに取り、PACK_STATS_ADDで1回分を数える。
+ *  定義しない場合は何も残らない。
+ */
+#ifdef PACK_STATS
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <x86intrin.h>
+#define pack_stats_now() __rdtsc ()
+#else
+#include <time.h>
+static inline uint64_t
+pack_stats_now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+void pack_stats_add (int op, const char *format, size_t bytes, uint64_t start);
+#define PACK_STATS_START(t) uint64_t t = pack_stats_now ()
+#define PACK_STATS_ADD(op, format, bytes, t) pack_stats_add ((op), (format), (bytes), (t))
+#else
+#define PACK_STATS_START(t)
+#define PACK_STATS_ADD(op, format, bytes, t)
+#endif
+
+/*
+ *  書式文字列の解析結果の表(PACK_CACHEを定義した場合のみ、pack_cache.cを参照)
+ *  定義しない場合、pack_cache_getは常にNULLを返す。
+ */
+#define PACK_CACHE_SIZE     256     /* 登録する書式文字列の数 */
+#define PACK_CACHE_MAXLEN   256     /* 登録する書式文字列の最大の長さ */
+#ifdef PACK_CACHE
+const pack_plan_t *pack_cache_get (const char *format);
+#else
+#define pack_cache_get(format) ((const pack_plan_t *) NULL)
+#endif
+
+char *pack_parse_op (char *fp, pack_op_t *op, int *endian);
+size_t pack_op_bytes (const pack_op_t *op, int n);
+int pack_data_size (const pack_op_t *op);
+int pack_op_native (const pack_op_t *op);
+int pack_op_string (const pack_op_t *op);
+int pack_align_pad (const pack_op_t *op, size_t off);
+char *pack_put_pad (char *bp, int n);
+size_t pack_fetch_save (pack_field_t *f, const pack_op_t *op, va_list *ap);
+size_t pack_fetch_load (pack_field_t *f, const pack_op_t *op, va_list *ap);
+int pack_field_size (const pack_field_t *f);
+char *pack_put_field (char *bp, const pack_field_t *f);
+char *pack_get_field (char *bp, const pack_field_t *f);
+const pack_op_t *pack_group_members (const pack_op_t *g, pack_op_t *buf);
+size_t pack_group_put (char *bp, const pack_op_t *g, va_list *ap);
+char *pack_group_get (char *bp, const pack_op_t *g, va_list *ap);
+int pack_format_check (char *format);
+size_t pack_format_put (char *bp, char *format, va_list *ap);
+char *pack_format_get (char *bp, char *format, va_list *ap);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __PACK_INTERNAL_H__ */
@@ -0,0 +1,245 @@
+/**
+ *  @file   pack_iov.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  writev/sendmsg用のscatter-gather出力。
+ *
+ *  単独変数や小さな配列はstage領域にpackし、threshold バイト以上で
+ *  変換の要らない配列(エンディアン変換や圧縮をしないもの)は
+ *  変数の領域をそのままiovecで参照する。大きな配列を複製しないので、
+ *  そのままwritevに渡せばpack_saveと同じバイト列が出力される。
+ *
+ *  参照した配列はwritevが終わるまで書き換えたり解放したりしてはならない。
+ *  '@'は出力全体(len)の先頭からの位置で揃え、詰め物はstageに置く。
+ *
+ *  例）
+ *  struct iovec iov[8];
+ *  char stage[256];
+ *  pack_iov_t v;
+ *  pack_iov_init (&v, iov, 8, stage, sizeof(stage), 4096);
+ *  pack_iov_save (&v, "i i d#", id, n, data, n);
+ *  writev (fd, v.iov, v.iovcnt);
+ */
+#include "pack_iov.h"
+#include "pack_internal.h"
+
+/**
+ *  @ingroup pack
+ *  @brief  scatter-gather出力を初期化する。
+ *  @param  v           scatter-gather出力
+ *  @param  iov         iovecの配列
+ *  @param  iovmax      iovecの配列の要素数
+ *  @param  stage       小さな項目を書き込む領域
+ *  @param  stage_size  stageのバイト数
+ *  @param  threshold   このバイト数以上の配列は参照する
+ */
+void pack_iov_init (pack_iov_t *v, struct iovec *iov, int iovmax,
+                    char *stage, size_t stage_size, size_t threshold)
+{
+    v->iov = iov;
+    v->iovmax = iovmax;
+    v->stage = stage;
+    v->stage_cap = stage_size;
+    v->threshold = threshold;
+    pack_iov_reset (v);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  出力を空にする。iovecとstageは再利用する。
+ *  @param  v   scatter-gather出力
+ */
+void pack_iov_reset (pack_iov_t *v)
+{
+    v->iovcnt = 0;
+    v->stage_len = 0;
+    v->len = 0;
+}
+
+/**
+ *  @brief  iovecを1つ追加する内部関数(直前のiovecと連続していればつなげる)
+ *  @retval 0:成功, -1:iovecが足りない
+ */
+static int
+pack_iov_push (pack_iov_t *v, char *base, size_t len)
+{
+    struct iovec *last;
+
+    if (len == 0) {
+        return 0;
+    }
+    last = (v->iovcnt > 0) ? &v->iov[v->iovcnt - 1] : NULL;
+    if (last != NULL && (char *) last->iov_base + last->iov_len == base) {
+        last->iov_len += len;
+    }
+    else {
+        if (v->iovcnt >= v->iovmax) {
+            return -1;
+        }
+        v->iov[v->iovcnt].iov_base = base;
+        v->iov[v->iovcnt].iov_len = len;
+        v->iovcnt++;
+    }
+    v->len += len;
+    return 0;
+}
+
+/**
+ *  @brief  1項目をstageにpackして出力に加える内部関数
+ *  @param  bytes   項目のバイト数(上限)
+ *  @retval 0:成功, -1:iovecまたはstageが足りない
+ */
+static int
+pack_iov_stage (pack_iov_t *v, const pack_field_t *f, size_t bytes)
+{
+    char *bp, *end;
+
+    if (v->stage_cap - v->stage_len < bytes) {
+        return -1;
+    }
+    bp = v->stage + v->stage_len;
+    end = pack_put_field (bp, f);
+    if (pack_iov_push (v, bp, end - bp) < 0) {
+        return -1;
+    }
+    v->stage_len += end - bp;
+    return 0;
+}
+
+/**
+ *  @brief  グループをstageにpackして出力に加える内部関数
+ *  @retval 0:成功, -1:iovecまたはstageが足りない
+ */
+static int
+pack_iov_stage_group (pack_iov_t *v, const pack_op_t *op, va_list *ap)
+{
+    size_t bytes;
+    va_list aq;
+    char *bp;
+
+    va_copy (aq, *ap);
+    bytes = pack_group_put (NULL, op, &aq);
+    va_end (aq);
+    if (v->stage_cap - v->stage_len < bytes) {
+        return -1;
+    }
+    bp = v->stage + v->stage_len;
+    bytes = pack_group_put (bp, op, ap);
+    if (pack_iov_push (v, bp, bytes) < 0) {
+        return -1;
+    }
+    v->stage_len += bytes;
+    return 0;
+}
+
+/**
+ *  @brief  1項目を取り出して出力に加える内部関数
+ *  @retval 0:成功, -1:iovecまたはstageが足りない
+ */
+static int
+pack_iov_put_op (pack_iov_t *v, const pack_op_t *op, va_list *ap)
+{
+    pack_op_t count = { 'J', 0, PACK_SCALAR, 0, 1, 4, 4, 0, NULL };
+    pack_field_t f, c;
+    size_t bytes;
+
+    if (op->type == PACK_GROUP) {
+        return pack_iov_stage_group (v, op, ap);
+    }
+    if (op->type == PACK_ALIGN) {
+        /* 出力全体の先頭からの位置で揃え、詰め物はstageに置く */
+        f.op = op;
+        f.n = pack_align_pad (op, v->len);
+        return pack_iov_stage (v, &f, f.n);
+    }
+    bytes = pack_fetch_save (&f, op, ap);
+    if (pack_op_native (op) && bytes >= v->threshold) {
+        if (op->mode == PACK_PREFIX) {
+            /* 要素数だけをstageに書き、配列は直接参照する */
+            count.endian = op->endian;
+            c.op = &count;
+            c.n = 1;
+            c.data = &c.v;
+            c.v.u32 = (f.n > 0) ? (uint32_t) f.n : 0;
+            if (pack_iov_stage (v, &c, PACK_PREFIX_SIZE) < 0) {
+                return -1;
+            }
+            bytes -= PACK_PREFIX_SIZE;
+        }
+        return pack_iov_push (v, f.data, bytes);
+    }
+    return pack_iov_stage (v, &f, bytes);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書式文字列に従ってscatter-gather出力にデータを加える。
+ *  @param  v       scatter-gather出力
+ *  @param  format  書式文字列
+ *  @param  ...     saveする変数列(pack_saveと同じ可変引数)
+ *  @retval 0:成功, -1:iovecまたはstageが足りない(出力は呼び出し前に戻る)、
+ *          扱えない書式(errnoはEINVAL)
+ */
+int pack_iov_save (pack_iov_t *v, char *format, ...)
+{
+    pack_iov_t saved = *v;
+    struct iovec last = {NULL, 0};
+    char *fp = format;
+    int endian = 0;
+    pack_op_t op;
+    va_list args;
+
+    if (pack_format_check (format) < 0) {
+        return -1;
+    }
+    if (v->iovcnt > 0) {
+        last = v->iov[v->iovcnt - 1];
+    }
+    va_start (args, format);
+    while ((fp = pack_parse_op (fp, &op, &endian)) != NULL) {
+        if (pack_iov_put_op (v, &op, &args) < 0) {
+            va_end (args);
+            *v = saved;
+            if (v->iovcnt > 0) {
+                v->iov[v->iovcnt - 1] = last;
+            }
+            return -1;
+        }
+    }
+    va_end (args);
+    return 0;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  planに従ってscatter-gather出力にデータを加える。
+ *  @param  v       scatter-gather出力
+ *  @param  plan    解析済みの書式
+ *  @param  ...     saveする変数列(pack_saveと同じ可変引数)
+ *  @retval 0:成功, -1:iovecまたはstageが足りない(出力は呼び出し前に戻る)
+ */
+int pack_iov_save_plan (pack_iov_t *v, const pack_plan_t *plan, ...)
+{
+    pack_iov_t saved = *v;
+    struct iovec last = {NULL, 0};
+    int i;
+    va_list args;
+
+    if (v->iovcnt > 0) {
+        last = v->iov[v->iovcnt - 1];
+    }
+    va_start (args, plan);
+    for (i = 0; i < plan->nops; i += 1 + plan->op[i].group) {
+        if (pack_iov_put_op (v, &plan->op[i], &args) < 0) {
+            va_end (args);
+            *v = saved;
+            if (v->iovcnt > 0) {
+                v->iov[v->iovcnt - 1] = last;
+            }
+            return -1;
+        }
+    }
+    va_end (args);
+    return 0;
+}
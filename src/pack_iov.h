@@ -0,0 +1,40 @@
+/**
+ *  @file   pack_iov.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  writev/sendmsg用のscatter-gather出力の宣言
+ */
+#ifndef __PACK_IOV_H__
+#define __PACK_IOV_H__
+
+#include <sys/uio.h>
+#include "pack.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* scatter-gather出力 */
+typedef struct {
+    struct iovec *iov;  /* iovecの配列 */
+    int iovcnt;         /* 使用中のiovecの数 */
+    int iovmax;         /* iovecの配列の要素数 */
+    char *stage;        /* 小さな項目をまとめて書き込む領域 */
+    size_t stage_len;   /* stageの使用中のバイト数 */
+    size_t stage_cap;   /* stageのバイト数 */
+    size_t threshold;   /* このバイト数以上の配列は複製せずに参照する */
+    size_t len;         /* 全体のバイト数 */
+} pack_iov_t;
+
+void pack_iov_init (pack_iov_t *v, struct iovec *iov, int iovmax,
+                    char *stage, size_t stage_size, size_t threshold);
+void pack_iov_reset (pack_iov_t *v);
+int pack_iov_save (pack_iov_t *v, char *format, ...);
+int pack_iov_save_plan (pack_iov_t *v, const pack_plan_t *plan, ...);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __PACK_IOV_H__ */
@@ -0,0 +1,593 @@
+/**
+ *  @file   pack_jit.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  書式をx86-64の機械語に変換して実行するsave/load。
+ *
+ *  pack_jit_compileは書式を解析し、すべての項目が変換を伴わない型
+ *  (c h i l f d b B w W j J q Q、'~'なし)であれば、save用とload用の関数を
+ *  機械語で生成する。生成した関数は項目毎に引数の構造体から変数の
+ *  アドレスを読み、読み込み、(必要ならbswapして)書き込みを並べただけの
+ *  分岐の無いコードになる。要素数が多い配列と'#'の配列だけはループ
+ *  (エンディアン変換しない場合はmemcpyの呼び出し)にする。
+ *
+ *  x86-64以外の環境、対応しない型を含む書式、実行可能なメモリを
+ *  確保できない環境では、同じ引数をplanの解釈で処理する。どちらの場合も
+ *  結果はpack_save/pack_loadと同じバイト列になる。
+ *
+ *  変数は可変引数ではなく、項目毎のpack_jit_arg_tの配列で渡す。
+ *  単独変数もsave/loadともにアドレスを渡す。
+ *
+ *  例）
+ *  pack_jit_t *jit = pack_jit_compile ("!i4 d f#");
+ *  pack_jit_arg_t args[3] = {{ia}, {&dv}, {fa, 10}};
+ *  bp = pack_jit_save (jit, bp, args);
+ *  pack_jit_free (jit);
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include "pack_jit.h"
+#include "pack_internal.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_X86_64 1
+#include <sys/mman.h>
+#endif
+
+struct pack_jit {
+    pack_plan_t *plan;  /* 解析済みの書式 */
+    char *(*save) (char *, const pack_jit_arg_t *);     /* 生成したsave */
+    char *(*load) (char *, const pack_jit_arg_t *);     /* 生成したload */
+    void *code;         /* 生成した機械語の領域 */
+    size_t code_size;   /* 領域のバイト数 */
+};
+
+#ifdef JIT_X86_64
+
+/* 展開して並べる配列の最大のバイト数(超えるとループにする) */
+#define JIT_UNROLL  256
+
+/* レジスタの番号 */
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RSI = 6, RDI = 7, R12 = 12, R13 = 13 };
+
+/* 機械語を書き込む領域(capを超えた分は長さだけ数える) */
+typedef struct {
+    unsigned char *p;
+    size_t len;
+    size_t cap;
+} jit_code_t;
+
+static void
+jit_byte (jit_code_t *c, int b)
+{
+    if (c->len < c->cap) {
+        c->p[c->len] = (unsigned char) b;
+    }
+    c->len++;
+}
+
+static void
+jit_u32 (jit_code_t *c, uint32_t v)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        jit_byte (c, (v >> (8 * i)) & 0xff);
+    }
+}
+
+static void
+jit_u64 (jit_code_t *c, uint64_t v)
+{
+    jit_u32 (c, (uint32_t) v);
+    jit_u32 (c, (uint32_t) (v >> 32));
+}
+
+/**
+ *  @brief  REXプレフィックス(必要な場合のみ)
+ *  @param  w       1:64ビットの演算
+ *  @param  reg     ModRMのreg側のレジスタ
+ *  @param  rm      ModRMのrm側(または命令に埋め込む)レジスタ
+ */
+static void
+jit_rex (jit_code_t *c, int w, int reg, int rm)
+{
+    int rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+
+    if (rex != 0x40) {
+        jit_byte (c, rex);
+    }
+}
+
+/* ModRM: [base + disp32] */
+static void
+jit_mem (jit_code_t *c, int reg, int base, int32_t disp)
+{
+    jit_byte (c, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        jit_byte (c, 0x24);
+    }
+    jit_u32 (c, (uint32_t) disp);
+}
+
+/* ModRM: レジスタ同士 */
+static void
+jit_modrm (jit_code_t *c, int reg, int rm)
+{
+    jit_byte (c, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* [base + disp]からsizeバイトをregへ読む(上位は0になる) */
+static void
+jit_load (jit_code_t *c, int size, int reg, int base, int32_t disp)
+{
+    jit_rex (c, size == 8, reg, base);
+    switch (size) {
+    case 1: jit_byte (c, 0x0f); jit_byte (c, 0xb6); break;    /* movzx r32, r/m8 */
+    case 2: jit_byte (c, 0x0f); jit_byte (c, 0xb7); break;    /* movzx r32, r/m16 */
+    default: jit_byte (c, 0x8b); break;                        /* mov r, r/m */
+    }
+    jit_mem (c, reg, base, disp);
+}
+
+/* regの下位sizeバイトを[base + disp]へ書く(regはRAX〜RBXに限る) */
+static void
+jit_store (jit_code_t *c, int size, int reg, int base, int32_t disp)
+{
+    if (size == 2) {
+        jit_byte (c, 0x66);
+    }
+    jit_rex (c, size == 8, reg, base);
+    jit_byte (c, (size == 1) ? 0x88 : 0x89);
+    jit_mem (c, reg, base, disp);
+}
+
+/* regの下位sizeバイトのバイト順を逆にする */
+static void
+jit_bswap (jit_code_t *c, int size, int reg)
+{
+    if (size == 2) {
+        /* rol r16, 8 */
+        jit_byte (c, 0x66);
+        jit_rex (c, 0, 0, reg);
+        jit_byte (c, 0xc1);
+        jit_modrm (c, 0, reg);
+        jit_byte (c, 8);
+        return;
+    }
+    jit_rex (c, size == 8, 0, reg);
+    jit_byte (c, 0x0f);
+    jit_byte (c, 0xc8 + (reg & 7));
+}
+
+/* mov dst, src */
+static void
+jit_mov (jit_code_t *c, int dst, int src)
+{
+    jit_rex (c, 1, src, dst);
+    jit_byte (c, 0x89);
+    jit_modrm (c, src, dst);
+}
+
+/* mov reg, imm32(符号拡張) */
+static void
+jit_mov_imm32 (jit_code_t *c, int reg, int32_t v)
+{
+    jit_rex (c, 1, 0, reg);
+    jit_byte (c, 0xc7);
+    jit_modrm (c, 0, reg);
+    jit_u32 (c, (uint32_t) v);
+}
+
+/* mov reg, imm64 */
+static void
+jit_mov_imm64 (jit_code_t *c, int reg, uint64_t v)
+{
+    jit_rex (c, 1, 0, reg);
+    jit_byte (c, 0xb8 + (reg & 7));
+    jit_u64 (c, v);
+}
+
+/* movsxd reg, dword [base + disp] */
+static void
+jit_movsxd (jit_code_t *c, int reg, int base, int32_t disp)
+{
+    jit_rex (c, 1, reg, base);
+    jit_byte (c, 0x63);
+    jit_mem (c, reg, base, disp);
+}
+
+/* add reg, imm32 */
+static void
+jit_add_imm (jit_code_t *c, int reg, int32_t v)
+{
+    jit_rex (c, 1, 0, reg);
+    jit_byte (c, 0x81);
+    jit_modrm (c, 0, reg);
+    jit_u32 (c, (uint32_t) v);
+}
+
+/* add dst, src */
+static void
+jit_add (jit_code_t *c, int dst, int src)
+{
+    jit_rex (c, 1, src, dst);
+    jit_byte (c, 0x01);
+    jit_modrm (c, src, dst);
+}
+
+/* shl reg, imm8 */
+static void
+jit_shl (jit_code_t *c, int reg, int bits)
+{
+    jit_rex (c, 1, 0, reg);
+    jit_byte (c, 0xc1);
+    jit_modrm (c, 4, reg);
+    jit_byte (c, bits);
+}
+
+/* test reg, reg */
+static void
+jit_test (jit_code_t *c, int reg)
+{
+    jit_rex (c, 1, reg, reg);
+    jit_byte (c, 0x85);
+    jit_modrm (c, reg, reg);
+}
+
+/* dec reg */
+static void
+jit_dec (jit_code_t *c, int reg)
+{
+    jit_rex (c, 1, 0, reg);
+    jit_byte (c, 0xff);
+    jit_modrm (c, 1, reg);
+}
+
+static void
+jit_push (jit_code_t *c, int reg)
+{
+    jit_rex (c, 0, 0, reg);
+    jit_byte (c, 0x50 + (reg & 7));
+}
+
+static void
+jit_pop (jit_code_t *c, int reg)
+{
+    jit_rex (c, 0, 0, reg);
+    jit_byte (c, 0x58 + (reg & 7));
+}
+
+/**
+ *  @brief  条件分岐(0x0f 0x80+cc rel32)
+ *  @param  target  飛び先(-1なら後でjit_patchで埋める)
+ *  @retval rel32の位置
+ */
+static size_t
+jit_jcc (jit_code_t *c, int cc, long target)
+{
+    size_t at;
+
+    jit_byte (c, 0x0f);
+    jit_byte (c, 0x80 + cc);
+    at = c->len;
+    jit_u32 (c, (target < 0) ? 0 : (uint32_t) (target - (long) (at + 4)));
+    return at;
+}
+
+/* jit_jccのrel32をtargetへの相対位置にする */
+static void
+jit_patch (jit_code_t *c, size_t at, size_t target)
+{
+    uint32_t rel = (uint32_t) ((long) target - (long) (at + 4));
+    int i;
+
+    for (i = 0; i < 4 && at + i < c->cap; i++) {
+        c->p[at + i] = (rel >> (8 * i)) & 0xff;
+    }
+}
+
+#define JIT_JLE 0xe
+#define JIT_JNE 0x5
+
+/**
+ *  @brief  [src + soff]から[dst + doff]へbytesバイトを複製する
+ */
+static void
+jit_copy (jit_code_t *c, int dst, int32_t doff, int src, int32_t soff, int bytes)
+{
+    int s;
+
+    for (s = 8; s > 0; s /= 2) {
+        for (; bytes >= s; bytes -= s, soff += s, doff += s) {
+            jit_load (c, s, RDX, src, soff);
+            jit_store (c, s, RDX, dst, doff);
+        }
+    }
+}
+
+/**
+ *  @brief  [src + soff]から[dst + doff]へn要素をバイト順を逆にして複製する
+ */
+static void
+jit_copy_swap (jit_code_t *c, int dst, int32_t doff, int src, int32_t soff, int n, int size)
+{
+    for (; n > 0; n--, soff += size, doff += size) {
+        jit_load (c, size, RDX, src, soff);
+        jit_bswap (c, size, RDX);
+        jit_store (c, size, RDX, dst, doff);
+    }
+}
+
+/**
+ *  @brief  1項目のsaveまたはloadを生成する
+ *
+ *  RBXはバッファの位置(boffだけ進んでいない)、R12は引数の配列を指す。
+ *
+ *  @param  k       項目の番号
+ *  @param  save    1:save, 0:load
+ *  @param  boff    RBXからのバッファの位置
+ */
+static void
+jit_op (jit_code_t *c, const pack_op_t *op, int k, int save, int32_t *boff)
+{
+    int32_t arg = k * (int32_t) sizeof(pack_jit_arg_t);
+    int swap = op->endian && op->size > 1;
+    int src = save ? RAX : RBX;
+    int dst = save ? RBX : RAX;
+    size_t skip, top;
+
+    jit_load (c, 8, RAX, R12, arg + (int32_t) offsetof (pack_jit_arg_t, data));
+    if (op->mode != PACK_VAR && op->bytes <= JIT_UNROLL) {
+        /* 並べて書く */
+        if (swap) {
+            jit_copy_swap (c, dst, save ? *boff : 0, src, save ? 0 : *boff, op->count, op->size);
+        }
+        else {
+            jit_copy (c, dst, save ? *boff : 0, src, save ? 0 : *boff, op->bytes);
+        }
+        *boff += op->bytes;
+        return;
+    }
+
+    /* 要素数をRCXに入れてループにする */
+    if (*boff != 0) {
+        jit_add_imm (c, RBX, *boff);
+        *boff = 0;
+    }
+    if (op->mode == PACK_VAR) {
+        jit_movsxd (c, RCX, R12, arg + (int32_t) offsetof (pack_jit_arg_t, n));
+    }
+    else {
+        jit_mov_imm32 (c, RCX, op->count);
+    }
+    jit_test (c, RCX);
+    skip = jit_jcc (c, JIT_JLE, -1);
+    if (!swap) {
+        /* memcpy (dst, src, n * size) */
+        if (op->size > 1) {
+            jit_shl (c, RCX, __builtin_ctz (op->size));
+        }
+        jit_mov (c, R13, RCX);
+        jit_mov (c, RDX, RCX);
+        jit_mov (c, RDI, dst);
+        jit_mov (c, RSI, src);
+        jit_mov_imm64 (c, RAX, (uint64_t) (uintptr_t) memcpy);
+        jit_byte (c, 0xff);     /* call rax */
+        jit_modrm (c, 2, RAX);
+        jit_add (c, RBX, R13);
+    }
+    else {
+        top = c->len;
+        jit_copy_swap (c, dst, 0, src, 0, 1, op->size);
+        jit_add_imm (c, RAX, op->size);
+        jit_add_imm (c, RBX, op->size);
+        jit_dec (c, RCX);
+        jit_jcc (c, JIT_JNE, (long) top);
+    }
+    jit_patch (c, skip, c->len);
+}
+
+/**
+ *  @brief  char *fn (char *buffer, const pack_jit_arg_t *args)を生成する
+ */
+static void
+jit_function (jit_code_t *c, const pack_plan_t *plan, int save)
+{
+    int32_t boff = 0;
+    int i;
+
+    /* 呼び出し先保存のレジスタを使う(3つ積むとスタックが16バイト境界になる) */
+    jit_push (c, RBX);
+    jit_push (c, R12);
+    jit_push (c, R13);
+    jit_mov (c, RBX, RDI);
+    jit_mov (c, R12, RSI);
+    for (i = 0; i < plan->nops; i++) {
+        jit_op (c, &plan->op[i], i, save, &boff);
+    }
+    /* lea rax, [rbx + boff] */
+    jit_rex (c, 1, RAX, RBX);
+    jit_byte (c, 0x8d);
+    jit_mem (c, RAX, RBX, boff);
+    jit_pop (c, R13);
+    jit_pop (c, R12);
+    jit_pop (c, RBX);
+    jit_byte (c, 0xc3);
+}
+
+/**
+ *  @brief  planのsave/loadを機械語にする内部関数
+ *  @retval 0:成功, -1:対応しない型を含む、またはメモリを確保できない
+ */
+static int
+jit_build (pack_jit_t *jit)
+{
+    const pack_plan_t *plan = jit->plan;
+    jit_code_t c = { NULL, 0, 0 };
+    size_t save_len;
+    int i;
+
+    for (i = 0; i < plan->nops; i++) {
+        if (plan->op[i].codec != 0 || strchr ("chilfdbBwWjJqQ", plan->op[i].type) == NULL) {
+            return -1;
+        }
+    }
+    /* 長さを数えてから書き込む */
+    jit_function (&c, plan, 1);
+    save_len = c.len;
+    jit_function (&c, plan, 0);
+    jit->code_size = c.len;
+    jit->code = mmap (NULL, jit->code_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        jit->code = NULL;
+        return -1;
+    }
+    c.p = jit->code;
+    c.len = 0;
+    c.cap = jit->code_size;
+    jit_function (&c, plan, 1);
+    jit_function (&c, plan, 0);
+    if (mprotect (jit->code, jit->code_size, PROT_READ | PROT_EXEC) < 0) {
+        munmap (jit->code, jit->code_size);
+        jit->code = NULL;
+        return -1;
+    }
+    jit->save = (char *(*) (char *, const pack_jit_arg_t *)) jit->code;
+    jit->load = (char *(*) (char *, const pack_jit_arg_t *)) ((char *) jit->code + save_len);
+    return 0;
+}
+
+#endif /* JIT_X86_64 */
+
+/**
+ *  @brief  引数の構造体から1項目分のデータを取り出す内部関数
+ */
+static INLINE void
+jit_field (pack_field_t *f, const pack_op_t *op, const pack_jit_arg_t *a)
+{
+    f->op = op;
+    f->data = a->data;
+    f->n = (op->mode == PACK_VAR) ? a->n : op->count;
+    f->scale = a->scale;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書式を解析し、可能であれば機械語に変換する。
+ *  @param  format  書式文字列
+ *  @retval 変換した書式、メモリが確保できなければNULL、
+ *          '*'の配列、グループ、'x', '@'を含めばNULL(errnoはEINVAL)
+ */
+pack_jit_t* pack_jit_compile (char *format)
+{
+    pack_jit_t *jit = calloc (1, sizeof(pack_jit_t));
+    int i;
+
+    if (jit == NULL) {
+        return NULL;
+    }
+    jit->plan = pack_compile (format);
+    if (jit->plan == NULL) {
+        free (jit);
+        return NULL;
+    }
+    for (i = 0; i < jit->plan->nops; i++) {
+        if (jit->plan->op[i].mode == PACK_PREFIX || jit->plan->op[i].type == PACK_GROUP
+            || jit->plan->op[i].type == 'x' || jit->plan->op[i].type == PACK_ALIGN) {
+            /* 項目毎の引数では要素数を返せず、グループの配列も渡せない。
+               詰め物は引数と対応しない */
+            pack_jit_free (jit);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+#ifdef JIT_X86_64
+    jit_build (jit);
+#endif
+    return jit;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  pack_jit_compileで作った書式を解放する。
+ *  @param  jit     変換した書式(NULLの場合は何もしない)
+ */
+void pack_jit_free (pack_jit_t *jit)
+{
+    if (jit == NULL) {
+        return;
+    }
+#ifdef JIT_X86_64
+    if (jit->code != NULL) {
+        munmap (jit->code, jit->code_size);
+    }
+#endif
+    pack_plan_free (jit->plan);
+    free (jit);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  機械語に変換されたかを返す。
+ *  @param  jit     変換した書式
+ *  @retval 1:機械語で実行する, 0:planを解釈して実行する
+ */
+int pack_jit_native (const pack_jit_t *jit)
+{
+    return jit->save != NULL;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  変換した書式に従ってbufferにデータをパックする。
+ *  @param  buffer  データ領域の先頭へのポインタ
+ *  @param  jit     変換した書式
+ *  @param  args    項目毎の変数(項目数の要素を持つ配列)
+ *  @retval buffer内にsaveされたデータの直後へのポインタ
+ */
+char* pack_jit_save (const pack_jit_t *jit, char *buffer, const pack_jit_arg_t *args)
+{
+    const pack_plan_t *plan = jit->plan;
+    pack_field_t f;
+    int i;
+
+    if (jit->save != NULL) {
+        return jit->save (buffer, args);
+    }
+    for (i = 0; i < plan->nops; i++) {
+        jit_field (&f, &plan->op[i], &args[i]);
+        if (plan->op[i].mode == PACK_SCALAR) {
+            memcpy (&f.v, args[i].data, pack_data_size (&plan->op[i]));
+        }
+        buffer = pack_put_field (buffer, &f);
+    }
+    return buffer;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  変換した書式に従ってbufferから変数へデータをloadする。
+ *  @param  buffer  データ領域の先頭へのポインタ
+ *  @param  jit     変換した書式
+ *  @param  args    項目毎の格納先(項目数の要素を持つ配列)
+ *  @retval buffer内からloadされた領域の直後へのポインタ
+ */
+char* pack_jit_load (const pack_jit_t *jit, char *buffer, const pack_jit_arg_t *args)
+{
+    const pack_plan_t *plan = jit->plan;
+    pack_field_t f;
+    int i;
+
+    if (jit->load != NULL) {
+        return jit->load (buffer, args);
+    }
+    for (i = 0; i < plan->nops; i++) {
+        jit_field (&f, &plan->op[i], &args[i]);
+        buffer = pack_get_field (buffer, &f);
+    }
+    return buffer;
+}
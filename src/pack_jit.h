@@ -0,0 +1,37 @@
+/**
+ *  @file   pack_jit.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  書式をx86-64の機械語に変換して実行するsave/loadの宣言
+ */
+#ifndef __PACK_JIT_H__
+#define __PACK_JIT_H__
+
+#include "pack.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 機械語に変換した書式(内容は非公開) */
+typedef struct pack_jit pack_jit_t;
+
+/* pack_jit_save/pack_jit_loadに渡す1項目分の引数 */
+typedef struct {
+    void *data;         /* 変数(単独変数の場合も)または配列の先頭 */
+    int n;              /* '#'の項目の要素数(それ以外は使わない) */
+    double scale;       /* 固定小数点(r, R, t, T)の倍率 */
+} pack_jit_arg_t;
+
+pack_jit_t* pack_jit_compile (char *format);
+void pack_jit_free (pack_jit_t *jit);
+int pack_jit_native (const pack_jit_t *jit);
+char* pack_jit_save (const pack_jit_t *jit, char *buffer, const pack_jit_arg_t *args);
+char* pack_jit_load (const pack_jit_t *jit, char *buffer, const pack_jit_arg_t *args);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __PACK_JIT_H__ */
@@ -0,0 +1,633 @@
+/**
+ *  @file   pack_log.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  mmapで開く追記専用のレコードログ。
+ *
+ *  データファイルは16バイトのヘッダの後に、PACK_LOG_ALIGNバイト境界から
+ *  始まるレコードを並べたもの。各レコードは
+ *
+ *	4バイト     内容のバイト数 len
+ *	4バイト     lenと内容のCRC32C
+ *	lenバイト   内容(pack_saveした1メッセージ)
+ *
+ *  で、数値はホストのバイト順。内容もPACK_LOG_ALIGNバイト境界から始まる
+ *  ので、pack_viewで配列を直接参照できることが多い。
+ *
+ *  索引ファイル(データファイル名 + ".idx")は各レコードの位置を
+ *  uint64_tで並べたもので、N番目のレコードをO(1)で取り出すのに使う。
+ *  索引はデータから作り直せるので、開く時に索引の末尾が壊れていたり
+ *  足りなかったりすれば、データファイルを走査して補う。
+ *
+ *  追記はレコードの内容を写像に書いてからヘッダを書く。プロセスが
+ *  途中で落ちても、ヘッダの無いレコードは無視される。電源断などで
+ *  書き込みが途中で切れたレコードはCRCで検出し、そこから後を捨てる。
+ *  pack_log_syncはデータをmsyncしてから索引を書く。sync_everyを
+ *  設定すると、その数のレコードを追記する毎にpack_log_syncする。
+ *
+ *  例）
+ *  pack_log_t g;
+ *  pack_log_open (&g, "data.log", PACK_LOG_WRITE);
+ *  pack_log_append (&g, "i d#", n, data, n);
+ *  pack_log_close (&g);
+ *
+ *  pack_log_open (&g, "data.log", PACK_LOG_READ);
+ *  for (i = 0; i < g.count; i++) {
+ *      pack_load (pack_log_get (&g, i, NULL), "i", &n);
+ *  }
+ *
+ *  pack_log_getが返すポインタは、追記で写像が広がると無効になる。
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pack_log.h"
+#include "pack_internal.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define PACK_LOG_X86 1
+#include <immintrin.h>
+#endif
+
+/* データファイルのヘッダ */
+#define LOG_MAGIC       "PACKLOG1"
+#define LOG_HEAD        16
+/* レコードのヘッダのバイト数(pack_scan_bufferのPACK_SCAN_FRAMEと同じ) */
+#define LOG_FRAME       8
+/* 写像を広げる最小のバイト数 */
+#define LOG_GROW        (1 << 20)
+
+#define LOG_ALIGN(x)    (((x) + PACK_LOG_ALIGN - 1) & ~(size_t) (PACK_LOG_ALIGN - 1))
+
+/* CRC32C(Castagnoli)の生成多項式(ビット反転) */
+#define LOG_CRC_POLY    0x82F63B78u
+
+static uint32_t log_crc_table[256];
+
+/**
+ *  @brief  CRC32Cを求める(表引き版)
+ */
+static uint32_t
+log_crc_table_sw (uint32_t c, const unsigned char *p, size_t n)
+{
+    while (n-- > 0) {
+        c = log_crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+    }
+    return c;
+}
+
+#ifdef PACK_LOG_X86
+
+/**
+ *  @brief  CRC32Cを求める(SSE4.2のcrc32命令版)
+ */
+__attribute__((target("sse4.2")))
+static uint32_t
+log_crc_sse42 (uint32_t c, const unsigned char *p, size_t n)
+{
+    uint64_t c64 = c, w;
+
+    for (; n >= 8; n -= 8, p += 8) {
+        memcpy (&w, p, 8);
+        c64 = _mm_crc32_u64 (c64, w);
+    }
+    c = (uint32_t) c64;
+    while (n-- > 0) {
+        c = _mm_crc32_u8 (c, *p++);
+    }
+    return c;
+}
+
+#endif /* PACK_LOG_X86 */
+
+typedef uint32_t (*log_crc_t) (uint32_t, const unsigned char *, size_t);
+
+static uint32_t log_crc_init (uint32_t c, const unsigned char *p, size_t n);
+
+/* 実行中のCPUで使うCRCの実装(初回呼び出し時に決まる) */
+static log_crc_t log_crc_kernel = log_crc_init;
+
+static uint32_t
+log_crc_init (uint32_t c, const unsigned char *p, size_t n)
+{
+    log_crc_t k = log_crc_table_sw;
+    uint32_t i, v;
+    int j;
+
+    for (i = 0; i < 256; i++) {
+        v = i;
+        for (j = 0; j < 8; j++) {
+            v = (v & 1) ? (v >> 1) ^ LOG_CRC_POLY : v >> 1;
+        }
+        log_crc_table[i] = v;
+    }
+#ifdef PACK_LOG_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("sse4.2")) {
+        k = log_crc_sse42;
+    }
+#endif
+    log_crc_kernel = k;
+    return k (c, p, n);
+}
+
+/**
+ *  @brief  レコードのCRCを求める内部関数
+ *  @param  rec レコードの先頭(lenを書いた後)
+ *  @param  len 内容のバイト数
+ */
+static uint32_t
+log_crc (const char *rec, uint32_t len)
+{
+    uint32_t c = ~0u;
+
+    c = log_crc_kernel (c, (const unsigned char *) rec, 4);
+    c = log_crc_kernel (c, (const unsigned char *) rec + LOG_FRAME, len);
+    return ~c;
+}
+
+/**
+ *  @brief  offにある正しいレコードの直後の位置を返す内部関数
+ *  @param  map     データファイルの写像
+ *  @param  off     レコードの位置
+ *  @param  limit   データファイルの有効なバイト数
+ *  @param  verify  1:CRCを確かめる
+ *  @retval 次のレコードの位置、正しいレコードが無ければ0
+ */
+static size_t
+log_check (const char *map, size_t off, size_t limit, int verify)
+{
+    uint32_t len, crc;
+
+    if (off < LOG_HEAD || off % PACK_LOG_ALIGN != 0
+        || off > limit || limit - off < LOG_FRAME) {
+        return 0;
+    }
+    memcpy (&len, map + off, 4);
+    memcpy (&crc, map + off + 4, 4);
+    if (len > limit - off - LOG_FRAME) {
+        return 0;
+    }
+    if (verify && crc != log_crc (map + off, len)) {
+        return 0;
+    }
+    return LOG_ALIGN (off + LOG_FRAME + len);
+}
+
+/**
+ *  @brief  索引の末尾にレコードの位置を加える内部関数
+ *  @retval 0:成功, -1:メモリ不足
+ */
+static int
+log_index_push (pack_log_t *g, uint64_t off)
+{
+    if (g->count == g->index_cap) {
+        size_t cap = (g->index_cap < 1024) ? 1024 : g->index_cap * 2;
+        uint64_t *p = realloc (g->index, cap * sizeof(uint64_t));
+        if (p == NULL) {
+            return -1;
+        }
+        g->index = p;
+        g->index_cap = cap;
+    }
+    g->index[g->count++] = off;
+    return 0;
+}
+
+/**
+ *  @brief  索引ファイルを読み、データと食い違う末尾を捨てる内部関数
+ *  @param  limit   データファイルのバイト数
+ *  @retval 0:成功, -1:失敗
+ */
+static int
+log_index_load (pack_log_t *g, size_t limit)
+{
+    struct stat st;
+    size_t n, i;
+    ssize_t r;
+
+    if (g->ifd < 0 || fstat (g->ifd, &st) < 0) {
+        return 0;
+    }
+    n = st.st_size / sizeof(uint64_t);
+    if (n == 0) {
+        return 0;
+    }
+    g->index = malloc (n * sizeof(uint64_t));
+    if (g->index == NULL) {
+        return -1;
+    }
+    g->index_cap = n;
+    r = pread (g->ifd, g->index, n * sizeof(uint64_t), 0);
+    if (r < 0) {
+        return -1;
+    }
+    n = r / sizeof(uint64_t);
+    /* 位置が増えていき、レコードの枠がデータに収まる所まで使う */
+    for (i = 0; i < n; i++) {
+        if ((i > 0 && g->index[i] <= g->index[i - 1])
+            || log_check (g->map, g->index[i], limit, 0) == 0) {
+            break;
+        }
+    }
+    /* 書き込みが途中で切れたかもしれない最後のレコードはCRCを確かめる */
+    while (i > 0 && log_check (g->map, g->index[i - 1], limit, 1) == 0) {
+        i--;
+    }
+    g->count = i;
+    g->index_saved = i;
+    return 0;
+}
+
+/**
+ *  @brief  データファイルを写像し直す内部関数
+ *  @param  len 写像するバイト数(ファイルもこの大きさにする)
+ *  @retval 0:成功, -1:失敗
+ */
+static int
+log_map (pack_log_t *g, size_t len)
+{
+    char *map;
+
+    if (g->writable && ftruncate (g->fd, len) < 0) {
+        return -1;
+    }
+    map = mmap (NULL, len, g->writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                MAP_SHARED, g->fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    if (g->map != NULL) {
+        munmap (g->map, g->map_len);
+    }
+    g->map = map;
+    g->map_len = len;
+    return 0;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  レコードログを開く。
+ *  @param  g       レコードログ
+ *  @param  path    データファイルのパス(索引ファイルは末尾に".idx"を加えたもの)
+ *  @param  flags   PACK_LOG_READまたはPACK_LOG_WRITE
+ *  @retval 0:成功, -1:失敗
+ */
+int pack_log_open (pack_log_t *g, const char *path, int flags)
+{
+    struct stat st;
+    char *ipath;
+    size_t limit, next;
+
+    memset (g, 0, sizeof(*g));
+    g->ifd = -1;
+    g->writable = (flags & PACK_LOG_WRITE) != 0;
+    g->fd = open (path, g->writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (g->fd < 0) {
+        return -1;
+    }
+    if (fstat (g->fd, &st) < 0) {
+        goto fail;
+    }
+    if (st.st_size == 0 && g->writable) {
+        char head[LOG_HEAD] = LOG_MAGIC;
+        if (pwrite (g->fd, head, LOG_HEAD, 0) != LOG_HEAD) {
+            goto fail;
+        }
+        st.st_size = LOG_HEAD;
+    }
+    limit = st.st_size;
+    if (limit < LOG_HEAD) {
+        errno = EINVAL;
+        goto fail;
+    }
+    g->writable = 0;
+    if (log_map (g, limit) < 0) {
+        goto fail;
+    }
+    g->writable = (flags & PACK_LOG_WRITE) != 0;
+    if (memcmp (g->map, LOG_MAGIC, 8) != 0) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    ipath = malloc (strlen (path) + 5);
+    if (ipath == NULL) {
+        goto fail;
+    }
+    strcpy (ipath, path);
+    strcat (ipath, ".idx");
+    g->ifd = open (ipath, g->writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    free (ipath);
+    if (g->ifd < 0 && g->writable) {
+        goto fail;
+    }
+    if (log_index_load (g, limit) < 0) {
+        goto fail;
+    }
+    /* 索引に無いレコードをデータファイルから探す */
+    g->end = (g->count > 0) ? log_check (g->map, g->index[g->count - 1], limit, 0) : LOG_HEAD;
+    while ((next = log_check (g->map, g->end, limit, 1)) != 0) {
+        if (log_index_push (g, g->end) < 0) {
+            goto fail;
+        }
+        g->end = next;
+    }
+    g->synced = g->end;
+    if (g->writable) {
+        /* 壊れたレコードより後ろは捨てる */
+        if (ftruncate (g->ifd, g->index_saved * sizeof(uint64_t)) < 0
+            || log_map (g, g->end) < 0) {
+            goto fail;
+        }
+    }
+    return 0;
+
+ fail:
+    {
+        int e = errno;
+        if (g->map != NULL) {
+            munmap (g->map, g->map_len);
+        }
+        if (g->ifd >= 0) {
+            close (g->ifd);
+        }
+        close (g->fd);
+        free (g->index);
+        memset (g, 0, sizeof(*g));
+        g->fd = g->ifd = -1;
+        errno = e;
+    }
+    return -1;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  追記したレコードをmsyncし、索引ファイルに書く。
+ *  @param  g   レコードログ
+ *  @retval 0:成功, -1:失敗
+ */
+int pack_log_sync (pack_log_t *g)
+{
+    size_t page = sysconf (_SC_PAGESIZE);
+    size_t start = g->synced & ~(page - 1);
+    size_t n = g->count - g->index_saved;
+
+    if (!g->writable) {
+        return 0;
+    }
+    if (g->end > start && msync (g->map + start, g->end - start, MS_SYNC) < 0) {
+        return -1;
+    }
+    g->synced = g->end;
+    if (n > 0) {
+        size_t bytes = n * sizeof(uint64_t);
+        if (pwrite (g->ifd, g->index + g->index_saved, bytes,
+                    g->index_saved * sizeof(uint64_t)) != (ssize_t) bytes
+            || fdatasync (g->ifd) < 0) {
+            return -1;
+        }
+        g->index_saved = g->count;
+    }
+    return 0;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  レコードログを閉じる。追記できる場合はsyncしてから閉じる。
+ *  @param  g   レコードログ
+ *  @retval 0:成功, -1:syncまたはファイルの切り詰めに失敗
+ */
+int pack_log_close (pack_log_t *g)
+{
+    int r = 0;
+
+    if (g->writable) {
+        r = pack_log_sync (g);
+    }
+    if (g->map != NULL) {
+        munmap (g->map, g->map_len);
+    }
+    /* 写像を広げるために伸ばした分を戻す */
+    if (g->writable && ftruncate (g->fd, g->end) < 0) {
+        r = -1;
+    }
+    if (g->ifd >= 0) {
+        close (g->ifd);
+    }
+    close (g->fd);
+    free (g->index);
+    memset (g, 0, sizeof(*g));
+    g->fd = g->ifd = -1;
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  次のレコードの内容を書き込む領域を確保する。
+ *
+ *  確保した領域にsaveしてから、実際のバイト数をpack_log_commitに渡す。
+ *
+ *  @param  g       レコードログ
+ *  @param  size    内容のバイト数の上限
+ *  @retval 内容を書き込む領域(PACK_LOG_ALIGNバイト境界)、失敗した場合はNULL
+ */
+char* pack_log_reserve (pack_log_t *g, size_t size)
+{
+    size_t need = g->end + LOG_FRAME + size;
+
+    if (!g->writable || size > UINT32_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (need > g->map_len) {
+        size_t len = g->map_len * 2;
+        size_t page = sysconf (_SC_PAGESIZE);
+        if (len < g->map_len + LOG_GROW) {
+            len = g->map_len + LOG_GROW;
+        }
+        if (len < need) {
+            len = need;
+        }
+        len = (len + page - 1) & ~(page - 1);
+        if (log_map (g, len) < 0) {
+            return NULL;
+        }
+    }
+    g->reserved = size;
+    return g->map + g->end + LOG_FRAME;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  pack_log_reserveで確保した領域をレコードとして追記する。
+ *  @param  g   レコードログ
+ *  @param  len 内容のバイト数(確保したバイト数以下)
+ *  @retval 0:成功, -1:失敗
+ */
+int pack_log_commit (pack_log_t *g, size_t len)
+{
+    char *rec = g->map + g->end;
+    uint32_t n = (uint32_t) len, crc;
+
+    if (len > g->reserved) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (log_index_push (g, g->end) < 0) {
+        return -1;
+    }
+    memcpy (rec, &n, 4);
+    crc = log_crc (rec, n);
+    memcpy (rec + 4, &crc, 4);
+    g->end = LOG_ALIGN (g->end + LOG_FRAME + len);
+    g->reserved = 0;
+    if (g->sync_every > 0 && g->count % g->sync_every == 0) {
+        return pack_log_sync (g);
+    }
+    return 0;
+}
+
+/**
+ *  @brief  書式文字列またはplanから次の項目を取り出す内部関数
+ *  @retval 項目、無ければNULL
+ */
+static const pack_op_t *
+log_next_op (char **fp, pack_op_t *op, int *endian, const pack_op_t *ops, int nops, int *i)
+{
+    const pack_op_t *o;
+
+    if (ops != NULL) {
+        if (*i >= nops) {
+            return NULL;
+        }
+        o = &ops[*i];
+        *i += 1 + o->group;
+        return o;
+    }
+    *fp = pack_parse_op (*fp, op, endian);
+    return (*fp != NULL) ? op : NULL;
+}
+
+/**
+ *  @brief  可変引数の項目をレコードとして追記する内部関数
+ *  @param  format  書式文字列(opsを与える場合はNULL)
+ *  @param  ops     解析済みの項目の配列
+ *  @param  nops    項目数
+ *  @param  ap      saveする変数の可変引数
+ *  @retval 0:成功, -1:失敗
+ */
+static int
+log_append (pack_log_t *g, char *format, const pack_op_t *ops, int nops, va_list *ap)
+{
+    const pack_op_t *o;
+    pack_field_t f;
+    pack_op_t op;
+    va_list aq;
+    size_t bound = 0;
+    char *fp = format, *p, *bp;
+    int endian = 0, i = 0;
+
+    /* 1回目は上限を求め、2回目に確保した領域へsaveする */
+    va_copy (aq, *ap);
+    while ((o = log_next_op (&fp, &op, &endian, ops, nops, &i)) != NULL) {
+        if (o->type == PACK_ALIGN) {
+            bound += o->count - 1;
+            continue;
+        }
+        bound += (o->type == PACK_GROUP) ? pack_group_put (NULL, o, &aq)
+                                         : pack_fetch_save (&f, o, &aq);
+    }
+    va_end (aq);
+    p = bp = pack_log_reserve (g, bound);
+    if (p == NULL) {
+        return -1;
+    }
+    fp = format;
+    endian = 0;
+    i = 0;
+    while ((o = log_next_op (&fp, &op, &endian, ops, nops, &i)) != NULL) {
+        if (o->type == PACK_ALIGN) {
+            /* レコードの内容の先頭からの位置で揃える */
+            bp = pack_put_pad (bp, pack_align_pad (o, bp - p));
+            continue;
+        }
+        if (o->type == PACK_GROUP) {
+            bp += pack_group_put (bp, o, ap);
+            continue;
+        }
+        pack_fetch_save (&f, o, ap);
+        bp = pack_put_field (bp, &f);
+    }
+    return pack_log_commit (g, bp - p);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書式文字列に従ってsaveしたものをレコードとして追記する。
+ *  @param  g       レコードログ
+ *  @param  format  書式文字列
+ *  @param  ...     saveする変数列(pack_saveと同じ可変引数)
+ *  @retval 0:成功, -1:失敗
+ */
+int pack_log_append (pack_log_t *g, char *format, ...)
+{
+    int r;
+    va_list args;
+
+    if (pack_format_check (format) < 0) {
+        return -1;
+    }
+    va_start (args, format);
+    r = log_append (g, format, NULL, 0, &args);
+    va_end (args);
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  planに従ってsaveしたものをレコードとして追記する。
+ *  @param  g       レコードログ
+ *  @param  plan    解析済みの書式
+ *  @param  ...     saveする変数列(pack_saveと同じ可変引数)
+ *  @retval 0:成功, -1:失敗
+ */
+int pack_log_append_plan (pack_log_t *g, const pack_plan_t *plan, ...)
+{
+    int r;
+    va_list args;
+
+    va_start (args, plan);
+    r = log_append (g, NULL, plan->op, plan->nops, &args);
+    va_end (args);
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  i番目のレコードの内容を返す。
+ *  @param  g   レコードログ
+ *  @param  i   レコードの番号(0から)
+ *  @param  len 内容のバイト数の格納先(NULLなら格納しない)
+ *  @retval 写像中の内容へのポインタ、iが範囲外の場合はNULL
+ */
+char* pack_log_get (const pack_log_t *g, size_t i, size_t *len)
+{
+    uint32_t n;
+    char *rec;
+
+    if (i >= g->count) {
+        return NULL;
+    }
+    rec = g->map + g->index[i];
+    if (len != NULL) {
+        memcpy (&n, rec, 4);
+        *len = n;
+    }
+    return rec + LOG_FRAME;
+}
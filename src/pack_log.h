@@ -0,0 +1,56 @@
+/**
+ *  @file   pack_log.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  mmapで開く追記専用のレコードログの宣言
+ */
+#ifndef __PACK_LOG_H__
+#define __PACK_LOG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "pack.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* pack_log_openのflags */
+#define PACK_LOG_READ   0   /* 読み込みのみ */
+#define PACK_LOG_WRITE  1   /* 追記する(ファイルが無ければ作る) */
+
+/* レコードの先頭の位置の境界(レコードの内容もこの境界から始まる) */
+#define PACK_LOG_ALIGN  8
+
+/* レコードログ */
+typedef struct {
+    int fd;             /* データファイル */
+    int ifd;            /* 索引ファイル(無ければ-1) */
+    int writable;       /* 1:追記できる */
+    char *map;          /* データファイルの写像 */
+    size_t map_len;     /* 写像のバイト数 */
+    size_t end;         /* 最後のレコードの直後の位置 */
+    uint64_t *index;    /* 各レコードの位置 */
+    size_t count;       /* レコード数 */
+    size_t index_cap;   /* indexの要素数 */
+    size_t index_saved; /* 索引ファイルに書いたレコード数 */
+    size_t synced;      /* msync済みのデータの終わり */
+    size_t reserved;    /* pack_log_reserveで確保したバイト数 */
+    size_t sync_every;  /* このレコード数毎にpack_log_syncする(0:しない) */
+} pack_log_t;
+
+int pack_log_open (pack_log_t *g, const char *path, int flags);
+int pack_log_close (pack_log_t *g);
+int pack_log_sync (pack_log_t *g);
+char* pack_log_reserve (pack_log_t *g, size_t size);
+int pack_log_commit (pack_log_t *g, size_t len);
+int pack_log_append (pack_log_t *g, char *format, ...);
+int pack_log_append_plan (pack_log_t *g, const pack_plan_t *plan, ...);
+char* pack_log_get (const pack_log_t *g, size_t i, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __PACK_LOG_H__ */
@@ -0,0 +1,484 @@
+/**
+ *  @file   pack_par.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  スレッドプールによる並列save/load。
+ *
+ *  pack_save_par/pack_load_parはpack_save/pack_loadと同じ引数と結果で、
+ *  大きな配列を含むメッセージを複数のスレッドで処理する。
+ *
+ *  1. 可変引数からすべての項目を取り出し、各項目のバイト数から
+ *     メッセージ中の位置を先に求める。可変長整数と'~'の配列は、
+ *     saveでは実際のバイト数を数え(大きければ並列に)、loadでは
+ *     値を復号せずに読み飛ばして位置を求める。
+ *  2. 1要素のバイト数が決まっている配列でthreshold以上のものは要素で
+ *     分割し、それ以外の項目は続くものをthreshold程度までまとめて、
+ *     それぞれをスレッドプールのタスクにする。
+ *
+ *  メッセージ全体がthresholdに満たない場合は1スレッドで処理する。
+ *  '*'の配列、グループ、文字列とバイト列('s', 'y')、'@'を含む場合は、
+ *  要素数を読むか前の項目を並べるまで位置が決まらないので、常に1スレッドで
+ *  処理する。
+ *  thresholdはpack_pool_set_thresholdで設定する。
+ *
+ *  例）
+ *  pack_pool_t *pool = pack_pool_create (0);
+ *  bp = pack_save_par (pool, bp, "i d# f#", n, da, n, fa, n);
+ *  bp = pack_load_par (pool, bp, "i d# f#", &n, da, n, fa, n);
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "pack_pool.h"
+#include "pack_internal.h"
+#include "pack_for.h"
+#include "pack_varint.h"
+
+/* 1つの配列を分割する最大数(ワーカー数に対する倍率) */
+#define PAR_SPLIT 4
+
+/* 取り出した1項目 */
+typedef struct {
+    pack_op_t op;
+    pack_field_t f;
+    size_t off;         /* メッセージ中の位置 */
+    size_t bytes;       /* バイト数 */
+} par_item_t;
+
+/* 1タスク: 続く項目[item, item+nitems)、またはitemの配列の[start, start+n)の要素 */
+typedef struct {
+    int item;
+    int nitems;
+    int start;          /* 分割しない場合は-1 */
+    int n;
+} par_task_t;
+
+/* 並列save/loadの仕事 */
+typedef struct {
+    par_item_t *items;
+    int nitems;
+    par_task_t *tasks;
+    int ntasks;
+    int tcap;
+    char *buffer;
+    int load;
+} par_job_t;
+
+/**
+ *  @brief  1要素のバイト数が決まっていない項目かを返す内部関数
+ */
+static int
+par_variable (const pack_op_t *op)
+{
+    return op->codec == '~' || op->type == 'v' || op->type == 'z';
+}
+
+/**
+ *  @brief  可変引数からすべての項目を取り出す内部関数
+ *  @param  format  書式文字列(planを与える場合はNULL)
+ *  @param  plan    解析済みの書式
+ *  @retval 0:成功, -1:メモリ不足
+ */
+static int
+par_collect (par_job_t *j, char *format, const pack_plan_t *plan, va_list *ap)
+{
+    par_item_t *it;
+    pack_op_t op;
+    char *fp = format;
+    int endian = 0, cap = 0, i = 0;
+
+    j->items = NULL;
+    j->nitems = 0;
+    for (;;) {
+        if (plan != NULL) {
+            if (i >= plan->nops) {
+                break;
+            }
+            op = plan->op[i++];
+        }
+        else if ((fp = pack_parse_op (fp, &op, &endian)) == NULL) {
+            break;
+        }
+        if (j->nitems == cap) {
+            cap = (cap < 16) ? 16 : cap * 2;
+            it = realloc (j->items, cap * sizeof(par_item_t));
+            if (it == NULL) {
+                return -1;
+            }
+            j->items = it;
+        }
+        it = &j->items[j->nitems++];
+        it->op = op;
+        it->bytes = j->load ? pack_fetch_load (&it->f, &it->op, ap)
+                            : pack_fetch_save (&it->f, &it->op, ap);
+    }
+    /* reallocで動いた分のポインタを直す */
+    for (i = 0; i < j->nitems; i++) {
+        it = &j->items[i];
+        it->f.op = &it->op;
+        if (!j->load && it->op.mode == PACK_SCALAR) {
+            it->f.data = &it->f.v;
+        }
+    }
+    return 0;
+}
+
+/**
+ *  @brief  saveする項目の実際のバイト数を数えるタスク
+ */
+static void
+par_size_task (void *arg, int task, int worker)
+{
+    par_job_t *j = arg;
+    par_item_t *it = &j->items[j->tasks[task].item];
+
+    it->bytes = pack_field_size (&it->f);
+    (void) worker;
+}
+
+/**
+ *  @brief  各項目の位置を求める内部関数
+ *  @retval メッセージ全体のバイト数
+ */
+static size_t
+par_layout (pack_pool_t *pool, par_job_t *j)
+{
+    size_t threshold = pack_pool_threshold (pool), off = 0;
+    par_item_t *it;
+    int i, big = 0;
+    char *p;
+
+    j->ntasks = 0;
+    for (i = 0; i < j->nitems; i++) {
+        it = &j->items[i];
+        it->off = off;
+        if (j->load && par_variable (&it->op)) {
+            /* 値を復号せずに読み飛ばす */
+            p = j->buffer + off;
+            if (it->op.codec == '~') {
+                it->bytes = pack_for_skip (p, it->f.n) - p;
+            }
+            else if (it->f.n > 0) {
+                it->bytes = pack_varint_skip (p, it->f.n) - p;
+            }
+        }
+        else if (!j->load && par_variable (&it->op)) {
+            /* 上限が大きい項目は後で並列に数える */
+            if (it->bytes >= threshold) {
+                j->tasks[j->ntasks++].item = i;
+                big = 1;
+                continue;
+            }
+            it->bytes = pack_field_size (&it->f);
+        }
+        off += it->bytes;
+    }
+    if (!big) {
+        return off;
+    }
+    pack_pool_run (pool, j->ntasks, par_size_task, j);
+    j->ntasks = 0;
+    for (off = 0, i = 0; i < j->nitems; i++) {
+        j->items[i].off = off;
+        off += j->items[i].bytes;
+    }
+    return off;
+}
+
+/**
+ *  @brief  タスクを1つ加える内部関数
+ */
+static void
+par_push (par_job_t *j, int item, int nitems, int start, int n)
+{
+    par_task_t *t = &j->tasks[j->ntasks++];
+
+    t->item = item;
+    t->nitems = nitems;
+    t->start = start;
+    t->n = n;
+}
+
+/**
+ *  @brief  項目をタスクに分ける内部関数
+ */
+static void
+par_split (pack_pool_t *pool, par_job_t *j)
+{
+    size_t threshold = pack_pool_threshold (pool), group = 0;
+    int maxsplit = pack_pool_size (pool) * PAR_SPLIT;
+    int i, k, first = 0, start, n;
+
+    j->ntasks = 0;
+    for (i = 0; i < j->nitems; i++) {
+        par_item_t *it = &j->items[i];
+
+        if (it->bytes < threshold || it->op.mode == PACK_SCALAR || par_variable (&it->op)) {
+            /* 小さな項目はまとめる */
+            group += it->bytes;
+            if (group >= threshold) {
+                par_push (j, first, i + 1 - first, -1, 0);
+                first = i + 1;
+                group = 0;
+            }
+            continue;
+        }
+        if (i > first) {
+            par_push (j, first, i - first, -1, 0);
+        }
+        first = i + 1;
+        group = 0;
+        k = (it->bytes + threshold - 1) / threshold;
+        if (k > maxsplit) {
+            k = maxsplit;
+        }
+        for (start = 0; start < it->f.n; start += n) {
+            n = (it->f.n + k - 1) / k;
+            if (n > it->f.n - start) {
+                n = it->f.n - start;
+            }
+            par_push (j, i, 1, start, n);
+        }
+    }
+    if (first < j->nitems) {
+        par_push (j, first, j->nitems - first, -1, 0);
+    }
+}
+
+/**
+ *  @brief  1タスク分の項目をsave/loadするタスク
+ */
+static void
+par_task (void *arg, int task, int worker)
+{
+    par_job_t *j = arg;
+    par_task_t *t = &j->tasks[task];
+    par_item_t *it = &j->items[t->item];
+    pack_field_t g;
+    char *bp;
+    int i;
+
+    if (t->start >= 0) {
+        g = it->f;
+        g.data = (char *) g.data + (size_t) t->start * pack_data_size (&it->op);
+        g.n = t->n;
+        bp = j->buffer + it->off + (size_t) t->start * it->op.size;
+        if (j->load) {
+            pack_get_field (bp, &g);
+        }
+        else {
+            pack_put_field (bp, &g);
+        }
+        return;
+    }
+    for (i = 0; i < t->nitems; i++, it++) {
+        bp = j->buffer + it->off;
+        if (j->load) {
+            pack_get_field (bp, &it->f);
+        }
+        else {
+            pack_put_field (bp, &it->f);
+        }
+    }
+    (void) worker;
+}
+
+/**
+ *  @brief  '*'の配列、グループ、's', 'y', '@'を含むかを返す内部関数
+ *
+ *  これらは要素数を読むか前の項目を並べるまでメッセージ中の位置が
+ *  決まらないので分割しない。
+ */
+static int
+par_serial (char *format, const pack_plan_t *plan)
+{
+    int i;
+
+    if (plan == NULL) {
+        return strpbrk (format, "*(sy@") != NULL;
+    }
+    for (i = 0; i < plan->nops; i++) {
+        if (plan->op[i].mode == PACK_PREFIX || plan->op[i].type == PACK_GROUP
+            || plan->op[i].type == PACK_ALIGN) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ *  @brief  1スレッドで順にsave/loadする内部関数
+ *  @retval 処理した領域の直後へのポインタ、'*'の上限を超えればNULL
+ */
+static char *
+par_serial_run (char *bp, char *format, const pack_plan_t *plan, int load, va_list *ap)
+{
+    const pack_op_t *o;
+    pack_field_t f;
+    pack_op_t op;
+    char *fp = format, *base = bp;
+    int endian = 0, i = 0;
+
+    while (bp != NULL) {
+        if (plan != NULL) {
+            if (i >= plan->nops) {
+                break;
+            }
+            o = &plan->op[i];
+            i += 1 + o->group;
+        }
+        else if ((fp = pack_parse_op (fp, &op, &endian)) != NULL) {
+            o = &op;
+        }
+        else {
+            break;
+        }
+        if (o->type == PACK_ALIGN) {
+            bp = load ? bp + pack_align_pad (o, bp - base)
+                      : pack_put_pad (bp, pack_align_pad (o, bp - base));
+        }
+        else if (o->type == PACK_GROUP) {
+            bp = load ? pack_group_get (bp, o, ap) : bp + pack_group_put (bp, o, ap);
+        }
+        else if (load) {
+            pack_fetch_load (&f, o, ap);
+            bp = pack_get_field (bp, &f);
+        }
+        else {
+            pack_fetch_save (&f, o, ap);
+            bp = pack_put_field (bp, &f);
+        }
+    }
+    return bp;
+}
+
+/**
+ *  @brief  並列save/loadの本体
+ *  @retval 処理した領域の直後へのポインタ、メモリ不足の場合はNULL
+ */
+static char *
+par_run (pack_pool_t *pool, char *buffer, char *format, const pack_plan_t *plan,
+         int load, va_list *ap)
+{
+    par_job_t j;
+    size_t total;
+    char *r = NULL;
+
+    if (par_serial (format, plan)) {
+        return par_serial_run (buffer, format, plan, load, ap);
+    }
+    j.buffer = buffer;
+    j.load = load;
+    j.tasks = NULL;
+    if (par_collect (&j, format, plan, ap) < 0) {
+        goto done;
+    }
+    /* 分割しても項目数 + 分割数を超えない */
+    j.tcap = 2 * j.nitems + j.nitems * pack_pool_size (pool) * PAR_SPLIT + 1;
+    j.tasks = malloc (j.tcap * sizeof(par_task_t));
+    if (j.tasks == NULL) {
+        goto done;
+    }
+    total = par_layout (pool, &j);
+    if (total < pack_pool_threshold (pool)) {
+        par_push (&j, 0, j.nitems, -1, 0);
+        par_task (&j, 0, 0);
+    }
+    else {
+        par_split (pool, &j);
+        pack_pool_run (pool, j.ntasks, par_task, &j);
+    }
+    r = buffer + total;
+ done:
+    free (j.items);
+    free (j.tasks);
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書式文字列に従ってbufferにデータを並列にsaveする。
+ *  @param  pool    スレッドプール
+ *  @param  buffer  データ領域の先頭へのポインタ
+ *  @param  format  書式文字列
+ *  @param  ...     saveする変数列(pack_saveと同じ可変引数)
+ *  @retval buffer内でsaveされたデータの直後へのポインタ、メモリ不足の場合と
+ *          扱えない書式の場合(errnoはEINVAL)はNULL
+ */
+char* pack_save_par (pack_pool_t *pool, char *buffer, char *format, ...)
+{
+    char *r;
+    va_list args;
+
+    if (pack_format_check (format) < 0) {
+        return NULL;
+    }
+    va_start (args, format);
+    r = par_run (pool, buffer, format, NULL, 0, &args);
+    va_end (args);
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書式文字列に従ってbufferからデータを並列にloadする。
+ *  @param  pool    スレッドプール
+ *  @param  buffer  データ領域の先頭へのポインタ
+ *  @param  format  書式文字列
+ *  @param  ...     loadする変数へのポインタ列(pack_loadと同じ可変引数)
+ *  @retval buffer内からloadされた領域の直後へのポインタ、メモリ不足の場合と
+ *          扱えない書式の場合(errnoはEINVAL)はNULL
+ */
+char* pack_load_par (pack_pool_t *pool, char *buffer, char *format, ...)
+{
+    char *r;
+    va_list args;
+
+    if (pack_format_check (format) < 0) {
+        return NULL;
+    }
+    va_start (args, format);
+    r = par_run (pool, buffer, format, NULL, 1, &args);
+    va_end (args);
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  planに従ってbufferにデータを並列にsaveする。
+ *  @param  pool    スレッドプール
+ *  @param  buffer  データ領域の先頭へのポインタ
+ *  @param  plan    解析済みの書式
+ *  @param  ...     saveする変数列(pack_saveと同じ可変引数)
+ *  @retval buffer内でsaveされたデータの直後へのポインタ、メモリ不足の場合はNULL
+ */
+char* pack_save_plan_par (pack_pool_t *pool, char *buffer, const pack_plan_t *plan, ...)
+{
+    char *r;
+    va_list args;
+
+    va_start (args, plan);
+    r = par_run (pool, buffer, NULL, plan, 0, &args);
+    va_end (args);
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  planに従ってbufferからデータを並列にloadする。
+ *  @param  pool    スレッドプール
+ *  @param  buffer  データ領域の先頭へのポインタ
+ *  @param  plan    解析済みの書式
+ *  @param  ...     loadする変数へのポインタ列(pack_loadと同じ可変引数)
+ *  @retval buffer内からloadされた領域の直後へのポインタ、メモリ不足の場合はNULL
+ */
+char* pack_load_plan_par (pack_pool_t *pool, char *buffer, const pack_plan_t *plan, ...)
+{
+    char *r;
+    va_list args;
+
+    va_start (args, plan);
+    r = par_run (pool, buffer, NULL, plan, 1, &args);
+    va_end (args);
+    return r;
+}
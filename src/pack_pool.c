@@ -0,0 +1,306 @@
+/**
+ *  @file   pack_pool.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  work stealingを行うスレッドプール。
+ *
+ *  pack_pool_runはntasks個のタスクをワーカーの数で等分して各ワーカーの
+ *  キューに積み、すべて終わるまで待つ。呼び出したスレッドもワーカー0として
+ *  タスクを実行する。自分のキューが空になったワーカーは、他のワーカーの
+ *  キューの後ろ半分を奪って続ける。タスクの重さが偏っていても、
+ *  すべてのワーカーが最後まで働く。
+ *
+ *  同じプールのpack_pool_runを複数のスレッドから同時に呼んではならない。
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pack_pool.h"
+
+/* キャッシュラインのバイト数 */
+#define POOL_LINE 64
+
+/* 1ワーカーのタスクのキュー([lo, hi)のタスクが残っている) */
+typedef union {
+    struct {
+        pthread_mutex_t lock;
+        int lo;
+        int hi;
+    } q;
+    char pad[(sizeof(pthread_mutex_t) + 2 * sizeof(int) + POOL_LINE - 1) / POOL_LINE * POOL_LINE];
+} pool_queue_t;
+
+/* スレッドに渡す引数 */
+typedef struct {
+    pack_pool_t *pool;
+    int worker;
+} pool_arg_t;
+
+struct pack_pool {
+    int n;                  /* ワーカー数(呼び出したスレッドを含む) */
+    pthread_t *threads;     /* n-1個のスレッド */
+    pool_arg_t *args;       /* スレッドの引数 */
+    pool_queue_t *queue;    /* ワーカー毎のキュー */
+    pthread_mutex_t lock;   /* 以下を保護する */
+    pthread_cond_t start;   /* 仕事の開始の通知 */
+    pthread_cond_t done;    /* 仕事の終了の通知 */
+    unsigned long gen;      /* 仕事の世代 */
+    int active;             /* 仕事を終えていないスレッドの数 */
+    int quit;               /* 1:スレッドを終了する */
+    pack_pool_fn fn;        /* 実行中の関数 */
+    void *arg;              /* fnの引数 */
+    size_t threshold;       /* 並列に処理する最小のバイト数 */
+};
+
+/**
+ *  @brief  自分のキューの先頭からタスクを取り出す内部関数
+ *  @retval タスクの番号、空なら-1
+ */
+static int
+pool_pop (pack_pool_t *p, int w)
+{
+    pool_queue_t *q = &p->queue[w];
+    int t = -1;
+
+    pthread_mutex_lock (&q->q.lock);
+    if (q->q.lo < q->q.hi) {
+        t = q->q.lo++;
+    }
+    pthread_mutex_unlock (&q->q.lock);
+    return t;
+}
+
+/**
+ *  @brief  他のワーカーのキューの後ろ半分を奪う内部関数
+ *
+ *  奪ったタスクのうち1つを返し、残りは自分のキューに入れる。
+ *
+ *  @retval タスクの番号、どのキューも空なら-1
+ */
+static int
+pool_steal (pack_pool_t *p, int w)
+{
+    int i, lo = 0, hi = 0;
+
+    for (i = 1; i < p->n && lo == hi; i++) {
+        pool_queue_t *v = &p->queue[(w + i) % p->n];
+        pthread_mutex_lock (&v->q.lock);
+        if (v->q.lo < v->q.hi) {
+            hi = v->q.hi;
+            lo = v->q.hi = hi - (hi - v->q.lo + 1) / 2;
+        }
+        pthread_mutex_unlock (&v->q.lock);
+    }
+    if (lo == hi) {
+        return -1;
+    }
+    pthread_mutex_lock (&p->queue[w].q.lock);
+    p->queue[w].q.lo = lo + 1;
+    p->queue[w].q.hi = hi;
+    pthread_mutex_unlock (&p->queue[w].q.lock);
+    return lo;
+}
+
+/**
+ *  @brief  タスクが無くなるまで実行する内部関数
+ */
+static void
+pool_work (pack_pool_t *p, int w)
+{
+    int t;
+
+    while ((t = pool_pop (p, w)) >= 0 || (t = pool_steal (p, w)) >= 0) {
+        p->fn (p->arg, t, w);
+    }
+}
+
+/**
+ *  @brief  ワーカースレッドの本体
+ */
+static void *
+pool_thread (void *a)
+{
+    pool_arg_t *arg = a;
+    pack_pool_t *p = arg->pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock (&p->lock);
+    for (;;) {
+        while (p->gen == seen && !p->quit) {
+            pthread_cond_wait (&p->start, &p->lock);
+        }
+        if (p->quit) {
+            break;
+        }
+        seen = p->gen;
+        pthread_mutex_unlock (&p->lock);
+        pool_work (p, arg->worker);
+        pthread_mutex_lock (&p->lock);
+        if (--p->active == 0) {
+            pthread_cond_signal (&p->done);
+        }
+    }
+    pthread_mutex_unlock (&p->lock);
+    return NULL;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  スレッドプールを作る。
+ *  @param  nthreads    ワーカー数(呼び出したスレッドを含む)、0以下ならCPU数
+ *  @retval スレッドプール、失敗した場合はNULL
+ */
+pack_pool_t* pack_pool_create (int nthreads)
+{
+    pack_pool_t *p;
+    int i;
+
+    if (nthreads <= 0) {
+        nthreads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+        if (nthreads <= 0) {
+            nthreads = 1;
+        }
+    }
+    p = calloc (1, sizeof(pack_pool_t));
+    if (p == NULL) {
+        return NULL;
+    }
+    p->n = nthreads;
+    p->threshold = PACK_PAR_THRESHOLD;
+    p->threads = calloc (nthreads, sizeof(pthread_t));
+    p->args = calloc (nthreads, sizeof(pool_arg_t));
+    p->queue = calloc (nthreads, sizeof(pool_queue_t));
+    if (p->threads == NULL || p->args == NULL || p->queue == NULL) {
+        free (p->threads);
+        free (p->args);
+        free (p->queue);
+        free (p);
+        return NULL;
+    }
+    pthread_mutex_init (&p->lock, NULL);
+    pthread_cond_init (&p->start, NULL);
+    pthread_cond_init (&p->done, NULL);
+    for (i = 0; i < nthreads; i++) {
+        pthread_mutex_init (&p->queue[i].q.lock, NULL);
+        p->args[i].pool = p;
+        p->args[i].worker = i;
+    }
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create (&p->threads[i], NULL, pool_thread, &p->args[i]) != 0) {
+            /* 作れた分のスレッドで動かす */
+            p->n = i;
+            break;
+        }
+    }
+    return p;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  スレッドを終了させ、スレッドプールを解放する。
+ *  @param  pool    スレッドプール
+ */
+void pack_pool_free (pack_pool_t *pool)
+{
+    int i;
+
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock (&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast (&pool->start);
+    pthread_mutex_unlock (&pool->lock);
+    for (i = 1; i < pool->n; i++) {
+        pthread_join (pool->threads[i], NULL);
+    }
+    for (i = 0; i < pool->n; i++) {
+        pthread_mutex_destroy (&pool->queue[i].q.lock);
+    }
+    pthread_mutex_destroy (&pool->lock);
+    pthread_cond_destroy (&pool->start);
+    pthread_cond_destroy (&pool->done);
+    free (pool->threads);
+    free (pool->args);
+    free (pool->queue);
+    free (pool);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  ワーカー数を返す。
+ *  @param  pool    スレッドプール
+ *  @retval ワーカー数(呼び出したスレッドを含む)
+ */
+int pack_pool_size (const pack_pool_t *pool)
+{
+    return pool->n;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  並列save/loadで分割する配列の最小のバイト数を設定する。
+ *
+ *  この大きさに満たないメッセージは1スレッドで処理する。
+ *
+ *  @param  pool    スレッドプール
+ *  @param  bytes   バイト数(初期値はPACK_PAR_THRESHOLD)
+ */
+void pack_pool_set_threshold (pack_pool_t *pool, size_t bytes)
+{
+    pool->threshold = (bytes > 0) ? bytes : 1;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  並列save/loadで分割する配列の最小のバイト数を返す。
+ *  @param  pool    スレッドプール
+ *  @retval バイト数
+ */
+size_t pack_pool_threshold (const pack_pool_t *pool)
+{
+    return pool->threshold;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  ntasks個のタスクを並列に実行し、すべて終わるまで待つ。
+ *  @param  pool    スレッドプール
+ *  @param  ntasks  タスク数
+ *  @param  fn      タスクを実行する関数、fn(arg, タスクの番号, ワーカーの番号)
+ *  @param  arg     fnに渡す引数
+ */
+void pack_pool_run (pack_pool_t *pool, int ntasks, pack_pool_fn fn, void *arg)
+{
+    int i, n = pool->n;
+
+    if (ntasks <= 0) {
+        return;
+    }
+    if (n == 1 || ntasks == 1) {
+        for (i = 0; i < ntasks; i++) {
+            fn (arg, i, 0);
+        }
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        pool->queue[i].q.lo = (int) ((long long) ntasks * i / n);
+        pool->queue[i].q.hi = (int) ((long long) ntasks * (i + 1) / n);
+    }
+    pthread_mutex_lock (&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->active = n - 1;
+    pool->gen++;
+    pthread_cond_broadcast (&pool->start);
+    pthread_mutex_unlock (&pool->lock);
+
+    pool_work (pool, 0);
+
+    pthread_mutex_lock (&pool->lock);
+    while (pool->active > 0) {
+        pthread_cond_wait (&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock (&pool->lock);
+}
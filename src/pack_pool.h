@@ -0,0 +1,62 @@
+/**
+ *  @file   pack_pool.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  スレッドプールと、それを使う並列処理の宣言
+ */
+#ifndef __PACK_POOL_H__
+#define __PACK_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "pack.h"
+#include "pack_log.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 並列save/loadで分割する配列の最小のバイト数の初期値 */
+#define PACK_PAR_THRESHOLD  (1 << 20)
+
+/* pack_scan_bufferのレコードの先頭から内容までのバイト数
+   (先頭4バイトが内容のバイト数、pack_log, pack_chanのレコードと同じ) */
+#define PACK_SCAN_FRAME     8
+
+/* スレッドプール */
+typedef struct pack_pool pack_pool_t;
+
+/* タスクを実行する関数(workerは0〜pack_pool_size()-1) */
+typedef void (*pack_pool_fn) (void *arg, int task, int worker);
+
+/* 1レコードを処理する関数(0以外を返すと走査を打ち切る) */
+typedef int (*pack_scan_fn) (void *state, char *rec, size_t len, size_t i);
+
+/* srcの状態をdstにまとめる関数 */
+typedef void (*pack_reduce_fn) (void *dst, const void *src);
+
+pack_pool_t* pack_pool_create (int nthreads);
+void pack_pool_free (pack_pool_t *pool);
+int pack_pool_size (const pack_pool_t *pool);
+void pack_pool_set_threshold (pack_pool_t *pool, size_t bytes);
+size_t pack_pool_threshold (const pack_pool_t *pool);
+void pack_pool_run (pack_pool_t *pool, int ntasks, pack_pool_fn fn, void *arg);
+
+int pack_scan (pack_pool_t *pool, const pack_log_t *g, pack_scan_fn fn,
+               void *states, size_t state_size, pack_reduce_fn reduce);
+ssize_t pack_scan_offsets (const char *base, size_t size, uint64_t *offsets, size_t max);
+int pack_scan_buffer (pack_pool_t *pool, char *base, size_t size,
+                      pack_scan_fn fn, void *states, size_t state_size, pack_reduce_fn reduce);
+
+char* pack_save_par (pack_pool_t *pool, char *buffer, char *format, ...);
+char* pack_load_par (pack_pool_t *pool, char *buffer, char *format, ...);
+char* pack_save_plan_par (pack_pool_t *pool, char *buffer, const pack_plan_t *plan, ...);
+char* pack_load_plan_par (pack_pool_t *pool, char *buffer, const pack_plan_t *plan, ...);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __PACK_POOL_H__ */
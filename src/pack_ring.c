@@ -0,0 +1,330 @@
+/**
+ *  @file   pack_ring.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  スレッド間でパックしたメッセージを受け渡すリングバッファ。
+ *
+ *  送り手はpack_ring_reserveでスロットを確保してそこへ直接saveし、
+ *  pack_ring_commitで受け手に渡す。受け手はpack_ring_acquireで受け取った
+ *  スロットからその場でloadし、pack_ring_releaseでスロットを返す。
+ *  メッセージ毎のmallocも、キューへ入れるための複製も要らない。
+ *
+ *  スロットは固定長で、それぞれが順序番号を持つ。番号が送り手の位置と
+ *  等しければ空き、位置+1なら受け取れるメッセージがある。位置の取り合いは
+ *  MPMCではCASで、SPSCでは相手がいないので単に書き込むだけで済ませ、
+ *  どちらもロックを取らない。送り手の位置、受け手の位置、各スロットは
+ *  別々のキャッシュラインに置く。
+ *
+ *  確保できない場合(満杯、空)は待たずにNULLか-1を返し、errnoを
+ *  EAGAINにする。待ち方(スピン、sched_yield等)は呼び出し側が決める。
+ *  's', 'y'はスロット内を参照するので、pack_ring_loadでは扱えない。
+ *  pack_ring_acquireとpack_loadで読み、使い終えてから返す。
+ *
+ *  例）
+ *  pack_ring_t *r = pack_ring_create (1024, 256, PACK_RING_MPMC);
+ *  送り手:
+ *  char *p = pack_ring_reserve (r, pack_size ("i d#", n));
+ *  pack_ring_commit (r, p, pack_save (p, "i d#", n, da, n) - p);
+ *  受け手:
+ *  char *p = pack_ring_acquire (r, &len);
+ *  pack_load (p, "i", &n);
+ *  ...
+ *  pack_ring_release (r, p);
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include "pack_ring.h"
+#include "pack_internal.h"
+
+/* キャッシュラインのバイト数 */
+#define RING_LINE   64
+
+/* スロットの先頭(この直後にメッセージを置く) */
+typedef struct {
+    size_t seq;         /* 順序番号 */
+    size_t len;         /* メッセージのバイト数 */
+} ring_cell_t;
+
+/* 送り手または受け手の位置(キャッシュラインを占有する) */
+typedef union {
+    size_t pos;
+    char pad[RING_LINE];
+} ring_pos_t;
+
+struct pack_ring {
+    ring_pos_t head;        /* 送り手の位置 */
+    ring_pos_t tail;        /* 受け手の位置 */
+    size_t mask;            /* スロット数-1 */
+    size_t stride;          /* スロットの間隔 */
+    size_t slot_size;       /* メッセージの最大のバイト数 */
+    int mode;               /* PACK_RING_SPSC, PACK_RING_MPMC */
+    char *cells;            /* スロットの領域 */
+};
+
+/**
+ *  @brief  位置に対応するスロット
+ */
+static INLINE ring_cell_t *
+ring_cell (const pack_ring_t *r, size_t pos)
+{
+    return (ring_cell_t *) (r->cells + (pos & r->mask) * r->stride);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  リングバッファを作る。
+ *  @param  slots       スロット数(2のべき乗に切り上げる)
+ *  @param  slot_size   1メッセージの最大のバイト数
+ *  @param  mode        PACK_RING_SPSCまたはPACK_RING_MPMC
+ *  @retval リングバッファ、失敗した場合はNULL
+ */
+pack_ring_t* pack_ring_create (size_t slots, size_t slot_size, int mode)
+{
+    pack_ring_t *r;
+    size_t n = 2, i;
+    void *p;
+
+    while (n < slots) {
+        n *= 2;
+    }
+    if (posix_memalign (&p, RING_LINE, sizeof(pack_ring_t)) != 0) {
+        return NULL;
+    }
+    r = p;
+    r->head.pos = 0;
+    r->tail.pos = 0;
+    r->mask = n - 1;
+    r->stride = (sizeof(ring_cell_t) + slot_size + RING_LINE - 1) / RING_LINE * RING_LINE;
+    r->slot_size = slot_size;
+    r->mode = mode;
+    if (posix_memalign (&p, RING_LINE, n * r->stride) != 0) {
+        free (r);
+        return NULL;
+    }
+    r->cells = p;
+    for (i = 0; i < n; i++) {
+        ring_cell (r, i)->seq = i;
+        ring_cell (r, i)->len = 0;
+    }
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  リングバッファを解放する。
+ *  @param  r   リングバッファ(NULLの場合は何もしない)
+ */
+void pack_ring_free (pack_ring_t *r)
+{
+    if (r == NULL) {
+        return;
+    }
+    free (r->cells);
+    free (r);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  1メッセージの最大のバイト数を返す。
+ *  @param  r   リングバッファ
+ *  @retval バイト数
+ */
+size_t pack_ring_slot_size (const pack_ring_t *r)
+{
+    return r->slot_size;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  メッセージを書き込むスロットを確保する。
+ *
+ *  確保したスロットは、書き込んだ後にpack_ring_commitで受け手に渡す。
+ *
+ *  @param  r       リングバッファ
+ *  @param  size    書き込むバイト数の上限
+ *  @retval スロットの先頭、満杯ならNULL(errnoはEAGAIN)、
+ *          sizeがスロットより大きければNULL(errnoはEMSGSIZE)
+ */
+char* pack_ring_reserve (pack_ring_t *r, size_t size)
+{
+    ring_cell_t *c;
+    size_t pos, seq;
+    intptr_t diff;
+
+    if (size > r->slot_size) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+    pos = __atomic_load_n (&r->head.pos, __ATOMIC_RELAXED);
+    for (;;) {
+        c = ring_cell (r, pos);
+        seq = __atomic_load_n (&c->seq, __ATOMIC_ACQUIRE);
+        diff = (intptr_t) (seq - pos);
+        if (diff == 0) {
+            if (r->mode == PACK_RING_SPSC) {
+                __atomic_store_n (&r->head.pos, pos + 1, __ATOMIC_RELAXED);
+                break;
+            }
+            if (__atomic_compare_exchange_n (&r->head.pos, &pos, pos + 1, 1,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            /* 受け手がまだスロットを返していない */
+            errno = EAGAIN;
+            return NULL;
+        }
+        else {
+            pos = __atomic_load_n (&r->head.pos, __ATOMIC_RELAXED);
+        }
+    }
+    return (char *) (c + 1);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書き込んだスロットを受け手に渡す。
+ *  @param  r       リングバッファ
+ *  @param  slot    pack_ring_reserveで確保したスロット
+ *  @param  len     書き込んだバイト数
+ */
+void pack_ring_commit (pack_ring_t *r, char *slot, size_t len)
+{
+    ring_cell_t *c = (ring_cell_t *) slot - 1;
+
+    (void) r;
+    c->len = len;
+    __atomic_store_n (&c->seq, __atomic_load_n (&c->seq, __ATOMIC_RELAXED) + 1,
+                      __ATOMIC_RELEASE);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  次のメッセージを受け取る。
+ *
+ *  受け取ったスロットは、読み終えた後にpack_ring_releaseで返す。
+ *
+ *  @param  r   リングバッファ
+ *  @param  len メッセージのバイト数を格納する領域へのポインタ(NULL可)
+ *  @retval メッセージの先頭、空ならNULL(errnoはEAGAIN)
+ */
+char* pack_ring_acquire (pack_ring_t *r, size_t *len)
+{
+    ring_cell_t *c;
+    size_t pos, seq;
+    intptr_t diff;
+
+    pos = __atomic_load_n (&r->tail.pos, __ATOMIC_RELAXED);
+    for (;;) {
+        c = ring_cell (r, pos);
+        seq = __atomic_load_n (&c->seq, __ATOMIC_ACQUIRE);
+        diff = (intptr_t) (seq - (pos + 1));
+        if (diff == 0) {
+            if (r->mode == PACK_RING_SPSC) {
+                __atomic_store_n (&r->tail.pos, pos + 1, __ATOMIC_RELAXED);
+                break;
+            }
+            if (__atomic_compare_exchange_n (&r->tail.pos, &pos, pos + 1, 1,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            /* 送り手がまだ渡していない */
+            errno = EAGAIN;
+            return NULL;
+        }
+        else {
+            pos = __atomic_load_n (&r->tail.pos, __ATOMIC_RELAXED);
+        }
+    }
+    if (len != NULL) {
+        *len = c->len;
+    }
+    return (char *) (c + 1);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  読み終えたスロットを送り手に返す。
+ *  @param  r       リングバッファ
+ *  @param  slot    pack_ring_acquireで受け取ったスロット
+ */
+void pack_ring_release (pack_ring_t *r, char *slot)
+{
+    ring_cell_t *c = (ring_cell_t *) slot - 1;
+
+    /* 受け取った時の番号は位置+1なので、1周先の位置にする */
+    __atomic_store_n (&c->seq, __atomic_load_n (&c->seq, __ATOMIC_RELAXED) + r->mask,
+                      __ATOMIC_RELEASE);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書式文字列に従ってメッセージをsaveし、受け手に渡す。
+ *  @param  r       リングバッファ
+ *  @param  format  書式文字列
+ *  @param  ...     saveする変数列(pack_saveと同じ可変引数)
+ *  @retval 0:成功, -1:満杯(errnoはEAGAIN)、スロットに入らない(EMSGSIZE)、
+ *          扱えない書式(EINVAL)
+ */
+int pack_ring_save (pack_ring_t *r, char *format, ...)
+{
+    char *slot;
+    size_t size;
+    va_list args, copy;
+
+    va_start (args, format);
+    va_copy (copy, args);
+    size = pack_format_put (NULL, format, &copy);
+    va_end (copy);
+    if (size == (size_t) -1) {
+        /* 扱えない書式(errnoはEINVAL) */
+        va_end (args);
+        return -1;
+    }
+    slot = pack_ring_reserve (r, size);
+    if (slot != NULL) {
+        pack_format_put (slot, format, &args);
+        pack_ring_commit (r, slot, size);
+    }
+    va_end (args);
+    return (slot != NULL) ? 0 : -1;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  次のメッセージを書式文字列に従ってloadし、スロットを返す。
+ *  @param  r       リングバッファ
+ *  @param  format  書式文字列
+ *  @param  ...     loadする変数列(pack_loadと同じ可変引数)
+ *  @retval 0:成功, -1:空(errnoはEAGAIN)、'*'の上限を超えた(EMSGSIZE)、
+ *          's', 'y'または扱えないグループを含む(EINVAL)
+ */
+int pack_ring_load (pack_ring_t *r, char *format, ...)
+{
+    char *slot, *end;
+    va_list args;
+
+    if (strpbrk (format, "sy") != NULL) {
+        /* 返した参照がスロットを返すと無効になる */
+        errno = EINVAL;
+        return -1;
+    }
+    if (pack_format_check (format) < 0) {
+        return -1;
+    }
+    slot = pack_ring_acquire (r, NULL);
+    if (slot == NULL) {
+        return -1;
+    }
+    va_start (args, format);
+    end = pack_format_get (slot, format, &args);
+    va_end (args);
+    pack_ring_release (r, slot);
+    return (end != NULL) ? 0 : -1;
+}
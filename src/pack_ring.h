@@ -0,0 +1,39 @@
+/**
+ *  @file   pack_ring.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  スレッド間でパックしたメッセージを受け渡すリングバッファの宣言
+ */
+#ifndef __PACK_RING_H__
+#define __PACK_RING_H__
+
+#include <stddef.h>
+#include "pack.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 送り手と受け手の数 */
+#define PACK_RING_SPSC  0   /* 送り手、受け手とも1スレッド */
+#define PACK_RING_MPMC  1   /* 送り手、受け手とも複数のスレッド */
+
+/* リングバッファ(内容は非公開) */
+typedef struct pack_ring pack_ring_t;
+
+pack_ring_t* pack_ring_create (size_t slots, size_t slot_size, int mode);
+void pack_ring_free (pack_ring_t *r);
+size_t pack_ring_slot_size (const pack_ring_t *r);
+char* pack_ring_reserve (pack_ring_t *r, size_t size);
+void pack_ring_commit (pack_ring_t *r, char *slot, size_t len);
+char* pack_ring_acquire (pack_ring_t *r, size_t *len);
+void pack_ring_release (pack_ring_t *r, char *slot);
+int pack_ring_save (pack_ring_t *r, char *format, ...);
+int pack_ring_load (pack_ring_t *r, char *format, ...);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __PACK_RING_H__ */
@@ -0,0 +1,200 @@
+/**
+ *  @file   pack_scan.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  レコードログ、またはメモリ上のレコードの並列走査。
+ *
+ *  pack_scan_bufferはbaseからsizeバイトに並んだレコードを走査する。
+ *  各レコードは先頭4バイトが内容のバイト数(ホストのバイト順)で、内容は
+ *  PACK_SCAN_FRAMEバイト後から始まり、次のレコードは8バイト境界に置く
+ *  (最後のレコードの後の詰め物は無くてもよい)。受信したバッファや別に
+ *  写像した領域もそのまま走査できる。レコードの位置はpack_scan_offsetsで
+ *  先に数えて並べるので、内容がsizeを越えるレコードがあればコールバックを
+ *  呼ぶ前にEINVALで失敗する。pack_scanはレコードログの索引をそのまま使う。
+ *
+ *  レコードをSCAN_MIN個以上ずつのまとまりに分け、スレッドプールの
+ *  タスクとして処理する。ワーカー毎に状態を1つずつ持ち、各レコードは
+ *  そのレコードを処理したワーカーの状態と一緒にコールバックに渡される。
+ *  走査が終わったら、reduceで全ワーカーの状態を先頭の状態にまとめる。
+ *
+ *  例）
+ *  typedef struct { double sum; char pad[56]; } sum_t;
+ *  sum_t s[pack_pool_size (pool)];
+ *  memset (s, 0, sizeof(s));
+ *  pack_scan (pool, &g, add_record, s, sizeof(sum_t), add_sum);
+ *  (s[0].sumが結果)
+ *
+ *  メモリ上のレコード(lenの後に4バイト空けて内容を置き、8バイト境界に並べる):
+ *  pack_scan_buffer (pool, buf, size, add_record, s, sizeof(sum_t), add_sum);
+ *
+ *  状態を並べた配列はワーカーの間で書き込みがぶつからないように、
+ *  state_sizeをキャッシュラインの倍数にするとよい。
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pack_pool.h"
+
+/* 1タスクのレコード数の最小値 */
+#define SCAN_MIN 256
+/* 1ワーカーあたりのタスク数(奪い合いの単位を細かくする) */
+#define SCAN_SPLIT 16
+
+/* 走査の仕事 */
+typedef struct {
+    char *base;                 /* レコードの位置の基準 */
+    const uint64_t *offsets;    /* 各レコードの位置 */
+    size_t nrecs;               /* レコード数 */
+    pack_scan_fn fn;
+    char *states;
+    size_t state_size;
+    size_t chunk;       /* 1タスクのレコード数 */
+    int stop;           /* 1:コールバックが打ち切りを求めた */
+} scan_job_t;
+
+/**
+ *  @brief  1タスク分のレコードを処理する内部関数
+ */
+static void
+scan_task (void *arg, int task, int worker)
+{
+    scan_job_t *j = arg;
+    void *state = j->states + (size_t) worker * j->state_size;
+    size_t i = (size_t) task * j->chunk;
+    size_t end = i + j->chunk;
+    uint32_t len;
+    char *rec;
+
+    if (end > j->nrecs) {
+        end = j->nrecs;
+    }
+    for (; i < end; i++) {
+        if (__atomic_load_n (&j->stop, __ATOMIC_RELAXED)) {
+            return;
+        }
+        rec = j->base + j->offsets[i];
+        memcpy (&len, rec, 4);
+        if (j->fn (state, rec + PACK_SCAN_FRAME, len, i) != 0) {
+            __atomic_store_n (&j->stop, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+/**
+ *  @brief  レコードの位置を並べて走査する内部関数
+ */
+static int
+scan_run (pack_pool_t *pool, char *base, const uint64_t *offsets, size_t nrecs,
+          pack_scan_fn fn, void *states, size_t state_size, pack_reduce_fn reduce)
+{
+    scan_job_t job;
+    size_t ntasks;
+    int i, n = pack_pool_size (pool);
+
+    job.base = base;
+    job.offsets = offsets;
+    job.nrecs = nrecs;
+    job.fn = fn;
+    job.states = states;
+    job.state_size = state_size;
+    job.stop = 0;
+    job.chunk = (nrecs + (size_t) n * SCAN_SPLIT - 1) / ((size_t) n * SCAN_SPLIT);
+    if (job.chunk < SCAN_MIN) {
+        job.chunk = SCAN_MIN;
+    }
+    ntasks = (nrecs + job.chunk - 1) / job.chunk;
+    pack_pool_run (pool, (int) ntasks, scan_task, &job);
+    if (reduce != NULL) {
+        for (i = 1; i < n; i++) {
+            reduce (states, (char *) states + (size_t) i * state_size);
+        }
+    }
+    return job.stop ? -1 : 0;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  メモリ上に並んだレコードの位置を数える。
+ *  @param  base        レコードの並びの先頭
+ *  @param  size        レコードの並びのバイト数
+ *  @param  offsets     各レコードの先頭のbaseからの位置を書く配列(NULLなら数えるだけ)
+ *  @param  max         offsetsの要素数(これを越えた分は書かずに数える)
+ *  @retval レコード数, -1:sizeを越えるレコードがある(errno=EINVAL)
+ */
+ssize_t pack_scan_offsets (const char *base, size_t size, uint64_t *offsets, size_t max)
+{
+    size_t off = 0, n = 0;
+    uint32_t len;
+
+    while (off < size) {
+        if (size - off < PACK_SCAN_FRAME) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy (&len, base + off, 4);
+        if (len > size - off - PACK_SCAN_FRAME) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (offsets != NULL && n < max) {
+            offsets[n] = off;
+        }
+        n++;
+        off = (off + PACK_SCAN_FRAME + len + 7) & ~(size_t) 7;
+    }
+    return (ssize_t) n;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  メモリ上に並んだレコードを並列に処理する。
+ *  @param  pool        スレッドプール
+ *  @param  base        レコードの並びの先頭
+ *  @param  size        レコードの並びのバイト数
+ *  @param  fn          1レコードを処理する関数、fn(状態, 内容, バイト数, 番号)
+ *  @param  states      ワーカー毎の状態(state_sizeバイトをpack_pool_size個)
+ *  @param  state_size  1ワーカーの状態のバイト数
+ *  @param  reduce      状態をstatesの先頭にまとめる関数(NULLならまとめない)
+ *  @retval 0:成功, -1:fnが0以外を返して打ち切った、
+ *          またはsizeを越えるレコードがある(errno=EINVAL、fnは呼ばない)
+ */
+int pack_scan_buffer (pack_pool_t *pool, char *base, size_t size,
+                      pack_scan_fn fn, void *states, size_t state_size, pack_reduce_fn reduce)
+{
+    ssize_t nrecs = pack_scan_offsets (base, size, NULL, 0);
+    uint64_t *offsets;
+    int r;
+
+    if (nrecs < 0) {
+        return -1;
+    }
+    offsets = malloc (((size_t) nrecs + 1) * sizeof(uint64_t));
+    if (offsets == NULL) {
+        return -1;
+    }
+    pack_scan_offsets (base, size, offsets, (size_t) nrecs);
+    r = scan_run (pool, base, offsets, (size_t) nrecs, fn, states, state_size, reduce);
+    free (offsets);
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  レコードログのすべてのレコードを並列に処理する。
+ *  @param  pool        スレッドプール
+ *  @param  g           レコードログ
+ *  @param  fn          1レコードを処理する関数、fn(状態, 内容, バイト数, 番号)
+ *  @param  states      ワーカー毎の状態(state_sizeバイトをpack_pool_size個)
+ *  @param  state_size  1ワーカーの状態のバイト数
+ *  @param  reduce      状態をstatesの先頭にまとめる関数(NULLならまとめない)
+ *  @retval 0:成功, -1:fnが0以外を返して打ち切った
+ */
+int pack_scan (pack_pool_t *pool, const pack_log_t *g, pack_scan_fn fn,
+               void *states, size_t state_size, pack_reduce_fn reduce)
+{
+    /* レコードログのレコードも先頭にバイト数、PACK_SCAN_FRAMEバイト後に内容を置く */
+    return scan_run (pool, g->map, g->index, g->count, fn, states, state_size, reduce);
+}
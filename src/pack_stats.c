@@ -0,0 +1,342 @@
+/**
+ *  @file   pack_stats.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  書式毎の呼び出し回数、バイト数、処理時間の統計。
+ *
+ *  PACK_STATSを定義してビルドした場合だけ、pack_size, pack_save,
+ *  pack_loadが書式文字列毎に呼び出し回数、バイト数、処理にかかった
+ *  サイクル数の合計とlog2のヒストグラムを数える。定義しない場合は
+ *  数える処理そのものが無くなり、pack_stats_dumpは空の結果を出力する。
+ *
+ *  統計はスレッド毎の表に数え、書式文字列は内容のハッシュで区別する
+ *  (アドレスの違う同じ内容の書式文字列は1つにまとめて数える)。
+ *  書式毎の統計は初めて数える時に確保して表のリストの先頭に加え、
+ *  追い出さないので、呼び出し箇所の多いプログラムでも書式の数に上限はない。
+ *  表は作ったスレッドだけが書き込み、全スレッドの表をつないだリストは
+ *  CASで先頭に加えるだけなので、数える側も集める側もロックを取らない。
+ *  pack_stats_dumpは全スレッドの表を書式文字列の内容でまとめて出力する。
+ *  終了したスレッドの表は、次に作られたスレッドが引き継ぐ。
+ *
+ *  例）
+ *  pack_stats_dump (stdout, PACK_STATS_PROMETHEUS);
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "pack_stats.h"
+#include "pack_internal.h"
+
+/* 1つの書式の統計 */
+typedef struct stats_entry {
+    struct stats_entry *chain;  /* 同じスロットの次の書式 */
+    struct stats_entry *next;   /* 同じ表の次の書式(pack_stats_dumpが辿る) */
+    uint64_t hash;              /* 書式文字列の内容のハッシュ */
+    const char *name;           /* 書式文字列の複製 */
+    uint64_t calls[PACK_STATS_OPS];
+    uint64_t bytes[PACK_STATS_OPS];
+    uint64_t cycles[PACK_STATS_OPS];
+    uint64_t hist[PACK_STATS_OPS][PACK_STATS_BUCKETS];
+} stats_entry_t;
+
+#ifdef PACK_STATS
+
+#include <pthread.h>
+
+/* 1スレッドの表(slotは表を持つスレッドだけが使う) */
+typedef struct stats_table {
+    struct stats_table *next;
+    int in_use;
+    stats_entry_t *list;                    /* 数えている全書式 */
+    stats_entry_t *slot[PACK_STATS_SLOTS];  /* 内容のハッシュで引く */
+} stats_table_t;
+
+/* 全スレッドの表のリスト */
+static stats_table_t *stats_list;
+/* このスレッドの表 */
+static __thread stats_table_t *stats_local;
+
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+/**
+ *  @brief  スレッドの終了時に表を手放す
+ */
+static void
+stats_release (void *p)
+{
+    stats_table_t *t = p;
+    __atomic_store_n (&t->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void
+stats_key_init (void)
+{
+    pthread_key_create (&stats_key, stats_release);
+}
+
+/**
+ *  @brief  このスレッドの表を返す内部関数(初回は手放された表を探すか作る)
+ */
+static stats_table_t *
+stats_table (void)
+{
+    stats_table_t *t;
+    int free_slot;
+
+    if (stats_local != NULL) {
+        return stats_local;
+    }
+    pthread_once (&stats_once, stats_key_init);
+    for (t = __atomic_load_n (&stats_list, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        free_slot = 0;
+        if (__atomic_compare_exchange_n (&t->in_use, &free_slot, 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (t == NULL) {
+        t = calloc (1, sizeof(stats_table_t));
+        if (t == NULL) {
+            return NULL;
+        }
+        t->in_use = 1;
+        t->next = __atomic_load_n (&stats_list, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n (&stats_list, &t->next, t, 1,
+                                             __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific (stats_key, t);
+    stats_local = t;
+    return t;
+}
+
+/* 書き込むのは表を持つスレッドだけなので、読み出しと加算を分けてよい */
+#define STATS_INC(x, v) __atomic_store_n (&(x), (x) + (v), __ATOMIC_RELAXED)
+
+/**
+ *  @brief  1回の呼び出しを数える
+ *  @param  op      PACK_STATS_SIZE, PACK_STATS_SAVE, PACK_STATS_LOAD
+ *  @param  format  書式文字列
+ *  @param  bytes   バイト数
+ *  @param  start   処理を始めた時のpack_stats_now()
+ */
+void pack_stats_add (int op, const char *format, size_t bytes, uint64_t start)
+{
+    uint64_t cycles = pack_stats_now () - start;
+    stats_table_t *t = stats_table ();
+    stats_entry_t *e;
+    uint64_t hash;
+    size_t len;
+    unsigned i;
+    int b;
+
+    if (t == NULL) {
+        return;
+    }
+    hash = pack_hash_string (format, &len);
+    i = (unsigned) (hash % PACK_STATS_SLOTS);
+    for (e = t->slot[i]; e != NULL; e = e->chain) {
+        if (e->hash == hash && strcmp (e->name, format) == 0) {
+            break;
+        }
+    }
+    if (e == NULL) {
+        /* 書式文字列が後で解放されても出力できるように複製しておく */
+        e = calloc (1, sizeof(stats_entry_t) + len + 1);
+        if (e == NULL) {
+            return;
+        }
+        e->hash = hash;
+        e->name = memcpy (e + 1, format, len + 1);
+        e->chain = t->slot[i];
+        t->slot[i] = e;
+        e->next = t->list;
+        __atomic_store_n (&t->list, e, __ATOMIC_RELEASE);
+    }
+    b = (cycles == 0) ? 0 : 64 - __builtin_clzll (cycles);
+    if (b >= PACK_STATS_BUCKETS) {
+        b = PACK_STATS_BUCKETS - 1;
+    }
+    STATS_INC (e->calls[op], 1);
+    STATS_INC (e->bytes[op], bytes);
+    STATS_INC (e->cycles[op], cycles);
+    STATS_INC (e->hist[op][b], 1);
+}
+
+/**
+ *  @brief  全スレッドの統計を書式の内容でまとめる内部関数
+ *  @param  n   まとめた書式の数の格納先
+ *  @retval まとめた統計(freeする)、メモリ不足の場合はNULL
+ */
+static stats_entry_t *
+stats_collect (int *n)
+{
+    stats_table_t *t;
+    stats_entry_t *all = NULL, *p;
+    int cap = 0, j, op, b;
+
+    *n = 0;
+    for (t = __atomic_load_n (&stats_list, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        const stats_entry_t *e;
+        for (e = __atomic_load_n (&t->list, __ATOMIC_ACQUIRE); e != NULL; e = e->next) {
+            const char *f = e->name;
+            for (j = 0; j < *n && (all[j].hash != e->hash || strcmp (all[j].name, f) != 0); j++) {
+            }
+            if (j == *n) {
+                if (*n == cap) {
+                    cap = (cap < 16) ? 16 : cap * 2;
+                    p = realloc (all, cap * sizeof(stats_entry_t));
+                    if (p == NULL) {
+                        free (all);
+                        return NULL;
+                    }
+                    all = p;
+                }
+                memset (&all[j], 0, sizeof(stats_entry_t));
+                all[j].hash = e->hash;
+                all[j].name = f;
+                (*n)++;
+            }
+            for (op = 0; op < PACK_STATS_OPS; op++) {
+                all[j].calls[op] += __atomic_load_n (&e->calls[op], __ATOMIC_RELAXED);
+                all[j].bytes[op] += __atomic_load_n (&e->bytes[op], __ATOMIC_RELAXED);
+                all[j].cycles[op] += __atomic_load_n (&e->cycles[op], __ATOMIC_RELAXED);
+                for (b = 0; b < PACK_STATS_BUCKETS; b++) {
+                    all[j].hist[op][b] += __atomic_load_n (&e->hist[op][b], __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+    return all;
+}
+
+#endif /* PACK_STATS */
+
+/* 出力する処理の名前 */
+static const char *stats_op_name[] = { "size", "save", "load" };
+
+/**
+ *  @brief  書式文字列を引用符の中に書ける形で出力する内部関数
+ */
+static void
+stats_quote (FILE *fp, const char *s)
+{
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc ('\\', fp);
+            fputc (*s, fp);
+        }
+        else if (*s == '\n') {
+            fputs ("\\n", fp);
+        }
+        else {
+            fputc (*s, fp);
+        }
+    }
+}
+
+/**
+ *  @brief  Prometheusの指標名とラベルを出力する内部関数(閉じ括弧は呼び出し側が書く)
+ */
+static void
+stats_label (FILE *fp, const char *metric, const char *name, int op)
+{
+    fprintf (fp, "%s{format=\"", metric);
+    stats_quote (fp, name);
+    fprintf (fp, "\",op=\"%s\"", stats_op_name[op]);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  統計を取るようにビルドされているかを返す。
+ *  @retval 1:PACK_STATSを定義してビルドされた, 0:されていない
+ */
+int pack_stats_enabled (void)
+{
+#ifdef PACK_STATS
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  全スレッドの統計をまとめて出力する。
+ *
+ *  JSONは {"formats":[{"format":..., "op":..., "calls":..., "bytes":...,
+ *  "cycles":..., "hist":[...]}, ...]} の形で、histのi番目は処理時間が
+ *  [2^(i-1), 2^i)サイクルだった回数。Prometheusはpack_calls_total,
+ *  pack_bytes_total, pack_cyclesヒストグラムをformatとopのラベルで出力する。
+ *
+ *  @param  fp      出力先
+ *  @param  format  PACK_STATS_JSONまたはPACK_STATS_PROMETHEUS
+ *  @retval 0:成功, -1:メモリ不足
+ */
+int pack_stats_dump (FILE *fp, int format)
+{
+    int n = 0, i, op, b, first = 1;
+    uint64_t sum;
+    stats_entry_t *all = NULL;
+
+#ifdef PACK_STATS
+    all = stats_collect (&n);
+    if (all == NULL && n > 0) {
+        return -1;
+    }
+#endif
+
+    if (format == PACK_STATS_JSON) {
+        fputs ("{\"formats\":[", fp);
+    }
+    else {
+        fputs ("# TYPE pack_calls_total counter\n"
+               "# TYPE pack_bytes_total counter\n"
+               "# TYPE pack_cycles histogram\n", fp);
+    }
+    for (i = 0; i < n; i++) {
+        for (op = 0; op < PACK_STATS_OPS; op++) {
+            if (all[i].calls[op] == 0) {
+                continue;
+            }
+            if (format == PACK_STATS_JSON) {
+                fputs (first ? "\n{\"format\":\"" : ",\n{\"format\":\"", fp);
+                stats_quote (fp, all[i].name);
+                fprintf (fp, "\",\"op\":\"%s\",\"calls\":%llu,\"bytes\":%llu,\"cycles\":%llu,\"hist\":[",
+                         stats_op_name[op], (unsigned long long) all[i].calls[op],
+                         (unsigned long long) all[i].bytes[op],
+                         (unsigned long long) all[i].cycles[op]);
+                for (b = 0; b < PACK_STATS_BUCKETS; b++) {
+                    fprintf (fp, b ? ",%llu" : "%llu", (unsigned long long) all[i].hist[op][b]);
+                }
+                fputs ("]}", fp);
+                first = 0;
+                continue;
+            }
+            stats_label (fp, "pack_calls_total", all[i].name, op);
+            fprintf (fp, "} %llu\n", (unsigned long long) all[i].calls[op]);
+            stats_label (fp, "pack_bytes_total", all[i].name, op);
+            fprintf (fp, "} %llu\n", (unsigned long long) all[i].bytes[op]);
+            for (sum = 0, b = 0; b < PACK_STATS_BUCKETS; b++) {
+                sum += all[i].hist[op][b];
+                stats_label (fp, "pack_cycles_bucket", all[i].name, op);
+                if (b == PACK_STATS_BUCKETS - 1) {
+                    fprintf (fp, ",le=\"+Inf\"} %llu\n", (unsigned long long) sum);
+                }
+                else {
+                    fprintf (fp, ",le=\"%llu\"} %llu\n", (1ULL << b) - 1, (unsigned long long) sum);
+                }
+            }
+            stats_label (fp, "pack_cycles_sum", all[i].name, op);
+            fprintf (fp, "} %llu\n", (unsigned long long) all[i].cycles[op]);
+            stats_label (fp, "pack_cycles_count", all[i].name, op);
+            fprintf (fp, "} %llu\n", (unsigned long long) all[i].calls[op]);
+        }
+    }
+    if (format == PACK_STATS_JSON) {
+        fputs ("\n]}\n", fp);
+    }
+    free (all);
+    return 0;
+}
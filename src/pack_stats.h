@@ -0,0 +1,39 @@
+/**
+ *  @file   pack_stats.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  書式毎の呼び出し回数、バイト数、処理時間の統計の宣言
+ */
+#ifndef __PACK_STATS_H__
+#define __PACK_STATS_H__
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* pack_stats_dumpの出力形式 */
+#define PACK_STATS_JSON         0
+#define PACK_STATS_PROMETHEUS   1
+
+/* 統計を取る処理 */
+#define PACK_STATS_SIZE 0
+#define PACK_STATS_SAVE 1
+#define PACK_STATS_LOAD 2
+#define PACK_STATS_OPS  3
+
+/* スレッド毎の表のハッシュのスロット数(数える書式の数に上限はない) */
+#define PACK_STATS_SLOTS    256
+/* 処理時間(サイクル数)のlog2のヒストグラムの区間数 */
+#define PACK_STATS_BUCKETS  40
+
+int pack_stats_enabled (void);
+int pack_stats_dump (FILE *fp, int format);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __PACK_STATS_H__ */
@@ -0,0 +1,763 @@
+/**
+ *  @file   pack_stream.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  ファイル記述子に対するバッファ付きの入出力。
+ *
+ *  pack_saveやpack_loadと同じ書式文字列で、ファイル、パイプ、ソケットへ
+ *  直接save/loadする。項目はバッファにpackし、バッファが一杯になったら
+ *  まとめてwriteする。loadはバッファが空になったらまとめてreadする。
+ *  短いread/writeやEINTRは内部で繰り返す。
+ *
+ *  バッファより大きな配列は要素を分割して処理するので、メッセージ全体が
+ *  メモリに載らなくてもよい。変換の要らない配列(エンディアン変換や圧縮を
+ *  しないもの)がバッファより大きい場合は、バッファを経由せずに変数の領域と
+ *  直接writev/readする。'*'の配列も要素数を読み書きした後は同じように扱う。
+ *  グループは項目が混ざって並ぶので分割せず、バッファに収まる大きさまで
+ *  扱う。loadでは読み過ぎないように、大きさの決まる項目のグループに限る。
+ *  's', 'y'はbuffer内を参照するloadしかないので、saveだけできる(loadは
+ *  errnoをEINVALにして失敗する)。
+ *  '@'はストリームの先頭(初期化してから読み書きしたバイト数)からの位置で揃える。
+ *
+ *  例）
+ *  pack_stream_t s;
+ *  pack_stream_init (&s, fd, NULL, 0);
+ *  pack_stream_save (&s, "i d#", n, data, n);
+ *  pack_stream_flush (&s);
+ *  pack_stream_free (&s);
+ *
+ *  1つのストリームはsaveかloadのどちらか一方に使う。saveした項目は
+ *  pack_stream_flushを呼ぶまで書き出されないことがある。loadが-1を返し
+ *  eofが1になっていれば、ファイルの終わりに達している。
+ *  失敗した項目がどこまで読み書きされたかは不定。
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "pack_stream.h"
+#include "pack_arena.h"
+#include "pack_internal.h"
+#include "pack_for.h"
+#include "pack_swap.h"
+#include "pack_varint.h"
+
+/**
+ *  @ingroup pack
+ *  @brief  ストリームを初期化する。
+ *  @param  s       ストリーム
+ *  @param  fd      ファイル記述子
+ *  @param  buffer  バッファ、NULLならmallocする
+ *  @param  size    バッファのバイト数(PACK_STREAM_MIN以上)、
+ *                  bufferがNULLで0ならPACK_STREAM_DEFAULT
+ *  @retval 0:成功, -1:失敗
+ */
+int pack_stream_init (pack_stream_t *s, int fd, char *buffer, size_t size)
+{
+    s->fd = fd;
+    s->pos = 0;
+    s->len = 0;
+    s->eof = 0;
+    s->io = 0;
+    s->storage = NULL;
+    s->arena = NULL;
+    if (buffer == NULL) {
+        if (size == 0) {
+            size = PACK_STREAM_DEFAULT;
+        }
+        if (size < PACK_STREAM_MIN) {
+            size = PACK_STREAM_MIN;
+        }
+        buffer = s->storage = malloc (size);
+        if (buffer == NULL) {
+            return -1;
+        }
+    }
+    else if (size < PACK_STREAM_MIN) {
+        errno = EINVAL;
+        return -1;
+    }
+    s->buf = buffer;
+    s->cap = size;
+    return 0;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  アリーナから割り当てたバッファでストリームを初期化する。
+ *  @param  s       ストリーム
+ *  @param  fd      ファイル記述子
+ *  @param  size    バッファのバイト数(PACK_STREAM_MIN以上)、0ならPACK_STREAM_DEFAULT
+ *  @param  a       アリーナ
+ *  @retval 0:成功, -1:失敗
+ */
+int pack_stream_init_arena (pack_stream_t *s, int fd, size_t size, pack_arena_t *a)
+{
+    char *buffer;
+
+    if (size == 0) {
+        size = PACK_STREAM_DEFAULT;
+    }
+    if (size < PACK_STREAM_MIN) {
+        size = PACK_STREAM_MIN;
+    }
+    buffer = pack_arena_alloc (a, size);
+    if (buffer == NULL) {
+        return -1;
+    }
+    pack_stream_init (s, fd, buffer, pack_arena_size (buffer));
+    s->storage = buffer;
+    s->arena = a;
+    return 0;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  mallocしたバッファを解放する。flushもcloseもしない。
+ *
+ *  pack_stream_init_arenaで初期化した場合はアリーナに返す。
+ *
+ *  @param  s   ストリーム
+ */
+void pack_stream_free (pack_stream_t *s)
+{
+    if (s->arena != NULL) {
+        pack_arena_release (s->arena, s->storage);
+    }
+    else {
+        free (s->storage);
+    }
+    s->storage = NULL;
+    s->arena = NULL;
+    s->buf = NULL;
+    s->cap = 0;
+    s->pos = 0;
+    s->len = 0;
+}
+
+/**
+ *  @brief  iovecをすべて書き出すまでwritevを繰り返す内部関数
+ *
+ *  書き終えたiovecのiov_lenは0になり、途中まで書いたiovecは残りを指す。
+ *
+ *  @retval 0:成功, -1:失敗
+ */
+static int
+stream_writev (int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t r;
+
+    while (iovcnt > 0) {
+        r = writev (fd, iov, iovcnt);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t) r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov->iov_len = 0;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+    return 0;
+}
+
+/**
+ *  @brief  バッファの内容とdataを続けて書き出す内部関数
+ *
+ *  書き出せなかったバッファの内容は、バッファの先頭に残す。
+ *
+ *  @retval 0:成功, -1:失敗
+ */
+static int
+stream_write (pack_stream_t *s, const void *data, size_t bytes)
+{
+    struct iovec iov[2];
+    int r;
+
+    iov[0].iov_base = s->buf;
+    iov[0].iov_len = s->len;
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = bytes;
+    r = stream_writev (s->fd, iov, 2);
+    s->io += s->len + bytes - iov[0].iov_len - iov[1].iov_len;
+    memmove (s->buf, iov[0].iov_base, iov[0].iov_len);
+    s->len = iov[0].iov_len;
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  バッファに溜まっているデータを書き出す。
+ *  @param  s   ストリーム
+ *  @retval 0:成功, -1:失敗(書き出せなかった分はバッファに残る)
+ */
+int pack_stream_flush (pack_stream_t *s)
+{
+    return stream_write (s, NULL, 0);
+}
+
+/**
+ *  @brief  '*'の要素数をストリームにsaveする内部関数
+ *  @retval 0:成功, -1:失敗
+ */
+static int
+stream_put_count (pack_stream_t *s, int n, int endian)
+{
+    pack_op_t count = { 'J', 0, PACK_SCALAR, 0, 1, 4, 4, 0, NULL };
+    pack_field_t c;
+
+    if (s->cap - s->len < PACK_PREFIX_SIZE && pack_stream_flush (s) < 0) {
+        return -1;
+    }
+    count.endian = endian;
+    c.op = &count;
+    c.n = 1;
+    c.v.u32 = (n > 0) ? (uint32_t) n : 0;
+    s->len = pack_put_field (s->buf + s->len, &c) - s->buf;
+    return 0;
+}
+
+/**
+ *  @brief  グループをストリームにsaveする内部関数
+ *
+ *  グループは要素の順に項目を混ぜて並べるので、分割せずにバッファでpackする。
+ *
+ *  @retval 0:成功, -1:失敗(バッファに収まらなければerrnoはEMSGSIZE)
+ */
+static int
+stream_put_group (pack_stream_t *s, const pack_op_t *op, va_list *ap)
+{
+    size_t bytes;
+    va_list aq;
+
+    va_copy (aq, *ap);
+    bytes = pack_group_put (NULL, op, &aq);
+    va_end (aq);
+    if (bytes > s->cap) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (s->cap - s->len < bytes && pack_stream_flush (s) < 0) {
+        return -1;
+    }
+    s->len += pack_group_put (s->buf + s->len, op, ap);
+    return 0;
+}
+
+/**
+ *  @brief  '@'の詰め物をストリームにsaveする内部関数
+ *  @retval 0:成功, -1:失敗
+ */
+static int
+stream_put_align (pack_stream_t *s, const pack_op_t *op)
+{
+    int n = pack_align_pad (op, s->io + s->len), k;
+
+    while (n > 0) {
+        if (s->len == s->cap && pack_stream_flush (s) < 0) {
+            return -1;
+        }
+        k = (s->cap - s->len < (size_t) n) ? (int) (s->cap - s->len) : n;
+        s->len = pack_put_pad (s->buf + s->len, k) - s->buf;
+        n -= k;
+    }
+    return 0;
+}
+
+/**
+ *  @brief  1項目を取り出してストリームにsaveする内部関数
+ *  @retval 0:成功, -1:失敗
+ */
+static int
+stream_put_op (pack_stream_t *s, const pack_op_t *op, va_list *ap)
+{
+    pack_field_t f, g;
+    pack_op_t v;
+    size_t bytes;
+    int dsize = pack_data_size (op);
+    int i, k;
+    uint64_t prev = 0;
+    char *p;
+
+    if (op->type == PACK_GROUP) {
+        return stream_put_group (s, op, ap);
+    }
+    if (op->type == PACK_ALIGN) {
+        return stream_put_align (s, op);
+    }
+    bytes = pack_fetch_save (&f, op, ap);
+    if (op->mode == PACK_PREFIX) {
+        /* 要素数を書いてから'#'の配列として続ける */
+        if (stream_put_count (s, f.n, op->endian) < 0) {
+            return -1;
+        }
+        v = *op;
+        v.mode = PACK_VAR;
+        f.op = op = &v;
+        bytes -= PACK_PREFIX_SIZE;
+    }
+    if (pack_op_native (op) && bytes >= s->cap) {
+        /* バッファに溜まっている分と一緒に、変数の領域から直接書き出す */
+        return stream_write (s, f.data, bytes);
+    }
+    /* バッファに収まる要素数ずつpackする */
+    if (op->codec == '~') {
+        k = s->cap / pack_for_bound (PACK_FOR_BLOCK, op->size) * PACK_FOR_BLOCK;
+    }
+    else {
+        k = s->cap / op->size;
+    }
+    g = f;
+    for (i = 0; i < f.n; i += g.n) {
+        g.n = (f.n - i < k) ? f.n - i : k;
+        g.data = (char *) f.data + (size_t) i * dsize;
+        if (s->cap - s->len < pack_op_bytes (op, g.n) && pack_stream_flush (s) < 0) {
+            return -1;
+        }
+        p = s->buf + s->len;
+        if (op->codec == '~') {
+            p = pack_for_put_from (p, g.data, g.n, op->size, islower (op->type), &prev);
+        }
+        else {
+            p = pack_put_field (p, &g);
+        }
+        s->len = p - s->buf;
+    }
+    return 0;
+}
+
+/**
+ *  @brief  バッファにwantバイト以上溜まるまで読み込む内部関数
+ *
+ *  未読のデータをバッファの先頭に寄せてから、空いている分だけreadする。
+ *  ファイルの終わりに達した場合はwantバイトに満たなくても戻る。
+ *
+ *  @retval 0:成功, -1:失敗
+ */
+static int
+stream_fill (pack_stream_t *s, size_t want)
+{
+    ssize_t r;
+
+    if (s->len - s->pos >= want) {
+        return 0;
+    }
+    memmove (s->buf, s->buf + s->pos, s->len - s->pos);
+    s->len -= s->pos;
+    s->pos = 0;
+    if (want > s->cap) {
+        want = s->cap;
+    }
+    while (s->len < want && !s->eof) {
+        r = read (s->fd, s->buf + s->len, s->cap - s->len);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (r == 0) {
+            s->eof = 1;
+            break;
+        }
+        s->len += r;
+        s->io += r;
+    }
+    return 0;
+}
+
+/**
+ *  @brief  バッファに残っている分を写し、残りをdataへ直接読む内部関数
+ *  @retval 0:成功, -1:失敗
+ */
+static int
+stream_read (pack_stream_t *s, char *data, size_t bytes)
+{
+    size_t have = s->len - s->pos;
+    ssize_t r;
+
+    if (have > bytes) {
+        have = bytes;
+    }
+    memcpy (data, s->buf + s->pos, have);
+    s->pos += have;
+    while (have < bytes) {
+        if (s->eof) {
+            return -1;
+        }
+        r = read (s->fd, data + have, bytes - have);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (r == 0) {
+            s->eof = 1;
+        }
+        have += r;
+        s->io += r;
+    }
+    return 0;
+}
+
+/**
+ *  @brief  可変長整数(単独変数または配列)をloadする内部関数
+ *
+ *  1要素は最大PACK_VARINT_MAXバイトなので、その分が読み込めていれば
+ *  まとめて復号する。ファイルの終わりの近くでは1つずつ範囲を確かめる。
+ *
+ *  @retval 0:成功, -1:失敗
+ */
+static int
+stream_get_varint (pack_stream_t *s, const pack_field_t *f)
+{
+    uint64_t *v = f->data;
+    int zigzag = (f->op->type == 'z');
+    int i = 0, m;
+    char *p, *end;
+
+    while (i < f->n) {
+        m = f->n - i;
+        if ((size_t) m > s->cap / PACK_VARINT_MAX) {
+            m = s->cap / PACK_VARINT_MAX;
+        }
+        if (stream_fill (s, (size_t) m * PACK_VARINT_MAX) < 0) {
+            return -1;
+        }
+        p = s->buf + s->pos;
+        end = s->buf + s->len;
+        if ((size_t) (end - p) >= (size_t) m * PACK_VARINT_MAX) {
+            s->pos += pack_varint_get_array (p, v + i, m, zigzag) - p;
+            i += m;
+            continue;
+        }
+        /* バッファの外を読まないように、1要素ずつ写してから復号する */
+        for (; i < f->n && p < end; i++) {
+            char tmp[PACK_VARINT_MAX] = {0};
+            size_t rest = end - p, used;
+
+            memcpy (tmp, p, (rest < PACK_VARINT_MAX) ? rest : PACK_VARINT_MAX);
+            used = pack_varint_get (tmp, &v[i]) - tmp;
+            if (used > rest) {
+                break;
+            }
+            if (zigzag) {
+                v[i] = pack_unzigzag (v[i]);
+            }
+            p += used;
+        }
+        s->pos = p - s->buf;
+        return (i < f->n) ? -1 : 0;
+    }
+    return 0;
+}
+
+/**
+ *  @brief  '~'で圧縮された配列をブロック毎にloadする内部関数
+ *  @retval 0:成功, -1:失敗
+ */
+static int
+stream_get_for (pack_stream_t *s, const pack_field_t *f)
+{
+    const pack_op_t *op = f->op;
+    uint64_t prev = 0;
+    size_t need;
+    int i, m;
+    char *p;
+
+    for (i = 0; i < f->n; i += m) {
+        m = (f->n - i < PACK_FOR_BLOCK) ? f->n - i : PACK_FOR_BLOCK;
+        if (stream_fill (s, pack_for_bound (m, op->size)) < 0) {
+            return -1;
+        }
+        p = s->buf + s->pos;
+        need = pack_for_block_size (p, s->len - s->pos, m);
+        if (need == 0 || need > s->len - s->pos) {
+            return -1;
+        }
+        p = pack_for_get_from (p, (char *) f->data + (size_t) i * op->size, m, op->size, &prev);
+        s->pos = p - s->buf;
+    }
+    return 0;
+}
+
+/**
+ *  @brief  '*'の要素数をストリームからloadする内部関数
+ *  @param  f   pack_fetch_loadで取り出した項目(nに要素数を設定する)
+ *  @retval 0:成功, -1:失敗(上限を超えていればerrnoはEMSGSIZE)
+ */
+static int
+stream_get_count (pack_stream_t *s, pack_field_t *f, int endian)
+{
+    pack_op_t count = { 'J', 0, PACK_SCALAR, 0, 1, 4, 4, 0, NULL };
+    pack_field_t c;
+    uint32_t n;
+
+    if (stream_fill (s, PACK_PREFIX_SIZE) < 0 || s->len - s->pos < PACK_PREFIX_SIZE) {
+        return -1;
+    }
+    count.endian = endian;
+    c.op = &count;
+    c.n = 1;
+    c.data = &n;
+    s->pos = pack_get_field (s->buf + s->pos, &c) - s->buf;
+    if (n > (uint32_t) ((f->n > 0) ? f->n : 0)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    *f->count = f->n = (int) n;
+    return 0;
+}
+
+/**
+ *  @brief  グループをストリームからloadする内部関数
+ *
+ *  グループ全体をバッファに読み込んでからunpackする。読み過ぎないように、
+ *  項目は大きさの決まっているもの(可変長整数と'~'以外)に限る。
+ *
+ *  @retval 0:成功, -1:失敗(バッファに収まらなければerrnoはEMSGSIZE、
+ *          大きさの決まらない項目があればEINVAL)
+ */
+static int
+stream_get_group (pack_stream_t *s, const pack_op_t *op, va_list *ap)
+{
+    pack_op_t buf[PACK_GROUP_MAX];
+    const pack_op_t *m = pack_group_members (op, buf);
+    pack_field_t f;
+    size_t need = 0;
+    uint32_t n;
+    va_list aq;
+    int k;
+    char *p;
+
+    for (k = 0; k < op->group; k++) {
+        if (m[k].type == 'v' || m[k].type == 'z' || m[k].codec == '~') {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (op->mode == PACK_FIXED) {
+        n = op->count;
+    }
+    else if (op->mode == PACK_VAR) {
+        /* 繰り返し数は項目毎の配列の後にある */
+        va_copy (aq, *ap);
+        for (k = 0; k < op->group; k++) {
+            pack_fetch_load (&f, &m[k], &aq);
+        }
+        n = va_arg (aq, int);
+        va_end (aq);
+    }
+    else {
+        if (stream_fill (s, PACK_PREFIX_SIZE) < 0 || s->len - s->pos < PACK_PREFIX_SIZE) {
+            return -1;
+        }
+        memcpy (&n, s->buf + s->pos, sizeof(n));
+        if (op->endian) {
+            n = pack_bswap32 (n);
+        }
+        need = PACK_PREFIX_SIZE;
+    }
+    need += (size_t) n * op->size;
+    if (need > s->cap) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (stream_fill (s, need) < 0 || s->len - s->pos < need) {
+        return -1;
+    }
+    p = pack_group_get (s->buf + s->pos, op, ap);
+    if (p == NULL) {
+        return -1;
+    }
+    s->pos = p - s->buf;
+    return 0;
+}
+
+/**
+ *  @brief  '@'の詰め物をストリームから読み飛ばす内部関数
+ *  @retval 0:成功, -1:失敗
+ */
+static int
+stream_get_align (pack_stream_t *s, const pack_op_t *op)
+{
+    int n = pack_align_pad (op, s->io - (s->len - s->pos)), k;
+
+    while (n > 0) {
+        if (stream_fill (s, n) < 0 || s->len == s->pos) {
+            return -1;
+        }
+        k = (s->len - s->pos < (size_t) n) ? (int) (s->len - s->pos) : n;
+        s->pos += k;
+        n -= k;
+    }
+    return 0;
+}
+
+/**
+ *  @brief  1項目をストリームからloadする内部関数
+ *  @retval 0:成功, -1:失敗
+ */
+static int
+stream_get_op (pack_stream_t *s, const pack_op_t *op, va_list *ap)
+{
+    pack_field_t f, g;
+    pack_op_t v;
+    size_t bytes;
+    int dsize = pack_data_size (op);
+    int i, k;
+    char *p;
+
+    if (op->type == PACK_GROUP) {
+        return stream_get_group (s, op, ap);
+    }
+    if (op->type == PACK_ALIGN) {
+        return stream_get_align (s, op);
+    }
+    if (pack_op_string (op)) {
+        /* 返した参照がバッファの読み足しで動いてしまう */
+        errno = EINVAL;
+        return -1;
+    }
+    bytes = pack_fetch_load (&f, op, ap);
+    if (op->mode == PACK_PREFIX) {
+        /* 要素数を読んでから'#'の配列として続ける */
+        if (stream_get_count (s, &f, op->endian) < 0) {
+            return -1;
+        }
+        v = *op;
+        v.mode = PACK_VAR;
+        f.op = op = &v;
+        bytes = pack_op_bytes (op, f.n);
+    }
+    if (op->type == 'v' || op->type == 'z') {
+        return stream_get_varint (s, &f);
+    }
+    if (op->codec == '~') {
+        return stream_get_for (s, &f);
+    }
+    if (pack_op_native (op) && bytes >= s->cap) {
+        return stream_read (s, f.data, bytes);
+    }
+    /* バッファに収まる要素数ずつunpackする */
+    k = s->cap / op->size;
+    g = f;
+    for (i = 0; i < f.n; i += g.n) {
+        g.n = (f.n - i < k) ? f.n - i : k;
+        g.data = (char *) f.data + (size_t) i * dsize;
+        if (stream_fill (s, (size_t) g.n * op->size) < 0
+            || s->len - s->pos < (size_t) g.n * op->size) {
+            return -1;
+        }
+        p = s->buf + s->pos;
+        s->pos = pack_get_field (p, &g) - s->buf;
+    }
+    return 0;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書式文字列に従ってストリームにデータをsaveする。
+ *  @param  s       ストリーム
+ *  @param  format  書式文字列
+ *  @param  ...     saveする変数列(pack_saveと同じ可変引数)
+ *  @retval 0:成功, -1:書き出しに失敗、扱えない書式(errnoはEINVAL)
+ */
+int pack_stream_save (pack_stream_t *s, char *format, ...)
+{
+    char *fp = format;
+    int endian = 0, r = 0;
+    pack_op_t op;
+    va_list args;
+
+    if (pack_format_check (format) < 0) {
+        return -1;
+    }
+    va_start (args, format);
+    while (r == 0 && (fp = pack_parse_op (fp, &op, &endian)) != NULL) {
+        r = stream_put_op (s, &op, &args);
+    }
+    va_end (args);
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  planに従ってストリームにデータをsaveする。
+ *  @param  s       ストリーム
+ *  @param  plan    解析済みの書式
+ *  @param  ...     saveする変数列(pack_saveと同じ可変引数)
+ *  @retval 0:成功, -1:書き出しに失敗
+ */
+int pack_stream_save_plan (pack_stream_t *s, const pack_plan_t *plan, ...)
+{
+    int i, r = 0;
+    va_list args;
+
+    va_start (args, plan);
+    for (i = 0; r == 0 && i < plan->nops; i += 1 + plan->op[i].group) {
+        r = stream_put_op (s, &plan->op[i], &args);
+    }
+    va_end (args);
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書式文字列に従ってストリームからデータをloadする。
+ *  @param  s       ストリーム
+ *  @param  format  書式文字列
+ *  @param  ...     loadする変数へのポインタ列(pack_loadと同じ可変引数)
+ *  @retval 0:成功, -1:読み込みに失敗またはファイルの終わり(eofが1)、
+ *          扱えない書式(errnoはEINVAL)
+ */
+int pack_stream_load (pack_stream_t *s, char *format, ...)
+{
+    char *fp = format;
+    int endian = 0, r = 0;
+    pack_op_t op;
+    va_list args;
+
+    if (pack_format_check (format) < 0) {
+        return -1;
+    }
+    va_start (args, format);
+    while (r == 0 && (fp = pack_parse_op (fp, &op, &endian)) != NULL) {
+        r = stream_get_op (s, &op, &args);
+    }
+    va_end (args);
+    return r;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  planに従ってストリームからデータをloadする。
+ *  @param  s       ストリーム
+ *  @param  plan    解析済みの書式
+ *  @param  ...     loadする変数へのポインタ列(pack_loadと同じ可変引数)
+ *  @retval 0:成功, -1:読み込みに失敗またはファイルの終わり(eofが1)
+ */
+int pack_stream_load_plan (pack_stream_t *s, const pack_plan_t *plan, ...)
+{
+    int i, r = 0;
+    va_list args;
+
+    va_start (args, plan);
+    for (i = 0; r == 0 && i < plan->nops; i += 1 + plan->op[i].group) {
+        r = stream_get_op (s, &plan->op[i], &args);
+    }
+    va_end (args);
+    return r;
+}
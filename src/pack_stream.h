@@ -0,0 +1,49 @@
+/**
+ *  @file   pack_stream.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  ファイル記述子に対するバッファ付きの入出力の宣言
+ */
+#ifndef __PACK_STREAM_H__
+#define __PACK_STREAM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "pack.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* バッファの最小バイト数(圧縮した配列の1ブロックが収まる大きさ) */
+#define PACK_STREAM_MIN     2048
+/* pack_stream_initにバッファを与えない場合のバイト数 */
+#define PACK_STREAM_DEFAULT 65536
+
+/* ファイル記述子に対する入出力 */
+typedef struct {
+    int fd;             /* ファイル記述子 */
+    char *buf;          /* バッファ */
+    size_t cap;         /* バッファのバイト数 */
+    size_t pos;         /* 読み出し位置(load時) */
+    size_t len;         /* バッファ中の有効なバイト数 */
+    int eof;            /* 1:load中にファイルの終わりに達した */
+    uint64_t io;        /* write/readした通算のバイト数('@'の位置の基準) */
+    char *storage;      /* mallocしたバッファ(呼び出し側が与えた場合はNULL) */
+    struct pack_arena *arena;   /* storageを割り当てたアリーナ(NULLならmalloc) */
+} pack_stream_t;
+
+int pack_stream_init (pack_stream_t *s, int fd, char *buffer, size_t size);
+void pack_stream_free (pack_stream_t *s);
+int pack_stream_flush (pack_stream_t *s);
+int pack_stream_save (pack_stream_t *s, char *format, ...);
+int pack_stream_save_plan (pack_stream_t *s, const pack_plan_t *plan, ...);
+int pack_stream_load (pack_stream_t *s, char *format, ...);
+int pack_stream_load_plan (pack_stream_t *s, const pack_plan_t *plan, ...);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __PACK_STREAM_H__ */
@@ -0,0 +1,288 @@
+/**
+ *  @file   pack_swap.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  配列のエンディアン変換コピー。
+ *
+ *  2/4/8バイト要素の配列をバイト順を反転しながらコピーする。
+ *  x86ではCPUIDを調べてAVX-512BW, AVX2, SSSE3のpshufbによる実装を
+ *  初回呼び出し時に選択し、それ以外の環境ではbswapによる実装を使う。
+ *  pack_swap_kernel_setで実装を固定できる(テストで全ての実装を通すため)。
+ */
+#include <string.h>
+#include <stdint.h>
+#include "pack_swap.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PACK_SWAP_X86 1
+#include <immintrin.h>
+#endif
+
+/* pshufb用のバイト並べ替えパターン(64バイト分) */
+static const char swap_mask16[64] = {
+    1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+    1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+    1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+    1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+};
+static const char swap_mask32[64] = {
+    3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+    3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+    3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+    3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+};
+static const char swap_mask64[64] = {
+    7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8,
+    7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8,
+    7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8,
+    7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8,
+};
+
+/**
+ *  @brief  1要素ずつエンディアン変換してコピーする内部関数
+ *  @param  d       コピー先
+ *  @param  s       コピー元
+ *  @param  bytes   コピーするバイト数(sizeの倍数)
+ *  @param  size    要素のバイト数(2, 4, 8)
+ */
+static void
+swap_scalar (char *d, const char *s, size_t bytes, int size)
+{
+    size_t i;
+#if defined(__GNUC__)
+    if (size == 2) {
+        uint16_t v;
+        for (i = 0; i < bytes; i += 2) {
+            memcpy (&v, s + i, 2);
+            v = __builtin_bswap16 (v);
+            memcpy (d + i, &v, 2);
+        }
+        return;
+    }
+    if (size == 4) {
+        uint32_t v;
+        for (i = 0; i < bytes; i += 4) {
+            memcpy (&v, s + i, 4);
+            v = __builtin_bswap32 (v);
+            memcpy (d + i, &v, 4);
+        }
+        return;
+    }
+    if (size == 8) {
+        uint64_t v;
+        for (i = 0; i < bytes; i += 8) {
+            memcpy (&v, s + i, 8);
+            v = __builtin_bswap64 (v);
+            memcpy (d + i, &v, 8);
+        }
+        return;
+    }
+#endif
+    for (i = 0; i < bytes; i += size) {
+        int j;
+        for (j = 0; j < size; j++) {
+            d[i + j] = s[i + size - 1 - j];
+        }
+    }
+}
+
+static void
+swap_kernel_scalar (char *d, const char *s, size_t bytes, const char *mask, int size)
+{
+    (void) mask;
+    swap_scalar (d, s, bytes, size);
+}
+
+#ifdef PACK_SWAP_X86
+
+__attribute__((target("ssse3")))
+static void
+swap_kernel_ssse3 (char *d, const char *s, size_t bytes, const char *mask, int size)
+{
+    __m128i m = _mm_loadu_si128 ((const __m128i *) mask);
+    size_t i;
+
+    for (i = 0; i + 16 <= bytes; i += 16) {
+        __m128i x = _mm_loadu_si128 ((const __m128i *) (s + i));
+        _mm_storeu_si128 ((__m128i *) (d + i), _mm_shuffle_epi8 (x, m));
+    }
+    swap_scalar (d + i, s + i, bytes - i, size);
+}
+
+__attribute__((target("avx2")))
+static void
+swap_kernel_avx2 (char *d, const char *s, size_t bytes, const char *mask, int size)
+{
+    __m256i m = _mm256_loadu_si256 ((const __m256i *) mask);
+    size_t i;
+
+    for (i = 0; i + 64 <= bytes; i += 64) {
+        __m256i x0 = _mm256_loadu_si256 ((const __m256i *) (s + i));
+        __m256i x1 = _mm256_loadu_si256 ((const __m256i *) (s + i + 32));
+        _mm256_storeu_si256 ((__m256i *) (d + i), _mm256_shuffle_epi8 (x0, m));
+        _mm256_storeu_si256 ((__m256i *) (d + i + 32), _mm256_shuffle_epi8 (x1, m));
+    }
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i x = _mm256_loadu_si256 ((const __m256i *) (s + i));
+        _mm256_storeu_si256 ((__m256i *) (d + i), _mm256_shuffle_epi8 (x, m));
+    }
+    swap_scalar (d + i, s + i, bytes - i, size);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void
+swap_kernel_avx512 (char *d, const char *s, size_t bytes, const char *mask, int size)
+{
+    __m512i m = _mm512_loadu_si512 ((const void *) mask);
+    size_t i;
+
+    (void) size;
+    for (i = 0; i + 64 <= bytes; i += 64) {
+        __m512i x = _mm512_loadu_si512 ((const void *) (s + i));
+        _mm512_storeu_si512 ((void *) (d + i), _mm512_shuffle_epi8 (x, m));
+    }
+    if (i < bytes) {
+        /* 端数はマスク付きのload/storeで処理する */
+        __mmask64 k = (~0ULL) >> (64 - (bytes - i));
+        __m512i x = _mm512_maskz_loadu_epi8 (k, (const void *) (s + i));
+        _mm512_mask_storeu_epi8 ((void *) (d + i), k, _mm512_shuffle_epi8 (x, m));
+    }
+}
+
+#endif /* PACK_SWAP_X86 */
+
+typedef void (*swap_kernel_t) (char *, const char *, size_t, const char *, int);
+
+static void swap_kernel_init (char *d, const char *s, size_t bytes, const char *mask, int size);
+
+/* 実行中のCPUで使う実装(初回呼び出し時に決まる) */
+static swap_kernel_t swap_kernel = swap_kernel_init;
+
+/**
+ *  @brief  levelの実装を返す内部関数
+ *  @param  level   PACK_SWAP_SCALAR〜PACK_SWAP_AVX512
+ *  @retval 実装、実行中のCPUで使えなければNULL
+ */
+static swap_kernel_t
+swap_kernel_find (int level)
+{
+#ifdef PACK_SWAP_X86
+    __builtin_cpu_init ();
+    switch (level) {
+    case PACK_SWAP_AVX512:
+        return __builtin_cpu_supports ("avx512bw") ? swap_kernel_avx512 : NULL;
+    case PACK_SWAP_AVX2:
+        return __builtin_cpu_supports ("avx2") ? swap_kernel_avx2 : NULL;
+    case PACK_SWAP_SSSE3:
+        return __builtin_cpu_supports ("ssse3") ? swap_kernel_ssse3 : NULL;
+    }
+#endif
+    return (level == PACK_SWAP_SCALAR) ? swap_kernel_scalar : NULL;
+}
+
+/**
+ *  @brief  CPUの機能を調べて使える中で最も速い実装を返す内部関数
+ */
+static swap_kernel_t
+swap_kernel_best (void)
+{
+    swap_kernel_t k = NULL;
+    int level;
+
+    for (level = PACK_SWAP_AVX512; k == NULL; level--) {
+        k = swap_kernel_find (level);
+    }
+    return k;
+}
+
+/**
+ *  @brief  実装を選び、そのまま変換を行う内部関数
+ */
+static void
+swap_kernel_init (char *d, const char *s, size_t bytes, const char *mask, int size)
+{
+    swap_kernel_t k = swap_kernel_best ();
+
+    swap_kernel = k;
+    k (d, s, bytes, mask, size);
+}
+
+/**
+ *  @brief  エンディアン変換に使う実装を固定する
+ *
+ *  実装を比べるテストのためのもので、変換中の他のスレッドがあってはならない。
+ *
+ *  @param  level   PACK_SWAP_SCALAR〜PACK_SWAP_AVX512、
+ *                  PACK_SWAP_AUTOならCPUIDで選ぶ既定の動作に戻す
+ *  @retval 0:成功, -1:実行中のCPUではその実装を使えない(実装は変えない)
+ */
+int pack_swap_kernel_set (int level)
+{
+    swap_kernel_t k = (level == PACK_SWAP_AUTO) ? swap_kernel_best () : swap_kernel_find (level);
+
+    if (k == NULL) {
+        return -1;
+    }
+    swap_kernel = k;
+    return 0;
+}
+
+/**
+ *  @brief  2バイト要素の配列をエンディアン変換してコピーする
+ *  @param  dst コピー先
+ *  @param  src コピー元(dstと重なってはならない)
+ *  @param  n   要素数
+ */
+void pack_swap16 (void *dst, const void *src, size_t n)
+{
+    swap_kernel (dst, src, n * 2, swap_mask16, 2);
+}
+
+/**
+ *  @brief  4バイト要素の配列をエンディアン変換してコピーする
+ *  @param  dst コピー先
+ *  @param  src コピー元(dstと重なってはならない)
+ *  @param  n   要素数
+ */
+void pack_swap32 (void *dst, const void *src, size_t n)
+{
+    swap_kernel (dst, src, n * 4, swap_mask32, 4);
+}
+
+/**
+ *  @brief  8バイト要素の配列をエンディアン変換してコピーする
+ *  @param  dst コピー先
+ *  @param  src コピー元(dstと重なってはならない)
+ *  @param  n   要素数
+ */
+void pack_swap64 (void *dst, const void *src, size_t n)
+{
+    swap_kernel (dst, src, n * 8, swap_mask64, 8);
+}
+
+/**
+ *  @brief  size バイト要素の配列をエンディアン変換してコピーする
+ *  @param  dst     コピー先
+ *  @param  src     コピー元(dstと重なってはならない)
+ *  @param  n       要素数
+ *  @param  size    要素のバイト数(1, 2, 4, 8以外は1要素ずつ反転する)
+ */
+void pack_swap (void *dst, const void *src, size_t n, int size)
+{
+    switch (size) {
+    case 1:
+        memcpy (dst, src, n);
+        return;
+    case 2:
+        pack_swap16 (dst, src, n);
+        return;
+    case 4:
+        pack_swap32 (dst, src, n);
+        return;
+    case 8:
+        pack_swap64 (dst, src, n);
+        return;
+    }
+    swap_scalar (dst, src, n * size, size);
+}
@@ -0,0 +1,55 @@
+/**
+ *  @file   pack_swap.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  配列のエンディアン変換コピー(packライブラリ内部用)
+ */
+#ifndef __PACK_SWAP_H__
+#define __PACK_SWAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 1つの値のバイト順を反転する */
+#if defined(__GNUC__)
+#define pack_bswap16(v) __builtin_bswap16 (v)
+#define pack_bswap32(v) __builtin_bswap32 (v)
+#define pack_bswap64(v) __builtin_bswap64 (v)
+#else
+static inline uint16_t pack_bswap16 (uint16_t v)
+{
+    return (uint16_t) ((v >> 8) | (v << 8));
+}
+static inline uint32_t pack_bswap32 (uint32_t v)
+{
+    return ((uint32_t) pack_bswap16 ((uint16_t) v) << 16) | pack_bswap16 ((uint16_t) (v >> 16));
+}
+static inline uint64_t pack_bswap64 (uint64_t v)
+{
+    return ((uint64_t) pack_bswap32 ((uint32_t) v) << 32) | pack_bswap32 ((uint32_t) (v >> 32));
+}
+#endif
+
+/* pack_swap_kernel_setで選ぶ実装 */
+#define PACK_SWAP_AUTO      (-1)    /* CPUIDで選ぶ(既定) */
+#define PACK_SWAP_SCALAR    0       /* bswap */
+#define PACK_SWAP_SSSE3     1
+#define PACK_SWAP_AVX2      2
+#define PACK_SWAP_AVX512    3
+
+int pack_swap_kernel_set (int level);
+void pack_swap16 (void *dst, const void *src, size_t n);
+void pack_swap32 (void *dst, const void *src, size_t n);
+void pack_swap64 (void *dst, const void *src, size_t n);
+void pack_swap (void *dst, const void *src, size_t n, int size);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __PACK_SWAP_H__ */
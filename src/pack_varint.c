@@ -0,0 +1,283 @@
+/**
+ *  @file   pack_varint.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  LEB128可変長整数の符号化と復号。
+ *
+ *  各バイトの下位7bitに値を下位から詰め、続きがあるバイトは最上位bitを立てる。
+ *  バイト単位の形式なのでエンディアン変換('!')の影響は受けない。
+ *
+ *  配列の復号では、続きbitが立っていないバイト(1バイトで表せる値)が
+ *  まとまっている部分をSSE4.1(x86で使える場合)またはSWARで一括して展開し、
+ *  それ以外の値だけを1つずつ復号する。
+ */
+#include <string.h>
+#include "pack_varint.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PACK_VARINT_X86 1
+#include <immintrin.h>
+#endif
+
+/**
+ *  @brief  値を符号化した場合のバイト数を返す
+ *  @param  v   値
+ *  @retval バイト数(1〜10)
+ */
+int pack_varint_len (uint64_t v)
+{
+    int n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+/**
+ *  @brief  値を符号化してsaveする
+ *  @param  p   save先へのポインタ
+ *  @param  v   値
+ *  @retval saveされたデータの直後へのポインタ
+ */
+char *pack_varint_put (char *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (char) (v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char) v;
+    return p;
+}
+
+/**
+ *  @brief  符号化された値をloadする
+ *
+ *  PACK_VARINT_MAXバイトを超えて続く不正なデータは、そこで打ち切る。
+ *
+ *  @param  p   load元へのポインタ
+ *  @param  v   値の格納先
+ *  @retval loadされた領域の直後へのポインタ
+ */
+char *pack_varint_get (char *p, uint64_t *v)
+{
+    const unsigned char *q = (const unsigned char *) p;
+    uint64_t r = 0;
+    int shift = 0, i;
+
+    for (i = 0; i < PACK_VARINT_MAX; i++) {
+        unsigned char c = q[i];
+        r |= (uint64_t) (c & 0x7f) << shift;
+        shift += 7;
+        if ((c & 0x80) == 0) {
+            i++;
+            break;
+        }
+    }
+    *v = r;
+    return p + i;
+}
+
+/**
+ *  @brief  配列を符号化した場合のバイト数を返す
+ *  @param  v       配列
+ *  @param  n       要素数
+ *  @param  zigzag  1:zigzag符号化する(vはint64_tの配列)
+ *  @retval バイト数
+ */
+size_t pack_varint_size_array (const uint64_t *v, int n, int zigzag)
+{
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        total += pack_varint_len (zigzag ? pack_zigzag (v[i]) : v[i]);
+    }
+    return total;
+}
+
+/**
+ *  @brief  配列を符号化してsaveする
+ *  @param  p       save先へのポインタ
+ *  @param  v       配列
+ *  @param  n       要素数
+ *  @param  zigzag  1:zigzag符号化する(vはint64_tの配列)
+ *  @retval saveされたデータの直後へのポインタ
+ */
+char *pack_varint_put_array (char *p, const uint64_t *v, int n, int zigzag)
+{
+    int i;
+
+    if (zigzag) {
+        for (i = 0; i < n; i++) {
+            p = pack_varint_put (p, pack_zigzag (v[i]));
+        }
+    }
+    else {
+        for (i = 0; i < n; i++) {
+            p = pack_varint_put (p, v[i]);
+        }
+    }
+    return p;
+}
+
+/* 8バイトの各最上位bit */
+#define VARINT_HIGH_BITS 0x8080808080808080ULL
+
+/**
+ *  @brief  SWARで1バイトの値の並びをまとめて展開する復号
+ *
+ *  残りの要素数が8以上あれば、続く8バイトはすべてこの配列の範囲内にある
+ *  (1要素は1バイト以上)ので、範囲外を読むことはない。
+ */
+static char *
+varint_get_array_swar (char *p, uint64_t *v, int n)
+{
+    const unsigned char *q;
+    int i = 0, j;
+
+    while (n - i >= 8) {
+        uint64_t w;
+        memcpy (&w, p, 8);
+        if ((w & VARINT_HIGH_BITS) == 0) {
+            q = (const unsigned char *) p;
+            for (j = 0; j < 8; j++) {
+                v[i + j] = q[j];
+            }
+            p += 8;
+            i += 8;
+            continue;
+        }
+        p = pack_varint_get (p, &v[i++]);
+    }
+    for (; i < n; i++) {
+        p = pack_varint_get (p, &v[i]);
+    }
+    return p;
+}
+
+#ifdef PACK_VARINT_X86
+
+/* 16バイト中のk番目からの2バイトをuint64_t 2つに広げて格納する */
+#define VARINT_WIDEN2(x, v, k) \
+    _mm_storeu_si128 ((__m128i *) ((v) + (k)), _mm_cvtepu8_epi64 (_mm_srli_si128 ((x), (k))))
+
+/**
+ *  @brief  SSE4.1による復号
+ *
+ *  16バイトを読み、最上位bitのマスクから先頭に並ぶ1バイトの値の数を求めて
+ *  まとめて展開し、次の複数バイトの値だけを1つずつ復号する。
+ */
+__attribute__((target("sse4.1")))
+static char *
+varint_get_array_sse41 (char *p, uint64_t *v, int n)
+{
+    int i = 0, j, k;
+
+    while (n - i >= 16) {
+        __m128i x = _mm_loadu_si128 ((const __m128i *) p);
+        unsigned m = (unsigned) _mm_movemask_epi8 (x);
+        if (m == 0) {
+            VARINT_WIDEN2 (x, v + i, 0);
+            VARINT_WIDEN2 (x, v + i, 2);
+            VARINT_WIDEN2 (x, v + i, 4);
+            VARINT_WIDEN2 (x, v + i, 6);
+            VARINT_WIDEN2 (x, v + i, 8);
+            VARINT_WIDEN2 (x, v + i, 10);
+            VARINT_WIDEN2 (x, v + i, 12);
+            VARINT_WIDEN2 (x, v + i, 14);
+            p += 16;
+            i += 16;
+            continue;
+        }
+        /* 最初の続きbitまでは1バイトの値 */
+        k = __builtin_ctz (m);
+        for (j = 0; j < k; j++) {
+            v[i + j] = (unsigned char) p[j];
+        }
+        p += k;
+        i += k;
+        p = pack_varint_get (p, &v[i++]);
+    }
+    return varint_get_array_swar (p, v + i, n - i);
+}
+
+#endif /* PACK_VARINT_X86 */
+
+typedef char *(*varint_kernel_t) (char *, uint64_t *, int);
+
+static char *varint_kernel_init (char *p, uint64_t *v, int n);
+
+/* 実行中のCPUで使う復号の実装(初回呼び出し時に決まる) */
+static varint_kernel_t varint_kernel = varint_kernel_init;
+
+static char *
+varint_kernel_init (char *p, uint64_t *v, int n)
+{
+    varint_kernel_t k = varint_get_array_swar;
+#ifdef PACK_VARINT_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("sse4.1")) {
+        k = varint_get_array_sse41;
+    }
+#endif
+    varint_kernel = k;
+    return k (p, v, n);
+}
+
+/**
+ *  @brief  符号化された配列をloadする
+ *  @param  p       load元へのポインタ
+ *  @param  v       配列の格納先
+ *  @param  n       要素数
+ *  @param  zigzag  1:zigzag符号を戻す(vはint64_tの配列)
+ *  @retval loadされた領域の直後へのポインタ
+ */
+char *pack_varint_get_array (char *p, uint64_t *v, int n, int zigzag)
+{
+    int i;
+
+    if (n <= 0) {
+        return p;
+    }
+    p = varint_kernel (p, v, n);
+    if (zigzag) {
+        for (i = 0; i < n; i++) {
+            v[i] = pack_unzigzag (v[i]);
+        }
+    }
+    return p;
+}
+
+/**
+ *  @brief  符号化された配列を読み飛ばす
+ *
+ *  続きbitが立っていないバイトをn個数えるだけで、値は復号しない。
+ *
+ *  @param  p   配列の先頭へのポインタ
+ *  @param  n   要素数
+ *  @retval 配列の直後へのポインタ
+ */
+char *pack_varint_skip (char *p, int n)
+{
+    uint64_t w;
+    int k;
+
+    /* 残りの要素数が8以上あれば、続く8バイトはこの配列の範囲内にある */
+    while (n >= 8) {
+        memcpy (&w, p, 8);
+        k = __builtin_popcountll (~w & VARINT_HIGH_BITS);
+        if (k >= n) {
+            break;
+        }
+        p += 8;
+        n -= k;
+    }
+    for (; n > 0; p++) {
+        if ((*p & 0x80) == 0) {
+            n--;
+        }
+    }
+    return p;
+}
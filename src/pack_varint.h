@@ -0,0 +1,37 @@
+/**
+ *  @file   pack_varint.h
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  LEB128可変長整数とzigzag符号化(packライブラリ内部用)
+ */
+#ifndef __PACK_VARINT_H__
+#define __PACK_VARINT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 64bit整数を符号化した場合の最大バイト数 */
+#define PACK_VARINT_MAX 10
+
+/* zigzag符号化: 絶対値の小さい負数を小さい符号なし整数に写す */
+#define pack_zigzag(v)   (((uint64_t) (v) << 1) ^ (uint64_t) -((uint64_t) (v) >> 63))
+#define pack_unzigzag(u) (((uint64_t) (u) >> 1) ^ (uint64_t) -((uint64_t) (u) & 1))
+
+int pack_varint_len (uint64_t v);
+char *pack_varint_put (char *p, uint64_t v);
+char *pack_varint_get (char *p, uint64_t *v);
+size_t pack_varint_size_array (const uint64_t *v, int n, int zigzag);
+char *pack_varint_put_array (char *p, const uint64_t *v, int n, int zigzag);
+char *pack_varint_get_array (char *p, uint64_t *v, int n, int zigzag);
+char *pack_varint_skip (char *p, int n);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __PACK_VARINT_H__ */
@@ -0,0 +1,152 @@
+/**
+ *  @file   pack_view.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  複製しないload(view)。
+ *
+ *  pack_viewはpack_loadと同じ書式文字列を受け取るが、配列の項目には
+ *  格納先の代わりに「先頭へのポインタを受け取る変数」と「予備の格納先」を渡す。
+ *  配列がホストのバイト順のままで、型の大きさに揃った位置にあれば
+ *  buffer内を直接指すポインタを返し、複製しない。エンディアン変換や
+ *  圧縮の展開が必要な場合、揃っていない場合だけ予備の格納先に展開して
+ *  そちらを指すポインタを返す。単独変数はpack_loadと同じく複製する。
+ *
+ *  例）
+ *  const double *dp;
+ *  double tmp[10];
+ *  bp = pack_view (bp, "i d#", &iv, &dp, tmp, 10);
+ *
+ *  予備の格納先にNULLを渡した場合、複製が必要になるとNULLを返す。
+ *  '*'の配列は要素数の代わりにint *を渡し、予備の格納先の要素数を入れておくと
+ *  loadした要素数が返る。要素数がそれを超えていればNULLを返す(errnoはEMSGSIZE)。
+ *  グループは項目が混ざって並ぶので参照できず、pack_loadと同じ引数で複製する。
+ *  's', 'y'はpack_loadと同じく(const char **, int *)で参照を返す。
+ *  bufferを揃えて置き、配列の前に'@'で境界を合わせておけば必ず参照になる。
+ *  返されたポインタはbufferが有効な間だけ使える。
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "pack.h"
+#include "pack_internal.h"
+
+/**
+ *  @brief  1項目をviewとして取り出す内部関数
+ *  @param  bp      load元へのポインタ
+ *  @param  base    bufferの先頭('@'の位置の基準)
+ *  @param  op      項目
+ *  @param  ap      可変引数
+ *  @retval loadされた領域の直後へのポインタ、予備の格納先が必要なのに無いか
+ *          '*'の要素数が上限を超えていればNULL
+ */
+static char *
+pack_view_op (char *bp, char *base, const pack_op_t *op, va_list *ap)
+{
+    pack_op_t count = { 'J', 0, PACK_SCALAR, 0, 1, 4, 4, 0, NULL };
+    pack_op_t v;
+    pack_field_t f, c;
+    void **view;
+    uint32_t n;
+    int direct;
+
+    if (op->type == PACK_ALIGN) {
+        return bp + pack_align_pad (op, bp - base);
+    }
+    if (op->type == PACK_GROUP) {
+        /* 項目が混ざって並ぶので参照できない */
+        return pack_group_get (bp, op, ap);
+    }
+    if (op->mode == PACK_SCALAR || pack_op_string (op) || op->type == 'x') {
+        /* 's', 'y'はpack_loadでも複製しない */
+        pack_fetch_load (&f, op, ap);
+        return pack_get_field (bp, &f);
+    }
+    if (strchr ("rRtT", op->type) != NULL) {
+        f.scale = va_arg (*ap, double);
+    }
+    view = va_arg (*ap, void **);
+    f.op = op;
+    f.data = va_arg (*ap, void *);
+    if (op->mode == PACK_PREFIX) {
+        f.count = va_arg (*ap, int *);
+        count.endian = op->endian;
+        c.op = &count;
+        c.n = 1;
+        c.data = &n;
+        bp = pack_get_field (bp, &c);
+        if (n > (uint32_t) ((*f.count > 0) ? *f.count : 0)) {
+            errno = EMSGSIZE;
+            return NULL;
+        }
+        *f.count = f.n = (int) n;
+        /* 以降は'#'の配列と同じ */
+        v = *op;
+        v.mode = PACK_VAR;
+        f.op = op = &v;
+    }
+    else {
+        f.n = (op->mode == PACK_VAR) ? va_arg (*ap, int) : op->count;
+    }
+
+    direct = pack_op_native (op) && ((uintptr_t) bp % op->size) == 0;
+    if (direct) {
+        *view = bp;
+        return (f.n > 0) ? bp + pack_op_bytes (op, f.n) : bp;
+    }
+    if (f.data == NULL) {
+        return NULL;
+    }
+    *view = f.data;
+    return pack_get_field (bp, &f);
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  書式文字列に従ってbufferからデータをloadし、配列はbuffer内を参照する。
+ *  @param  buffer  データ領域の先頭へのポインタ
+ *  @param  format  書式文字列
+ *  @param  ...     単独変数はloadする変数へのポインタ、配列は
+ *                  (const 型 **view, 型 *予備の格納先 [, int 要素数 | int *要素数])
+ *  @retval buffer内からloadされた領域の直後へのポインタ、失敗した場合はNULL
+ *          (扱えない書式の場合errnoはEINVAL)
+ */
+char* pack_view (char *buffer, char *format, ...)
+{
+    char *fp = format, *bp = buffer;
+    int endian = 0;
+    pack_op_t op;
+    va_list args;
+
+    if (pack_format_check (format) < 0) {
+        return NULL;
+    }
+    va_start (args, format);
+    while (bp != NULL && (fp = pack_parse_op (fp, &op, &endian)) != NULL) {
+        bp = pack_view_op (bp, buffer, &op, &args);
+    }
+    va_end (args);
+    return bp;
+}
+
+/**
+ *  @ingroup pack
+ *  @brief  planに従ってbufferからデータをloadし、配列はbuffer内を参照する。
+ *  @param  buffer  データ領域の先頭へのポインタ
+ *  @param  plan    解析済みの書式
+ *  @param  ...     pack_viewと同じ可変引数
+ *  @retval buffer内からloadされた領域の直後へのポインタ、失敗した場合はNULL
+ */
+char* pack_view_plan (char *buffer, const pack_plan_t *plan, ...)
+{
+    char *bp = buffer;
+    int i;
+    va_list args;
+
+    va_start (args, plan);
+    for (i = 0; bp != NULL && i < plan->nops; i += 1 + plan->op[i].group) {
+        bp = pack_view_op (bp, buffer, &plan->op[i], &args);
+    }
+    va_end (args);
+    return bp;
+}
@@ -0,0 +1,426 @@
+/**
+ *  @file   packgen.c
+ *  @author Ryosuke Tajima
+ *  @license The MIT License
+ *
+ *  書式の定義ファイルから、書式毎に特化したsave/load/size関数を生成する。
+ *
+ *  使い方: packgen 定義ファイル 出力ヘッダ
+ *
+ *  定義ファイルには1行に1つ、名前と書式文字列を空白で区切って書く。
+ *  空行と'#'で始まる行は無視する。例えば
+ *
+ *    point   !i4 d f#
+ *
+ *  から、可変引数ではなく型の付いた引数を持つ次のインライン関数を生成する。
+ *
+ *    static inline int size_point (int n2);
+ *    static inline char *save_point (char *buffer, const int *a0, double a1,
+ *                                    const float *a2, int n2);
+ *    static inline char *load_point (char *buffer, int *a0, double *a1,
+ *                                    float *a2, int n2);
+ *
+ *  引数は項目の順に、単独変数はsaveでは値、loadではポインタ、配列は
+ *  先頭へのポインタと('#'の場合)要素数、固定小数点はその前に倍率になる。
+ *  '*'の配列の要素数は、loadでは上限を入れて渡し、loadした要素数が返る
+ *  int *になる。文字列's'はsaveではconst char *だけ、バイト列'y'は先頭と
+ *  バイト数を取り、loadではどちらもbuffer内の先頭とバイト数を受け取る
+ *  const char **, int *になる。詰め物'x'と境界合わせ'@'は引数を取らず、
+ *  '@'はbufferの先頭からの位置で揃える。グループ('(...)')は生成できない。
+ *  変換の無い型(c h i l f d b B w W j J q Q)はpack_gen.hの関数で直接
+ *  コピーし、それ以外の項目はその項目だけの書式でpack_save/pack_loadを
+ *  呼ぶ。どちらもpack_save/pack_loadと同じバイト列になる。
+ *
+ *  CMakeではlibpack_generate(target 定義ファイル)で生成してtargetに加える。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "pack_internal.h"
+
+/* 定義ファイルの1行の最大の長さ */
+#define GEN_LINE    4096
+
+/* 生成した名前(重複の検査に使う) */
+static char **gen_names;
+static int gen_nnames;
+
+/**
+ *  @brief  書式文字に対応する変数の型
+ */
+static const char *
+gen_ctype (char type)
+{
+    switch (type) {
+    case 'c': return "char";
+    case 'h': return "short";
+    case 'i': return "int";
+    case 'l': return "long";
+    case 'f': return "float";
+    case 'd': return "double";
+    case 'b': return "int8_t";
+    case 'B': return "uint8_t";
+    case 'w': return "int16_t";
+    case 'W': return "uint16_t";
+    case 'j': return "int32_t";
+    case 'J': return "uint32_t";
+    case 'q': return "int64_t";
+    case 'Q': return "uint64_t";
+    case 'v': return "uint64_t";
+    case 'z': return "int64_t";
+    }
+    return isupper (type) ? "double" : "float";
+}
+
+/**
+ *  @brief  変換せずに直接コピーできる項目か
+ */
+static int
+gen_direct (const pack_op_t *op)
+{
+    return op->codec == 0 && op->mode != PACK_PREFIX
+        && strchr ("chilfdbBwWjJqQ", op->type) != NULL;
+}
+
+/**
+ *  @brief  固定小数点(倍率の引数を取る)項目か
+ */
+static int
+gen_scaled (const pack_op_t *op)
+{
+    return strchr ("rRtT", op->type) != NULL;
+}
+
+/**
+ *  @brief  1項目だけの書式文字列を作る
+ */
+static void
+gen_op_format (const pack_op_t *op, char *buf, size_t size)
+{
+    char count[16] = "";
+
+    if (pack_op_string (op)) {
+        /* 's', 'y'は要素数を付けない */
+    }
+    else if (op->mode == PACK_VAR) {
+        strcpy (count, "#");
+    }
+    else if (op->mode == PACK_PREFIX) {
+        strcpy (count, "*");
+    }
+    else if (op->mode == PACK_FIXED) {
+        snprintf (count, sizeof(count), "%d", op->count);
+    }
+    snprintf (buf, size, "%s%s%c%s", op->endian ? "!" : "", op->codec ? "~" : "",
+              op->type, count);
+}
+
+/**
+ *  @brief  saveまたはloadの引数の並びを出力する
+ */
+static void
+gen_params (FILE *out, const pack_op_t *ops, int nops, int save)
+{
+    int k;
+
+    fprintf (out, "char *buffer");
+    for (k = 0; k < nops; k++) {
+        const pack_op_t *op = &ops[k];
+        if (op->type == 'x' || op->type == PACK_ALIGN) {
+            /* 詰め物は変数を取らない */
+            continue;
+        }
+        if (pack_op_string (op)) {
+            if (!save) {
+                fprintf (out, ", const char **a%d, int *n%d", k, k);
+            }
+            else if (op->type == 's') {
+                fprintf (out, ", const char *a%d", k);
+            }
+            else {
+                fprintf (out, ", const void *a%d, int n%d", k, k);
+            }
+            continue;
+        }
+        if (gen_scaled (op)) {
+            fprintf (out, ", double s%d", k);
+        }
+        if (op->mode == PACK_SCALAR) {
+            fprintf (out, save ? ", %s a%d" : ", %s *a%d", gen_ctype (op->type), k);
+        }
+        else {
+            fprintf (out, save ? ", const %s *a%d" : ", %s *a%d", gen_ctype (op->type), k);
+        }
+        if (op->mode == PACK_VAR) {
+            fprintf (out, ", int n%d", k);
+        }
+        else if (op->mode == PACK_PREFIX) {
+            fprintf (out, save ? ", int n%d" : ", int *n%d", k);
+        }
+    }
+}
+
+/**
+ *  @brief  size_名前 を出力する
+ */
+static void
+gen_size (FILE *out, const char *name, const pack_op_t *ops, int nops)
+{
+    char f[32];
+    int k, nvar = 0;
+
+    fprintf (out, "static inline int\nsize_%s (", name);
+    for (k = 0; k < nops; k++) {
+        if (ops[k].mode == PACK_VAR || ops[k].mode == PACK_PREFIX) {
+            fprintf (out, "%sint n%d", (nvar++ > 0) ? ", " : "", k);
+        }
+    }
+    fprintf (out, "%s)\n{\n    int size = 0;\n\n", (nvar == 0) ? "void" : "");
+    for (k = 0; k < nops; k++) {
+        const pack_op_t *op = &ops[k];
+        if (op->type == PACK_ALIGN) {
+            /* 詰め物は前の項目までの大きさで決まる */
+            fprintf (out, "    size += (int) pack_gen_align (size, %d);\n", op->count);
+        }
+        else if (op->type == 'x') {
+            fprintf (out, "    size += %d;\n", op->count);
+        }
+        else if (!gen_direct (op)) {
+            gen_op_format (op, f, sizeof(f));
+            fprintf (out, "    size += pack_size ((char *) \"%s\"%s", f,
+                     (op->mode == PACK_VAR || op->mode == PACK_PREFIX) ? "" : ");\n");
+            if (op->mode == PACK_VAR || op->mode == PACK_PREFIX) {
+                fprintf (out, ", n%d);\n", k);
+            }
+        }
+        else if (op->mode == PACK_VAR) {
+            fprintf (out, "    size += n%d * (int) sizeof(%s);\n", k, gen_ctype (op->type));
+        }
+        else {
+            fprintf (out, "    size += %d * (int) sizeof(%s);\n", op->count, gen_ctype (op->type));
+        }
+    }
+    fprintf (out, "    return size;\n}\n\n");
+}
+
+/**
+ *  @brief  save_名前 または load_名前 を出力する
+ */
+static void
+gen_body (FILE *out, const char *name, const pack_op_t *ops, int nops, int save)
+{
+    char f[32], n[16];
+    int k;
+
+    fprintf (out, "static inline char *\n%s_%s (", save ? "save" : "load", name);
+    gen_params (out, ops, nops, save);
+    fprintf (out, ")\n{\n    char *bp = buffer;\n\n");
+    for (k = 0; k < nops; k++) {
+        const pack_op_t *op = &ops[k];
+        if (op->mode == PACK_VAR) {
+            snprintf (n, sizeof(n), "n%d", k);
+        }
+        else {
+            snprintf (n, sizeof(n), "%d", op->count);
+        }
+        if (op->type == PACK_ALIGN) {
+            /* bufferの先頭からの位置で揃える */
+            fprintf (out, save ? "    bp = pack_gen_pad (bp, pack_gen_align (bp - buffer, %d));\n"
+                               : "    bp += pack_gen_align (bp - buffer, %d);\n", op->count);
+            continue;
+        }
+        if (op->type == 'x') {
+            fprintf (out, save ? "    bp = pack_gen_pad (bp, %d);\n" : "    bp += %d;\n", op->count);
+            continue;
+        }
+        if (gen_direct (op)) {
+            fprintf (out, "    bp = pack_gen_%s (bp, %sa%d, %s, sizeof(%s), %d);\n",
+                     save ? "put" : "get", (save && op->mode == PACK_SCALAR) ? "&" : "",
+                     k, n, gen_ctype (op->type), op->endian);
+            continue;
+        }
+        gen_op_format (op, f, sizeof(f));
+        fprintf (out, "    bp = pack_%s (bp, (char *) \"%s\"", save ? "save" : "load", f);
+        if (gen_scaled (op)) {
+            fprintf (out, ", s%d", k);
+        }
+        fprintf (out, ", a%d", k);
+        if ((op->mode == PACK_VAR || op->mode == PACK_PREFIX) && !(save && op->type == 's')) {
+            fprintf (out, ", n%d", k);
+        }
+        fprintf (out, ");\n");
+    }
+    fprintf (out, "    return bp;\n}\n\n");
+}
+
+/**
+ *  @brief  コメントの中に書式文字列を出力する("*" "/"はつなげない)
+ */
+static void
+gen_comment (FILE *out, const char *s)
+{
+    for (; *s != '\0'; s++) {
+        fputc (*s, out);
+        if (s[0] == '*' && s[1] == '/') {
+            fputc (' ', out);
+        }
+    }
+}
+
+/**
+ *  @brief  名前がCの識別子で、まだ使われていないかを調べる
+ *  @retval 0:使える, -1:使えない
+ */
+static int
+gen_check_name (const char *name)
+{
+    const char *p;
+    int i;
+
+    if (!isalpha ((unsigned char) name[0]) && name[0] != '_') {
+        return -1;
+    }
+    for (p = name; *p != '\0'; p++) {
+        if (!isalnum ((unsigned char) *p) && *p != '_') {
+            return -1;
+        }
+    }
+    for (i = 0; i < gen_nnames; i++) {
+        if (strcmp (gen_names[i], name) == 0) {
+            return -1;
+        }
+    }
+    gen_names = realloc (gen_names, (gen_nnames + 1) * sizeof(char *));
+    if (gen_names == NULL) {
+        return -1;
+    }
+    gen_names[gen_nnames++] = strdup (name);
+    return 0;
+}
+
+/**
+ *  @brief  1つの書式の関数を出力する
+ *  @retval 0:成功, -1:メモリが確保できない, -2:グループを含む
+ */
+static int
+gen_format (FILE *out, const char *name, char *format)
+{
+    pack_op_t *ops = NULL, *p, op;
+    char *fp = format;
+    int nops = 0, endian = 0;
+
+    if (strchr (format, '(') != NULL) {
+        /* 扱えないグループは解析が途中で止まるので、解析する前に断る */
+        return -2;
+    }
+    while ((fp = pack_parse_op (fp, &op, &endian)) != NULL) {
+        p = realloc (ops, (nops + 1) * sizeof(pack_op_t));
+        if (p == NULL) {
+            free (ops);
+            return -1;
+        }
+        ops = p;
+        ops[nops++] = op;
+    }
+    fprintf (out, "/* %s: \"", name);
+    gen_comment (out, format);
+    fprintf (out, "\" */\n");
+    gen_size (out, name, ops, nops);
+    gen_body (out, name, ops, nops, 1);
+    gen_body (out, name, ops, nops, 0);
+    free (ops);
+    return 0;
+}
+
+/**
+ *  @brief  出力ファイル名からインクルードガードの名前を作る
+ */
+static void
+gen_guard (const char *path, char *buf, size_t size)
+{
+    const char *base = strrchr (path, '/');
+    size_t i;
+
+    base = (base != NULL) ? base + 1 : path;
+    snprintf (buf, size, "__PACKGEN_%s", base);
+    for (i = 0; buf[i] != '\0'; i++) {
+        buf[i] = isalnum ((unsigned char) buf[i]) ? toupper ((unsigned char) buf[i]) : '_';
+    }
+    snprintf (buf + i, size - i, "__");
+}
+
+int main (int argc, char **argv)
+{
+    FILE *in, *out;
+    char line[GEN_LINE], guard[GEN_LINE];
+    char *name, *format, *end;
+    const char *base;
+    int lineno = 0, r = 0, k;
+
+    if (argc != 3) {
+        fprintf (stderr, "usage: packgen <formats.def> <output.h>\n");
+        return 2;
+    }
+    in = fopen (argv[1], "r");
+    if (in == NULL) {
+        perror (argv[1]);
+        return 1;
+    }
+    out = fopen (argv[2], "w");
+    if (out == NULL) {
+        perror (argv[2]);
+        fclose (in);
+        return 1;
+    }
+    gen_guard (argv[2], guard, sizeof(guard));
+    base = strrchr (argv[1], '/');
+    fprintf (out, "/* packgenが%sから生成した。編集しないこと。 */\n",
+             (base != NULL) ? base + 1 : argv[1]);
+    fprintf (out, "#ifndef %s\n#define %s\n\n#include \"pack_gen.h\"\n\n", guard, guard);
+
+    while (fgets (line, sizeof(line), in) != NULL) {
+        lineno++;
+        name = line;
+        while (isspace ((unsigned char) *name)) {
+            name++;
+        }
+        if (*name == '\0' || *name == '#') {
+            continue;
+        }
+        for (format = name; *format != '\0' && !isspace ((unsigned char) *format); format++)
+            ;
+        if (*format != '\0') {
+            *format++ = '\0';
+        }
+        while (isspace ((unsigned char) *format)) {
+            format++;
+        }
+        end = format + strlen (format);
+        while (end > format && isspace ((unsigned char) end[-1])) {
+            *--end = '\0';
+        }
+        if (gen_check_name (name) < 0) {
+            fprintf (stderr, "%s:%d: invalid or duplicate name '%s'\n", argv[1], lineno, name);
+            r = 1;
+            break;
+        }
+        if ((k = gen_format (out, name, format)) < 0) {
+            fprintf (stderr, "%s:%d: %s\n", argv[1], lineno,
+                     (k == -2) ? "groups are not supported" : "out of memory");
+            r = 1;
+            break;
+        }
+    }
+    fprintf (out, "#endif /* %s */\n", guard);
+    if (ferror (in)) {
+        perror (argv[1]);
+        r = 1;
+    }
+    fclose (in);
+    if (fclose (out) != 0 || r != 0) {
+        remove (argv[2]);
+        return 1;
+    }
+    return 0;
+}
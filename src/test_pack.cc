@@ -1,5 +1,28 @@
 #include <gtest/gtest.h>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "pack.h"
+#include "pack.hpp"
+#include "pack_iov.h"
+#include "pack_stream.h"
+#include "pack_log.h"
+#include "pack_pool.h"
+#include "pack_stats.h"
+#include "pack_swap.h"
+#include "pack_jit.h"
+#include "pack_ring.h"
+#include "pack_chan.h"
+#include "pack_arena.h"
+#include "test_formats_pack.h"
 
 /* save/load用のバッファ */
 char buff[1024];
@@ -338,6 +361,2100 @@ TEST(pack, mixed_1) {
     }
 } 
 
+/* planを使ったsave/load */
+TEST(pack, plan) {
+    char ac[4] = {1,2,3,4}, bc[4] = {};
+    short ah = 5, bh = 0;
+    long al = 1L << 40, bl = 0;
+    float af[10] = {1,2,3,4,5,6,7,8,9,10}, bf[10] = {};
+    double ad[3] = {0.5, 1.5, 2.5}, bd[3] = {};
+    char ref[1024];
+    pack_plan_t *plan;
+
+    plan = pack_compile ((char*)"c4 h l !f# d3");
+    ASSERT_TRUE(plan != NULL);
+    /* sizeのテスト */
+    EXPECT_EQ(pack_size ((char*)"c4 h l !f# d3", 10), pack_size_plan (plan, 10));
+    EXPECT_EQ(pack_size ((char*)"c4 h l !f# d3", 3), pack_size_plan (plan, 3));
+    clear_buff();
+    /* save: 書式文字列版と同じ内容になること */
+    memset (ref, 0, sizeof(ref));
+    char *rtail = pack_save (ref, (char*)"c4 h l !f# d3", ac, ah, al, af, 10, ad);
+    tail = pack_save_plan (buff, plan, ac, ah, al, af, 10, ad);
+    EXPECT_EQ(rtail - ref, tail - buff);
+    EXPECT_EQ(0, memcmp (ref, buff, tail - buff));
+    EXPECT_EQ(&buff[pack_size_plan (plan, 10)], tail);
+    /* load */
+    tail = pack_load_plan (buff, plan, bc, &bh, &bl, bf, 10, bd);
+    EXPECT_EQ(&buff[pack_size_plan (plan, 10)], tail);
+    for (int i=0; i<4; i++) {
+	EXPECT_EQ(ac[i], bc[i]);
+    }
+    EXPECT_EQ(ah, bh);
+    EXPECT_EQ(al, bl);
+    for (int i=0; i<10; i++) {
+	EXPECT_EQ(af[i], bf[i]);
+    }
+    for (int i=0; i<3; i++) {
+	EXPECT_EQ(ad[i], bd[i]);
+    }
+    pack_plan_free (plan);
+
+    /* '#'を含まない書式 */
+    plan = pack_compile ((char*)"i d");
+    EXPECT_EQ((int)(sizeof(int) + sizeof(double)), pack_size_plan (plan));
+    pack_plan_free (plan);
+}
+
+/* 大きな配列のエンディアン変換 */
+/* 1要素ずつバイト順を反転した結果 */
+static void swap_reference (char *d, const char *s, size_t n, int size)
+{
+    for (size_t i=0; i<n; i++) {
+	for (int j=0; j<size; j++) {
+	    d[i * size + j] = s[i * size + size - 1 - j];
+	}
+    }
+}
+
+TEST(pack, swap_array) {
+    /* SIMDの端数処理を通すため、要素数は半端な値にする */
+    const int n = 1000 + 13;
+    short *ah = new short[n], *bh = new short[n];
+    int *ai = new int[n], *bi = new int[n];
+    double *ad = new double[n], *bd = new double[n];
+    char *buf = new char[n * (sizeof(short) + sizeof(int) + sizeof(double))];
+    int kernels = 0;
+
+    for (int i=0; i<n; i++) {
+	ah[i] = (short)(i * 7 + 1);
+	ai[i] = i * 100003 + 1;
+	ad[i] = i * 0.25 + 1;
+    }
+    /* このCPUで使える全ての実装を通す */
+    for (int level = PACK_SWAP_SCALAR; level <= PACK_SWAP_AVX512; level++) {
+	if (pack_swap_kernel_set (level) < 0) {
+	    continue;
+	}
+	SCOPED_TRACE(level);
+	kernels++;
+	/* エンディアン変換あり */
+	tail = pack_save (buf, (char*)"!h# i# d#", ah, n, ai, n, ad, n);
+	EXPECT_EQ(buf + n * (sizeof(short) + sizeof(int) + sizeof(double)), tail);
+	/* 各要素のバイト順が反転していること */
+	for (int i=0; i<n; i++) {
+	    char *w = (char *) &ai[i];
+	    char *p = buf + n * sizeof(short) + i * sizeof(int);
+	    for (int j=0; j<(int)sizeof(int); j++) {
+		EXPECT_EQ(w[j], p[sizeof(int) - 1 - j]);
+	    }
+	}
+	memset (bh, 0, n * sizeof(short));
+	memset (bi, 0, n * sizeof(int));
+	memset (bd, 0, n * sizeof(double));
+	tail = pack_load (buf, (char*)"!h# i# d#", bh, n, bi, n, bd, n);
+	EXPECT_EQ(buf + n * (sizeof(short) + sizeof(int) + sizeof(double)), tail);
+	for (int i=0; i<n; i++) {
+	    EXPECT_EQ(ah[i], bh[i]);
+	    EXPECT_EQ(ai[i], bi[i]);
+	    EXPECT_EQ(ad[i], bd[i]);
+	}
+	/* 端数の要素数と、コピー先の直後を書き換えないこと */
+	for (int size = 2; size <= 8; size *= 2) {
+	    char src[66 * 8], dst[66 * 8], ref[66 * 8];
+	    for (int i=0; i<(int)sizeof(src); i++) {
+		src[i] = (char) (i * 13 + size);
+	    }
+	    for (int m = 1; m <= 65; m++) {
+		memset (dst, 0x5a, sizeof(dst));
+		memset (ref, 0x5a, sizeof(ref));
+		swap_reference (ref, src, m, size);
+		pack_swap (dst, src, m, size);
+		EXPECT_EQ(0, memcmp (dst, ref, sizeof(dst))) << "size " << size << " n " << m;
+	    }
+	}
+    }
+    pack_swap_kernel_set (PACK_SWAP_AUTO);
+    EXPECT_LE(1, kernels);
+    /* エンディアン変換なしはそのままのバイト列になること */
+    tail = pack_save (buf, (char*)"i#", ai, n);
+    EXPECT_EQ(0, memcmp (buf, ai, n * sizeof(int)));
+    EXPECT_EQ(-1, pack_swap_kernel_set (PACK_SWAP_AVX512 + 1));
+
+    delete[] ah; delete[] bh;
+    delete[] ai; delete[] bi;
+    delete[] ad; delete[] bd;
+    delete[] buf;
+}
+
+/* C++フロントエンドのsave/load */
+TEST(pack, cxx_front_end) {
+    char ac[4] = {1,2,3,4}, bc[4] = {};
+    short ah = -5, bh = 0;
+    int ai = 123456, bi = 0;
+    long al = -(1L << 40), bl = 0;
+    float af[10] = {1,2,3,4,5,6,7,8,9,10}, bf[10] = {};
+    double ad[4] = {0.5, 1.5, 2.5, 3.5}, bd[4] = {};
+    char ref[1024];
+
+    /* sizeはpack_sizeと同じ値 */
+    static_assert(pack::size<"i d4">() == sizeof(int) + 4 * sizeof(double));
+    EXPECT_EQ(pack_size ((char*)"c4 h i l !f# d4", 10), (pack::size<"c4 h i l !f# d4">(10)));
+
+    /* saveはpack_saveと同じバイト列 */
+    for (int e = 0; e < 2; e++) {
+	clear_buff();
+	memset (ref, 0, sizeof(ref));
+	char *rtail;
+	if (e) {
+	    rtail = pack_save (ref, (char*)"!c4 h i l f# d4 f", ac, ah, ai, al, af, 10, ad, 0.25);
+	    tail = pack::save<"!c4 h i l f# d4 f">(buff, ac, ah, ai, al, af, 10, ad, 0.25);
+	}
+	else {
+	    rtail = pack_save (ref, (char*)"c4 h i l f# d4 f", ac, ah, ai, al, af, 10, ad, 0.25);
+	    tail = pack::save<"c4 h i l f# d4 f">(buff, ac, ah, ai, al, af, 10, ad, 0.25);
+	}
+	EXPECT_EQ(rtail - ref, tail - buff);
+	EXPECT_EQ(0, memcmp (ref, buff, sizeof(buff)));
+    }
+
+    /* load */
+    float bs = 0;
+    tail = pack::load<"!c4 h i l f# d4 f">(buff, bc, &bh, &bi, &bl, bf, 10, bd, &bs);
+    EXPECT_EQ(&buff[pack_size ((char*)"c4 h i l f# d4 f", 10)], tail);
+    for (int i=0; i<4; i++) {
+	EXPECT_EQ(ac[i], bc[i]);
+	EXPECT_EQ(ad[i], bd[i]);
+    }
+    EXPECT_EQ(ah, bh);
+    EXPECT_EQ(ai, bi);
+    EXPECT_EQ(al, bl);
+    for (int i=0; i<10; i++) {
+	EXPECT_EQ(af[i], bf[i]);
+    }
+    EXPECT_EQ(0.25f, bs);
+}
+
+/* 伸長するバッファへのsave */
+TEST(pack, buf) {
+    char ac[4] = {1,2,3,4};
+    short ah = 5;
+    float af[100];
+    char storage[16];
+    pack_buf_t b;
+
+    for (int i=0; i<100; i++) {
+	af[i] = i;
+    }
+    /* 呼び出し側の領域から始めて、足りなくなったら伸長する */
+    pack_buf_init (&b, storage, sizeof(storage));
+    EXPECT_EQ(0, pack_buf_save (&b, (char*)"c4 h", ac, ah));
+    EXPECT_EQ(storage, b.data);
+    EXPECT_EQ(0, pack_buf_save (&b, (char*)"!f#", af, 100));
+    EXPECT_NE(storage, b.data);
+    EXPECT_EQ((size_t) pack_size ((char*)"c4 h f#", 100), b.len);
+    clear_buff();
+    tail = pack_save (buff, (char*)"c4 h !f#", ac, ah, af, 100);
+    EXPECT_EQ(0, memcmp (buff, b.data, b.len));
+
+    /* resetしても領域は再利用される */
+    char *data = b.data;
+    size_t cap = b.cap;
+    pack_buf_reset (&b);
+    EXPECT_EQ(0u, b.len);
+    pack_plan_t *plan = pack_compile ((char*)"c4 h !f#");
+    EXPECT_EQ(0, pack_buf_save_plan (&b, plan, ac, ah, af, 100));
+    EXPECT_EQ(data, b.data);
+    EXPECT_EQ(cap, b.cap);
+    EXPECT_EQ(0, memcmp (buff, b.data, b.len));
+    pack_plan_free (plan);
+    pack_buf_free (&b);
+}
+
+/* 幅が固定された整数のsave/load */
+TEST(pack, fixed_width) {
+    int8_t ab = -3, bb = 0;
+    uint8_t aB[3] = {1, 200, 255}, bB[3] = {};
+    int16_t aw = -1234, bw = 0;
+    uint16_t aW[3] = {1, 40000, 65535}, bW[3] = {};
+    int32_t aj = -123456789, bj = 0;
+    uint32_t aJ[3] = {1, 0x01020304u, 0xffffffffu}, bJ[3] = {};
+    int64_t aq = -(1LL << 50), bq = 0;
+    uint64_t aQ[3] = {1, 0x0102030405060708ull, ~0ull}, bQ[3] = {};
+
+    /* サイズは環境によらない */
+    EXPECT_EQ(1+3+2+6+4+12+8+24, pack_size ((char*)"b B3 w W3 j J3 q Q3"));
+    for (int e = 0; e < 2; e++) {
+	char *fmt = (char*)(e ? "!b B3 w W3 j J3 q Q3" : "b B3 w W3 j J3 q Q3");
+	clear_buff();
+	tail = pack_save (buff, fmt, ab, aB, aw, aW, aj, aJ, aq, aQ);
+	EXPECT_EQ(&buff[60], tail);
+	tail = pack_load (buff, fmt, &bb, bB, &bw, bW, &bj, bJ, &bq, bQ);
+	EXPECT_EQ(&buff[60], tail);
+	EXPECT_EQ(ab, bb);
+	EXPECT_EQ(aw, bw);
+	EXPECT_EQ(aj, bj);
+	EXPECT_EQ(aq, bq);
+	for (int i=0; i<3; i++) {
+	    EXPECT_EQ(aB[i], bB[i]);
+	    EXPECT_EQ(aW[i], bW[i]);
+	    EXPECT_EQ(aJ[i], bJ[i]);
+	    EXPECT_EQ(aQ[i], bQ[i]);
+	}
+	/* C++フロントエンドと同じバイト列 */
+	char ref[64] = {};
+	if (e) {
+	    pack::save<"!b B3 w W3 j J3 q Q3">(ref, ab, aB, aw, aW, aj, aJ, aq, aQ);
+	}
+	else {
+	    pack::save<"b B3 w W3 j J3 q Q3">(ref, ab, aB, aw, aW, aj, aJ, aq, aQ);
+	}
+	EXPECT_EQ(0, memcmp (ref, buff, 60));
+    }
+    /* 0x01020304をエンディアン変換すると逆順のバイト列になる */
+    clear_buff();
+    pack_save (buff, (char*)"!J", 0x01020304u);
+    uint32_t v = 0x01020304u;
+    char *w = (char *) &v;
+    EXPECT_EQ(w[3], buff[0]);
+    EXPECT_EQ(w[0], buff[3]);
+}
+
+/* 可変長整数のsave/load */
+TEST(pack, varint) {
+    uint64_t av[40], bv[40] = {};
+    int64_t az[40], bz[40] = {};
+    uint64_t sv = 300, tv = 0;
+    int64_t sz = -2, tz = 0;
+
+    /* 1バイトの値が続く部分と複数バイトの値が混ざった配列 */
+    for (int i=0; i<40; i++) {
+	av[i] = (i % 17 == 16) ? (1ULL << (i + 20)) : (uint64_t) i;
+	az[i] = (i % 2) ? -i : i * 1000;
+    }
+    av[39] = ~0ULL;
+    az[39] = INT64_MIN;
+
+    /* pack_sizeは上限、pack_size_exactは実際のサイズ */
+    EXPECT_EQ(10 * (1 + 1 + 40 + 40), pack_size ((char*)"v z v# z#", 40, 40));
+    int exact = pack_size_exact ((char*)"v z v# z#", sv, sz, av, 40, az, 40);
+    EXPECT_LT(exact, pack_size ((char*)"v z v# z#", 40, 40));
+    clear_buff();
+    tail = pack_save (buff, (char*)"v z v# z#", sv, sz, av, 40, az, 40);
+    EXPECT_EQ(&buff[exact], tail);
+    /* 300 = 0xac 0x02, -2 = zigzag 3 */
+    EXPECT_EQ((char) 0xac, buff[0]);
+    EXPECT_EQ(2, buff[1]);
+    EXPECT_EQ(3, buff[2]);
+    tail = pack_load (buff, (char*)"v z v# z#", &tv, &tz, bv, 40, bz, 40);
+    EXPECT_EQ(&buff[exact], tail);
+    EXPECT_EQ(sv, tv);
+    EXPECT_EQ(sz, tz);
+    for (int i=0; i<40; i++) {
+	EXPECT_EQ(av[i], bv[i]);
+	EXPECT_EQ(az[i], bz[i]);
+    }
+}
+
+/* 整数配列の圧縮 */
+TEST(pack, for_codec) {
+    const int n = 1000;
+    long *al = new long[n], *bl = new long[n];
+    int *ai = new int[n], *bi = new int[n];
+    uint64_t *aq = new uint64_t[n], *bq = new uint64_t[n];
+    char *buf = new char[pack_size ((char*)"~l# ~i# ~Q#", n, n, n)];
+
+    for (int i=0; i<n; i++) {
+	/* タイムスタンプ、符号の変わる値、全ビットを使う値 */
+	al[i] = 1700000000000L + i * 1000L + (i % 7);
+	ai[i] = (i % 2) ? -i * 3 : i * 5;
+	aq[i] = 0x9e3779b97f4a7c15ULL * (i + 1);
+    }
+    int exact = pack_size_exact ((char*)"~l# ~i# ~Q#", al, n, ai, n, aq, n);
+    tail = pack_save (buf, (char*)"~l# ~i# ~Q#", al, n, ai, n, aq, n);
+    EXPECT_EQ(buf + exact, tail);
+    EXPECT_LE(exact, pack_size ((char*)"~l# ~i# ~Q#", n, n, n));
+    /* タイムスタンプは元の大きさの1/4以下になる */
+    EXPECT_LT(pack_size_exact ((char*)"~l#", al, n) * 4, (int)(n * sizeof(long)));
+    tail = pack_load (buf, (char*)"~l# ~i# ~Q#", bl, n, bi, n, bq, n);
+    EXPECT_EQ(buf + exact, tail);
+    for (int i=0; i<n; i++) {
+	EXPECT_EQ(al[i], bl[i]);
+	EXPECT_EQ(ai[i], bi[i]);
+	EXPECT_EQ(aq[i], bq[i]);
+    }
+    /* 全て同じ値なら2つ目以降のブロックはビット幅0になる */
+    for (int i=0; i<n; i++) {
+	ai[i] = 7;
+    }
+    EXPECT_EQ((2 + 128 * 3 / 8) + 7 * 2, pack_size_exact ((char*)"~i#", ai, n));
+
+    delete[] al; delete[] bl;
+    delete[] ai; delete[] bi;
+    delete[] aq; delete[] bq;
+    delete[] buf;
+}
+
+/* 精度を落とした浮動小数点数のsave/load */
+TEST(pack, reduced_float) {
+    const int n = 37;
+    float af[n], bf[n] = {};
+    double ad[n], bd[n] = {};
+    float se = 0.5f, te = 0;
+    double sr = -1.25, tr = 0;
+
+    for (int i=0; i<n; i++) {
+	af[i] = (i - 18) * 0.5f;
+	ad[i] = (i - 18) * 0.25;
+    }
+    /* 2バイト/4バイトで保存される */
+    EXPECT_EQ(2 + 2 + 4 * n * 2 + 4 * n, pack_size ((char*)"e R e# E# g# G# t#", n, n, n, n, n));
+    for (int e = 0; e < 2; e++) {
+	char *fmt = (char*)(e ? "!e R e# E# g# G# t#" : "e R e# E# g# G# t#");
+	clear_buff();
+	tail = pack_save (buff, fmt, se, 100.0, sr, af, n, ad, n, af, n, ad, n, 1000.0, af, n);
+	EXPECT_EQ(&buff[pack_size (fmt, n, n, n, n, n)], tail);
+	/* 0.5刻みの値は半精度でもbfloat16でも誤差なく戻る */
+	tail = pack_load (buff, fmt, &te, 100.0, &tr, bf, n, bd, n, bf, n, bd, n, 1000.0, bf, n);
+	EXPECT_EQ(&buff[pack_size (fmt, n, n, n, n, n)], tail);
+	EXPECT_EQ(se, te);
+	EXPECT_EQ(sr, tr);
+	for (int i=0; i<n; i++) {
+	    EXPECT_EQ(af[i], bf[i]);
+	    EXPECT_EQ(ad[i], bd[i]);
+	}
+    }
+    /* 丸め: 1 + 2^-11 は偶数側の1に、1 + 3*2^-11 は1 + 2^-9 になる */
+    float r[2] = {1.0f + 1.0f / 2048, 1.0f + 3.0f / 2048}, s[2];
+    pack_save (buff, (char*)"e2", r);
+    pack_load (buff, (char*)"e2", s);
+    EXPECT_EQ(1.0f, s[0]);
+    EXPECT_EQ(1.0f + 1.0f / 512, s[1]);
+    /* 半精度の範囲を超える値は無限大、固定小数点は飽和する */
+    float big[2] = {1e6f, -1e6f}, res[2];
+    pack_save (buff, (char*)"e2", big);
+    pack_load (buff, (char*)"e2", res);
+    EXPECT_TRUE(std::isinf (res[0]));
+    EXPECT_TRUE(std::isinf (res[1]) && res[1] < 0);
+    pack_save (buff, (char*)"r2", 1.0, big);
+    int16_t raw[2];
+    pack_load (buff, (char*)"w2", raw);
+    EXPECT_EQ(32767, raw[0]);
+    EXPECT_EQ(-32768, raw[1]);
+}
+
+/* scatter-gather出力 */
+TEST(pack, iov) {
+    const int n = 1000;
+    double *ad = new double[n];
+    int ai[4] = {1,2,3,4};
+    struct iovec iov[8];
+    char stage[64];
+    pack_iov_t v;
+
+    for (int i=0; i<n; i++) {
+	ad[i] = i * 0.5;
+    }
+    pack_iov_init (&v, iov, 8, stage, sizeof(stage), 1024);
+    EXPECT_EQ(0, pack_iov_save (&v, (char*)"i c i4 d# h", n, 'x', ai, ad, n, 7));
+    /* 大きな配列は参照され、前後の小さな項目はstageにまとめられる */
+    ASSERT_EQ(3, v.iovcnt);
+    EXPECT_EQ(stage, iov[0].iov_base);
+    EXPECT_EQ((void *) ad, iov[1].iov_base);
+    EXPECT_EQ(n * sizeof(double), iov[1].iov_len);
+    EXPECT_EQ((size_t) pack_size ((char*)"i c i4 d# h", n), v.len);
+    /* iovecをつなげるとpack_saveと同じバイト列になる */
+    char *ref = new char[v.len], *cat = new char[v.len];
+    pack_save (ref, (char*)"i c i4 d# h", n, 'x', ai, ad, n, 7);
+    size_t off = 0;
+    for (int i=0; i<v.iovcnt; i++) {
+	memcpy (cat + off, iov[i].iov_base, iov[i].iov_len);
+	off += iov[i].iov_len;
+    }
+    EXPECT_EQ(0, memcmp (ref, cat, v.len));
+    /* エンディアン変換する配列はstageに入るので、stageが足りなければ失敗する */
+    pack_iov_reset (&v);
+    EXPECT_EQ(-1, pack_iov_save (&v, (char*)"!d#", ad, n));
+    EXPECT_EQ(0, v.iovcnt);
+    EXPECT_EQ(0u, v.len);
+
+    delete[] ad;
+    delete[] ref;
+    delete[] cat;
+}
+
+/* 複製しないload */
+TEST(pack, view) {
+    double ad[10] = {1,2,3,4,5,6,7,8,9,10}, tmp[10] = {};
+    int ai[3] = {7,8,9}, ti[3] = {};
+    char ac[5] = {'a','b','c','d','e'};
+    const double *vd;
+    const int *vi;
+    const char *vc;
+    int iv = 0;
+    /* 8バイト境界に揃えたバッファ */
+    alignas(8) char abuf[256];
+
+    /* i(4バイト) i3(12バイト)の後なのでd#は8バイト境界に揃う */
+    tail = pack_save (abuf, (char*)"i i3 d# c5", 3, ai, ad, 10, ac);
+    char *vt = pack_view (abuf, (char*)"i i3 d# c5", &iv, &vi, ti, &vd, tmp, 10, &vc, NULL);
+    EXPECT_EQ(tail, vt);
+    EXPECT_EQ(3, iv);
+    /* buffer内を直接指している */
+    EXPECT_EQ((const int *) &abuf[4], vi);
+    EXPECT_EQ((const double *) &abuf[16], vd);
+    EXPECT_EQ(&abuf[96], vc);
+    for (int i=0; i<10; i++) {
+	EXPECT_EQ(ad[i], vd[i]);
+    }
+    /* エンディアン変換が必要な配列は予備の格納先に展開される */
+    pack_save (abuf, (char*)"!i i3", 3, ai);
+    vt = pack_view (abuf, (char*)"!i i3", &iv, &vi, ti);
+    EXPECT_EQ(&abuf[16], vt);
+    EXPECT_EQ(ti, vi);
+    EXPECT_EQ(3, iv);
+    for (int i=0; i<3; i++) {
+	EXPECT_EQ(ai[i], vi[i]);
+    }
+    /* 境界に揃っていなければ展開し、予備の格納先が無ければ失敗する */
+    pack_save (abuf, (char*)"c d#", 'z', ad, 10);
+    EXPECT_EQ(&abuf[81], pack_view (abuf, (char*)"c d#", &ac[0], &vd, tmp, 10));
+    EXPECT_EQ(tmp, vd);
+    EXPECT_EQ(ad[9], vd[9]);
+    EXPECT_EQ(NULL, pack_view (abuf, (char*)"c d#", &ac[0], &vd, NULL, 10));
+}
+
+/* ファイル記述子へのバッファ付き入出力 */
+TEST(pack, stream) {
+    const int N = 5000;
+    static double ad[N], ld[N];
+    static int ai[N], li[N];
+    static uint64_t av[N], lv[N];
+    static int64_t aq[N], lq[N];
+    static float af[N], lf[N];
+    int iv = 0;
+    char cv = 0;
+    /* 必要なバイト数を求めてメモリ上にsaveしたものと比べる */
+    const char *fmt = "c d# !i# v# ~q# e# i";
+    for (int i=0; i<N; i++) {
+	ad[i] = i * 0.5;
+	ai[i] = i * 3 - 7;
+	av[i] = (uint64_t) i * i * 131;
+	aq[i] = 1000000007LL * i - (i % 7) * 13;
+	af[i] = (float) (i % 100) / 4.0f;
+    }
+    int bytes = pack_size_exact ((char*)fmt, 'x', ad, N, ai, N, av, N, aq, N, af, N, 42);
+    char *mem = (char *) malloc (bytes);
+    char *mt = pack_save (mem, (char*)fmt, 'x', ad, N, ai, N, av, N, aq, N, af, N, 42);
+    EXPECT_EQ(bytes, mt - mem);
+
+    FILE *fp = tmpfile ();
+    ASSERT_TRUE(fp != NULL);
+    int fd = fileno (fp);
+    pack_stream_t s;
+    /* 配列より小さなバッファで書く */
+    ASSERT_EQ(0, pack_stream_init (&s, fd, NULL, PACK_STREAM_MIN));
+    for (int r=0; r<3; r++) {
+	EXPECT_EQ(0, pack_stream_save (&s, (char*)fmt, 'x', ad, N, ai, N, av, N, aq, N, af, N, 42));
+    }
+    EXPECT_EQ(0, pack_stream_flush (&s));
+    pack_stream_free (&s);
+    EXPECT_EQ(3 * bytes, lseek (fd, 0, SEEK_END));
+
+    char *file = (char *) malloc (3 * bytes);
+    EXPECT_EQ(3 * bytes, pread (fd, file, 3 * bytes, 0));
+    for (int r=0; r<3; r++) {
+	EXPECT_EQ(0, memcmp (mem, file + r * bytes, bytes));
+    }
+
+    /* 読み込み */
+    lseek (fd, 0, SEEK_SET);
+    ASSERT_EQ(0, pack_stream_init (&s, fd, NULL, PACK_STREAM_MIN));
+    for (int r=0; r<3; r++) {
+	memset (ld, 0, sizeof(ld));
+	memset (lq, 0, sizeof(lq));
+	EXPECT_EQ(0, pack_stream_load (&s, (char*)fmt, &cv, ld, N, li, N, lv, N, lq, N, lf, N, &iv));
+	EXPECT_EQ('x', cv);
+	EXPECT_EQ(42, iv);
+	EXPECT_EQ(0, memcmp (ad, ld, sizeof(ad)));
+	EXPECT_EQ(0, memcmp (ai, li, sizeof(ai)));
+	EXPECT_EQ(0, memcmp (av, lv, sizeof(av)));
+	EXPECT_EQ(0, memcmp (aq, lq, sizeof(aq)));
+	EXPECT_EQ(0, memcmp (af, lf, sizeof(af)));
+    }
+    /* ファイルの終わり */
+    EXPECT_EQ(0, s.eof);
+    EXPECT_EQ(-1, pack_stream_load (&s, (char*)"c", &cv));
+    EXPECT_EQ(1, s.eof);
+    pack_stream_free (&s);
+
+    /* 途中で切れたデータ */
+    for (int cut = bytes - 1; cut > 0; cut -= bytes / 7) {
+	ASSERT_EQ(0, ftruncate (fd, cut));
+	lseek (fd, 0, SEEK_SET);
+	ASSERT_EQ(0, pack_stream_init (&s, fd, NULL, 0));
+	EXPECT_EQ(-1, pack_stream_load (&s, (char*)fmt, &cv, ld, N, li, N, lv, N, lq, N, lf, N, &iv));
+	EXPECT_EQ(1, s.eof);
+	pack_stream_free (&s);
+    }
+    /* 呼び出し側が与えるバッファは小さすぎてはならない */
+    char small[16];
+    EXPECT_EQ(-1, pack_stream_init (&s, fd, small, sizeof(small)));
+    fclose (fp);
+    free (file);
+    free (mem);
+}
+
+/* 2GiBを超える配列(メモリは触らずに/dev/nullへ書き、バイト数だけを確かめる) */
+TEST(pack, stream_large) {
+    const int N = 300000000;
+    const size_t bytes = (size_t) N * sizeof(double);
+    void *p = mmap (NULL, bytes, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+	GTEST_SKIP() << "cannot map " << bytes << " bytes";
+    }
+    double *big = (double *) p;
+    int fd = open ("/dev/null", O_WRONLY);
+    ASSERT_TRUE(fd >= 0);
+    pack_stream_t s;
+    ASSERT_EQ(0, pack_stream_init (&s, fd, NULL, 0));
+    EXPECT_EQ(0, pack_stream_save (&s, (char*)"c d#", 'a', big, N));
+    EXPECT_EQ(0, pack_stream_flush (&s));
+    EXPECT_EQ(1 + bytes, s.io);
+    EXPECT_EQ(0, pack_stream_save (&s, (char*)"d*", big, N));
+    EXPECT_EQ(0, pack_stream_flush (&s));
+    EXPECT_EQ(1 + bytes + 4 + bytes, s.io);
+    pack_stream_free (&s);
+    close (fd);
+
+    /* 読み込みはデータが足りなければ失敗する */
+    FILE *fp = tmpfile ();
+    ASSERT_TRUE(fp != NULL);
+    char head[64] = {0};
+    ASSERT_EQ(64u, fwrite (head, 1, sizeof(head), fp));
+    fflush (fp);
+    lseek (fileno (fp), 0, SEEK_SET);
+    ASSERT_EQ(0, pack_stream_init (&s, fileno (fp), NULL, 0));
+    EXPECT_EQ(-1, pack_stream_load (&s, (char*)"d#", big, N));
+    EXPECT_EQ(64u, s.io);
+    EXPECT_EQ(1, s.eof);
+    pack_stream_free (&s);
+    fclose (fp);
+    munmap (p, bytes);
+}
+
+/* 2GiBを超える配列の参照(メモリは触らずに終わりの位置だけを確かめる) */
+TEST(pack, view_large) {
+    const int N = 300000000;
+    const size_t bytes = (size_t) N * sizeof(double);
+    void *p = mmap (NULL, bytes, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+	GTEST_SKIP() << "cannot map " << bytes << " bytes";
+    }
+    double *vd = NULL;
+    EXPECT_EQ((char *) p + bytes, pack_view ((char *) p, (char*)"d#", &vd, NULL, N));
+    EXPECT_EQ((double *) p, vd);
+    munmap (p, bytes);
+}
+
+/* 追記専用のレコードログ */
+TEST(pack, log) {
+    char path[] = "/tmp/test_pack_log_XXXXXX";
+    int fd = mkstemp (path);
+    ASSERT_TRUE(fd >= 0);
+    close (fd);
+    std::string ipath = std::string (path) + ".idx";
+    double ad[64];
+    for (int i=0; i<64; i++) {
+	ad[i] = i * 0.25;
+    }
+
+    pack_log_t g;
+    ASSERT_EQ(0, pack_log_open (&g, path, PACK_LOG_WRITE));
+    EXPECT_EQ(0u, g.count);
+    g.sync_every = 100;
+    for (int i=0; i<1000; i++) {
+	ASSERT_EQ(0, pack_log_append (&g, (char*)"i i d#", i, i % 64, ad, i % 64));
+    }
+    EXPECT_EQ(1000u, g.count);
+    EXPECT_EQ(0, pack_log_close (&g));
+
+    /* 読み込みとO(1)の参照 */
+    ASSERT_EQ(0, pack_log_open (&g, path, PACK_LOG_READ));
+    ASSERT_EQ(1000u, g.count);
+    for (size_t i=0; i<g.count; i++) {
+	size_t len;
+	int iv, n;
+	const double *vd;
+	char *p = pack_log_get (&g, i, &len);
+	EXPECT_EQ(8 + (i % 64) * sizeof(double), len);
+	EXPECT_EQ(0u, (uintptr_t) p % PACK_LOG_ALIGN);
+	/* 写像中の配列をそのまま参照する */
+	EXPECT_EQ(p + len, pack_view (p, (char*)"i i d#", &iv, &n, &vd, NULL, (int) (i % 64)));
+	EXPECT_EQ((int) i, iv);
+	EXPECT_EQ((const double *) (p + 8), vd);
+	if (n > 0) {
+	    EXPECT_EQ(ad[n - 1], vd[n - 1]);
+	}
+    }
+    EXPECT_TRUE(pack_log_get (&g, 1000, NULL) == NULL);
+    EXPECT_EQ(-1, pack_log_append (&g, (char*)"i", 1));
+    pack_log_close (&g);
+
+    /* 索引が途中までしか無く、最後のレコードが壊れている */
+    ASSERT_EQ(0, truncate (ipath.c_str (), 100 * sizeof(uint64_t)));
+    struct stat st;
+    stat (path, &st);
+    fd = open (path, O_RDWR);
+    char c = 0x55;
+    EXPECT_EQ(1, pwrite (fd, &c, 1, st.st_size - 1));
+    close (fd);
+    ASSERT_EQ(0, pack_log_open (&g, path, PACK_LOG_WRITE));
+    EXPECT_EQ(999u, g.count);
+    EXPECT_EQ(0, pack_log_append (&g, (char*)"i", -1));
+    EXPECT_EQ(0, pack_log_close (&g));
+    ASSERT_EQ(0, pack_log_open (&g, path, PACK_LOG_READ));
+    EXPECT_EQ(1000u, g.count);
+    int iv = 0;
+    pack_load (pack_log_get (&g, 999, NULL), (char*)"i", &iv);
+    EXPECT_EQ(-1, iv);
+    pack_load (pack_log_get (&g, 998, NULL), (char*)"i", &iv);
+    EXPECT_EQ(998, iv);
+    pack_log_close (&g);
+    stat (ipath.c_str (), &st);
+    EXPECT_EQ(1000 * sizeof(uint64_t), (size_t) st.st_size);
+
+    unlink (path);
+    unlink (ipath.c_str ());
+}
+
+/* スレッドプール */
+static void count_task (void *arg, int task, int worker)
+{
+    int *done = (int *) arg;
+    __atomic_fetch_add (&done[task], 1, __ATOMIC_RELAXED);
+    /* 先頭のタスクほど重くして奪い合いを起こす */
+    if (task < 8) {
+	usleep (2000);
+    }
+    (void) worker;
+}
+
+TEST(pack, pool) {
+    pack_pool_t *pool = pack_pool_create (4);
+    ASSERT_TRUE(pool != NULL);
+    EXPECT_EQ(4, pack_pool_size (pool));
+    for (int r=0; r<3; r++) {
+	int done[1000] = {};
+	pack_pool_run (pool, 1000, count_task, done);
+	for (int i=0; i<1000; i++) {
+	    EXPECT_EQ(1, done[i]);
+	}
+    }
+    pack_pool_free (pool);
+}
+
+/* レコードログの並列走査 */
+typedef struct {
+    double sum;
+    long recs;
+    long isum;
+    char pad[40];
+} scan_state_t;
+
+static int scan_record (void *state, char *rec, size_t len, size_t i)
+{
+    scan_state_t *s = (scan_state_t *) state;
+    int iv, n;
+    double d[16];
+    pack_load (rec, (char*)"i i", &iv, &n);
+    pack_load (rec + 8, (char*)"d#", d, n);
+    for (int k=0; k<n; k++) {
+	s->sum += d[k];
+    }
+    s->recs++;
+    s->isum += iv;
+    (void) len;
+    return (iv < 0 && i > 0) ? 1 : 0;
+}
+
+static void scan_reduce (void *dst, const void *src)
+{
+    scan_state_t *d = (scan_state_t *) dst;
+    const scan_state_t *s = (const scan_state_t *) src;
+    d->sum += s->sum;
+    d->recs += s->recs;
+    d->isum += s->isum;
+}
+
+TEST(pack, scan) {
+    char path[] = "/tmp/test_pack_scan_XXXXXX";
+    int fd = mkstemp (path);
+    ASSERT_TRUE(fd >= 0);
+    close (fd);
+    std::string ipath = std::string (path) + ".idx";
+    pack_log_t g;
+    ASSERT_EQ(0, pack_log_open (&g, path, PACK_LOG_WRITE));
+    double d[16];
+    double sum = 0;
+    long isum = 0;
+    for (int i=0; i<20000; i++) {
+	int n = i % 16;
+	for (int k=0; k<n; k++) {
+	    d[k] = i + k * 0.5;
+	    sum += d[k];
+	}
+	isum += i;
+	ASSERT_EQ(0, pack_log_append (&g, (char*)"i i d#", i, n, d, n));
+    }
+    pack_log_close (&g);
+
+    ASSERT_EQ(0, pack_log_open (&g, path, PACK_LOG_READ));
+    pack_pool_t *pool = pack_pool_create (4);
+    scan_state_t st[4];
+    memset (st, 0, sizeof(st));
+    EXPECT_EQ(0, pack_scan (pool, &g, scan_record, st, sizeof(scan_state_t), scan_reduce));
+    EXPECT_EQ(20000, st[0].recs);
+    EXPECT_EQ(isum, st[0].isum);
+    EXPECT_NEAR(sum, st[0].sum, 1e-6 * sum);
+    pack_log_close (&g);
+
+    /* コールバックが打ち切る */
+    ASSERT_EQ(0, pack_log_open (&g, path, PACK_LOG_WRITE));
+    ASSERT_EQ(0, pack_log_append (&g, (char*)"i i", -1, 0));
+    memset (st, 0, sizeof(st));
+    EXPECT_EQ(-1, pack_scan (pool, &g, scan_record, st, sizeof(scan_state_t), NULL));
+    pack_log_close (&g);
+
+    /* メモリ上のレコード(受信したバッファなど) */
+    std::vector<char> mem;
+    std::vector<uint64_t> offsets;
+    for (int i=0; i<20000; i++) {
+	int n = i % 16;
+	for (int k=0; k<n; k++) {
+	    d[k] = i + k * 0.5;
+	}
+	uint32_t len = pack_size ((char*)"i i d#", n);
+	size_t off = mem.size ();
+	offsets.push_back (off);
+	mem.resize ((off + PACK_SCAN_FRAME + len + 7) & ~(size_t) 7);
+	memcpy (&mem[off], &len, 4);
+	pack_save (&mem[off + PACK_SCAN_FRAME], (char*)"i i d#", i, n, d, n);
+    }
+    std::vector<uint64_t> found (offsets.size ());
+    EXPECT_EQ(20000, pack_scan_offsets (mem.data (), mem.size (), NULL, 0));
+    EXPECT_EQ(20000, pack_scan_offsets (mem.data (), mem.size (), found.data (), found.size ()));
+    EXPECT_TRUE(found == offsets);
+    memset (st, 0, sizeof(st));
+    EXPECT_EQ(0, pack_scan_buffer (pool, mem.data (), mem.size (),
+				   scan_record, st, sizeof(scan_state_t), scan_reduce));
+    EXPECT_EQ(20000, st[0].recs);
+    EXPECT_EQ(isum, st[0].isum);
+    EXPECT_NEAR(sum, st[0].sum, 1e-6 * sum);
+    /* 一部のレコードだけ、打ち切り */
+    memset (st, 0, sizeof(st));
+    EXPECT_EQ(0, pack_scan_buffer (pool, &mem[offsets[100]], offsets[150] - offsets[100],
+				   scan_record, st, sizeof(scan_state_t), scan_reduce));
+    EXPECT_EQ(50, st[0].recs);
+    EXPECT_EQ(50 * 100 + 49 * 50 / 2, st[0].isum);
+    int neg = -1, zero = 0;
+    memcpy (&mem[offsets[5] + PACK_SCAN_FRAME], &neg, 4);
+    memcpy (&mem[offsets[5] + PACK_SCAN_FRAME + 4], &zero, 4);
+    EXPECT_EQ(-1, pack_scan_buffer (pool, mem.data (), mem.size (),
+				    scan_record, st, sizeof(scan_state_t), NULL));
+    EXPECT_EQ(0, pack_scan_buffer (pool, mem.data (), 0,
+				   scan_record, st, sizeof(scan_state_t), NULL));
+
+    /* 途中で切れたフレーム、壊れたバイト数はコールバックを呼ばずにEINVAL */
+    memset (st, 0, sizeof(st));
+    errno = 0;
+    EXPECT_EQ(-1, pack_scan_buffer (pool, mem.data (), offsets[10] + 4,
+				    scan_record, st, sizeof(scan_state_t), NULL));
+    EXPECT_EQ(EINVAL, errno);
+    errno = 0;
+    EXPECT_EQ(-1, pack_scan_buffer (pool, mem.data (), offsets[10] + PACK_SCAN_FRAME + 2,
+				    scan_record, st, sizeof(scan_state_t), NULL));
+    EXPECT_EQ(EINVAL, errno);
+    uint32_t bad = 0xfffffff0;
+    memcpy (&mem[offsets[7]], &bad, 4);
+    errno = 0;
+    EXPECT_EQ(-1, pack_scan_offsets (mem.data (), mem.size (), NULL, 0));
+    EXPECT_EQ(EINVAL, errno);
+    errno = 0;
+    EXPECT_EQ(-1, pack_scan_buffer (pool, mem.data (), mem.size (),
+				    scan_record, st, sizeof(scan_state_t), NULL));
+    EXPECT_EQ(EINVAL, errno);
+    long recs = 0;
+    for (int k=0; k<4; k++) {
+	recs += st[k].recs;
+    }
+    EXPECT_EQ(0, recs);
+
+    pack_pool_free (pool);
+    unlink (path);
+    unlink (ipath.c_str ());
+}
+
+/* 大きな配列の並列save/load */
+TEST(pack, par) {
+    const int N = 200000;
+    std::vector<double> ad(N), ld(N);
+    std::vector<float> af(N), lf(N), ae(N), le(N);
+    std::vector<uint64_t> av(N), lv(N);
+    std::vector<int64_t> aq(N), lq(N);
+    for (int i=0; i<N; i++) {
+	ad[i] = i * 0.125;
+	af[i] = (float) i;
+	ae[i] = (float) (i % 1000) * 0.5f;
+	av[i] = (uint64_t) i * (i % 17);
+	aq[i] = (int64_t) i * 1000 - (i % 5);
+    }
+    const char *fmt = "c d# !f# v# ~q# i e# Q";
+    int bytes = pack_size_exact ((char*)fmt, 'a', ad.data (), N, af.data (), N, av.data (), N,
+				 aq.data (), N, 7, ae.data (), N, (uint64_t) 99);
+    std::vector<char> ser(bytes), par(bytes);
+    EXPECT_EQ(ser.data () + bytes, pack_save (ser.data (), (char*)fmt, 'a', ad.data (), N, af.data (), N,
+					      av.data (), N, aq.data (), N, 7, ae.data (), N, (uint64_t) 99));
+
+    pack_pool_t *pool = pack_pool_create (4);
+    pack_pool_set_threshold (pool, 4096);
+    EXPECT_EQ(4096u, pack_pool_threshold (pool));
+    EXPECT_EQ(par.data () + bytes, pack_save_par (pool, par.data (), (char*)fmt, 'a', ad.data (), N, af.data (), N,
+						  av.data (), N, aq.data (), N, 7, ae.data (), N, (uint64_t) 99));
+    EXPECT_EQ(0, memcmp (ser.data (), par.data (), bytes));
+
+    char cv = 0;
+    int iv = 0;
+    uint64_t uq = 0;
+    EXPECT_EQ(par.data () + bytes, pack_load_par (pool, par.data (), (char*)fmt, &cv, ld.data (), N, lf.data (), N,
+						  lv.data (), N, lq.data (), N, &iv, le.data (), N, &uq));
+    EXPECT_EQ('a', cv);
+    EXPECT_EQ(7, iv);
+    EXPECT_EQ(99u, uq);
+    EXPECT_TRUE(ad == ld);
+    EXPECT_TRUE(af == lf);
+    EXPECT_TRUE(av == lv);
+    EXPECT_TRUE(aq == lq);
+    EXPECT_TRUE(ae == le);
+
+    /* planと、thresholdに満たない小さなメッセージ */
+    pack_plan_t *plan = pack_compile ((char*)"i d4");
+    double d4[4] = {1, 2, 3, 4}, l4[4] = {};
+    char small[64];
+    pack_pool_set_threshold (pool, PACK_PAR_THRESHOLD);
+    EXPECT_EQ(small + 4 + 32, pack_save_plan_par (pool, small, plan, 3, d4));
+    EXPECT_EQ(small + 4 + 32, pack_load_plan_par (pool, small, plan, &iv, l4));
+    EXPECT_EQ(3, iv);
+    EXPECT_EQ(4.0, l4[3]);
+    pack_plan_free (plan);
+    pack_pool_free (pool);
+}
+
+/* 書式文字列の解析結果の表を通しても結果が変わらないこと */
+TEST(pack, cache) {
+    char fmt[32];
+    int ia[2] = {1, 2}, ib[2] = {};
+    double d = 1.5, e = 0;
+
+    /* 同じ領域の書式文字列を書き換えて使う */
+    strcpy (fmt, "i2");
+    for (int k=0; k<3; k++) {
+	EXPECT_EQ(8, pack_size (fmt));
+	EXPECT_EQ(&buff[8], pack_save (buff, fmt, ia));
+	EXPECT_EQ(&buff[8], pack_load (buff, fmt, ib));
+	EXPECT_EQ(2, ib[1]);
+	strcpy (fmt, "!d");
+	EXPECT_EQ(8, pack_size (fmt));
+	EXPECT_EQ(&buff[8], pack_save (buff, fmt, d));
+	EXPECT_EQ(&buff[8], pack_load (buff, (char*)"!d", &e));
+	EXPECT_EQ(1.5, e);
+	strcpy (fmt, "i2");
+    }
+    /* 別の領域の同じ内容の書式文字列 */
+    char other[32];
+    strcpy (other, "!d");
+    e = 0;
+    EXPECT_EQ(&buff[8], pack_load (buff, other, &e));
+    EXPECT_EQ(1.5, e);
+    pack_buf_t b;
+    pack_buf_init (&b, NULL, 0);
+    EXPECT_EQ(0, pack_buf_save (&b, other, d));
+    EXPECT_EQ(0, memcmp (b.data, buff, 8));
+    pack_buf_free (&b);
+
+    /* 複数のスレッドから同じ書式文字列、別々の書式文字列を使う */
+    std::vector<std::thread> th;
+    for (int t=0; t<4; t++) {
+	th.emplace_back ([t] {
+	    char b[256], f[32];
+	    int v[40], w[40];
+	    for (int i=0; i<40; i++) {
+		v[i] = i * t;
+	    }
+	    for (int i=0; i<200; i++) {
+		int n = 1 + (i + t) % 40;
+		snprintf (f, sizeof(f), "c i%d", n);
+		char c = 0;
+		EXPECT_EQ(1 + 4 * n, pack_size (f));
+		pack_save (b, f, 'x', v);
+		memset (w, 0, sizeof(w));
+		EXPECT_EQ(&b[1 + 4 * n], pack_load (b, (char*)"c i#", &c, w, n));
+		EXPECT_EQ('x', c);
+		EXPECT_EQ(v[n - 1], w[n - 1]);
+	    }
+	});
+    }
+    for (auto &t : th) {
+	t.join ();
+    }
+
+    /* 表に入りきらない数の書式文字列、長い書式文字列 */
+    for (int n=1; n<=1000; n++) {
+	snprintf (fmt, sizeof(fmt), "c%d", n);
+	EXPECT_EQ(n, pack_size (fmt));
+    }
+    std::string longfmt;
+    for (int n=0; n<200; n++) {
+	longfmt += "c ";
+    }
+    EXPECT_EQ(200, pack_size ((char*) longfmt.c_str ()));
+    EXPECT_EQ(200, pack_size ((char*) longfmt.c_str ()));
+}
+
+/* 機械語に変換した書式のsave/loadがpack_save/pack_loadと同じ結果になること */
+TEST(pack, jit) {
+    char a[300], b[300];
+    char c = 'x', c2 = 0;
+    short h = 0x1234, h2 = 0;
+    int i4[4] = {1, -2, 0x12345678, 4}, i4b[4] = {};
+    long l = 0x0102030405060708L, l2 = 0;
+    float f = 1.25f, fa[100], fb[100];
+    double d = -3.5, d2 = 0, da[100], db[100];
+    uint16_t w[3] = {1, 0xff00, 3}, w2[3] = {};
+    uint64_t q = 0x1122334455667788ULL, q2 = 0;
+    for (int k=0; k<100; k++) {
+	fa[k] = k * 0.5f;
+	da[k] = k * 0.25;
+    }
+    for (int k=0; k<300; k++) {
+	a[k] = (char) k;
+    }
+
+    const char *formats[] = {"!i4 d f#", "c h i4 l f d", "!c h i4 l f d", "W3 Q", "!W3 Q",
+			     "d100 !d100", "!f# f#", "c300 !l", "i4 c#"};
+    for (const char *fmt : formats) {
+	pack_jit_t *jit = pack_jit_compile ((char*) fmt);
+	ASSERT_NE((pack_jit_t*) NULL, jit);
+#if defined(__x86_64__)
+	EXPECT_EQ(1, pack_jit_native (jit));
+#endif
+	for (int n : {0, 1, 7, 100}) {
+	    char *e1 = NULL, *e2 = NULL;
+	    std::vector<char> expect (2048, 0), got (2048, 0);
+	    std::string s (fmt);
+	    pack_jit_arg_t args[8] = {};
+	    if (s == "!i4 d f#") {
+		e1 = pack_save (expect.data (), (char*) fmt, i4, d, fa, n);
+		args[0].data = i4; args[1].data = &d; args[2].data = fa; args[2].n = n;
+	    }
+	    else if (s == "c h i4 l f d" || s == "!c h i4 l f d") {
+		e1 = pack_save (expect.data (), (char*) fmt, c, h, i4, l, f, d);
+		args[0].data = &c; args[1].data = &h; args[2].data = i4;
+		args[3].data = &l; args[4].data = &f; args[5].data = &d;
+	    }
+	    else if (s == "W3 Q" || s == "!W3 Q") {
+		e1 = pack_save (expect.data (), (char*) fmt, w, q);
+		args[0].data = w; args[1].data = &q;
+	    }
+	    else if (s == "d100 !d100") {
+		e1 = pack_save (expect.data (), (char*) fmt, da, da);
+		args[0].data = da; args[1].data = da;
+	    }
+	    else if (s == "!f# f#") {
+		e1 = pack_save (expect.data (), (char*) fmt, fa, n, fa, n);
+		args[0].data = fa; args[0].n = n; args[1].data = fa; args[1].n = n;
+	    }
+	    else if (s == "c300 !l") {
+		e1 = pack_save (expect.data (), (char*) fmt, a, l);
+		args[0].data = a; args[1].data = &l;
+	    }
+	    else {
+		e1 = pack_save (expect.data (), (char*) fmt, i4, a, n);
+		args[0].data = i4; args[1].data = a; args[1].n = n;
+	    }
+	    e2 = pack_jit_save (jit, got.data (), args);
+	    EXPECT_EQ(e1 - expect.data (), e2 - got.data ()) << fmt << " " << n;
+	    EXPECT_EQ(expect, got) << fmt << " " << n;
+
+	    /* 同じバイト列からloadする */
+	    pack_jit_arg_t largs[8] = {};
+	    memcpy (largs, args, sizeof(args));
+	    if (s == "!i4 d f#") {
+		largs[0].data = i4b; largs[1].data = &d2; largs[2].data = fb;
+		memset (fb, 0, sizeof(fb));
+		EXPECT_EQ(e2, pack_jit_load (jit, got.data (), largs));
+		EXPECT_EQ(0, memcmp (i4, i4b, sizeof(i4)));
+		EXPECT_EQ(d, d2);
+		EXPECT_EQ(0, memcmp (fa, fb, n * sizeof(float)));
+	    }
+	    else if (s == "c h i4 l f d" || s == "!c h i4 l f d") {
+		float f2 = 0;
+		largs[0].data = &c2; largs[1].data = &h2; largs[2].data = i4b;
+		largs[3].data = &l2; largs[4].data = &f2; largs[5].data = &d2;
+		EXPECT_EQ(e2, pack_jit_load (jit, got.data (), largs));
+		EXPECT_EQ(c, c2);
+		EXPECT_EQ(h, h2);
+		EXPECT_EQ(0, memcmp (i4, i4b, sizeof(i4)));
+		EXPECT_EQ(l, l2);
+		EXPECT_EQ(f, f2);
+		EXPECT_EQ(d, d2);
+	    }
+	    else if (s == "W3 Q" || s == "!W3 Q") {
+		largs[0].data = w2; largs[1].data = &q2;
+		EXPECT_EQ(e2, pack_jit_load (jit, got.data (), largs));
+		EXPECT_EQ(0, memcmp (w, w2, sizeof(w)));
+		EXPECT_EQ(q, q2);
+	    }
+	    else if (s == "d100 !d100") {
+		largs[0].data = db; largs[1].data = db;
+		EXPECT_EQ(e2, pack_jit_load (jit, got.data (), largs));
+		EXPECT_EQ(0, memcmp (da, db, sizeof(da)));
+	    }
+	    else if (s == "!f# f#") {
+		largs[0].data = fb; largs[1].data = fb;
+		memset (fb, 0, sizeof(fb));
+		EXPECT_EQ(e2, pack_jit_load (jit, got.data (), largs));
+		EXPECT_EQ(0, memcmp (fa, fb, n * sizeof(float)));
+	    }
+	    else if (s == "c300 !l") {
+		largs[0].data = b; largs[1].data = &l2;
+		EXPECT_EQ(e2, pack_jit_load (jit, got.data (), largs));
+		EXPECT_EQ(0, memcmp (a, b, sizeof(a)));
+		EXPECT_EQ(l, l2);
+	    }
+	    else {
+		largs[0].data = i4b; largs[1].data = b;
+		EXPECT_EQ(e2, pack_jit_load (jit, got.data (), largs));
+		EXPECT_EQ(0, memcmp (a, b, n));
+	    }
+	}
+	pack_jit_free (jit);
+    }
+
+    /* 変換できない型を含む書式はplanを解釈する */
+    pack_jit_t *jit = pack_jit_compile ((char*) "i v r ~i#");
+    ASSERT_NE((pack_jit_t*) NULL, jit);
+    EXPECT_EQ(0, pack_jit_native (jit));
+    int iv = 5, ia[3] = {10, 11, 13}, ib[3] = {};
+    uint64_t vv = 300;
+    float rv = 1.5f;
+    std::vector<char> expect (64, 0), got (64, 0);
+    char *e1 = pack_save (expect.data (), (char*) "i v r ~i#", iv, vv, 10.0, rv, ia, 3);
+    pack_jit_arg_t args[4] = {{&iv, 0, 0}, {&vv, 0, 0}, {&rv, 0, 10.0}, {ia, 3, 0}};
+    EXPECT_EQ(e1 - expect.data (), pack_jit_save (jit, got.data (), args) - got.data ());
+    EXPECT_EQ(expect, got);
+    int iv2 = 0;
+    uint64_t vv2 = 0;
+    float rv2 = 0;
+    pack_jit_arg_t largs[4] = {{&iv2, 0, 0}, {&vv2, 0, 0}, {&rv2, 0, 10.0}, {ib, 3, 0}};
+    EXPECT_EQ(got.data () + (e1 - expect.data ()), pack_jit_load (jit, got.data (), largs));
+    EXPECT_EQ(iv, iv2);
+    EXPECT_EQ(vv, vv2);
+    EXPECT_EQ(rv, rv2);
+    EXPECT_EQ(0, memcmp (ia, ib, sizeof(ia)));
+    pack_jit_free (jit);
+}
+
+/* packgenで生成した関数がpack_save/pack_load/pack_sizeと同じ結果になること */
+TEST(pack, packgen) {
+    std::vector<char> expect (4096, 0), got (4096, 0);
+    int i4[4] = {1, -2, 0x12345678, 4}, i4b[4] = {};
+    double d = -3.5, d2 = 0;
+    float fa[8] = {0.5f, 1, 2, 3, 4, 5, 6, 7}, fb[8] = {};
+
+    /* 変換の無い型 */
+    for (int n : {0, 3, 8}) {
+	std::fill (expect.begin (), expect.end (), 0);
+	std::fill (got.begin (), got.end (), 0);
+	EXPECT_EQ(pack_size ((char*) "!i4 d f#", n), size_point (n));
+	char *e = pack_save (expect.data (), (char*) "!i4 d f#", i4, d, fa, n);
+	EXPECT_EQ(e - expect.data (), save_point (got.data (), i4, d, fa, n) - got.data ());
+	EXPECT_EQ(expect, got);
+	memset (fb, 0, sizeof(fb));
+	EXPECT_EQ(got.data () + (e - expect.data ()), load_point (got.data (), i4b, &d2, fb, n));
+	EXPECT_EQ(0, memcmp (i4, i4b, sizeof(i4)));
+	EXPECT_EQ(d, d2);
+	EXPECT_EQ(0, memcmp (fa, fb, n * sizeof(float)));
+    }
+
+    /* すべての単独変数の型、エンディアン変換の有無 */
+    char c = 'a';
+    short h = 0x1234;
+    int iv = -7;
+    long l = 0x0102030405060708L;
+    float f = 2.5f;
+    int8_t b = -3;
+    uint8_t B = 200;
+    int16_t w = -300;
+    uint16_t W = 60000;
+    int32_t j = -70000;
+    uint32_t J = 4000000000u;
+    int64_t q = -5;
+    uint64_t Q = 0x1122334455667788ULL;
+    for (int swap = 0; swap < 2; swap++) {
+	const char *fmt = swap ? "!c h i l f d b B w W j J q Q" : "c h i l f d b B w W j J q Q";
+	EXPECT_EQ(pack_size ((char*) fmt), swap ? size_swapped () : size_scalars ());
+	char *e = pack_save (expect.data (), (char*) fmt, c, h, iv, l, f, d, b, B, w, W, j, J, q, Q);
+	char *g = swap ? save_swapped (got.data (), c, h, iv, l, f, d, b, B, w, W, j, J, q, Q)
+	    : save_scalars (got.data (), c, h, iv, l, f, d, b, B, w, W, j, J, q, Q);
+	EXPECT_EQ(e - expect.data (), g - got.data ());
+	EXPECT_EQ(0, memcmp (expect.data (), got.data (), e - expect.data ()));
+	char c2; short h2; int iv2; long l2; float f2; double dd;
+	int8_t b2; uint8_t B2; int16_t w2; uint16_t W2; int32_t j2; uint32_t J2; int64_t q2; uint64_t Q2;
+	g = swap ? load_swapped (got.data (), &c2, &h2, &iv2, &l2, &f2, &dd, &b2, &B2, &w2, &W2, &j2, &J2, &q2, &Q2)
+	    : load_scalars (got.data (), &c2, &h2, &iv2, &l2, &f2, &dd, &b2, &B2, &w2, &W2, &j2, &J2, &q2, &Q2);
+	EXPECT_EQ(e - expect.data (), g - got.data ());
+	EXPECT_EQ(c, c2); EXPECT_EQ(h, h2); EXPECT_EQ(iv, iv2); EXPECT_EQ(l, l2);
+	EXPECT_EQ(f, f2); EXPECT_EQ(d, dd); EXPECT_EQ(b, b2); EXPECT_EQ(B, B2);
+	EXPECT_EQ(w, w2); EXPECT_EQ(W, W2); EXPECT_EQ(j, j2); EXPECT_EQ(J, J2);
+	EXPECT_EQ(q, q2); EXPECT_EQ(Q, Q2);
+    }
+
+    /* 変換を伴う型はpack_save/pack_loadを通す */
+    short h3[3] = {1, -2, 3}, h3b[3] = {};
+    uint16_t wa[5] = {1, 2, 3, 4, 65535}, wb[5] = {};
+    int ia[6] = {100, 101, 103, 90, 1000, -5}, ib[6] = {};
+    uint64_t v = 300, v2 = 0;
+    int64_t z = -300, z2 = 0;
+    float ea[4] = {0.5f, -1, 2, 1024}, eb[4] = {};
+    float ra[2] = {1.25f, -2.5f}, rb[2] = {};
+    double T = 3.75, T2 = 0;
+    std::fill (expect.begin (), expect.end (), 0);
+    std::fill (got.begin (), got.end (), 0);
+    EXPECT_EQ(pack_size ((char*) "!h3 W# ~i# v z e# !r2 T c", 5, 6, 4), size_mixed (5, 6, 4));
+    char *e = pack_save (expect.data (), (char*) "!h3 W# ~i# v z e# !r2 T c",
+			 h3, wa, 5, ia, 6, v, z, ea, 4, 100.0, ra, 1000.0, T, c);
+    char *g = save_mixed (got.data (), h3, wa, 5, ia, 6, v, z, ea, 4, 100.0, ra, 1000.0, T, c);
+    EXPECT_EQ(e - expect.data (), g - got.data ());
+    EXPECT_EQ(expect, got);
+    char c2 = 0;
+    EXPECT_EQ(g, load_mixed (got.data (), h3b, wb, 5, ib, 6, &v2, &z2, eb, 4, 100.0, rb, 1000.0, &T2, &c2));
+    EXPECT_EQ(0, memcmp (h3, h3b, sizeof(h3)));
+    EXPECT_EQ(0, memcmp (wa, wb, sizeof(wa)));
+    EXPECT_EQ(0, memcmp (ia, ib, sizeof(ia)));
+    EXPECT_EQ(v, v2);
+    EXPECT_EQ(z, z2);
+    EXPECT_EQ(0, memcmp (ea, eb, sizeof(ea)));
+    EXPECT_EQ(0, memcmp (ra, rb, sizeof(ra)));
+    EXPECT_EQ(T, T2);
+    EXPECT_EQ(c, c2);
+
+    /* 展開すると大きい配列 */
+    std::vector<double> da (100), db (100);
+    for (int k=0; k<100; k++) {
+	da[k] = k * 0.5;
+    }
+    EXPECT_EQ(1600, size_big ());
+    e = pack_save (expect.data (), (char*) "d100 !d100", da.data (), da.data ());
+    EXPECT_EQ(e - expect.data (), save_big (got.data (), da.data (), da.data ()) - got.data ());
+    EXPECT_EQ(expect, got);
+    EXPECT_EQ(got.data () + 1600, load_big (got.data (), db.data (), db.data ()));
+    EXPECT_EQ(da, db);
+}
+
+/* リングバッファでのメッセージの受け渡し */
+TEST(pack, ring) {
+    pack_ring_t *r = pack_ring_create (3, 40, PACK_RING_SPSC);
+    ASSERT_NE((pack_ring_t*) NULL, r);
+    EXPECT_EQ(40u, pack_ring_slot_size (r));
+
+    /* スロットに直接saveして渡し、その場でloadする */
+    double da[4] = {1, 2, 3, 4}, db[4] = {};
+    int n = 0;
+    char *p = pack_ring_reserve (r, pack_size ((char*) "i d#", 4));
+    ASSERT_NE((char*) NULL, p);
+    pack_ring_commit (r, p, pack_save (p, (char*) "i d#", 4, da, 4) - p);
+    size_t len = 0;
+    p = pack_ring_acquire (r, &len);
+    ASSERT_NE((char*) NULL, p);
+    EXPECT_EQ(36u, len);
+    char *bp = pack_load (p, (char*) "i", &n);
+    pack_load (bp, (char*) "d#", db, n);
+    EXPECT_EQ(0, memcmp (da, db, sizeof(da)));
+    pack_ring_release (r, p);
+
+    /* 空、満杯(スロット数は4に切り上げられる)、大きすぎるメッセージ */
+    errno = 0;
+    EXPECT_EQ((char*) NULL, pack_ring_acquire (r, &len));
+    EXPECT_EQ(EAGAIN, errno);
+    EXPECT_EQ(-1, pack_ring_load (r, (char*) "i", &n));
+    for (int k=0; k<4; k++) {
+	EXPECT_EQ(0, pack_ring_save (r, (char*) "i v", k, (uint64_t) k * 1000));
+    }
+    errno = 0;
+    EXPECT_EQ(-1, pack_ring_save (r, (char*) "i", 9));
+    EXPECT_EQ(EAGAIN, errno);
+    for (int k=0; k<4; k++) {
+	uint64_t v = 0;
+	EXPECT_EQ(0, pack_ring_load (r, (char*) "i v", &n, &v));
+	EXPECT_EQ(k, n);
+	EXPECT_EQ((uint64_t) k * 1000, v);
+    }
+    errno = 0;
+    EXPECT_EQ((char*) NULL, pack_ring_reserve (r, 41));
+    EXPECT_EQ(EMSGSIZE, errno);
+    EXPECT_EQ(-1, pack_ring_save (r, (char*) "d#", da, 6));
+    EXPECT_EQ(EMSGSIZE, errno);
+    pack_ring_free (r);
+
+    /* SPSC: 順序通りに届く */
+    r = pack_ring_create (64, 16, PACK_RING_SPSC);
+    const int count = 100000;
+    std::thread producer ([r, count] {
+	for (int k=0; k<count; k++) {
+	    while (pack_ring_save (r, (char*) "i", k) < 0) {
+		std::this_thread::yield ();
+	    }
+	}
+    });
+    int bad = 0;
+    for (int k=0; k<count; k++) {
+	int v;
+	while (pack_ring_load (r, (char*) "i", &v) < 0) {
+	    std::this_thread::yield ();
+	}
+	bad += (v != k);
+    }
+    producer.join ();
+    EXPECT_EQ(0, bad);
+    pack_ring_free (r);
+
+    /* MPMC: すべてのメッセージがちょうど1回ずつ届く */
+    r = pack_ring_create (128, 16, PACK_RING_MPMC);
+    const int nthreads = 4, per = 20000;
+    std::atomic<long> received (0), sum (0);
+    std::vector<std::thread> th;
+    for (int t=0; t<nthreads; t++) {
+	th.emplace_back ([r, t, per] {
+	    for (int k=0; k<per; k++) {
+		char *slot;
+		while ((slot = pack_ring_reserve (r, 8)) == NULL) {
+		    std::this_thread::yield ();
+		}
+		pack_ring_commit (r, slot, pack_save (slot, (char*) "i i", t, k) - slot);
+	    }
+	});
+	th.emplace_back ([r, &received, &sum, nthreads, per] {
+	    while (received.load () < (long) nthreads * per) {
+		size_t l;
+		char *slot = pack_ring_acquire (r, &l);
+		if (slot == NULL) {
+		    std::this_thread::yield ();
+		    continue;
+		}
+		int a, b;
+		pack_load (slot, (char*) "i i", &a, &b);
+		pack_ring_release (r, slot);
+		sum += (long) a * per + b;
+		received++;
+	    }
+	});
+    }
+    for (auto &t : th) {
+	t.join ();
+    }
+    long total = (long) nthreads * per;
+    EXPECT_EQ(total, received.load ());
+    EXPECT_EQ(total * (total - 1) / 2, sum.load ());
+    pack_ring_free (r);
+}
+
+TEST(pack, chan) {
+    pack_chan_t w, r;
+    ASSERT_EQ(0, pack_chan_create (&w, NULL, 1000));
+    EXPECT_EQ(4096u, w.size);
+
+    /* 読み手がいなければ書いたレコードは捨てられる */
+    EXPECT_EQ(0, pack_chan_save (&w, 0, (char*) "i", 1));
+
+    /* 共有メモリ上に直接saveし、その場でloadする */
+    ASSERT_EQ(0, pack_chan_attach (&r, w.fd));
+    size_t len = 0;
+    errno = 0;
+    EXPECT_EQ((char*) NULL, pack_chan_next (&r, &len, 0));
+    EXPECT_EQ(EAGAIN, errno);
+    double da[4] = {1, 2, 3, 4}, db[4] = {};
+    int n = 0;
+    char *p = pack_chan_reserve (&w, pack_size ((char*) "i d#", 4), 0);
+    ASSERT_NE((char*) NULL, p);
+    pack_chan_commit (&w, pack_save (p, (char*) "i d#", 4, da, 4) - p);
+    p = pack_chan_next (&r, &len, 0);
+    ASSERT_NE((char*) NULL, p);
+    EXPECT_EQ(36u, len);
+    pack_load (pack_load (p, (char*) "i", &n), (char*) "d#", db, 4);
+    EXPECT_EQ(4, n);
+    EXPECT_EQ(0, memcmp (da, db, sizeof(da)));
+    pack_chan_release (&r);
+
+    /* 読み手が読まなければ満杯になる、大きすぎるレコード */
+    int k = 0;
+    while (pack_chan_save (&w, 0, (char*) "i d", k, k * 0.5) == 0) {
+	k++;
+    }
+    EXPECT_EQ(EAGAIN, errno);
+    EXPECT_EQ(4096 / 24, k);
+    errno = 0;
+    EXPECT_EQ((char*) NULL, pack_chan_reserve (&w, 4096, 0));
+    EXPECT_EQ(EMSGSIZE, errno);
+    for (int i=0; i<k; i++) {
+	double d = 0;
+	EXPECT_EQ(0, pack_chan_load (&r, 0, (char*) "i d", &n, &d));
+	EXPECT_EQ(i, n);
+	EXPECT_EQ(i * 0.5, d);
+    }
+    EXPECT_EQ(0, pack_chan_close (&r));
+    EXPECT_EQ(0, pack_chan_save (&w, 0, (char*) "i", 1));
+    EXPECT_EQ(0, pack_chan_close (&w));
+
+    /* 2つの読み手のプロセスが、折り返しと待ちを挟んですべてのレコードを受け取る */
+    ASSERT_EQ(0, pack_chan_create (&w, NULL, 4096));
+    const int count = 100000, nreaders = 2;
+    int ready[2];
+    ASSERT_EQ(0, pipe (ready));
+    pid_t pids[nreaders];
+    for (int i=0; i<nreaders; i++) {
+	pids[i] = fork ();
+	ASSERT_LE(0, pids[i]);
+	if (pids[i] == 0) {
+	    int errors = 0, v;
+	    double d;
+	    pack_chan_t c;
+	    if (pack_chan_attach (&c, w.fd) < 0 || write (ready[1], "r", 1) != 1) {
+		_exit (2);
+	    }
+	    for (int j=0; j<count; j++) {
+		if (pack_chan_load (&c, 5000, (char*) "i d", &v, &d) < 0
+		    || v != j || d != j * 0.5) {
+		    errors++;
+		}
+	    }
+	    if (pack_chan_next (&c, NULL, -1) != NULL || errno != EPIPE) {
+		errors++;
+	    }
+	    pack_chan_close (&c);
+	    _exit (errors ? 1 : 0);
+	}
+    }
+    for (int i=0; i<nreaders; i++) {
+	char ch;
+	ASSERT_EQ(1, read (ready[0], &ch, 1));
+    }
+    close (ready[0]);
+    close (ready[1]);
+    int failed = 0;
+    for (int j=0; j<count; j++) {
+	failed += pack_chan_save (&w, 5000, (char*) "i d", j, j * 0.5) < 0;
+    }
+    EXPECT_EQ(0, failed);
+    EXPECT_EQ(0, pack_chan_close (&w));
+    for (int i=0; i<nreaders; i++) {
+	int status = -1;
+	ASSERT_EQ(pids[i], waitpid (pids[i], &status, 0));
+	EXPECT_TRUE(WIFEXITED(status));
+	EXPECT_EQ(0, WEXITSTATUS(status));
+    }
+
+    /* 接続したまま終了した読み手は、書き手が待っている間に外される */
+    ASSERT_EQ(0, pack_chan_create (&w, NULL, 4096));
+    int go[2];
+    ASSERT_EQ(0, pipe (ready));
+    ASSERT_EQ(0, pipe (go));
+    pid_t dead = fork ();
+    ASSERT_LE(0, dead);
+    if (dead == 0) {
+	char ch;
+	pack_chan_t c;
+	close (go[1]);
+	if (pack_chan_attach (&c, w.fd) < 0 || write (ready[1], "r", 1) != 1) {
+	    _exit (2);
+	}
+	/* pack_chan_closeを呼ばずに終了する */
+	_exit (read (go[0], &ch, 1) == 0 ? 0 : 1);
+    }
+    char ch;
+    ASSERT_EQ(1, read (ready[0], &ch, 1));
+    close (ready[0]);
+    close (ready[1]);
+    close (go[0]);
+    k = 0;
+    while (pack_chan_save (&w, 0, (char*) "i d", k, k * 0.5) == 0) {
+	k++;
+    }
+    EXPECT_EQ(EAGAIN, errno);
+    EXPECT_EQ(4096 / 24, k);
+    std::thread killer ([&] {
+	usleep (50000);
+	close (go[1]);
+	int status = -1;
+	EXPECT_EQ(dead, waitpid (dead, &status, 0));
+	EXPECT_TRUE(WIFEXITED(status));
+	EXPECT_EQ(0, WEXITSTATUS(status));
+    });
+    EXPECT_EQ(0, pack_chan_save (&w, 5000, (char*) "i d", k, k * 0.5));
+    killer.join ();
+    EXPECT_EQ(0u, w.hdr->reader[0].active);
+    for (int j=0; j<1000; j++) {
+	EXPECT_EQ(0, pack_chan_save (&w, 0, (char*) "i d", j, j * 0.5));
+    }
+    EXPECT_EQ(0, pack_chan_close (&w));
+}
+
+TEST(pack, arena) {
+    pack_arena_t *a = pack_arena_create (0);
+    ASSERT_NE((pack_arena_t*) NULL, a);
+
+    /* サイズクラスの大きさまで使え、解放したブロックはすぐ再利用される */
+    char *p = (char*) pack_arena_alloc (a, 100);
+    ASSERT_NE((char*) NULL, p);
+    EXPECT_EQ(0u, (uintptr_t) p % 16);
+    EXPECT_EQ(112u, pack_arena_size (p));
+    memset (p, 0x5a, 112);
+    pack_arena_release (a, p);
+    EXPECT_EQ(p, pack_arena_alloc (a, 80));
+
+    /* 大きさを変えると内容を引き継ぐ、PACK_ARENA_MAXより大きなブロック */
+    char *q = (char*) pack_arena_realloc (a, p, 100);
+    EXPECT_EQ(p, q);
+    q = (char*) pack_arena_realloc (a, p, 5000);
+    ASSERT_NE((char*) NULL, q);
+    EXPECT_EQ(8176u, pack_arena_size (q));
+    EXPECT_EQ(0x5a, q[0]);
+    EXPECT_EQ(0x5a, q[111]);
+    char *big = (char*) pack_arena_alloc (a, PACK_ARENA_MAX + 1);
+    ASSERT_NE((char*) NULL, big);
+    EXPECT_EQ((size_t) PACK_ARENA_MAX + 1, pack_arena_size (big));
+    big = (char*) pack_arena_realloc (a, big, 3 * PACK_ARENA_MAX);
+    ASSERT_NE((char*) NULL, big);
+    big[3 * PACK_ARENA_MAX - 1] = 1;
+    pack_arena_release (a, big);
+    pack_arena_release (a, q);
+
+    /* 定常状態では毎回同じブロックを使う */
+    double da[100];
+    for (int i=0; i<100; i++) {
+	da[i] = i * 0.25;
+    }
+    pack_buf_t b;
+    char *first = NULL;
+    int moved = 0;
+    for (int k=0; k<1000; k++) {
+	pack_buf_init_arena (&b, a);
+	ASSERT_EQ(0, pack_buf_save (&b, (char*) "i d#", k, da, 100));
+	EXPECT_EQ(804u, b.len);
+	if (first == NULL) {
+	    first = b.data;
+	}
+	moved += (b.data != first);
+	int n;
+	double db[100];
+	pack_load (pack_load (b.data, (char*) "i", &n), (char*) "d#", db, 100);
+	EXPECT_EQ(k, n);
+	EXPECT_EQ(0, memcmp (da, db, sizeof(da)));
+	pack_buf_free (&b);
+    }
+    EXPECT_EQ(0, moved);
+
+    /* resetすると先頭から割り当て直す */
+    pack_arena_reset (a);
+    char *r1 = (char*) pack_arena_alloc (a, 10);
+    pack_arena_reset (a);
+    EXPECT_EQ(r1, pack_arena_alloc (a, 10));
+
+    /* ストリームのバッファ */
+    FILE *fp = tmpfile ();
+    ASSERT_NE((FILE*) NULL, fp);
+    pack_stream_t s;
+    ASSERT_EQ(0, pack_stream_init_arena (&s, fileno (fp), 0, a));
+    EXPECT_LE((size_t) PACK_STREAM_DEFAULT, s.cap);
+    for (int k=0; k<1000; k++) {
+	ASSERT_EQ(0, pack_stream_save (&s, (char*) "i d#", k, da, 100));
+    }
+    ASSERT_EQ(0, pack_stream_flush (&s));
+    pack_stream_free (&s);
+    lseek (fileno (fp), 0, SEEK_SET);
+    ASSERT_EQ(0, pack_stream_init_arena (&s, fileno (fp), PACK_STREAM_MIN, a));
+    int bad = 0;
+    for (int k=0; k<1000; k++) {
+	int n;
+	double db[100];
+	ASSERT_EQ(0, pack_stream_load (&s, (char*) "i d#", &n, db, 100));
+	bad += (n != k || memcmp (da, db, sizeof(da)) != 0);
+    }
+    EXPECT_EQ(0, bad);
+    pack_stream_free (&s);
+    fclose (fp);
+
+    /* 複数のスレッドで割り当て、別のスレッドで解放する */
+    const int nthreads = 4, per = 20000;
+    std::vector<std::vector<char*>> handoff (nthreads);
+    std::vector<std::thread> th;
+    std::atomic<int> errors (0);
+    for (int t=0; t<nthreads; t++) {
+	th.emplace_back ([a, t, per, &handoff, &errors] {
+	    std::vector<char*> live;
+	    for (int k=0; k<per; k++) {
+		size_t size = 16 + (size_t) (k * 7919 + t * 131) % 3000;
+		char *m = (char*) pack_arena_alloc (a, size);
+		if (m == NULL) {
+		    errors++;
+		    continue;
+		}
+		memset (m, t + 1, size);
+		live.push_back (m);
+		if (live.size () > 64) {
+		    char *o = live.front ();
+		    live.erase (live.begin ());
+		    if (o[0] != t + 1) {
+			errors++;
+		    }
+		    pack_arena_release (a, o);
+		}
+	    }
+	    handoff[t] = live;
+	});
+    }
+    for (auto &t : th) {
+	t.join ();
+    }
+    EXPECT_EQ(0, errors.load ());
+    th.clear ();
+    for (int t=0; t<nthreads; t++) {
+	th.emplace_back ([a, t, nthreads, &handoff] {
+	    for (char *m : handoff[(t + 1) % nthreads]) {
+		pack_arena_release (a, m);
+	    }
+	});
+    }
+    for (auto &t : th) {
+	t.join ();
+    }
+    pack_arena_free (a);
+
+    /* huge pageが使えなくても動く */
+    a = pack_arena_create (PACK_ARENA_HUGE);
+    ASSERT_NE((pack_arena_t*) NULL, a);
+    p = (char*) pack_arena_alloc (a, 4096);
+    ASSERT_NE((char*) NULL, p);
+    memset (p, 1, 4096);
+    pack_arena_free (a);
+}
+
+/* 要素数を前に置く'*'の配列と繰り返しのグループ */
+TEST(pack, prefix_group) {
+    float af[5] = {1.5f,2.5f,3.5f,4.5f,5.5f}, lf[8] = {};
+    int ai[3] = {10,20,30}, li[4] = {};
+    double ad[3] = {0.25,0.5,0.75}, ld[4] = {};
+    char buf[256], cv = 0;
+    int n;
+
+    /* 要素数を数えてから読むので、呼び出し側は上限だけ渡す */
+    EXPECT_EQ(1 + 4 + 5 * 4, pack_size ((char*)"c f*", 5));
+    tail = pack_save (buf, (char*)"c f*", 'x', af, 5);
+    EXPECT_EQ(&buf[25], tail);
+    n = 8;
+    EXPECT_EQ(tail, pack_load (buf, (char*)"c f*", &cv, lf, &n));
+    EXPECT_EQ('x', cv);
+    EXPECT_EQ(5, n);
+    for (int i=0; i<5; i++) {
+	EXPECT_EQ(af[i], lf[i]);
+    }
+    /* 上限を超えていれば失敗する */
+    n = 4;
+    errno = 0;
+    EXPECT_EQ(NULL, pack_load (buf, (char*)"c f*", &cv, lf, &n));
+    EXPECT_EQ(EMSGSIZE, errno);
+    /* 複製しないloadでも同じ */
+    const float *vf;
+    n = 8;
+    EXPECT_EQ(tail, pack_view (buf, (char*)"c f*", &cv, &vf, lf, &n));
+    EXPECT_EQ(5, n);
+    EXPECT_EQ(af[4], vf[4]);
+
+    /* グループは項目毎の配列を要素の順に混ぜて並べる */
+    const char *fmt = "(i f d)*";
+    EXPECT_EQ(4 + 3 * 16, pack_size_exact ((char*)fmt, ai, af, ad, 3));
+    tail = pack_save (buf, (char*)fmt, ai, af, ad, 3);
+    EXPECT_EQ(&buf[52], tail);
+    int iv;
+    float fv;
+    double dv;
+    pack_load (buf + 4 + 16, (char*)"i f d", &iv, &fv, &dv);
+    EXPECT_EQ(20, iv);
+    EXPECT_EQ(2.5f, fv);
+    EXPECT_EQ(0.5, dv);
+    n = 4;
+    EXPECT_EQ(tail, pack_load (buf, (char*)fmt, li, lf, ld, &n));
+    EXPECT_EQ(3, n);
+    for (int i=0; i<3; i++) {
+	EXPECT_EQ(ai[i], li[i]);
+	EXPECT_EQ(af[i], lf[i]);
+	EXPECT_EQ(ad[i], ld[i]);
+    }
+    /* planでも同じバイト列になる */
+    char buf2[256];
+    pack_plan_t *plan = pack_compile ((char*)"c (i f d)* i");
+    ASSERT_TRUE(plan != NULL);
+    tail = pack_save_plan (buf2, plan, 'y', ai, af, ad, 3, 99);
+    EXPECT_EQ(&buf2[1 + 52 + 4], tail);
+    EXPECT_EQ(0, memcmp (buf2 + 1, buf, 52));
+    n = 4;
+    EXPECT_EQ(tail, pack_load_plan (buf2, plan, &cv, li, lf, ld, &n, &iv));
+    EXPECT_EQ('y', cv);
+    EXPECT_EQ(3, n);
+    EXPECT_EQ(99, iv);
+    EXPECT_EQ(ad[2], ld[2]);
+    pack_plan_free (plan);
+
+    /* 固定回数と'#'、エンディアン変換 */
+    tail = pack_save (buf, (char*)"(i !d)2 (i2 f)#", ai, ad, ai, af, 1);
+    EXPECT_EQ(2 * 12 + 12, tail - buf);
+    memset (li, 0, sizeof(li));
+    EXPECT_EQ(tail, pack_load (buf, (char*)"(i !d)2 (i2 f)#", li, ld, li + 2, lf, 1));
+    EXPECT_EQ(20, li[1]);
+    EXPECT_EQ(ad[1], ld[1]);
+    EXPECT_EQ(10, li[2]);
+    EXPECT_EQ(20, li[3]);
+    EXPECT_EQ(af[0], lf[0]);
+
+    /* 伸長するバッファ */
+    pack_buf_t b;
+    pack_buf_init (&b, NULL, 0);
+    EXPECT_EQ(0, pack_buf_save (&b, (char*)fmt, ai, af, ad, 3));
+    EXPECT_EQ(52u, b.len);
+    pack_save (buf, (char*)fmt, ai, af, ad, 3);
+    EXPECT_EQ(0, memcmp (b.data, buf, 52));
+    pack_buf_free (&b);
+
+    /* 大きな'*'の配列はiovecで直接参照し、要素数だけstageに書く */
+    const int N = 1000;
+    std::vector<double> big(N), back(N);
+    for (int i=0; i<N; i++) {
+	big[i] = i * 0.125;
+    }
+    struct iovec iov[4];
+    char stage[64];
+    pack_iov_t v;
+    pack_iov_init (&v, iov, 4, stage, sizeof(stage), 1024);
+    EXPECT_EQ(0, pack_iov_save (&v, (char*)"d*", big.data(), N));
+    ASSERT_EQ(2, v.iovcnt);
+    EXPECT_EQ(4u, iov[0].iov_len);
+    EXPECT_EQ((void *) big.data(), iov[1].iov_base);
+
+    /* ストリームではバッファより大きな配列も分割して読み書きする */
+    FILE *fp = tmpfile ();
+    ASSERT_TRUE(fp != NULL);
+    pack_stream_t s;
+    ASSERT_EQ(0, pack_stream_init (&s, fileno (fp), NULL, PACK_STREAM_MIN));
+    EXPECT_EQ(0, pack_stream_save (&s, (char*)"c !d* (i f d)*", 'z', big.data(), N, ai, af, ad, 3));
+    EXPECT_EQ(0, pack_stream_flush (&s));
+    pack_stream_free (&s);
+    lseek (fileno (fp), 0, SEEK_SET);
+    ASSERT_EQ(0, pack_stream_init (&s, fileno (fp), NULL, PACK_STREAM_MIN));
+    int m = N;
+    n = 4;
+    EXPECT_EQ(0, pack_stream_load (&s, (char*)"c !d* (i f d)*", &cv, back.data(), &m, li, lf, ld, &n));
+    EXPECT_EQ('z', cv);
+    EXPECT_EQ(N, m);
+    EXPECT_EQ(3, n);
+    EXPECT_EQ(big[N - 1], back[N - 1]);
+    EXPECT_EQ(ad[2], ld[2]);
+    pack_stream_free (&s);
+    fclose (fp);
+
+    /* 並列版は要素数を読むまで位置が決まらないので1スレッドで処理する */
+    pack_pool_t *pool = pack_pool_create (2);
+    tail = pack_save (buf, (char*)fmt, ai, af, ad, 3);
+    EXPECT_EQ(tail - buf + buf2, pack_save_par (pool, buf2, (char*)fmt, ai, af, ad, 3));
+    EXPECT_EQ(0, memcmp (buf, buf2, 52));
+    n = 4;
+    EXPECT_EQ(tail, pack_load_par (pool, buf, (char*)fmt, li, lf, ld, &n));
+    EXPECT_EQ(3, n);
+    pack_pool_free (pool);
+
+    /* packgenでは'*'の要素数をint *で受け取る */
+    EXPECT_EQ(pack_size ((char*)"c !f* d*", 5, 3), size_prefixed (5, 3));
+    tail = save_prefixed (buf, 'p', af, 5, ad, 3);
+    pack_save (buf2, (char*)"c !f* d*", 'p', af, 5, ad, 3);
+    EXPECT_EQ(0, memcmp (buf, buf2, tail - buf));
+    int m1 = 8, m2 = 4;
+    EXPECT_EQ(tail, load_prefixed (buf, &cv, lf, &m1, ld, &m2));
+    EXPECT_EQ(5, m1);
+    EXPECT_EQ(3, m2);
+    EXPECT_EQ(af[4], lf[4]);
+
+    /* 要素数を返せないJITは受け付けない */
+    errno = 0;
+    EXPECT_EQ(NULL, pack_jit_compile ((char*)"i f*"));
+    EXPECT_EQ(EINVAL, errno);
+}
+
+/* 長さを前に置く文字列とバイト列 */
+TEST(pack, string_blob) {
+    const char *key = "user:1234";
+    unsigned char body[300];
+    char buf[512];
+    for (int i=0; i<300; i++) {
+	body[i] = (unsigned char) (i * 7);
+    }
+
+    EXPECT_EQ(4 + 9 + 4 + 300 + 4, pack_size ((char*)"s y i", 9, 300));
+    EXPECT_EQ(4 + 9 + 4 + 300 + 4, pack_size_exact ((char*)"s y i", key, body, 300, 5));
+    tail = pack_save (buf, (char*)"s y i", key, body, 300, 5);
+    EXPECT_EQ(4 + 9 + 4 + 300 + 4, tail - buf);
+    /* バイト数に続けて'\0'の無いバイト列になる */
+    int n = 0;
+    pack_load (buf, (char*)"i", &n);
+    EXPECT_EQ(9, n);
+    EXPECT_EQ(0, memcmp (buf + 4, key, 9));
+
+    /* loadは複製せずにbuffer内を指す */
+    const char *kp = NULL, *bp = NULL;
+    int klen = 0, blen = 0, iv = 0;
+    EXPECT_EQ(tail, pack_load (buf, (char*)"s y i", &kp, &klen, &bp, &blen, &iv));
+    EXPECT_EQ(buf + 4, kp);
+    EXPECT_EQ(9, klen);
+    EXPECT_EQ(buf + 17, bp);
+    EXPECT_EQ(300, blen);
+    EXPECT_EQ(0, memcmp (bp, body, 300));
+    EXPECT_EQ(5, iv);
+    /* 長さが要らなければNULLを渡せる */
+    EXPECT_EQ(tail, pack_load (buf, (char*)"s y i", &kp, NULL, &bp, &blen, &iv));
+    EXPECT_EQ(std::string(key), std::string(kp, 9));
+
+    /* 空の文字列とNULL、エンディアン変換するバイト数 */
+    tail = pack_save (buf, (char*)"s !y", "", NULL, 0);
+    EXPECT_EQ(8, tail - buf);
+    tail = pack_save (buf, (char*)"!s", key);
+    uint32_t be = 0;
+    memcpy (&be, buf, 4);
+    EXPECT_EQ(9u, __builtin_bswap32 (be));
+    EXPECT_EQ(tail, pack_load (buf, (char*)"!s", &kp, &klen));
+    EXPECT_EQ(9, klen);
+
+    /* plan、view、伸長するバッファでも同じ */
+    pack_plan_t *plan = pack_compile ((char*)"c s y");
+    ASSERT_TRUE(plan != NULL);
+    tail = pack_save_plan (buf, plan, 'k', key, body, 300);
+    char cv = 0;
+    EXPECT_EQ(tail, pack_load_plan (buf, plan, &cv, &kp, &klen, &bp, &blen));
+    EXPECT_EQ('k', cv);
+    EXPECT_EQ(buf + 5, kp);
+    EXPECT_EQ(300, blen);
+    EXPECT_EQ(tail, pack_view (buf, (char*)"c s y", &cv, &kp, &klen, &bp, &blen));
+    EXPECT_EQ(buf + 18, bp);
+    pack_buf_t b;
+    pack_buf_init (&b, NULL, 0);
+    EXPECT_EQ(0, pack_buf_save_plan (&b, plan, 'k', key, body, 300));
+    EXPECT_EQ((size_t) (tail - buf), b.len);
+    EXPECT_EQ(0, memcmp (b.data, buf, b.len));
+    pack_buf_free (&b);
+    pack_plan_free (plan);
+
+    /* 大きなバイト列はiovecで直接参照する */
+    struct iovec iov[4];
+    char stage[64];
+    pack_iov_t v;
+    pack_iov_init (&v, iov, 4, stage, sizeof(stage), 256);
+    EXPECT_EQ(0, pack_iov_save (&v, (char*)"s y", key, body, 300));
+    ASSERT_EQ(2, v.iovcnt);
+    EXPECT_EQ(4u + 9 + 4, iov[0].iov_len);
+    EXPECT_EQ((void *) body, iov[1].iov_base);
+
+    /* 参照を返せないストリームのload、リングのloadは受け付けない */
+    FILE *fp = tmpfile ();
+    ASSERT_TRUE(fp != NULL);
+    pack_stream_t s;
+    ASSERT_EQ(0, pack_stream_init (&s, fileno (fp), NULL, 0));
+    EXPECT_EQ(0, pack_stream_save (&s, (char*)"s y", key, body, 300));
+    EXPECT_EQ(0, pack_stream_flush (&s));
+    pack_stream_free (&s);
+    EXPECT_EQ(4 + 9 + 4 + 300, lseek (fileno (fp), 0, SEEK_END));
+    lseek (fileno (fp), 0, SEEK_SET);
+    ASSERT_EQ(0, pack_stream_init (&s, fileno (fp), NULL, 0));
+    errno = 0;
+    EXPECT_EQ(-1, pack_stream_load (&s, (char*)"s", &kp, &klen));
+    EXPECT_EQ(EINVAL, errno);
+    pack_stream_free (&s);
+    fclose (fp);
+    pack_ring_t *r = pack_ring_create (4, 128, PACK_RING_SPSC);
+    EXPECT_EQ(0, pack_ring_save (r, (char*)"s", key));
+    errno = 0;
+    EXPECT_EQ(-1, pack_ring_load (r, (char*)"s", &kp, &klen));
+    EXPECT_EQ(EINVAL, errno);
+    char *slot = pack_ring_acquire (r, NULL);
+    ASSERT_TRUE(slot != NULL);
+    pack_load (slot, (char*)"s", &kp, &klen);
+    EXPECT_EQ(std::string(key), std::string(kp, klen));
+    pack_ring_release (r, slot);
+    pack_ring_free (r);
+
+    /* packgen */
+    EXPECT_EQ(pack_size ((char*)"s !y i", 9, 300), size_keyed (9, 300));
+    tail = save_keyed (buf, key, body, 300, 77);
+    char ref[512];
+    pack_save (ref, (char*)"s !y i", key, body, 300, 77);
+    EXPECT_EQ(0, memcmp (buf, ref, tail - buf));
+    EXPECT_EQ(tail, load_keyed (buf, &kp, &klen, &bp, &blen, &iv));
+    EXPECT_EQ(9, klen);
+    EXPECT_EQ(300, blen);
+    EXPECT_EQ(77, iv);
+}
+
+/* 詰め物と境界合わせ */
+TEST(pack, align_pad) {
+    static char fmt[] = "c @32 !d# x3 i @16 f4";
+    alignas(64) char buf[256], buf2[256];
+    double ad[3] = {1.5, -2.25, 1e10}, ld[3];
+    float af[4] = {1, 2, 3, 4}, lf[4];
+    char cv = 0;
+    int iv = 0;
+
+    EXPECT_EQ(80, pack_size (fmt, 3));
+    EXPECT_EQ(80, pack_size_exact (fmt, 'a', ad, 3, 7, af));
+    EXPECT_EQ(32, pack_size ((char*)"c @32"));
+    EXPECT_EQ(3, pack_size ((char*)"x3"));
+    memset (buf, 0xff, sizeof(buf));
+    char *tail = pack_save (buf, fmt, 'a', ad, 3, 7, af);
+    ASSERT_EQ(buf + 80, tail);
+    /* 詰め物は0で埋まる */
+    for (int i=1; i<32; i++) {
+	EXPECT_EQ(0, buf[i]);
+    }
+    EXPECT_EQ(0, memcmp (&buf[56], "\0\0\0", 3));
+    EXPECT_EQ(0, buf[63]);
+    EXPECT_EQ(tail, pack_load (buf, fmt, &cv, ld, 3, &iv, lf));
+    EXPECT_EQ('a', cv);
+    EXPECT_EQ(7, iv);
+    EXPECT_EQ(0, memcmp (ad, ld, sizeof(ad)));
+    EXPECT_EQ(0, memcmp (af, lf, sizeof(af)));
+
+    /* 固定長の計画は大きさを前もって求め、可変長の計画は順に求める */
+    pack_plan_t *plan = pack_compile ((char*)"c @8 i2");
+    EXPECT_EQ(16, pack_size_plan (plan));
+    int ai[2] = {5, 6}, li[2];
+    EXPECT_EQ(buf2 + 16, pack_save_plan (buf2, plan, 'b', ai));
+    EXPECT_EQ(buf2 + 16, pack_load_plan (buf2, plan, &cv, li));
+    EXPECT_EQ(6, li[1]);
+    pack_plan_free (plan);
+    plan = pack_compile (fmt);
+    EXPECT_EQ(80, pack_size_plan (plan, 3));
+    EXPECT_EQ(buf2 + 80, pack_save_plan (buf2, plan, 'a', ad, 3, 7, af));
+    EXPECT_EQ(0, memcmp (buf, buf2, 80));
+
+    /* 境界に揃っていればviewはbufferを直接指す */
+    EXPECT_EQ(buf2 + 63, pack_save (buf2, (char*)"c @32 d# x3 i", 'a', ad, 3, 7));
+    double *vd = NULL;
+    EXPECT_EQ(buf2 + 63, pack_view (buf2, (char*)"c @32 d# x3 i", &cv, &vd, NULL, 3, &iv));
+    EXPECT_EQ((double *) &buf2[32], vd);
+    EXPECT_EQ(1e10, vd[2]);
+    EXPECT_EQ(7, iv);
+    /* バイト順を変える配列は複製する */
+    float *vf = NULL;
+    EXPECT_EQ(buf + 80, pack_view_plan (buf, plan, &cv, &vd, ld, 3, &iv, &vf, lf));
+    EXPECT_EQ(ld, vd);
+    EXPECT_EQ(1e10, vd[2]);
+    EXPECT_EQ(4.0f, vf[3]);
+    pack_plan_free (plan);
+
+    /* pack_bufは先頭からの位置で揃える */
+    pack_buf_t b;
+    pack_buf_init (&b, NULL, 0);
+    EXPECT_EQ(0, pack_buf_save (&b, (char*)"c", 'z'));
+    EXPECT_EQ(0, pack_buf_save (&b, (char*)"@8 d", 0.5));
+    EXPECT_EQ(16u, b.len);
+    pack_buf_free (&b);
+
+    /* 詰め物はstageにまとめる */
+    struct iovec iov[4];
+    char stage[128];
+    pack_iov_t v;
+    pack_iov_init (&v, iov, 4, stage, sizeof(stage), 1024);
+    EXPECT_EQ(0, pack_iov_save (&v, fmt, 'a', ad, 3, 7, af));
+    EXPECT_EQ(80u, v.len);
+    EXPECT_EQ(0, memcmp (stage, buf, 80));
+
+    /* ストリームは書き込んだ通算のバイト数で揃える */
+    FILE *fp = tmpfile ();
+    ASSERT_TRUE(fp != NULL);
+    pack_stream_t s;
+    ASSERT_EQ(0, pack_stream_init (&s, fileno (fp), NULL, 64));
+    EXPECT_EQ(0, pack_stream_save (&s, fmt, 'a', ad, 3, 7, af));
+    EXPECT_EQ(0, pack_stream_save (&s, (char*)"c @32 i", 'q', 9));
+    EXPECT_EQ(0, pack_stream_flush (&s));
+    pack_stream_free (&s);
+    EXPECT_EQ(80 + 20, lseek (fileno (fp), 0, SEEK_END));
+    lseek (fileno (fp), 0, SEEK_SET);
+    ASSERT_EQ(0, pack_stream_init (&s, fileno (fp), NULL, 64));
+    memset (ld, 0, sizeof(ld));
+    EXPECT_EQ(0, pack_stream_load (&s, fmt, &cv, ld, 3, &iv, lf));
+    EXPECT_EQ(0, memcmp (ad, ld, sizeof(ad)));
+    EXPECT_EQ(0, pack_stream_load (&s, (char*)"c @32 i", &cv, &iv));
+    EXPECT_EQ('q', cv);
+    EXPECT_EQ(9, iv);
+    pack_stream_free (&s);
+    fclose (fp);
+
+    /* 並列版は1スレッドで処理する */
+    pack_pool_t *pool = pack_pool_create (2);
+    EXPECT_EQ(buf2 + 80, pack_save_par (pool, buf2, fmt, 'a', ad, 3, 7, af));
+    EXPECT_EQ(0, memcmp (buf, buf2, 80));
+    EXPECT_EQ(buf2 + 80, pack_load_par (pool, buf2, fmt, &cv, ld, 3, &iv, lf));
+    pack_pool_free (pool);
+
+    /* JITは扱わない */
+    errno = 0;
+    EXPECT_TRUE(pack_jit_compile (fmt) == NULL);
+    EXPECT_EQ(EINVAL, errno);
+
+    /* packgen */
+    EXPECT_EQ(80, size_aligned (3));
+    memset (buf2, 0xff, sizeof(buf2));
+    EXPECT_EQ(buf2 + 80, save_aligned (buf2, 'a', ad, 3, 7, af));
+    EXPECT_EQ(0, memcmp (buf, buf2, 80));
+    EXPECT_EQ(buf2 + 80, load_aligned (buf2, &cv, ld, 3, &iv, lf));
+    EXPECT_EQ(7, iv);
+}
+
+/* 扱えないグループは項目を落とさずに失敗する */
+TEST(pack, group_invalid) {
+    const char *bad[] = {
+	"(i s)*", "c (i s f)*", "(i y)2", "(i @8 f)2", "((i)2 f)3",
+	"(i i i i i i i i i i i i i i i i i)2",
+    };
+    char buf[256];
+    int ai[4] = {1, 2, 3, 4}, n = 2;
+    for (const char *f : bad) {
+	SCOPED_TRACE(f);
+	errno = 0;
+	EXPECT_TRUE(pack_compile ((char*)f) == NULL);
+	EXPECT_EQ(EINVAL, errno);
+	errno = 0;
+	EXPECT_EQ(-1, pack_size ((char*)f, 2));
+	EXPECT_EQ(EINVAL, errno);
+	memset (buf, 0x55, sizeof(buf));
+	errno = 0;
+	EXPECT_TRUE(pack_save (buf, (char*)f, ai, ai, 2) == NULL);
+	EXPECT_EQ(EINVAL, errno);
+	EXPECT_EQ(0x55, (unsigned char) buf[0]);
+	EXPECT_TRUE(pack_load (buf, (char*)f, ai, ai, &n) == NULL);
+	EXPECT_TRUE(pack_view (buf, (char*)f, ai, ai, &n) == NULL);
+	EXPECT_EQ(-1, pack_size_exact ((char*)f, ai, ai, 2));
+	pack_buf_t b;
+	pack_buf_init (&b, NULL, 0);
+	EXPECT_EQ(-1, pack_buf_save (&b, (char*)f, ai, ai, 2));
+	EXPECT_EQ(0u, b.len);
+	pack_buf_free (&b);
+	errno = 0;
+	EXPECT_TRUE(pack_jit_compile ((char*)f) == NULL);
+	EXPECT_EQ(EINVAL, errno);
+    }
+    /* 同じ書式を何度渡しても表の登録数を使い切らない */
+    for (int i=0; i<1000; i++) {
+	pack_size ((char*)"(i s)*", 1);
+    }
+    pack_ring_t *r = pack_ring_create (4, 64, PACK_RING_SPSC);
+    errno = 0;
+    EXPECT_EQ(-1, pack_ring_save (r, (char*)"(i s)*", ai, "a", 1));
+    EXPECT_EQ(EINVAL, errno);
+    EXPECT_TRUE(pack_ring_acquire (r, NULL) == NULL);
+    pack_ring_free (r);
+    /* 16項目までは扱える */
+    static char max[] = "(i i i i i i i i i i i i i i i i)1";
+    pack_plan_t *plan = pack_compile (max);
+    ASSERT_TRUE(plan != NULL);
+    EXPECT_EQ(64, pack_size_plan (plan));
+    EXPECT_EQ(64, pack_size (max));
+    pack_plan_free (plan);
+}
+
+/* 書式毎の統計(PACK_STATSを定義してビルドした場合のみ数える) */
+static std::string stats_dump (int format)
+{
+    char *out = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream (&out, &len);
+    EXPECT_EQ(0, pack_stats_dump (fp, format));
+    fclose (fp);
+    std::string s (out, len);
+    free (out);
+    return s;
+}
+
+/* Prometheusの出力から1つの値を取り出す(無ければ0) */
+static unsigned long long stats_value (const std::string &prom, const std::string &key)
+{
+    size_t i = prom.find (key + " ");
+    return (i == std::string::npos) ? 0 : strtoull (prom.c_str () + i + key.size () + 1, NULL, 10);
+}
+
+TEST(pack, stats) {
+    static char fmt[] = "c c c i d2";
+    double d[2] = {1, 2};
+    int iv = 0;
+    char c = 0;
+    /* 他のテストで数えた分を除くため、前後の差を見る */
+    std::string before = stats_dump (PACK_STATS_PROMETHEUS);
+    for (int i=0; i<10; i++) {
+	pack_save (buff, fmt, 'a', 'b', 'c', 1, d);
+    }
+    pack_load (buff, fmt, &c, &c, &c, &iv, d);
+    /* 別のスレッドで数えたもの、別の領域にある同じ内容の書式もまとめられる */
+    std::vector<std::thread> th;
+    for (int k=0; k<4; k++) {
+	th.emplace_back ([] {
+	    char b[64];
+	    char f[] = "c c c i d2";
+	    double e[2] = {3, 4};
+	    for (int i=0; i<100; i++) {
+		pack_size ((char*)"c c c i d2");
+		pack_save (b, f, 'a', 'b', 'c', 1, e);
+	    }
+	});
+    }
+    for (auto &t : th) {
+	t.join ();
+    }
+    /* 書式の数に上限はない */
+    std::vector<std::string> many;
+    for (int i=0; i<300; i++) {
+	many.push_back ("c" + std::to_string (i + 1) + " i");
+	pack_size ((char*) many.back ().c_str ());
+    }
+    /* 扱えない書式はバイト数に数えない */
+    EXPECT_EQ(-1, pack_size ((char*)"(i s)*", 1));
+    std::string json = stats_dump (PACK_STATS_JSON);
+    std::string prom = stats_dump (PACK_STATS_PROMETHEUS);
+    if (!pack_stats_enabled ()) {
+	EXPECT_EQ("{\"formats\":[\n]}\n", json);
+	return;
+    }
+    auto diff = [&](const std::string &key) {
+	return stats_value (prom, key) - stats_value (before, key);
+    };
+    EXPECT_EQ(410u, diff ("pack_calls_total{format=\"c c c i d2\",op=\"save\"}"));
+    EXPECT_EQ(9430u, diff ("pack_bytes_total{format=\"c c c i d2\",op=\"save\"}"));
+    EXPECT_EQ(1u, diff ("pack_calls_total{format=\"c c c i d2\",op=\"load\"}"));
+    EXPECT_EQ(23u, diff ("pack_bytes_total{format=\"c c c i d2\",op=\"load\"}"));
+    EXPECT_EQ(400u, diff ("pack_calls_total{format=\"c c c i d2\",op=\"size\"}"));
+    EXPECT_EQ(1u, diff ("pack_cycles_bucket{format=\"c c c i d2\",op=\"load\",le=\"+Inf\"}"));
+    EXPECT_EQ(1u, diff ("pack_calls_total{format=\"c300 i\",op=\"size\"}"));
+    EXPECT_EQ(1u, diff ("pack_calls_total{format=\"(i s)*\",op=\"size\"}"));
+    EXPECT_EQ(0u, diff ("pack_bytes_total{format=\"(i s)*\",op=\"size\"}"));
+    EXPECT_EQ(std::string::npos, prom.find ("(other)"));
+    EXPECT_NE(std::string::npos, json.find ("{\"format\":\"c c c i d2\",\"op\":\"save\",\"calls\":"));
+}
+
 int main(int argc, char **argv)
 {
     testing::InitGoogleTest(&argc, argv);